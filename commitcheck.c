@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Standalone regression check for the activation journal in fscommit.c,
+ * built and run by "make regress" with COMMIT_JOURNAL pointed somewhere harmless.
+ * A held commit whose journal is snapshotted must not be rolled back once
+ * the snapshot is booted, while a journal left by the running root must be.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSCOMMIT_H
+#include "fscommit.h"
+#endif
+
+bool noop = false;
+
+static int held(const char *target, const char *backup, const char *contents);
+static int restamp(const char *root);
+static bool holds(const char *path, const char *contents);
+
+int
+main(void) {
+	int failed;
+	char dir[MAXPATHLEN], target[MAXPATHLEN], backup[MAXPATHLEN];
+
+	failed = 0;
+	strlcpy(dir, "/tmp/dfbeadm.commitcheck.XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "unable to create %s (%s)\n", dir, strerror(errno));
+		return(1);
+	}
+	snprintf(target, sizeof(target), "%s/fstab", dir);
+	snprintf(backup, sizeof(backup), "%s/fstab.bak", dir);
+	unlink(COMMIT_JOURNAL);
+
+	/* the new environment boots with the held journal in its snapshot */
+	if (held(target, backup, "old\n") != 0 || held(target, backup, "new\n") != 0 || restamp("elsewhere@ROOT") != 0) {
+		fprintf(stderr, "unable to set up a held commit\n");
+		failed++;
+	} else if (recoverjournal() != 0 || !holds(target, "new\n") || access(COMMIT_JOURNAL, F_OK) == 0) {
+		fprintf(stderr, "FAIL: a journal from another root was rolled back or kept\n");
+		failed++;
+	} else {
+		fprintf(stdout, "ok: a journal from another root is discarded\n");
+	}
+
+	/* the same root crashed before the commit was retired */
+	if (held(target, backup, "newer\n") != 0) {
+		fprintf(stderr, "unable to set up a held commit\n");
+		failed++;
+	} else if (recoverjournal() != 0 || !holds(target, "new\n") || access(COMMIT_JOURNAL, F_OK) == 0) {
+		fprintf(stderr, "FAIL: a journal from this root was not rolled back\n");
+		failed++;
+	} else {
+		fprintf(stdout, "ok: a journal from this root is rolled back\n");
+	}
+
+	unlink(COMMIT_JOURNAL);
+	unlink(target);
+	unlink(backup);
+	rmdir(dir);
+	return((failed == 0) ? 0 : 1);
+}
+
+/*
+ * Commit contents to target and leave the journal in place, as activation does
+ * returns 0 on success
+ */
+static int
+held(const char *target, const char *backup, const char *contents) {
+	stagedfile sf;
+
+	if (stagefile(&sf, target, backup, contents, strlen(contents)) != 0) {
+		unstage(&sf, 1);
+		return(-1);
+	}
+	return(commitfiles(&sf, 1, true));
+}
+
+/*
+ * Rewrite the journal's stamp as if it had been written under root
+ * returns 0 on success
+ */
+static int
+restamp(const char *root) {
+	FILE *in, *out;
+	char line[MAXPATHLEN * 4], tmp[MAXPATHLEN];
+	bool first;
+
+	snprintf(tmp, sizeof(tmp), "%s.restamp", COMMIT_JOURNAL);
+	if ((in = fopen(COMMIT_JOURNAL, "r")) == NULL) {
+		return(-1);
+	}
+	if ((out = fopen(tmp, "w")) == NULL) {
+		fclose(in);
+		return(-1);
+	}
+	for (first = true; fgets(line, sizeof(line), in) != NULL; first = false) {
+		if (first) {
+			fprintf(out, "%s\t%s\n", COMMIT_STAMP, root);
+		} else {
+			fputs(line, out);
+		}
+	}
+	fclose(in);
+	if (fclose(out) != 0) {
+		unlink(tmp);
+		return(-1);
+	}
+	return(rename(tmp, COMMIT_JOURNAL));
+}
+
+/*
+ * returns whether path holds exactly contents
+ */
+static bool
+holds(const char *path, const char *contents) {
+	FILE *in;
+	char buf[64];
+	size_t got;
+
+	if ((in = fopen(path, "r")) == NULL) {
+		return(false);
+	}
+	got = fread(buf, 1, sizeof(buf) - 1, in);
+	fclose(in);
+	buf[got] = 0;
+	return(strcmp(buf, contents) == 0);
+}
@@ -80,11 +80,79 @@
 #ifndef DFBEADM_SNAPFS_H
 #include "snapfs.h"
 #endif
+/* label parsing and validation */
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+/* atomic installation of fstab and loader.conf */
+#ifndef DFBEADM_FSCOMMIT_H
+#include "fscommit.h"
+#endif
+/* the boot environment record database */
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+/* boot environments limited to a subtree */
+#ifndef DFBEADM_FSSCOPE_H
+#include "fsscope.h"
+#endif
+/* ioctl accounting and progress reporting */
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+/* space accounting */
+#ifndef DFBEADM_FSUSAGE_H
+#include "fsusage.h"
+#endif
+/* comparing two environments */
+#ifndef DFBEADM_FSDIFF_H
+#include "fsdiff.h"
+#endif
+/* moving environments between hosts */
+#ifndef DFBEADM_FSEXPORT_H
+#include "fsexport.h"
+#endif
+/* manifests and verification */
+#ifndef DFBEADM_FSVERIFY_H
+#include "fsverify.h"
+#endif
+/* record database against what's on disk */
+#ifndef DFBEADM_FSRECONCILE_H
+#include "fsreconcile.h"
+#endif
+/* readers share, writers serialize */
+#ifndef DFBEADM_FSLOCK_H
+#include "fslock.h"
+#endif
+/* running against a model of HAMMER2 instead of the kernel */
+#ifndef DFBEADM_FSSIM_H
+#include "fssim.h"
+#endif
+/* ioctl traces */
+#ifndef DFBEADM_FSREPLAY_H
+#include "fsreplay.h"
+#endif
+/* coalesced requests for a new environment */
+#ifndef DFBEADM_FSTRIGGER_H
+#include "fstrigger.h"
+#endif
+#ifndef DFBEADM_FSWATCH_H
+#include "fswatch.h"
+#endif
 
 /* envtest return code mnemonics */
 #define LISTBENV 0x04
 #define CREATEBE 0x08
 #define ACTIVATE 0x10
+#define DIFFBENV 0x40
+#define EXPORTBE 0x80
+#define IMPORTBE 0x100
+#define VERIFYBE 0x200
+#define RECONCILE 0x400
+#define REPLAYIO 0x800
+#define TRIGGERBE 0x1000
+/* modes that change the record database or the installed fstab */
+#define WRITEMODES (CREATEBE|ACTIVATE|RECONCILE)
 
 /* environment check results */
 /* currently limited to just UID checking */
@@ -100,29 +168,56 @@ extern bool noop;
  * ----------------------
  *  exflags layout
  * ----------------------
- * 0 0 0 0 0 0 0 0
- * | | | | | | | |
- * | | | | | | | \- verbosity flag
- * | | | | | | \- verbosity flag
- * | | | | | \- list
- * | | | | \- create
- * | | | \- activate
- * | | \- delete 
- * | \- reserved
- * \- reserved
+ * 0 0 0 0 0 0 0 0 0 0 0 0 0
+ * | | | | | | | | | | | | |
+ * | | | | | | | | | | | | \- verbosity flag
+ * | | | | | | | | | | | \- verbosity flag
+ * | | | | | | | | | | \- list
+ * | | | | | | | | | \- create
+ * | | | | | | | | \- activate
+ * | | | | | | | \- delete 
+ * | | | | | | \- diff
+ * | | | | | \- export
+ * | | | | \- import
+ * | | | \- verify
+ * | | \- reconcile
+ * | \- replay
+ * \- trigger
  */
 
+/* everything parsed from the command line besides the mode flags */
+struct cookopts {
+	char **scopes; /* -s, repeatable */
+	int nscopes;
+	bool stamp; /* -t */
+	bool filtered; /* -q was given, list from the record database */
+	bool usage; /* -u, list space accounting instead */
+	char *diffold; /* -x old,new */
+	char *diffnew;
+	char *altroot; /* -e label,altroot */
+	char *importdir; /* -i */
+	bool manifest; /* -m, record a manifest with -c */
+	char *verifyroot; /* -V label[,root] */
+	char *iotrace; /* -T record=file or replay=file */
+	int window; /* -g window[,prefix] */
+	char *trigprefix;
+	int deadline; /* -W, seconds any device operation may take */
+	bequery query;
+};
+
 static void usage(void);
+static int parsequery(char *optstr, bequery *query);
 /* This is where the actual logic processing should take place */
-int cook(uint8_t *flags, char *bestring);
+int cook(uint16_t *flags, char *bestring, struct cookopts *opts);
 int envtest(void);
 
 #ifdef DEBUG
 bool dbg = true; /* Force enable for debug builds */
 #else
-bool dbg = false; /* Default to not adding runtime traces */
+bool dbg = false; /* Traces are only dumped on failure */
 #endif
 bool noop = false;
+bool progress = false;
 
 /* 
  * TODO: Remove all but the most rudimentary logic from this function, instead 
@@ -131,26 +226,26 @@ bool noop = false;
 int 
 main(int argc, char **argv) { 
 	/* a bitmap flag value to pass to other functions */
-	uint8_t exflags; 
+	uint16_t exflags; 
 	int ch, ret;
 	char belabel[MNAMELEN];
+	struct cookopts opts;
 
 	exflags = 0;
 	ret = ch = 0;
+	memset(&opts, 0, sizeof(opts));
+	opts.query.older = -1;
+	opts.query.newer = -1;
 
 	/* bail early */
 	if ( argc == 1 ) { usage(); }
 
-	while((ch = getopt(argc,argv,"a:c:d:hlnrD")) != -1) { 
+	while((ch = getopt(argc,argv,"a:c:d:e:g:hi:lmnpq:rRs:tT:uV:W:x:D")) != -1) { 
 		switch(ch) { 
 			case 'a': 
-				/* this codepath is not yet ready for use */
-				/* exflags |= ACTIVATE;
+				exflags |= ACTIVATE;
 				strlcpy(belabel,optarg,(MNAMELEN-1));
 				break;
-				*/
-				NOTIMP(ch);
-				return(ret);
 			case 'c':
 				exflags |= CREATEBE;
 				strlcpy(belabel,optarg,(MNAMELEN-1));
@@ -165,13 +260,41 @@ main(int argc, char **argv) {
 			case 'D':
 				dbg = true;
 				break;
+			case 'e':
+				/* the environment's PFSes are mounted under altroot, laid out as in its fstab */
+				exflags = EXPORTBE;
+				if ((opts.altroot = strchr(optarg, ',')) == NULL) {
+					usage();
+				}
+				*opts.altroot++ = 0;
+				strlcpy(belabel,optarg,(MNAMELEN-1));
+				break;
+			case 'g':
+				/* ask for an environment within the window, shared with everyone else who asks */
+				exflags = TRIGGERBE;
+				if ((opts.trigprefix = strchr(optarg, ',')) != NULL) {
+					*opts.trigprefix++ = 0;
+				} else {
+					opts.trigprefix = TRIGGER_PREFIX;
+				}
+				if ((opts.window = atoi(optarg)) < 0 || opts.window > TRIGGER_MAXWINDOW) {
+					usage();
+				}
+				break;
 			case 'h':
 				usage();
+			case 'i':
+				exflags = IMPORTBE;
+				opts.importdir = optarg;
+				break;
 			case 'l':
 				/* This will clear other flags */
 				exflags |= LISTBENV;
 				exflags &= LISTBENV;
 				break;
+			case 'm':
+				opts.manifest = true;
+				break;
 			case 'n':
 				/* 
 				 * This is the NO-OP flag, it will mostly be useful during the debugging 
@@ -180,9 +303,76 @@ main(int argc, char **argv) {
 				 */
 				noop = true;
 				break;
+			case 'p':
+				/* report progress per snapshot and ioctl latencies at the end */
+				progress = true;
+				break;
+			case 'q':
+				if (parsequery(optarg, &opts.query) != 0) {
+					usage();
+				}
+				opts.filtered = true;
+				break;
 			case 'r':
 				NOTIMP(ch);
 				return(ret);
+			case 's':
+				/* may be given multiple times, one boot environment per scope */
+				if ((opts.scopes = reallocarray(opts.scopes, (size_t)opts.nscopes + 1, sizeof(char *))) == NULL) {
+					err(errno, "%s: scope list", __progname);
+				}
+				opts.scopes[opts.nscopes++] = optarg;
+				break;
+			case 't':
+				/* append a timestamp to the label given with -c */
+				opts.stamp = true;
+				break;
+			case 'T':
+				/* record=file logs this run's ioctls, replay=file replays such a log and does nothing else */
+				if (strncmp(optarg, "record=", 7) == 0) {
+					opts.iotrace = optarg + 7;
+				} else if (strncmp(optarg, "replay=", 7) == 0) {
+					exflags = REPLAYIO;
+					opts.iotrace = optarg + 7;
+				} else {
+					usage();
+				}
+				break;
+			case 'u':
+				/* like -l, but with the space every environment pins */
+				exflags |= LISTBENV;
+				exflags &= LISTBENV;
+				opts.usage = true;
+				break;
+			case 'R':
+				/* bring the record database in line with the snapshots on disk */
+				exflags = RECONCILE;
+				break;
+			case 'V':
+				/* the running system unless the environment is mounted elsewhere */
+				exflags = VERIFYBE;
+				if ((opts.verifyroot = strchr(optarg, ',')) != NULL) {
+					*opts.verifyroot++ = 0;
+				} else {
+					opts.verifyroot = "/";
+				}
+				strlcpy(belabel,optarg,(MNAMELEN-1));
+				break;
+			case 'W':
+				/* a hung device costs at most this much per operation, instead of the whole run */
+				if ((opts.deadline = atoi(optarg)) <= 0 || opts.deadline > WATCH_MAXDEADLINE) {
+					usage();
+				}
+				break;
+			case 'x':
+				/* two mounted environments to compare, old first */
+				exflags = DIFFBENV;
+				opts.diffold = optarg;
+				if ((opts.diffnew = strchr(optarg, ',')) == NULL) {
+					usage();
+				}
+				*opts.diffnew++ = 0;
+				break;
 			default:
 				usage();
 		}
@@ -190,20 +380,70 @@ main(int argc, char **argv) {
 	/* Pass all the serious logic into cook() */
 	argc -= optind;
 	argv += optind;
-	ret = cook(&exflags, belabel);
+	ret = cook(&exflags, belabel, &opts);
+	free(opts.scopes);
+	/* the trace ring is only formatted when someone will read it */
+	if (dbg || ret != 0) {
+		tracedump(stderr);
+	}
 	return(ret);
 }
 
 int
-cook(uint8_t *flags, char *bestring) {
+cook(uint16_t *flags, char *bestring, struct cookopts *opts) {
 	int retc;
+	bool leading;
+	char stamped[MNAMELEN];
 	retc = 0;
+	leading = false;
 
+	/* replaying runs against the simulated backend only, anyone can do it anywhere */
+	if (*flags == REPLAYIO) {
+		return((replay(opts->iotrace) != 0) ? 1 : 0);
+	}
+	/* before anything can touch a device */
+	watch_init(opts->deadline);
 	if ((retc = envtest()) != 0) {
 		return(retc);
 	}
 	/* Placeholder logic to quelch compiler warnings */
 	assert(flags != NULL);
+	if (siminit() != 0) {
+		return(1);
+	}
+	/* only whoever ends up leading the round creates anything, without holding the lock while it waits */
+	if (*flags == TRIGGERBE) {
+		if ((retc = trigger(opts->window, opts->trigprefix, bestring, MNAMELEN, &leading)) != 0 || !leading) {
+			return(retc);
+		}
+		/* the label is already stamped */
+		*flags = CREATEBE;
+		opts->stamp = false;
+	}
+	/* -u files what it measured in the record database, a dry run changes nothing and can share the lock with readers */
+	if ((retc = belock(((*flags & WRITEMODES) != 0 || ((*flags & LISTBENV) != 0 && opts->usage)) && !noop)) != LOCK_HELD) {
+		retc = (retc == LOCK_TIMEOUT) ? 3 : 1;
+		if (leading) {
+			trigger_done(bestring, retc);
+		}
+		return(retc);
+	}
+	if (opts->iotrace != NULL && iotrace_open(opts->iotrace) != 0) {
+		if (leading) {
+			trigger_done(bestring, 1);
+		}
+		beunlock();
+		return(1);
+	}
+	/* finish undoing an interrupted activation before anything reads the fstab, a simulated run has no business with it */
+	if ((*flags & (CREATEBE|ACTIVATE)) != 0 && !simactive() && (retc = recoverjournal()) != 0) {
+		if (leading) {
+			trigger_done(bestring, retc);
+		}
+		iotrace_close();
+		beunlock();
+		return(retc);
+	}
 	switch(*flags) {
 		case(ACTIVATE):
 			assert(bestring != NULL);
@@ -211,15 +451,73 @@ cook(uint8_t *flags, char *bestring) {
 			break;
 		case(CREATEBE):
 			assert(bestring != NULL);
-			retc = create(bestring);
+			if (opts->stamp) {
+				if (stamplabel(bestring, time(NULL), stamped, sizeof(stamped)) < 0) {
+					fprintf(stderr,"ERR: %s [%s:%u] %s: Label \"%s\" is too long to be timestamped\n",__progname,__FILE__,__LINE__,__func__,bestring);
+					retc = 1;
+					break;
+				}
+				bestring = stamped;
+			}
+			if ((retc = checklabel(bestring)) != LABEL_OK) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Invalid label \"%s\": %s\n",__progname,__FILE__,__LINE__,__func__,bestring,labelerr(retc));
+				break;
+			}
+			if (opts->nscopes > 0) {
+				if (opts->manifest) {
+					fprintf(stderr,"WRN: %s [%s:%u] %s: Scoped environments don't get a manifest, ignoring -m\n",__progname,__FILE__,__LINE__,__func__);
+				}
+				retc = create_scoped(bestring, opts->scopes, opts->nscopes);
+			} else if ((retc = create(bestring)) == 0 && opts->manifest) {
+				/*
+				 * hashed from the live tree right after the snapshots, not from the snapshots themselves:
+				 * anything written in between, and /boot when it isn't HAMMER2, is recorded as it is now
+				 */
+				retc = (mkmanifest(bestring, "/") != 0) ? 1 : 0;
+			}
+			break;
+		case(EXPORTBE):
+			retc = exportenv(bestring, opts->altroot);
+			break;
+		case(IMPORTBE):
+			retc = importenv(opts->importdir);
+			break;
+		case(VERIFYBE):
+			retc = verifyenv(bestring, opts->verifyroot);
+			retc = (retc < 0) ? 2 : retc;
+			break;
+		case(RECONCILE):
+			retc = (reconcile() != 0) ? 1 : 0;
+			break;
+		case(DIFFBENV):
+			retc = diffenvs(opts->diffold, opts->diffnew);
 			break;
 		case(LISTBENV):
-			list();
+			if (opts->usage) {
+				retc = (usage_report() != 0) ? 1 : 0;
+			} else if (opts->filtered) {
+				retc = (query_bedata(&opts->query) < 0) ? 1 : 0;
+			} else {
+				list();
+			}
 			break;
 		default:
 			usage();
 			break;
 	}
+	progress_finish();
+	/* anything abandoned already failed whatever needed it, this says where and why */
+	if (watch_report(stderr) != 0 && retc == 0) {
+		retc = 1;
+	}
+	query_close();
+	if (iotrace_close() != 0 && retc == 0) {
+		retc = 1;
+	}
+	if (leading) {
+		trigger_done(bestring, retc);
+	}
+	beunlock();
 
 	return(retc);
 }
@@ -236,6 +534,99 @@ envtest(void) {
 	return(retc);
 }
 
+/*
+ * Parse the -q filter list, a comma separated list of newest=N, 
+ * older=TIME, newer=TIME, since-upgrade, label=PREFIX, active, 
+ * gone, all, device=DEV, minsize=BYTES[KMGT] and pfs
+ */
+static int
+parsequery(char *optstr, bequery *query) {
+	enum { Q_NEWEST = 0, Q_OLDER, Q_NEWER, Q_SINCE, Q_LABEL, Q_ACTIVE, Q_GONE, Q_ALL, Q_DEVICE, Q_MINSIZE, Q_PFS };
+	char *const tokens[] = { "newest", "older", "newer", "since-upgrade", "label", "active", "gone", "all", "device", "minsize", "pfs", NULL };
+	char *value, *unit;
+	unsigned long long size;
+
+	while (*optstr != 0) {
+		value = NULL;
+		switch (getsubopt(&optstr, tokens, &value)) {
+			case Q_NEWEST:
+				if (value == NULL || (query->newest = atoi(value)) <= 0) {
+					fprintf(stderr,"ERR: %s: newest= takes a positive count\n",__progname);
+					return(-1);
+				}
+				break;
+			case Q_OLDER:
+				if (value == NULL || (query->older = parsebetime(value)) < 0) {
+					fprintf(stderr,"ERR: %s: older= takes a time as %s, %s or @seconds\n",__progname,BETIME_FMT,"%Y.%m.%d");
+					return(-1);
+				}
+				break;
+			case Q_NEWER:
+				if (value == NULL || (query->newer = parsebetime(value)) < 0) {
+					fprintf(stderr,"ERR: %s: newer= takes a time as %s, %s or @seconds\n",__progname,BETIME_FMT,"%Y.%m.%d");
+					return(-1);
+				}
+				break;
+			case Q_SINCE:
+				query->sinceactive = true;
+				break;
+			case Q_LABEL:
+				if (value == NULL || *value == 0) {
+					fprintf(stderr,"ERR: %s: label= takes a label prefix\n",__progname);
+					return(-1);
+				}
+				query->prefix = value;
+				break;
+			case Q_ACTIVE:
+				query->active = true;
+				break;
+			case Q_GONE:
+				query->extant = QUERY_GONE;
+				break;
+			case Q_ALL:
+				query->extant = QUERY_ALL;
+				break;
+			case Q_DEVICE:
+				if (value == NULL || *value == 0) {
+					fprintf(stderr,"ERR: %s: device= takes a device as in fstab, without the @PFS\n",__progname);
+					return(-1);
+				}
+				query->device = value;
+				break;
+			case Q_MINSIZE:
+				errno = 0;
+				if (value == NULL || (size = strtoull(value, &unit, 10)) == 0 || errno != 0 ||
+				    (unit[0] != 0 && (unit[1] != 0 || strchr("KMGT", unit[0]) == NULL))) {
+					fprintf(stderr,"ERR: %s: minsize= takes a size in bytes, optionally suffixed by K, M, G or T\n",__progname);
+					return(-1);
+				}
+				switch (*unit) {
+					case 'T':
+						size <<= 10;
+						/* FALLTHROUGH */
+					case 'G':
+						size <<= 10;
+						/* FALLTHROUGH */
+					case 'M':
+						size <<= 10;
+						/* FALLTHROUGH */
+					case 'K':
+						size <<= 10;
+						break;
+				}
+				query->minsize = (uint64_t)size;
+				break;
+			case Q_PFS:
+				query->pfses = true;
+				break;
+			default:
+				fprintf(stderr,"ERR: %s: Unknown query filter \"%s\"\n",__progname,(value != NULL) ? value : "");
+				return(-1);
+		}
+	}
+	return(0);
+}
+
 /*
  * tell the user how this program works
  */
@@ -247,10 +638,26 @@ usage(void) {
 	               "  -a  Activate the given boot environment\n"
 	               "  -c  Create a new boot environment with the given label\n"
 	               "  -d  Destroy the given boot environment\n"
-	               "  -D  Print debugging information during execution\n"
+	               "  -e  Export a boot environment mounted under a directory to stdout, given as label,altroot\n"
+	               "  -D  Print the trace of this run when it finishes\n"
+	               "  -g  Create an environment once the given window in seconds has passed, shared with every\n"
+	               "      request made in the meantime, given as window[,prefix]\n"
 	               "  -h  This help text\n"
+	               "  -i  Import an exported boot environment from stdin into the given directory\n"
 	               "  -l  List existing boot environments\n"
+	               "  -m  Record a manifest of the files under /boot, /etc and /usr/lib with -c, hashed from the live tree\n"
 	               "  -n  No-op/dry run, only show what would be done\n"
-	               "  -r  Remove the given boot environment\n");
+	               "  -p  Show progress and per-device ioctl latency histograms, see also "DFBEADM_STATUS"\n"
+	               "  -q  Filter -l through the record database: newest=N,older=TIME,newer=TIME,since-upgrade,\n"
+	               "      label=PREFIX,active,gone,all,device=DEV,minsize=BYTES[KMGT],pfs\n"
+	               "  -r  Remove the given boot environment\n"
+	               "  -R  Reconcile the record database with the snapshots on disk\n"
+	               "  -s  Limit -c to the PFSes at or below the given mountpoint, may be repeated\n"
+	               "  -t  Append a UTC timestamp to the label given with -c\n"
+	               "  -T  record=FILE logs every HAMMER2 ioctl of this run, replay=FILE replays such a log against the simulator\n"
+	               "  -u  List the space referenced by each boot environment, largest size delta first\n"
+	               "  -V  Verify a boot environment against its manifest, given as label[,root]\n"
+	               "  -W  Abandon any device operation that takes longer than the given number of seconds\n"
+	               "  -x  Compare two mounted boot environments, given as old,new\n");
 	_exit(0);
 }
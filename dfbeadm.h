@@ -35,9 +35,10 @@
 /* Currently encoded like RGB, but Major, Minor, Patch */
 #define DFBEADM_VER 0x000200
 #define DFBEADM_VER_STRING "0.2.0-DEV"
-#define PFSDELIM '@'
-#define BESEP ':'
-#define TMAX 18
+/* PFSDELIM, BESEP, TMAX, BETIME_FMT and TSEP */
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
 #define NOTIMP(a) fprintf(stderr,"WRN: %s [%s:%u] %s: -%c is not implemented at this time!\n",__progname,__FILE__,__LINE__,__func__,a)
 
 /* Asserts are a good thing to have across all files */
@@ -54,6 +55,11 @@
 /* HAMMER2 specific needs */
 #include <vfs/hammer2/hammer2_ioctl.h>
 
+/* DBGTRACE() and friends are available everywhere */
+#ifndef DFBEADM_FSTRACE_H
+#include "fstrace.h"
+#endif
+
 /* struct to hold the relevant data to rebuild the fstab */
 struct bootenv_data { 
 	struct fstab fstab; /* this should be pretty obvious, but this is each PFS's description in the fstab */
@@ -61,6 +67,9 @@ struct bootenv_data {
 	char curlabel[NAME_MAX]; /* this may actually not be necessary, bubt it's the current label of the PFS */
 	int mountfd;
 	bool snap;
+	uint64_t snaptid; /* the origin's last snapshot TID once the snapshot exists */
+	int64_t snaptime; /* when it was taken */
+	uint64_t snapsize; /* bytes it references */
 } __packed;
 
 struct efstab_lookup {
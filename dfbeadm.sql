@@ -9,7 +9,7 @@ PRAGMA foreign_keys=on;
 
 -- Database and Application version info
 -- NOTE: These are currently placeholders
-PRAGMA user_version=0;
+PRAGMA user_version=5;
 PRAGMA application_id=999;
 
 -- Table dofinitions
@@ -22,21 +22,66 @@ CREATE TABLE IF NOT EXISTS hashalgo (
 
 CREATE TABLE IF NOT EXISTS h2be (
 	belabel text UNIQUE NOT NULL, -- Should be usable as a primary key
-	fstab blob NOT NULL, -- Hold the complete fstab
+	fstab blob NOT NULL, -- The complete fstab, a NUL, then the loader.conf root spec, ready to install
 	active bool NOT NULL DEFAULT false, -- Is this the one currently in use?
 	extant bool NOT NULL DEFAULT true, -- Does this boot environment still exist?
 	fshash text UNIQUE NOT NULL, -- Since belabel is unique, this should also be unique
 	hashspec integer NOT NULL DEFAULT 0, -- Default to using whirlpool for the fstab digest
+	betime integer NOT NULL DEFAULT 0, -- Creation time, parsed from timestamped labels when present
 	PRIMARY KEY (belabel,fshash),
 	FOREIGN KEY (hashspec) REFERENCES hashalgo(id)
 );
 
+-- Space accounting per PFS, as measured when each snapshot was taken
+CREATE TABLE IF NOT EXISTS pfsusage (
+	pfs text PRIMARY KEY NOT NULL, -- device@pfs, snapshots keep their :belabel suffix
+	belabel text NOT NULL DEFAULT '', -- Boot environment the PFS belongs to, empty for live PFSes
+	stamp integer NOT NULL, -- No longer set, always 0
+	datasize integer NOT NULL, -- Bytes referenced by the PFS
+	inodes integer NOT NULL, -- Inodes referenced by the PFS
+	measured integer NOT NULL -- When the figures were taken
+);
+
+-- Digests of the files under the manifest paths, taken when the environment was created with -m
+CREATE TABLE IF NOT EXISTS bemanifest (
+	belabel text NOT NULL, -- Boot environment the manifest belongs to
+	path text NOT NULL, -- Relative to the environment's root, with a leading slash
+	size integer NOT NULL, -- File size in bytes
+	digest text NOT NULL, -- Hex digest of the contents
+	hashspec integer NOT NULL DEFAULT 4, -- Algorithm used for digest
+	PRIMARY KEY (belabel,path),
+	FOREIGN KEY (hashspec) REFERENCES hashalgo(id)
+);
+
+-- One row per PFS snapshot of every environment
+CREATE TABLE IF NOT EXISTS h2pfs (
+	belabel text NOT NULL REFERENCES h2be(belabel) ON DELETE CASCADE, -- Boot environment the snapshot belongs to
+	device text NOT NULL, -- The part of the fs_spec before the '@'
+	pfs text NOT NULL, -- Name of the PFS the snapshot was taken of
+	snapshot text NOT NULL, -- Name of the snapshot, pfs:belabel
+	mountpoint text NOT NULL, -- Where it's mounted when the environment is active
+	tid integer NOT NULL, -- Creation TID, the origin's last snapshot TID right after it was taken
+	ctime integer NOT NULL, -- Creation time
+	datasize integer NOT NULL, -- Bytes referenced when it was taken
+	PRIMARY KEY (belabel,device,pfs)
+) WITHOUT ROWID;
+
 -- Index creation to help prevent slow lookups
 CREATE INDEX IF NOT EXISTS extant_bootenvs ON h2be (belabel,extant);
 CREATE INDEX IF NOT EXISTS fstab_hashes ON h2be (fstab,fshash);
+-- Covers the newest/older/since queries without touching the table
+CREATE INDEX IF NOT EXISTS bootenv_times ON h2be (betime,belabel,extant);
+-- Sums the figures of an environment without touching the table
+CREATE INDEX IF NOT EXISTS usage_envs ON pfsusage (belabel,datasize,inodes);
+-- Cover listing snapshots by time, by device and finding the environments containing a PFS
+CREATE INDEX IF NOT EXISTS pfs_times ON h2pfs (ctime,belabel,device,pfs);
+CREATE INDEX IF NOT EXISTS pfs_devices ON h2pfs (device,ctime,pfs,belabel,datasize);
+CREATE INDEX IF NOT EXISTS pfs_members ON h2pfs (pfs,belabel,device);
+-- Hands snapshots back in the order PFS_GET listings are sorted into for -R
+CREATE INDEX IF NOT EXISTS pfs_inventory ON h2pfs (device,snapshot,belabel);
 
 -- Populate the hash algo table with hashes 
--- Not all of these are currently available, but should all be 
+-- All of these are implemented in fsdigest.c, and should all be 
 -- resonably good hashes with good performance.
 -- These are probably overkill for simple integrity checking, but 
 -- to my knowledge have no risk of collisions, 
@@ -44,9 +89,9 @@ CREATE INDEX IF NOT EXISTS fstab_hashes ON h2be (fstab,fshash);
 BEGIN;
 	INSERT INTO hashalgo VALUES
 	(0, 'whirlpool'),
-	(1, 'sha3-512'), -- Not in LibreSSL 2.9.1
-	(2, 'blake2b512'), -- Not in LibreSSL 2.9.1
-	(3, 'shake256'), -- Not in LibreSSL 2.9.1
+	(1, 'sha3-512'),
+	(2, 'blake2b512'),
+	(3, 'shake256'), -- 512 bits of output
 	(4, 'sha2-512');
 COMMIT;
 
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSCACHE_H
+#include "fscache.h"
+#endif
+#ifndef DFBEADM_H2TEST_H
+#include "fstest.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+#ifndef DFBEADM_FSSIM_H
+#include "fssim.h"
+#endif
+
+
+extern char *__progname;
+extern bool noop;
+
+/* the in-memory copy of the cache, sorted by mountpoint */
+static discovery *dcache = NULL;
+static int dcount = 0;
+static pthread_once_t dcache_once = PTHREAD_ONCE_INIT;
+
+static void cacheinit(void);
+static int cmpdisc(const void *a, const void *b);
+static void classify(const struct statfs *sfs, discovery *de);
+static int fstabkey(struct discovery_header *key);
+static void savecache(const struct discovery_header *key);
+
+/*
+ * Find the cached classification of a mountpoint, loading the cache on first use.
+ * Safe to call from several threads at once.
+ * returns NULL if the mountpoint isn't in the mount table
+ */
+const discovery *
+cachelookup(const char *mountpoint) {
+	discovery key;
+
+	assert(mountpoint != NULL);
+	pthread_once(&dcache_once, cacheinit);
+	if (dcache == NULL) {
+		return(NULL);
+	}
+	strlcpy(key.mountpoint, mountpoint, MNAMELEN);
+	return(bsearch(&key, dcache, (size_t)dcount, sizeof(discovery), cmpdisc));
+}
+
+/*
+ * Load the discovery cache if it still describes this system, 
+ * otherwise classify every mount again and rewrite it.
+ * returns 0 on success, nonzero if no cache could be built
+ */
+int
+loadcache(void) {
+	int cfd, i, vfscount, retc;
+	struct discovery_header want, have;
+	struct statfs *vfs;
+
+	cfd = i = vfscount = retc = 0;
+	vfs = NULL;
+	memset(&want, 0, sizeof(want));
+	memset(&have, 0, sizeof(have));
+	want.magic = DFBEADM_CACHE_MAGIC;
+	want.version = DFBEADM_CACHE_VER;
+
+	DBGTRACE("Entering to load %s", DFBEADM_CACHE_FILE);
+	if (fstabkey(&want) != 0) {
+		return(-1);
+	}
+	/* MNT_NOWAIT keeps a hung filesystem from stalling what should be a cheap check */
+	if ((vfscount = vfsstat(NULL, 0, MNT_NOWAIT)) <= 0 ||
+	    (vfs = calloc((size_t)vfscount, sizeof(struct statfs))) == NULL ||
+	    (vfscount = vfsstat(vfs, (long)((size_t)vfscount * sizeof(struct statfs)), MNT_NOWAIT)) <= 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the mount table (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+		free(vfs);
+		return(-1);
+	}
+	want.vfs_fingerprint = FNV_OFFSET;
+	for (i = 0; i < vfscount; i++) {
+		want.vfs_fingerprint = fnv1a(want.vfs_fingerprint, vfs[i].f_mntonname, strnlen(vfs[i].f_mntonname, MNAMELEN));
+		want.vfs_fingerprint = fnv1a(want.vfs_fingerprint, vfs[i].f_mntfromname, strnlen(vfs[i].f_mntfromname, MNAMELEN));
+		want.vfs_fingerprint = fnv1a(want.vfs_fingerprint, vfs[i].f_fstypename, strnlen(vfs[i].f_fstypename, MFSNAMELEN));
+		want.vfs_fingerprint = fnv1a(want.vfs_fingerprint, &vfs[i].f_fsid, sizeof(vfs[i].f_fsid));
+	}
+	want.count = (uint32_t)vfscount;
+
+	/* a matching header means nothing changed since the last run */
+	if ((cfd = open(DFBEADM_CACHE_FILE, O_RDONLY)) >= 0) {
+		if (read(cfd, &have, sizeof(have)) == (ssize_t)sizeof(have) && memcmp(&have, &want, sizeof(want)) == 0 &&
+		    (dcache = calloc((size_t)want.count, sizeof(discovery))) != NULL) {
+			if (read(cfd, dcache, want.count * sizeof(discovery)) == (ssize_t)(want.count * sizeof(discovery))) {
+				dcount = (int)want.count;
+			} else {
+				free(dcache);
+				dcache = NULL;
+			}
+		}
+		close(cfd);
+	}
+	if (dcache != NULL) {
+		DBGTRACE("Cache hit, %d mounts classified without probing", dcount);
+		free(vfs);
+		return(0);
+	}
+
+	if ((dcache = calloc((size_t)vfscount, sizeof(discovery))) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to allocate discovery cache!\n",__progname,__FILE__,__LINE__,__func__);
+		free(vfs);
+		return(-2);
+	}
+	for (i = 0; i < vfscount; i++) {
+		classify(&vfs[i], &dcache[i]);
+	}
+	dcount = vfscount;
+	qsort(dcache, (size_t)dcount, sizeof(discovery), cmpdisc);
+	savecache(&want);
+	free(vfs);
+
+	DBGTRACE("Cache rebuilt with %d mounts, returning %d to caller", dcount, retc);
+	return(retc);
+}
+
+/*
+ * 64-bit FNV-1a, only used to notice change, not to defend against it
+ */
+uint64_t
+fnv1a(uint64_t hash, const void *buf, size_t len) {
+	const unsigned char *p;
+
+	for (p = buf; len > 0; len--, p++) {
+		hash ^= *p;
+		hash *= FNV_PRIME;
+	}
+	return(hash);
+}
+
+static void
+cacheinit(void) {
+	if (loadcache() != 0) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: Discovery cache unavailable, probing every mountpoint\n",__progname,__FILE__,__LINE__,__func__);
+	}
+}
+
+static int
+cmpdisc(const void *a, const void *b) {
+	return(strncmp(((const discovery *)a)->mountpoint, ((const discovery *)b)->mountpoint, MNAMELEN));
+}
+
+/*
+ * Work out what a mount is, only HAMMER2 mounts are ever probed with an ioctl,
+ * so a nullfs mount of a HAMMER2 directory is never treated as a PFS.
+ */
+static void
+classify(const struct statfs *sfs, discovery *de) {
+	memset(de, 0, sizeof(discovery));
+	strlcpy(de->mountpoint, sfs->f_mntonname, MNAMELEN);
+	if (strncmp(sfs->f_fstypename, "hammer2", MFSNAMELEN) == 0) {
+		de->h2 = probeh2(de->mountpoint, sfs->f_mntfromname);
+	}
+}
+
+/*
+ * Fill in the fstab(5) half of the cache key
+ */
+static int
+fstabkey(struct discovery_header *key) {
+	int ffd;
+	ssize_t got;
+	char buf[PAGE_SIZE];
+	const char *path;
+	struct stat fst;
+
+	path = (simactive()) ? simfstab() : _PATH_FSTAB;
+	if ((ffd = open(path, O_RDONLY)) < 0 || fstat(ffd, &fst) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read %s (%s)\n",__progname,__FILE__,__LINE__,__func__,path,strerror(errno));
+		if (ffd >= 0) {
+			close(ffd);
+		}
+		return(-1);
+	}
+	key->fstab_mtime = (int64_t)fst.st_mtime;
+	key->fstab_size = (int64_t)fst.st_size;
+	key->fstab_hash = FNV_OFFSET;
+	while ((got = read(ffd, buf, sizeof(buf))) > 0) {
+		key->fstab_hash = fnv1a(key->fstab_hash, buf, (size_t)got);
+	}
+	close(ffd);
+	return((got < 0) ? -1 : 0);
+}
+
+/*
+ * Replace the on-disk cache, failures only cost a probe on the next run
+ */
+static void
+savecache(const struct discovery_header *key) {
+	int cfd;
+	char tmpcache[MAXPATHLEN];
+
+	/* a simulated system must never stand in for the real one on the next run */
+	if (noop || geteuid() != 0 || simactive()) {
+		return;
+	}
+	snprintf(tmpcache, sizeof(tmpcache), "%s.XXXXXX", DFBEADM_CACHE_FILE);
+	if ((cfd = mkstemp(tmpcache)) < 0) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to stage %s (%s)\n",__progname,__FILE__,__LINE__,__func__,DFBEADM_CACHE_FILE,strerror(errno));
+		return;
+	}
+	if (write(cfd, key, sizeof(*key)) != (ssize_t)sizeof(*key) ||
+	    write(cfd, dcache, (size_t)dcount * sizeof(discovery)) != (ssize_t)((size_t)dcount * sizeof(discovery)) ||
+	    rename(tmpcache, DFBEADM_CACHE_FILE) != 0) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to write %s (%s)\n",__progname,__FILE__,__LINE__,__func__,DFBEADM_CACHE_FILE,strerror(errno));
+		unlink(tmpcache);
+	}
+	close(cfd);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Persistent cache of the mountpoint classification done by ish2(), 
+ * keyed on the fstab(5) contents and the mount table reported by getfsstat(2),
+ * so unchanged systems never have to probe their mounts again.
+ */
+
+#define DFBEADM_FSCACHE_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#include <stdint.h>
+
+#define DFBEADM_CACHE_FILE "/var/db/dfbeadm.discovery"
+/* "DFBC" in ASCII, bump the version whenever the entry layout changes */
+#define DFBEADM_CACHE_MAGIC 0x44464243
+#define DFBEADM_CACHE_VER 2
+
+/* What we learned about a single mountpoint, the fstab already says what's mounted there */
+struct discovery_entry {
+	char mountpoint[MNAMELEN];
+	bool h2;
+};
+
+struct discovery_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t fstab_mtime;
+	int64_t fstab_size;
+	uint64_t fstab_hash;
+	uint64_t vfs_fingerprint;
+	uint32_t count;
+};
+
+/* seed and multiplier for fnv1a() */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct discovery_entry discovery;
+
+const discovery *cachelookup(const char *mountpoint);
+int loadcache(void);
+uint64_t fnv1a(uint64_t hash, const void *buf, size_t len);
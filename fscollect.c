@@ -49,11 +49,22 @@
 #ifndef DFBEADM_SNAPFS_H
 #include "snapfs.h"
 #endif
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+#ifndef DFBEADM_FSPREFLIGHT_H
+#include "fspreflight.h"
+#endif
 
 #define LABELED 0
 #define NOBE 1
 
-extern bool dbg;
 
 /* 
  * create a boot environment
@@ -61,21 +72,47 @@ extern bool dbg;
  */
 int
 create(const char *label) { 
-	/* since we can't rely on the VFS layer for all of our fstab data, we need to be sure what exists */
-	int i, fstabcount, retc, vfscount;
-	struct fstab *fsptr;
-	struct statfs *vfsptr;
+	int fstabcount, retc;
 	bedata *befs;
 	
 	assert(label != NULL);
-	i = retc = fstabcount = vfscount = 0;
-	fsptr = NULL;
-	vfsptr = NULL;
+	retc = fstabcount = 0;
+	befs = NULL;
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entered with label = %s\n",__progname,__FILE__,__LINE__,__func__,label);
+	DBGTRACE("Entered with label = %s", label);
+	if ((retc = collectfs(&befs, &fstabcount)) == 0) {
+		/* now pass the buffers to the next step, only complete environments get recorded */
+		if ((retc = mktargets(befs, fstabcount, label)) == 0) {
+			/* the snapshots exist either way, but an unrecorded environment is worth failing over */
+			retc = (write_bedata(befs, fstabcount, label) != 0) ? 1 : 0;
+		} else {
+			retc = 1;
+		}
+		/* ensure we clean up after ourselves */
+		freefs(befs, fstabcount);
 	}
-	if ((vfscount = getfsstat(vfsptr, 0, MNT_WAIT)) == 0) { 
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Read the system fstab(5) into a freshly allocated buffer of bedata structs,
+ * shared by create() and the scoped variants so the fstab is only walked once.
+ * returns 0 if successful, >=2 on allocation failure
+ */
+int
+collectfs(bedata **befs, int *fscount) {
+	/* since we can't rely on the VFS layer for all of our fstab data, we need to be sure what exists */
+	int i, fstabcount, vfscount;
+	struct fstab *fsptr;
+	bedata *target;
+
+	assert((befs != NULL) && (fscount != NULL));
+	i = fstabcount = vfscount = 0;
+	fsptr = NULL;
+	target = NULL;
+
+	if ((vfscount = vfsstat(NULL, 0, MNT_WAIT)) == 0) { 
 		fprintf(stderr, "ERR: %s [%s:%u] %s: Something's wrong, no filesystems found\n",__progname,__FILE__,__LINE__,__func__);
 	}
 	/* Simple loop to get filesystem count from /etc/fstab */
@@ -94,45 +131,52 @@ create(const char *label) {
 	}
 
 	/* now that we have an idea what we're working with, let's go about cloning this data */
-	if ((befs = calloc((size_t)fstabcount, sizeof(bedata))) == NULL) {
+	if ((target = calloc((size_t)fstabcount, sizeof(bedata))) == NULL) {
 		fprintf(stderr,"Could not allocate initial buffer!\n");
-		retc = 2;
+		return(2);
 	}
 
-	/* now allocate space for the members */
+	/* now allocate space for the members, calloc(3) leaves anything we don't reach as NULL for freefs() */
 	for (i = 0; i < fstabcount; i++) {
-		if ((befs[i].fstab.fs_spec = calloc(MNAMELEN, 1)) == NULL) {
-			fprintf(stderr, "%s [%s:%u] %s: Could not allocate buffer\n",__progname,__FILE__,__LINE__,__func__);
-			free(befs);
-			return(2);
-		}
-		if ((befs[i].fstab.fs_file = calloc(MNAMELEN, 1)) == NULL) {
+		if (((target[i].fstab.fs_spec = calloc(MNAMELEN, 1)) == NULL) ||
+		    ((target[i].fstab.fs_file = calloc(MNAMELEN, 1)) == NULL) ||
+		    ((target[i].fstab.fs_vfstype = calloc(MNAMELEN, 1)) == NULL) ||
+		    ((target[i].fstab.fs_mntops = calloc(MNAMELEN, 1)) == NULL) ||
+		    ((target[i].fstab.fs_type = calloc(MNAMELEN, 1)) == NULL)) {
 			fprintf(stderr, "%s [%s:%u] %s: Could not allocate buffer\n",__progname,__FILE__,__LINE__,__func__);
-			free(befs);
-			return(2);
-		}
-		if ((befs[i].fstab.fs_vfstype = calloc(MNAMELEN, 1)) == NULL) {
-			fprintf(stderr, "%s [%s:%u] %s: Could not allocate buffer\n",__progname,__FILE__,__LINE__,__func__);
-			free(befs);
-			return(2);
-		}
-		if ((befs[i].fstab.fs_mntops = calloc(MNAMELEN, 1)) == NULL) {
-			fprintf(stderr, "%s [%s:%u] %s: Could not allocate buffer\n",__progname,__FILE__,__LINE__,__func__);
-			free(befs);
-			return(2);
-		}
-		if ((befs[i].fstab.fs_type = calloc(MNAMELEN, 1)) == NULL) {
-			fprintf(stderr, "%s [%s:%u] %s: Could not allocate buffer\n",__progname,__FILE__,__LINE__,__func__);
-			free(befs);
+			freefs(target, fstabcount);
 			return(2);
 		}
 	}
 
-	/* now pass the buffers to the next step */
-	mktargets(befs, fstabcount, label);
+	/* these steps are done for every filesystem */
+	for (i = 0; i < fstabcount && (fsptr = getfsent()) != NULL; i++) {
+		strlcpy(target[i].fstab.fs_spec, fsptr->fs_spec, MNAMELEN);
+		strlcpy(target[i].fstab.fs_file, fsptr->fs_file, MNAMELEN);
+		strlcpy(target[i].fstab.fs_vfstype, fsptr->fs_vfstype, MNAMELEN);
+		strlcpy(target[i].fstab.fs_mntops, fsptr->fs_mntops, MNAMELEN);
+		strlcpy(target[i].fstab.fs_type, fsptr->fs_type, MNAMELEN);
+		target[i].fstab.fs_freq = fsptr->fs_freq;
+		target[i].fstab.fs_passno = fsptr->fs_passno;
+	}
+	endfsent();
+
+	*befs = target;
+	*fscount = fstabcount;
+	return(0);
+}
 
-	/* ensure we clean up after ourselves */
-	for (i ^= i; i < fstabcount; i++) { 
+/*
+ * Release a buffer handed out by collectfs()
+ */
+void
+freefs(bedata *befs, int fscount) {
+	int i;
+
+	if (befs == NULL) {
+		return;
+	}
+	for (i = 0; i < fscount; i++) { 
 		free(befs[i].fstab.fs_spec);
 		free(befs[i].fstab.fs_file);
 		free(befs[i].fstab.fs_vfstype);
@@ -140,31 +184,51 @@ create(const char *label) {
 		free(befs[i].fstab.fs_type);
 	}
 	free(befs);
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
-	}
-	return(retc);
 }
 
 /* 
- * TODO: Have this function call openfs() prior to exit. 
- * It'll cause a slightly deeper call stack than I'd like, 
- * but fits better logically.
  * Creates a buffer of targets to be handed off to snapfs()
  * This function should be called directly from create(), and provided
  * with a buffer of currently existing filesystems
+ * returns the number of problems preflight_create() found, or of snapshots that failed
  */
-void
+int
 mktargets(bedata *target, int fscount, const char *label) {
-	register int i, ret;
-	struct fstab *current;
+	int retc;
 
 	assert((target != NULL) && (label != NULL));
-	ret = 0;
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entered with target = %p, fscount = %d, label = %s\n",
-				__progname,__FILE__,__LINE__,__func__,(void *)target,fscount,label);
+	DBGTRACE("Entered with target = %p, fscount = %d, label = %s", (void *)target, fscount, label);
+
+	marktargets(target, fscount, label);
+	/* nothing has been changed yet, and nothing will be unless the whole environment checks out */
+	if ((retc = preflight_create(target, fscount, label)) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %d problems found, %s was not created\n",__progname,__FILE__,__LINE__,__func__,retc,label);
+		closefs(target, fscount);
+		DBGTRACE("Returning %d to caller", retc);
+		return(retc);
 	}
+	/* 
+	 * now everything should be in place to create snapshots 
+	 * looping is handled internally
+	 */
+	retc = snapfs(target, fscount, label);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/* 
+ * Decide which entries of an already collected buffer get snapshotted,
+ * opening the mountpoint and writing the new PFS label for each of them.
+ * Only touches the entries it is given, so scope workers can run it concurrently.
+ * returns the number of filesystems marked for snapshotting
+ */
+int
+marktargets(bedata *target, int fscount, const char *label) {
+	register int i, ret;
+	int marked;
+
+	assert((target != NULL) && (label != NULL));
+	ret = marked = 0;
 
 	/* 
 	 * now that we have the number of existing filesystems and the 
@@ -173,101 +237,57 @@ mktargets(bedata *target, int fscount, const char *label) {
 	 * we're just building the struct.
 	 */
 	for (i = 0; i < fscount; i++) { 
-		current = getfsent();
-
-		/* these steps are done for every filesystem */
-		strlcpy(target[i].fstab.fs_spec, current->fs_spec, MNAMELEN);
-		strlcpy(target[i].fstab.fs_file, current->fs_file, MNAMELEN);
-		strlcpy(target[i].fstab.fs_vfstype, current->fs_vfstype, MNAMELEN);
-		strlcpy(target[i].fstab.fs_mntops, current->fs_mntops, MNAMELEN);
-		strlcpy(target[i].fstab.fs_type, current->fs_type, MNAMELEN);
-		target[i].fstab.fs_freq = current->fs_freq;
-		target[i].fstab.fs_passno = current->fs_passno;
-
-		/* now do some additional work in the same loop */
-		if (ish2(current->fs_file)) { 
+		if (ish2(target[i].fstab.fs_file, target[i].fstab.fs_spec)) { 
 			target[i].snap = true;
-			openfs(target[i].fstab.fs_file,&target[i].mountfd);
+			openfs(target[i].fstab.fs_file,target[i].fstab.fs_spec,&target[i].mountfd);
 			if ((ret = relabel(&target[i], label)) != LABELED) { 
 				if ((ret = newlabel(&target[i], label)) != LABELED) {
 					/* Assume failure, remove from snapshot candidacy */
 					fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to write label %s to %s!\n",__progname,__FILE__,__LINE__,__func__,label,target[i].fstab.fs_file);
 					target[i].snap = false;
 					close(target[i].mountfd); /* XXX: may not be necessary, but should not cause issues */
+					target[i].mountfd = 0;
 				}
 			}
 		} else {
 			target[i].snap = false;
 		}
+		marked += (target[i].snap) ? 1 : 0;
 	}
-	/* 
-	 * now everything should be in place to create snapshots 
-	 * looping is handled internally
-	 */
-	snapfs(target, fscount, label);
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning to caller\n",__progname,__FILE__,__LINE__,__func__);
-	}
+	return(marked);
 }
 
 /* 
  * return 0 if relabeling is done successfully
- * nonzero indicates error, no meaning assigned to 
- * return values yet
+ * NOBE if the spec carries no boot environment label,
+ * any other value if the new name could not be written
  */
 int
 relabel(bedata *fs, const char *label) {
-	char *found, fsbuf[NAME_MAX];
-	int i, retc;
+	int retc;
+	labelview view;
 
-	i = retc = 0;
-	found = NULL;
+	retc = LABELED;
 	assert((fs != NULL) && (label != NULL));
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with fs = %p, label = %s\n",__progname,__FILE__,__LINE__,__func__,(void *)fs,label);
-	}
-	/* 
-	 * XXX: this function, along with ish2(), will almost certainly need significant rewriting
-	 * as the current mean sof detecting a NULLFS mount vs a HAMMER2 mount are 
-	 * ill-defined at this point. It's definitely possible to fail silently, but that shouldn't be 
-	 * necessary. 
-	 */
+	DBGTRACE("Entering with fs = %p, label = %s", (void *)fs, label);
 
 	/* simply check for the existence of a boot environment */
-	if ((found = strchr(fs->fstab.fs_spec, BESEP)) == NULL) {
+	if (parselabel(fs->fstab.fs_spec, &view) != 0 || view.belen == 0) {
 		/* This means there's no indication of a dfbeadm compliant snapshot here, so we can just jump into the snapshot creation logic */
 		fprintf(stderr,"INF: %s [%s:%u] %s: No existing boot environment found for %s\n",
 				__progname,__FILE__,__LINE__,__func__,fs->fstab.fs_spec);
 		retc = NOBE; 
-	} else { 
-		for (i ^= i; *found != 0 && i < NAME_MAX; found++) { 
-			fs->curlabel[i] = *found; /* copy the found label one character at a time into fs->curlabel */
-			i++;
-		} 
-		if (dbg) { 
-			fprintf(stderr,"DBG: %s [%s:%u] %s: %d iterations to copy fs->curlabel=(%s)\n",__progname,__FILE__,__LINE__,__func__,i,fs->curlabel);
-		}
-		/* see if the label is too long to fit in the allocated space */
-		if ((NAME_MAX - 1)< ((unsigned int)i + strlen(label))) {
-			fprintf(stderr,"ERR: %s [%s:%u] %s: Given name of %s is too long!\n", __progname,__FILE__,__LINE__,__func__,label);
-		} else {
-			found -= i;
-			clearBElabel(found);
-			/* write the new file spec into pfs snapshot struct */
-			snprintf(fsbuf, (NAME_MAX -1), "%s%c%s",fs->fstab.fs_spec,BESEP,label); /* no longer necessary, but nice for visualizations */
-			/* XXX: This may actually be copying too much data into the structure, test with label only */
-			snprintf(fs->snapshot.name, (NAME_MAX - 1), "%s%c%s", (strchr(fs->fstab.fs_spec,PFSDELIM) + 1), BESEP, label);
-			if (dbg) {
-				fprintf(stderr,"DBG: %s [%s:%u] %s: Generated new label of (fsbuf)=%s from (fs->fstab.fs_spec)=%s%s\n",__progname,__FILE__,__LINE__,__func__,fsbuf,fs->fstab.fs_spec,fs->curlabel);
-			}
-			/* Seems like a good idea, but then snapfs.c:xtractLabel() would need to be updated to handle this properly */
-			//memset(fs->fstab.fs_spec,0,(size_t)NAME_MAX); /* clear out the current fstab block device entry prior to being passed to snapfs */
-		}
-		fs->curlabel[i] = 0; /* ensure NULL termination */
-	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n", __progname,__FILE__,__LINE__,__func__,retc);
+	} else if (fmtsnapname(&view, label, fs->snapshot.name, sizeof(fs->snapshot.name)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Given name of %s is too long!\n", __progname,__FILE__,__LINE__,__func__,label);
+		retc = -1;
+	} else {
+		/* keep the old label around, then cut it off the spec so the new fstab names the base PFS */
+		memcpy(fs->curlabel, fs->fstab.fs_spec + view.beoff, (view.belen < NAME_MAX) ? view.belen : NAME_MAX - 1);
+		fs->curlabel[(view.belen < NAME_MAX) ? view.belen : NAME_MAX - 1] = 0;
+		fs->fstab.fs_spec[view.beoff - 1] = 0;
+		DBGTRACE("Generated new label of %s from (fs->fstab.fs_spec)=%s%c%s", fs->snapshot.name, fs->fstab.fs_spec, BESEP, fs->curlabel);
 	}
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
@@ -275,56 +295,38 @@ relabel(bedata *fs, const char *label) {
  * XXX: Ensure that this is properly migrated from snapfs.c
  */
 int
-openfs(const char *mountpoint, int *fsfd) {
+openfs(const char *mountpoint, const char *dev, int *fsfd) {
 	int retc;
 	retc = 0;
 	/* Ensure we can't try to open mountpoints without escalated privileges */
 	assert((geteuid() == 0) && (mountpoint != NULL));
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with mountpoint = %s\n",__progname,__FILE__,__LINE__,__func__,mountpoint);
-	}
-	if ((retc = open(mountpoint,O_RDONLY)) > 0) {
+	DBGTRACE("Entering with mountpoint = %s", mountpoint);
+	if ((retc = h2open(mountpoint, O_RDONLY, dev)) > 0) {
 		*fsfd = retc;
 		retc ^= retc;
 	} else {
 		fprintf(stderr,"ERR: %s [%s:%u] %s: Error opening %s: %s\n",__progname,__FILE__,__LINE__,__func__,mountpoint,strerror(errno));
 	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Opened fd %d for %s, returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,*fsfd,mountpoint,retc);
-	}
-	return(retc);
-}
-
-/* 
- * XXX: Maybe not needed, 0's out the name of 
- * an existing boot environment label
- */
-int
-clearBElabel(char *label) {
-	int retc;
-	retc = 0;
-	assert(label != NULL);
-	for (;*label != 0; label++) {
-		*label ^= *label;
-	}
+	DBGTRACE("Opened fd %d for %s, returning %d to caller", *fsfd, mountpoint, retc);
 	return(retc);
 }
 
 int
 newlabel(bedata *fs, const char *label) {
 	int retc;
+	labelview view;
+
 	retc = LABELED; /* same as 0, assume success */
 	assert((fs != NULL) && (label != NULL));
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with fs = %p, label = %s\n", __progname,__FILE__,__LINE__,__func__,(void *)fs, label);
-	}
-	/* Alert user that name might be too long */
-	if (strlen(label) + strlen(fs->fstab.fs_spec) > (NAME_MAX - 1)) {
-		fprintf(stderr,"WRN: %s [%s:%u] %s: Given label (%s) is too long and will be truncated!\n",__progname,__FILE__,__LINE__,__func__,label);
-	}
-	snprintf(fs->snapshot.name,(NAME_MAX - 1), "%s%c%s", (strchr(fs->fstab.fs_spec,PFSDELIM) + 1), BESEP, label);
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
+	DBGTRACE("Entering with fs = %p, label = %s", (void *)fs, label);
+	if (parselabel(fs->fstab.fs_spec, &view) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %s does not name a PFS (no '%c')!\n",__progname,__FILE__,__LINE__,__func__,fs->fstab.fs_spec,PFSDELIM);
+		retc = NOBE;
+	} else if (fmtsnapname(&view, label, fs->snapshot.name, sizeof(fs->snapshot.name)) < 0) {
+		/* refuse rather than truncate, a truncated name could collide with another environment */
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Given label (%s) is too long for %s!\n",__progname,__FILE__,__LINE__,__func__,label,fs->fstab.fs_spec);
+		retc = -1;
 	}
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
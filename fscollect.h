@@ -38,8 +38,10 @@
 #endif
 
 int create(const char *label);
-void mktargets(bedata *target, int fscount, const char *label);
+int collectfs(bedata **befs, int *fscount);
+void freefs(bedata *befs, int fscount);
+int mktargets(bedata *target, int fscount, const char *label);
+int marktargets(bedata *target, int fscount, const char *label);
 int relabel(bedata *fs, const char *label);
 int newlabel(bedata *fs, const char *label);
-int openfs(const char *mountpoint, int *fsfd);
-int clearBElabel(char *label);
+int openfs(const char *mountpoint, const char *dev, int *fsfd);
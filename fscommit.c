@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSCOMMIT_H
+#include "fscommit.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+static void parentdir(const char *path, char *dir, size_t dirlen);
+static int syncdir(const char *path);
+static int restore(const char *target, const char *backup, bool present);
+static int rollback(stagedfile *files, int nfiles);
+static int undojournal(FILE *journal);
+static int rootstamp(char *dst, size_t dstlen);
+static int ownjournal(FILE *journal);
+
+/*
+ * Write the new contents of target into a temporary file beside it,
+ * nothing is flushed here, commitfiles() does that for all files at once
+ * returns 0 on success
+ */
+int
+stagefile(stagedfile *sf, const char *target, const char *backup, const char *buf, size_t len) {
+	char dir[MAXPATHLEN];
+	const char *base;
+	ssize_t wrote;
+	size_t done;
+
+	assert((sf != NULL) && (target != NULL) && (backup != NULL) && (buf != NULL));
+	memset(sf, 0, sizeof(stagedfile));
+	sf->target = target;
+	sf->backup = backup;
+	sf->fd = -1;
+	parentdir(target, dir, sizeof(dir));
+	base = ((base = strrchr(target, '/')) != NULL) ? base + 1 : target;
+	snprintf(sf->staged, sizeof(sf->staged), "%s/.%s.XXXXXX", dir, base);
+
+	if ((sf->fd = mkstemp(sf->staged)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to stage %s (%s)\n",__progname,__FILE__,__LINE__,__func__,target,strerror(errno));
+		sf->staged[0] = 0;
+		return(-1);
+	}
+	for (done = 0; done < len; done += (size_t)wrote) {
+		if ((wrote = write(sf->fd, buf + done, len - done)) < 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to write %s (%s)\n",__progname,__FILE__,__LINE__,__func__,sf->staged,strerror(errno));
+			return(-2);
+		}
+	}
+	if (fchmod(sf->fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH) != 0) {
+		return(-3);
+	}
+	DBGTRACE("Staged %zu bytes for %s in %s", len, target, sf->staged);
+	return(0);
+}
+
+/*
+ * Throw away staged files that will not be committed
+ */
+void
+unstage(stagedfile *files, int nfiles) {
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].fd >= 0) {
+			close(files[i].fd);
+			files[i].fd = -1;
+		}
+		if (files[i].staged[0] != 0) {
+			unlink(files[i].staged);
+			files[i].staged[0] = 0;
+		}
+	}
+}
+
+/*
+ * Install every staged file or none of them.
+ * The order of operations is what makes this safe:
+ *   1. hard link each current target to its backup
+ *   2. write the journal
+ *   3. one barrier: fsync the staged files, the journal and their directories together
+ *   4. rename each staged file over its target, rolling back on failure
+ *   5. flush the renames and retire the journal
+ * A crash anywhere after 3 leaves a journal behind, and recoverjournal() puts 
+ * every target back to its backup, so the files always describe the same environment.
+ * With hold, a successful commit keeps its journal until the caller either retires
+ * it with retirecommit() or undoes the commit with revertcommit(), so whatever the
+ * files depend on can still be made to exist in between, crash or not.
+ * returns 0 on success
+ */
+int
+commitfiles(stagedfile *files, int nfiles, bool hold) {
+	int i, j, jfd, ndirs, renamed, retc;
+	bool keepjournal;
+	char dirs[COMMIT_MAXFILES + 1][MAXPATHLEN], root[MNAMELEN];
+	struct stat st;
+
+	assert((files != NULL) && (nfiles > 0) && (nfiles <= COMMIT_MAXFILES));
+	retc = ndirs = renamed = 0;
+	jfd = -1;
+	keepjournal = false;
+	DBGTRACE("Entering with %d files, hold = %d", nfiles, hold);
+	if (noop) {
+		for (i = 0; i < nfiles; i++) {
+			fprintf(stdout,"INF: %s [%s:%u] %s: Would install %s (staged in %s)\n",__progname,__FILE__,__LINE__,__func__,files[i].target,files[i].staged);
+		}
+		unstage(files, nfiles);
+		return(0);
+	}
+
+	/* 1. keep the current versions reachable without copying them */
+	for (i = 0; i < nfiles; i++) {
+		files[i].present = (stat(files[i].target, &st) == 0);
+		if ((unlink(files[i].backup) != 0 && errno != ENOENT) ||
+		    (files[i].present && link(files[i].target, files[i].backup) != 0)) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to back up %s to %s (%s)\n",
+					__progname,__FILE__,__LINE__,__func__,files[i].target,files[i].backup,strerror(errno));
+			unstage(files, nfiles);
+			return(-1);
+		}
+	}
+
+	/* 2. record what has to be undone should we not make it to the end */
+	if (rootstamp(root, sizeof(root)) != 0 || (jfd = open(COMMIT_JOURNAL, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to create %s (%s)\n",__progname,__FILE__,__LINE__,__func__,COMMIT_JOURNAL,strerror(errno));
+		unstage(files, nfiles);
+		return(-2);
+	}
+	dprintf(jfd, "%s\t%s\n", COMMIT_STAMP, root);
+	for (i = 0; i < nfiles; i++) {
+		dprintf(jfd, "%d\t%s\t%s\t%s\n", files[i].present, files[i].target, files[i].backup, files[i].staged);
+	}
+
+	/* 3. the only barrier before the renames, covering every file involved */
+	for (i = 0; i < nfiles; i++) {
+		parentdir(files[i].target, dirs[ndirs], MAXPATHLEN);
+		for (j = 0; j < ndirs && strcmp(dirs[j], dirs[ndirs]) != 0; j++) { ; }
+		ndirs += (j == ndirs) ? 1 : 0;
+	}
+	parentdir(COMMIT_JOURNAL, dirs[ndirs], MAXPATHLEN);
+	for (j = 0; j < ndirs && strcmp(dirs[j], dirs[ndirs]) != 0; j++) { ; }
+	ndirs += (j == ndirs) ? 1 : 0;
+	for (i = 0; i < nfiles && retc == 0; i++) {
+		retc = fsync(files[i].fd);
+	}
+	if (retc == 0) {
+		retc = fsync(jfd);
+	}
+	for (i = 0; i < ndirs && retc == 0; i++) {
+		retc = syncdir(dirs[i]);
+	}
+	close(jfd);
+	if (retc != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to flush staged files (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+		unstage(files, nfiles);
+		unlink(COMMIT_JOURNAL);
+		return(-3);
+	}
+
+	/* 4. the point of no return for each file individually */
+	for (renamed = 0; renamed < nfiles; renamed++) {
+		if (rename(files[renamed].staged, files[renamed].target) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to install %s (%s), rolling back\n",
+					__progname,__FILE__,__LINE__,__func__,files[renamed].target,strerror(errno));
+			retc = -4;
+			break;
+		}
+		files[renamed].staged[0] = 0;
+	}
+	if (retc != 0) {
+		/* a failed rollback leaves the journal for recoverjournal() to retry */
+		keepjournal = (rollback(files, renamed) != 0);
+		unstage(files, nfiles);
+	}
+
+	/* 5. once the renames are durable the journal has nothing left to protect */
+	for (i = 0; i < ndirs; i++) {
+		syncdir(dirs[i]);
+	}
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].fd >= 0) {
+			close(files[i].fd);
+			files[i].fd = -1;
+		}
+	}
+	if (!keepjournal && !(hold && retc == 0)) {
+		unlink(COMMIT_JOURNAL);
+	}
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Make a commit held by commitfiles() final
+ */
+void
+retirecommit(void) {
+	char dir[MAXPATHLEN];
+
+	if (unlink(COMMIT_JOURNAL) == 0) {
+		parentdir(COMMIT_JOURNAL, dir, sizeof(dir));
+		syncdir(dir);
+	}
+}
+
+/*
+ * Put every file of a commit held by commitfiles() back to its backup
+ * returns 0 if there was nothing to undo or every file was restored
+ */
+int
+revertcommit(void) {
+	FILE *journal;
+
+	if ((journal = fopen(COMMIT_JOURNAL, "r")) == NULL) {
+		return((errno == ENOENT) ? 0 : -1);
+	}
+	if (ownjournal(journal) != 0) {
+		fclose(journal);
+		return(-1);
+	}
+	return(undojournal(journal));
+}
+
+/*
+ * Undo a commit that was interrupted, should be called before 
+ * anything else touches the files a commit manages. A journal stamped
+ * with another root was snapshotted mid commit and is only discarded.
+ * returns 0 if there was nothing to do or the rollback succeeded
+ */
+int
+recoverjournal(void) {
+	int own;
+	FILE *journal;
+
+	if ((journal = fopen(COMMIT_JOURNAL, "r")) == NULL) {
+		return((errno == ENOENT) ? 0 : -1);
+	}
+	/* a journal written under another root came along in a snapshot, its backups are not ours */
+	if ((own = ownjournal(journal)) != 0) {
+		fclose(journal);
+		if (own < 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to tell which root %s belongs to\n",__progname,__FILE__,__LINE__,__func__,COMMIT_JOURNAL);
+			return(-1);
+		}
+		fprintf(stderr,"WRN: %s [%s:%u] %s: %s was written by another environment, discarding it\n",__progname,__FILE__,__LINE__,__func__,COMMIT_JOURNAL);
+		if (!noop) {
+			unlink(COMMIT_JOURNAL);
+		}
+		return(0);
+	}
+	fprintf(stderr,"WRN: %s [%s:%u] %s: Found an interrupted activation in %s, rolling back\n",__progname,__FILE__,__LINE__,__func__,COMMIT_JOURNAL);
+	if (noop) {
+		fclose(journal);
+		return(0);
+	}
+	return(undojournal(journal));
+}
+
+/*
+ * Restore every target a journal names and retire it if that worked, closes journal
+ * returns 0 on success
+ */
+static int
+undojournal(FILE *journal) {
+	int present, retc;
+	char target[MAXPATHLEN], backup[MAXPATHLEN], staged[MAXPATHLEN], dir[MAXPATHLEN];
+
+	retc = 0;
+	while (fscanf(journal, "%d\t%1023[^\t]\t%1023[^\t]\t%1023[^\n]\n", &present, target, backup, staged) == 4) {
+		unlink(staged);
+		if (restore(target, backup, present != 0) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to restore %s from %s, fix it by hand!\n",__progname,__FILE__,__LINE__,__func__,target,backup);
+			retc = -1;
+		}
+		parentdir(target, dir, sizeof(dir));
+		syncdir(dir);
+	}
+	fclose(journal);
+	if (retc == 0) {
+		unlink(COMMIT_JOURNAL);
+	}
+	return(retc);
+}
+
+/*
+ * Render loader.conf(5) with vfs.root.mountfrom pointed at rootspec,
+ * every other line of the current file is carried over untouched
+ * returns NULL on failure, the caller frees the buffer
+ */
+char *
+mkloaderconf(const char *rootspec, size_t *conflen) {
+	int lfd;
+	size_t cur, len, keylen;
+	ssize_t got;
+	char *conf, *key, *line, *next, *out;
+	struct stat st;
+
+	assert((rootspec != NULL) && (conflen != NULL));
+	conf = NULL; cur = 0;
+	if ((lfd = open(LOADER_CONF, O_RDONLY)) >= 0) {
+		if (fstat(lfd, &st) != 0 || (conf = calloc((size_t)st.st_size + 1, 1)) == NULL) {
+			close(lfd);
+			return(NULL);
+		}
+		for (; cur < (size_t)st.st_size && (got = read(lfd, conf + cur, (size_t)st.st_size - cur)) > 0; cur += (size_t)got) { ; }
+		close(lfd);
+	} else if (errno != ENOENT) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read %s (%s)\n",__progname,__FILE__,__LINE__,__func__,LOADER_CONF,strerror(errno));
+		return(NULL);
+	}
+	/* the old file, plus the new assignment */
+	len = cur + sizeof(LOADER_ROOTVAR "=\"hammer2:\"\n") + strlen(rootspec);
+	if ((out = calloc(len + 1, 1)) == NULL) {
+		free(conf);
+		return(NULL);
+	}
+	*conflen = 0;
+	keylen = sizeof(LOADER_ROOTVAR) - 1;
+	for (line = conf; line != NULL && *line != 0; line = next) {
+		next = strchr(line, '\n');
+		next = (next != NULL) ? next + 1 : line + strlen(line);
+		/* drop any existing assignment, ours goes at the end */
+		key = line + strspn(line, " \t");
+		if (strncmp(key, LOADER_ROOTVAR, keylen) == 0 && key[keylen + strspn(key + keylen, " \t")] == '=') {
+			continue;
+		}
+		memcpy(out + *conflen, line, (size_t)(next - line));
+		*conflen += (size_t)(next - line);
+	}
+	if (*conflen > 0 && out[*conflen - 1] != '\n') {
+		out[(*conflen)++] = '\n';
+	}
+	*conflen += (size_t)snprintf(out + *conflen, len + 1 - *conflen, "%s=\"hammer2:%s\"\n", LOADER_ROOTVAR, rootspec);
+	free(conf);
+	return(out);
+}
+
+/*
+ * The device mounted as / identifies the environment we're running in
+ * returns 0 on success
+ */
+static int
+rootstamp(char *dst, size_t dstlen) {
+	struct statfs rootfs;
+
+	if (statfs("/", &rootfs) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to stat / (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+		return(-1);
+	}
+	strlcpy(dst, rootfs.f_mntfromname, dstlen);
+	return(0);
+}
+
+/*
+ * Read the stamp at the head of a journal, leaving it positioned at the first entry
+ * returns 0 if it was written under the current root, 1 if not, -1 if that can't be told
+ */
+static int
+ownjournal(FILE *journal) {
+	char line[sizeof(COMMIT_STAMP) + MNAMELEN + 1], root[MNAMELEN];
+
+	if (rootstamp(root, sizeof(root)) != 0) {
+		return(-1);
+	}
+	/* an unstamped journal can't be shown to be ours */
+	if (fgets(line, sizeof(line), journal) == NULL || strncmp(line, COMMIT_STAMP "\t", sizeof(COMMIT_STAMP)) != 0) {
+		return(1);
+	}
+	line[strcspn(line, "\n")] = 0;
+	return((strcmp(line + sizeof(COMMIT_STAMP), root) == 0) ? 0 : 1);
+}
+
+static void
+parentdir(const char *path, char *dir, size_t dirlen) {
+	const char *slash;
+
+	if ((slash = strrchr(path, '/')) == NULL) {
+		strlcpy(dir, ".", dirlen);
+	} else if (slash == path) {
+		strlcpy(dir, "/", dirlen);
+	} else {
+		snprintf(dir, dirlen, "%.*s", (int)(slash - path), path);
+	}
+}
+
+static int
+syncdir(const char *path) {
+	int dfd, retc;
+
+	if ((dfd = open(path, O_RDONLY|O_DIRECTORY)) < 0) {
+		return(-1);
+	}
+	retc = fsync(dfd);
+	close(dfd);
+	return(retc);
+}
+
+/*
+ * Put target back the way it was before the commit, the backup link
+ * is kept so the previous version stays available to the user
+ */
+static int
+restore(const char *target, const char *backup, bool present) {
+	char tmp[MAXPATHLEN];
+
+	if (!present) {
+		return((unlink(target) == 0 || errno == ENOENT) ? 0 : -1);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.restore", target);
+	unlink(tmp);
+	if (link(backup, tmp) != 0 || rename(tmp, target) != 0) {
+		unlink(tmp);
+		return(-1);
+	}
+	return(0);
+}
+
+static int
+rollback(stagedfile *files, int nfiles) {
+	int i, failed;
+
+	for (i = failed = 0; i < nfiles; i++) {
+		if (restore(files[i].target, files[i].backup, files[i].present) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to restore %s from %s, fix it by hand!\n",
+					__progname,__FILE__,__LINE__,__func__,files[i].target,files[i].backup);
+			failed++;
+		}
+	}
+	return(failed);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Atomic installation of several configuration files at once, used for activation
+ * so that fstab(5) and loader.conf(5) can never disagree. Every file is staged next
+ * to its target, all of them are made durable together along with a journal, and
+ * only then renamed into place. An interrupted commit is rolled back from the journal.
+ */
+
+#define DFBEADM_FSCOMMIT_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#define LOADER_CONF "/boot/loader.conf"
+#define LOADER_BACKUP "/boot/loader.conf.bak"
+#define FSTAB_BACKUP "/etc/fstab.bak"
+/* 
+ * the journal may well end up inside a snapshot, so it is stamped with the
+ * root it was written under and ignored anywhere else
+ */
+#ifndef COMMIT_JOURNAL
+#define COMMIT_JOURNAL "/var/db/dfbeadm.journal"
+#endif
+#define COMMIT_STAMP "root"
+#define LOADER_ROOTVAR "vfs.root.mountfrom"
+/* fstab and loader.conf, leave room for more */
+#define COMMIT_MAXFILES 4
+
+struct staged_file {
+	const char *target; /* the file being replaced */
+	const char *backup; /* hard link to the version being replaced */
+	char staged[MAXPATHLEN]; /* new contents, in the same directory as target */
+	int fd;
+	bool present; /* whether target existed before the commit */
+};
+
+typedef struct staged_file stagedfile;
+
+int stagefile(stagedfile *sf, const char *target, const char *backup, const char *buf, size_t len);
+void unstage(stagedfile *files, int nfiles);
+int commitfiles(stagedfile *files, int nfiles, bool hold);
+void retirecommit(void);
+int revertcommit(void);
+int recoverjournal(void);
+char *mkloaderconf(const char *rootspec, size_t *conflen);
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSDIFF_H
+#include "fsdiff.h"
+#endif
+
+extern char *__progname;
+
+/* one line of output, sorted before printing since workers finish in any order */
+struct diff_entry {
+	char *path;
+	char kind;
+};
+
+struct diff_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	const char *oldroot;
+	const char *newroot;
+	char **queue; /* directories relative to both roots, used as a stack */
+	int nqueue, aqueue;
+	int busy; /* workers holding a directory, the walk is over once this and nqueue are 0 */
+	struct diff_entry *found;
+	int nfound, afound;
+	int failed;
+};
+
+static void *diffworker(void *arg);
+static void diffdir(struct diff_pool *pool, const char *rel);
+static int readnames(int dfd, char ***names, int *count);
+static bool samefile(int olddir, int newdir, const char *name, const struct stat *os, const struct stat *ns);
+static bool samecontent(int olddir, int newdir, const char *name);
+static void report(struct diff_pool *pool, char kind, const char *rel, const char *name);
+static int enqueue(struct diff_pool *pool, const char *rel, const char *name);
+static int cmpnames(const void *a, const void *b);
+static int cmpentries(const void *a, const void *b);
+
+/*
+ * Compare the trees at oldroot and newroot, typically two environments
+ * mounted somewhere with mount_hammer2(8), and print every path that
+ * was added, deleted, modified or changed type
+ * returns 0 when the walk completed, whether or not anything differs
+ */
+int
+diffenvs(const char *oldroot, const char *newroot) {
+	int i, nworkers;
+	pthread_t workers[DIFF_WORKERS];
+	struct diff_pool pool;
+
+	assert((oldroot != NULL) && (newroot != NULL));
+	DBGTRACE("Entering with oldroot = %s, newroot = %s", oldroot, newroot);
+	memset(&pool, 0, sizeof(pool));
+	pool.oldroot = oldroot;
+	pool.newroot = newroot;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.more, NULL);
+	if (enqueue(&pool, "", "") != 0) {
+		pthread_cond_destroy(&pool.more);
+		pthread_mutex_destroy(&pool.lock);
+		return(-1);
+	}
+	for (nworkers = 0; nworkers < DIFF_WORKERS; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, diffworker, &pool) != 0) {
+			break;
+		}
+	}
+	if (nworkers == 0) {
+		diffworker(&pool);
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_cond_destroy(&pool.more);
+	pthread_mutex_destroy(&pool.lock);
+
+	qsort(pool.found, (size_t)pool.nfound, sizeof(struct diff_entry), cmpentries);
+	for (i = 0; i < pool.nfound; i++) {
+		fprintf(stdout,"%c %s\n",pool.found[i].kind,pool.found[i].path);
+		free(pool.found[i].path);
+	}
+	fprintf(stdout,"INF: %s [%s:%u] %s: %d differences\n",__progname,__FILE__,__LINE__,__func__,pool.nfound);
+	free(pool.found);
+	free(pool.queue);
+	DBGTRACE("Returning %d to caller", pool.failed);
+	return(pool.failed);
+}
+
+static void *
+diffworker(void *arg) {
+	char *rel;
+	struct diff_pool *pool;
+
+	pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->nqueue == 0 && pool->busy > 0) {
+			pthread_cond_wait(&pool->more, &pool->lock);
+		}
+		if (pool->nqueue == 0) {
+			/* nothing queued and nobody left to queue more */
+			break;
+		}
+		rel = pool->queue[--pool->nqueue];
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+		diffdir(pool, rel);
+		free(rel);
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+		pthread_cond_broadcast(&pool->more);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return(NULL);
+}
+
+/*
+ * Merge the sorted listings of one directory in both trees,
+ * subdirectories present in both are queued for the other workers
+ */
+static void
+diffdir(struct diff_pool *pool, const char *rel) {
+	int olddir, newdir, nold, nnew, i, j, cmp;
+	char path[MAXPATHLEN], **oldnames, **newnames;
+	struct stat os, ns;
+
+	oldnames = newnames = NULL;
+	nold = nnew = 0;
+	olddir = newdir = -1;
+	snprintf(path, sizeof(path), "%s/%s", pool->oldroot, rel);
+	if ((olddir = open(path, O_RDONLY|O_DIRECTORY)) < 0 || readnames(olddir, &oldnames, &nold) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read %s (%s)\n",__progname,__FILE__,__LINE__,__func__,path,strerror(errno));
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = -1;
+		pthread_mutex_unlock(&pool->lock);
+		goto done;
+	}
+	snprintf(path, sizeof(path), "%s/%s", pool->newroot, rel);
+	if ((newdir = open(path, O_RDONLY|O_DIRECTORY)) < 0 || readnames(newdir, &newnames, &nnew) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read %s (%s)\n",__progname,__FILE__,__LINE__,__func__,path,strerror(errno));
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = -1;
+		pthread_mutex_unlock(&pool->lock);
+		goto done;
+	}
+	for (i = j = 0; i < nold || j < nnew;) {
+		cmp = (i == nold) ? 1 : (j == nnew) ? -1 : strcmp(oldnames[i], newnames[j]);
+		if (cmp < 0) {
+			report(pool, DIFF_DELETED, rel, oldnames[i++]);
+			continue;
+		}
+		if (cmp > 0) {
+			report(pool, DIFF_ADDED, rel, newnames[j++]);
+			continue;
+		}
+		if (fstatat(olddir, oldnames[i], &os, AT_SYMLINK_NOFOLLOW) != 0 || fstatat(newdir, newnames[j], &ns, AT_SYMLINK_NOFOLLOW) != 0) {
+			report(pool, DIFF_MODIFIED, rel, oldnames[i]);
+		} else if ((os.st_mode & S_IFMT) != (ns.st_mode & S_IFMT)) {
+			report(pool, DIFF_RETYPED, rel, oldnames[i]);
+		} else if (S_ISDIR(os.st_mode)) {
+			if ((os.st_mode != ns.st_mode || os.st_uid != ns.st_uid || os.st_gid != ns.st_gid)) {
+				report(pool, DIFF_MODIFIED, rel, oldnames[i]);
+			}
+			/* nothing cheaper proves a whole subtree unchanged, so every one is read */
+			if (enqueue(pool, rel, oldnames[i]) != 0) {
+				pthread_mutex_lock(&pool->lock);
+				pool->failed = -1;
+				pthread_mutex_unlock(&pool->lock);
+			}
+		} else if (!samefile(olddir, newdir, oldnames[i], &os, &ns)) {
+			report(pool, DIFF_MODIFIED, rel, oldnames[i]);
+		}
+		i++; j++;
+	}
+
+done:
+	for (i = 0; i < nold; i++) {
+		free(oldnames[i]);
+	}
+	for (j = 0; j < nnew; j++) {
+		free(newnames[j]);
+	}
+	free(oldnames);
+	free(newnames);
+	if (olddir >= 0) {
+		close(olddir);
+	}
+	if (newdir >= 0) {
+		close(newdir);
+	}
+}
+
+/*
+ * Sorted names in a directory, without . and ..
+ */
+static int
+readnames(int dfd, char ***names, int *count) {
+	int alloc, dupfd;
+	char **grown;
+	DIR *dir;
+	struct dirent *ent;
+
+	alloc = 0;
+	/* closedir(3) takes the descriptor with it, the caller still needs its own */
+	if ((dupfd = dup(dfd)) < 0 || (dir = fdopendir(dupfd)) == NULL) {
+		if (dupfd >= 0) {
+			close(dupfd);
+		}
+		return(-1);
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		if (*count == alloc) {
+			alloc = (alloc == 0) ? 32 : alloc * 2;
+			if ((grown = reallocarray(*names, (size_t)alloc, sizeof(char *))) == NULL) {
+				closedir(dir);
+				return(-1);
+			}
+			*names = grown;
+		}
+		if (((*names)[*count] = strdup(ent->d_name)) == NULL) {
+			closedir(dir);
+			return(-1);
+		}
+		(*count)++;
+	}
+	closedir(dir);
+	qsort(*names, (size_t)*count, sizeof(char *), cmpnames);
+	return(0);
+}
+
+/*
+ * Decide whether a non-directory is unchanged. The two trees are separate
+ * snapshots or filesystems, so inode numbers say nothing; matching size,
+ * ownership, mode and mtime are taken as unchanged, and a regular file
+ * whose mtime alone moved is settled by reading both copies.
+ * Symlinks are compared by target.
+ */
+static bool
+samefile(int olddir, int newdir, const char *name, const struct stat *os, const struct stat *ns) {
+	ssize_t oldlen, newlen;
+	char oldlink[MAXPATHLEN], newlink[MAXPATHLEN];
+
+	if (os->st_size != ns->st_size || os->st_mode != ns->st_mode || os->st_uid != ns->st_uid || os->st_gid != ns->st_gid) {
+		return(false);
+	}
+	if (S_ISLNK(os->st_mode)) {
+		oldlen = readlinkat(olddir, name, oldlink, sizeof(oldlink));
+		newlen = readlinkat(newdir, name, newlink, sizeof(newlink));
+		return(oldlen >= 0 && oldlen == newlen && memcmp(oldlink, newlink, (size_t)oldlen) == 0);
+	}
+	if (os->st_mtim.tv_sec == ns->st_mtim.tv_sec && os->st_mtim.tv_nsec == ns->st_mtim.tv_nsec) {
+		return(true);
+	}
+	return(S_ISREG(os->st_mode) && samecontent(olddir, newdir, name));
+}
+
+/*
+ * Read both copies of a regular file, same size already established
+ */
+static bool
+samecontent(int olddir, int newdir, const char *name) {
+	int oldfd, newfd;
+	bool same;
+	ssize_t got, more, n;
+	char oldbuf[DIFF_BLOCK], newbuf[DIFF_BLOCK];
+
+	same = false;
+	oldfd = openat(olddir, name, O_RDONLY|O_NOFOLLOW);
+	newfd = openat(newdir, name, O_RDONLY|O_NOFOLLOW);
+	if (oldfd >= 0 && newfd >= 0) {
+		for (same = true; same && (got = read(oldfd, oldbuf, sizeof(oldbuf))) != 0;) {
+			for (more = 0; got > 0 && more < got;) {
+				if ((n = read(newfd, newbuf + more, (size_t)(got - more))) <= 0) {
+					break;
+				}
+				more += n;
+			}
+			same = (got > 0 && more == got && memcmp(oldbuf, newbuf, (size_t)got) == 0);
+		}
+		/* the new copy must end where the old one did */
+		same = same && read(newfd, newbuf, 1) == 0;
+	}
+	if (oldfd >= 0) {
+		close(oldfd);
+	}
+	if (newfd >= 0) {
+		close(newfd);
+	}
+	return(same);
+}
+
+static void
+report(struct diff_pool *pool, char kind, const char *rel, const char *name) {
+	char path[MAXPATHLEN];
+	struct diff_entry *grown;
+
+	snprintf(path, sizeof(path), "%s%s%s", rel, (*rel != 0) ? "/" : "", name);
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nfound == pool->afound) {
+		if ((grown = reallocarray(pool->found, (size_t)pool->afound + 64, sizeof(struct diff_entry))) == NULL) {
+			pool->failed = -1;
+			pthread_mutex_unlock(&pool->lock);
+			return;
+		}
+		pool->found = grown;
+		pool->afound += 64;
+	}
+	if ((pool->found[pool->nfound].path = strdup(path)) != NULL) {
+		pool->found[pool->nfound++].kind = kind;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Queue rel/name for the next idle worker
+ */
+static int
+enqueue(struct diff_pool *pool, const char *rel, const char *name) {
+	int retc;
+	char path[MAXPATHLEN], **grown;
+
+	retc = 0;
+	snprintf(path, sizeof(path), "%s%s%s", rel, (*rel != 0 && *name != 0) ? "/" : "", name);
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nqueue == pool->aqueue) {
+		if ((grown = reallocarray(pool->queue, (size_t)pool->aqueue + 64, sizeof(char *))) == NULL) {
+			retc = -1;
+		} else {
+			pool->queue = grown;
+			pool->aqueue += 64;
+		}
+	}
+	if (retc == 0 && (pool->queue[pool->nqueue] = strdup(path)) != NULL) {
+		pool->nqueue++;
+		pthread_cond_signal(&pool->more);
+	} else {
+		retc = -1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return(retc);
+}
+
+static int
+cmpnames(const void *a, const void *b) {
+	return(strcmp(*(char *const *)a, *(char *const *)b));
+}
+
+static int
+cmpentries(const void *a, const void *b) {
+	return(strcmp(((const struct diff_entry *)a)->path, ((const struct diff_entry *)b)->path));
+}
@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef DFBEADM_FSDIGEST_H
+#include "fsdigest.h"
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DIGEST_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*blake2bfn)(uint64_t h[8], const unsigned char *block, uint64_t t0, uint64_t t1, uint64_t last);
+
+static void digestsetup(void);
+static void compress(digest *ctx, const unsigned char *p, size_t nblocks);
+static void addcount(digest *ctx, uint64_t n);
+static void sha512block(uint64_t h[8], const unsigned char *p);
+static void whirlpoolblock(uint64_t h[8], const unsigned char *p);
+static void keccakf(uint64_t st[25]);
+static void blake2b_portable(uint64_t h[8], const unsigned char *block, uint64_t t0, uint64_t t1, uint64_t last);
+#ifdef DIGEST_X86
+static void blake2b_avx2(uint64_t h[8], const unsigned char *block, uint64_t t0, uint64_t t1, uint64_t last);
+#endif
+
+static pthread_once_t digestonce = PTHREAD_ONCE_INIT;
+static blake2bfn blake2bkernel = blake2b_portable;
+static const char *blake2bname = "portable";
+/* whirlpool's circulant tables and round constants, built from its S-box in digestsetup() */
+static uint64_t wpt[8][256];
+static uint64_t wprc[10];
+
+static const uint64_t sha512iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint64_t sha512k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t keccakrc[24] = {
+	0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL, 0x8000000080008000ULL,
+	0x000000000000808bULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+	0x000000000000008aULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+	0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+	0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800aULL, 0x800000008000000aULL,
+	0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+static const uint8_t blake2bsigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint64_t
+load64be(const unsigned char *p) {
+	return(((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+	       ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7]);
+}
+
+static inline uint64_t
+load64le(const unsigned char *p) {
+	return(((uint64_t)p[7] << 56) | ((uint64_t)p[6] << 48) | ((uint64_t)p[5] << 40) | ((uint64_t)p[4] << 32) |
+	       ((uint64_t)p[3] << 24) | ((uint64_t)p[2] << 16) | ((uint64_t)p[1] << 8) | (uint64_t)p[0]);
+}
+
+static inline void
+store64be(unsigned char *p, uint64_t v) {
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8) {
+		p[i] = (unsigned char)v;
+	}
+}
+
+static inline void
+store64le(unsigned char *p, uint64_t v) {
+	int i;
+
+	for (i = 0; i < 8; i++, v >>= 8) {
+		p[i] = (unsigned char)v;
+	}
+}
+
+/*
+ * Start a digest, returns 0 on success, -1 for an unknown algorithm
+ */
+int
+digest_init(digest *ctx, hashspec algo) {
+	assert(ctx != NULL);
+	pthread_once(&digestonce, digestsetup);
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->algo = algo;
+	switch (algo) {
+		case whirlpool:
+			ctx->blocklen = 64;
+			break;
+		case sha3_512:
+			/* 1600 bit state less twice the digest */
+			ctx->blocklen = 72;
+			break;
+		case shake256:
+			ctx->blocklen = 136;
+			break;
+		case blake2k512:
+			ctx->blocklen = 128;
+			memcpy(ctx->h.blake2b, sha512iv, sizeof(sha512iv));
+			/* no key, no salt, sequential mode, 64 byte digest */
+			ctx->h.blake2b[0] ^= 0x01010000ULL ^ DIGEST_MAXLEN;
+			break;
+		case sha2_512:
+			ctx->blocklen = 128;
+			memcpy(ctx->h.sha512, sha512iv, sizeof(sha512iv));
+			break;
+		default:
+			return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Hash len more bytes, as many of them as fill whole blocks are compressed
+ * straight out of the caller's buffer
+ */
+void
+digest_update(digest *ctx, const void *data, size_t len) {
+	size_t take, nblocks;
+	bool lazy;
+	const unsigned char *p;
+
+	assert((ctx != NULL) && (data != NULL || len == 0));
+	p = data;
+	/* BLAKE2b flags its last block, so a full block is only compressed once more input shows up */
+	lazy = (ctx->algo == blake2k512);
+	if (ctx->buffered > 0) {
+		take = (len < ctx->blocklen - ctx->buffered) ? len : ctx->blocklen - ctx->buffered;
+		memcpy(ctx->buf + ctx->buffered, p, take);
+		ctx->buffered += take;
+		p += take; len -= take;
+		if (ctx->buffered < ctx->blocklen || (lazy && len == 0)) {
+			return;
+		}
+		compress(ctx, ctx->buf, 1);
+		ctx->buffered = 0;
+	}
+	nblocks = len / ctx->blocklen;
+	if (lazy && nblocks > 0 && len % ctx->blocklen == 0) {
+		nblocks--;
+	}
+	if (nblocks > 0) {
+		compress(ctx, p, nblocks);
+		p += nblocks * ctx->blocklen;
+		len -= nblocks * ctx->blocklen;
+	}
+	memcpy(ctx->buf, p, len);
+	ctx->buffered = len;
+}
+
+/*
+ * Pad, compress the last block and write the digest to md
+ * returns the digest length
+ */
+size_t
+digest_final(digest *ctx, unsigned char *md) {
+	int i;
+	size_t lenpos;
+
+	assert((ctx != NULL) && (md != NULL));
+	switch (ctx->algo) {
+		case sha2_512:
+		case whirlpool:
+			/* both append the length in bits big endian, SHA-512 in 128 bits and whirlpool in 256 */
+			lenpos = ctx->blocklen - 16;
+			addcount(ctx, ctx->buffered);
+			ctx->buf[ctx->buffered++] = 0x80;
+			if (ctx->buffered > ((ctx->algo == whirlpool) ? 32 : lenpos)) {
+				memset(ctx->buf + ctx->buffered, 0, ctx->blocklen - ctx->buffered);
+				if (ctx->algo == whirlpool) {
+					whirlpoolblock(ctx->h.whirlpool, ctx->buf);
+				} else {
+					sha512block(ctx->h.sha512, ctx->buf);
+				}
+				ctx->buffered = 0;
+			}
+			memset(ctx->buf + ctx->buffered, 0, ctx->blocklen - ctx->buffered);
+			store64be(ctx->buf + lenpos, (ctx->count[1] << 3) | (ctx->count[0] >> 61));
+			store64be(ctx->buf + lenpos + 8, ctx->count[0] << 3);
+			if (ctx->algo == whirlpool) {
+				whirlpoolblock(ctx->h.whirlpool, ctx->buf);
+			} else {
+				sha512block(ctx->h.sha512, ctx->buf);
+			}
+			for (i = 0; i < 8; i++) {
+				store64be(md + i * 8, ctx->h.sha512[i]);
+			}
+			break;
+		case sha3_512:
+		case shake256:
+			memset(ctx->buf + ctx->buffered, 0, ctx->blocklen - ctx->buffered);
+			ctx->buf[ctx->buffered] ^= (ctx->algo == sha3_512) ? 0x06 : 0x1f;
+			ctx->buf[ctx->blocklen - 1] ^= 0x80;
+			compress(ctx, ctx->buf, 1);
+			/* both rates are wider than the digest, so one squeeze is enough */
+			for (i = 0; i < 8; i++) {
+				store64le(md + i * 8, ctx->h.keccak[i]);
+			}
+			break;
+		case blake2k512:
+			addcount(ctx, ctx->buffered);
+			memset(ctx->buf + ctx->buffered, 0, ctx->blocklen - ctx->buffered);
+			blake2bkernel(ctx->h.blake2b, ctx->buf, ctx->count[0], ctx->count[1], ~0ULL);
+			for (i = 0; i < 8; i++) {
+				store64le(md + i * 8, ctx->h.blake2b[i]);
+			}
+			break;
+		default:
+			return(0);
+	}
+	explicit_bzero(ctx, sizeof(*ctx));
+	return(DIGEST_MAXLEN);
+}
+
+/*
+ * The algorithm's name as listed in the hashalgo table
+ */
+const char *
+digest_name(hashspec algo) {
+	static const char *names[] = { "whirlpool", "sha3-512", "blake2b512", "shake256", "sha2-512" };
+
+	return(((unsigned int)algo < sizeof(names) / sizeof(names[0])) ? names[algo] : "unknown");
+}
+
+/*
+ * Which kernel digest_init() settled on for an algorithm, for the trace
+ */
+const char *
+digest_kernel(hashspec algo) {
+	pthread_once(&digestonce, digestsetup);
+	return((algo == blake2k512) ? blake2bname : "portable");
+}
+
+/*
+ * Build the whirlpool tables and pick the kernels this CPU can run, once per process
+ */
+static void
+digestsetup(void) {
+	/* the mini-boxes the whirlpool S-box is made of, and the first row of its circulant matrix */
+	static const uint8_t ebox[16] = { 0x1, 0xb, 0x9, 0xc, 0xd, 0x6, 0xf, 0x3, 0xe, 0x8, 0x7, 0x4, 0xa, 0x2, 0x5, 0x0 };
+	static const uint8_t rbox[16] = { 0x7, 0xc, 0xb, 0xd, 0xe, 0x4, 0x9, 0xf, 0x6, 0x3, 0x8, 0xa, 0x2, 0x5, 0x1, 0x0 };
+	static const uint8_t circ[8] = { 1, 1, 4, 1, 8, 5, 2, 9 };
+	uint8_t einv[16], sbox[256], a, b, c;
+	unsigned int x, j, t, prod, m;
+	uint64_t row;
+
+	for (x = 0; x < 16; x++) {
+		einv[ebox[x]] = (uint8_t)x;
+	}
+	for (x = 0; x < 256; x++) {
+		a = ebox[x >> 4];
+		b = einv[x & 0xf];
+		c = rbox[a ^ b];
+		sbox[x] = (uint8_t)((ebox[a ^ c] << 4) | einv[b ^ c]);
+	}
+	for (x = 0; x < 256; x++) {
+		row = 0;
+		for (j = 0; j < 8; j++) {
+			/* multiply in GF(2^8) reduced by x^8 + x^4 + x^3 + x^2 + 1 */
+			prod = 0;
+			for (m = sbox[x], t = circ[j]; t != 0; t >>= 1) {
+				if (t & 1) {
+					prod ^= m;
+				}
+				m = (m & 0x80) ? ((m << 1) ^ 0x11d) : (m << 1);
+			}
+			row = (row << 8) | prod;
+		}
+		wpt[0][x] = row;
+		for (t = 1; t < 8; t++) {
+			wpt[t][x] = ROTR64(row, 8 * t);
+		}
+	}
+	for (x = 0; x < 10; x++) {
+		wprc[x] = 0;
+		for (j = 0; j < 8; j++) {
+			wprc[x] |= (uint64_t)sbox[8 * x + j] << (56 - 8 * j);
+		}
+	}
+#ifdef DIGEST_X86
+	__builtin_cpu_init();
+	if (getenv(DIGEST_PORTABLE_ENV) == NULL && __builtin_cpu_supports("avx2")) {
+		blake2bkernel = blake2b_avx2;
+		blake2bname = "avx2";
+	}
+#endif
+}
+
+static void
+addcount(digest *ctx, uint64_t n) {
+	ctx->count[0] += n;
+	if (ctx->count[0] < n) {
+		ctx->count[1]++;
+	}
+}
+
+static void
+compress(digest *ctx, const unsigned char *p, size_t nblocks) {
+	size_t i;
+	unsigned int j;
+
+	for (; nblocks > 0; nblocks--, p += ctx->blocklen) {
+		switch (ctx->algo) {
+			case sha2_512:
+				addcount(ctx, ctx->blocklen);
+				sha512block(ctx->h.sha512, p);
+				break;
+			case whirlpool:
+				addcount(ctx, ctx->blocklen);
+				whirlpoolblock(ctx->h.whirlpool, p);
+				break;
+			case blake2k512:
+				addcount(ctx, ctx->blocklen);
+				blake2bkernel(ctx->h.blake2b, p, ctx->count[0], ctx->count[1], 0);
+				break;
+			case sha3_512:
+			case shake256:
+				for (i = 0, j = 0; i < ctx->blocklen; i += 8, j++) {
+					ctx->h.keccak[j] ^= load64le(p + i);
+				}
+				keccakf(ctx->h.keccak);
+				break;
+		}
+	}
+}
+
+static void
+sha512block(uint64_t h[8], const unsigned char *p) {
+	int i;
+	uint64_t w[80], a, b, c, d, e, f, g, k, t1, t2;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = load64be(p + i * 8);
+	}
+	for (; i < 80; i++) {
+		w[i] = (ROTR64(w[i - 2], 19) ^ ROTR64(w[i - 2], 61) ^ (w[i - 2] >> 6)) + w[i - 7] +
+		       (ROTR64(w[i - 15], 1) ^ ROTR64(w[i - 15], 8) ^ (w[i - 15] >> 7)) + w[i - 16];
+	}
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 80; i++) {
+		t1 = k + (ROTR64(e, 14) ^ ROTR64(e, 18) ^ ROTR64(e, 41)) + ((e & f) ^ (~e & g)) + sha512k[i] + w[i];
+		t2 = (ROTR64(a, 28) ^ ROTR64(a, 34) ^ ROTR64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+/* one round of whirlpool's W, every output word mixes one byte of each input word */
+#define WPROUND(out, in, i) \
+	(out)[i] = wpt[0][(in)[(i) & 7] >> 56] ^ wpt[1][((in)[((i) + 7) & 7] >> 48) & 0xff] ^ \
+	           wpt[2][((in)[((i) + 6) & 7] >> 40) & 0xff] ^ wpt[3][((in)[((i) + 5) & 7] >> 32) & 0xff] ^ \
+	           wpt[4][((in)[((i) + 4) & 7] >> 24) & 0xff] ^ wpt[5][((in)[((i) + 3) & 7] >> 16) & 0xff] ^ \
+	           wpt[6][((in)[((i) + 2) & 7] >> 8) & 0xff] ^ wpt[7][(in)[((i) + 1) & 7] & 0xff]
+
+static void
+whirlpoolblock(uint64_t h[8], const unsigned char *p) {
+	int i, r;
+	uint64_t block[8], key[8], state[8], l[8];
+
+	for (i = 0; i < 8; i++) {
+		block[i] = load64be(p + i * 8);
+		key[i] = h[i];
+		state[i] = block[i] ^ key[i];
+	}
+	for (r = 0; r < 10; r++) {
+		for (i = 0; i < 8; i++) {
+			WPROUND(l, key, i);
+		}
+		l[0] ^= wprc[r];
+		memcpy(key, l, sizeof(key));
+		for (i = 0; i < 8; i++) {
+			WPROUND(l, state, i);
+			l[i] ^= key[i];
+		}
+		memcpy(state, l, sizeof(state));
+	}
+	for (i = 0; i < 8; i++) {
+		h[i] ^= state[i] ^ block[i];
+	}
+}
+
+static void
+keccakf(uint64_t st[25]) {
+	static const uint8_t rotc[24] = { 1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14, 27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44 };
+	static const uint8_t piln[24] = { 10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4, 15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1 };
+	int r, i, j;
+	uint64_t t, bc[5];
+
+	for (r = 0; r < 24; r++) {
+		/* theta */
+		for (i = 0; i < 5; i++) {
+			bc[i] = st[i] ^ st[i + 5] ^ st[i + 10] ^ st[i + 15] ^ st[i + 20];
+		}
+		for (i = 0; i < 5; i++) {
+			t = bc[(i + 4) % 5] ^ ROTL64(bc[(i + 1) % 5], 1);
+			for (j = 0; j < 25; j += 5) {
+				st[j + i] ^= t;
+			}
+		}
+		/* rho and pi */
+		t = st[1];
+		for (i = 0; i < 24; i++) {
+			j = piln[i];
+			bc[0] = st[j];
+			st[j] = ROTL64(t, rotc[i]);
+			t = bc[0];
+		}
+		/* chi */
+		for (j = 0; j < 25; j += 5) {
+			for (i = 0; i < 5; i++) {
+				bc[i] = st[j + i];
+			}
+			for (i = 0; i < 5; i++) {
+				st[j + i] ^= (~bc[(i + 1) % 5]) & bc[(i + 2) % 5];
+			}
+		}
+		/* iota */
+		st[0] ^= keccakrc[r];
+	}
+}
+
+#define B2G(a, b, c, d, x, y) do { \
+	a = a + b + (x); d = ROTR64(d ^ a, 32); \
+	c = c + d; b = ROTR64(b ^ c, 24); \
+	a = a + b + (y); d = ROTR64(d ^ a, 16); \
+	c = c + d; b = ROTR64(b ^ c, 63); \
+} while (0)
+
+static void
+blake2b_portable(uint64_t h[8], const unsigned char *block, uint64_t t0, uint64_t t1, uint64_t last) {
+	int i, r;
+	uint64_t m[16], v[16];
+	const uint8_t *s;
+
+	for (i = 0; i < 16; i++) {
+		m[i] = load64le(block + i * 8);
+	}
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = sha512iv[i];
+	}
+	v[12] ^= t0;
+	v[13] ^= t1;
+	v[14] ^= last;
+	for (r = 0; r < 12; r++) {
+		s = blake2bsigma[r];
+		B2G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+		B2G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+		B2G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+		B2G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+		B2G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+		B2G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+		B2G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+		B2G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+	}
+	for (i = 0; i < 8; i++) {
+		h[i] ^= v[i] ^ v[i + 8];
+	}
+}
+
+#ifdef DIGEST_X86
+/*
+ * BLAKE2b with the state held as four rows of four words, so each G
+ * step works on a whole row at once and diagonals are lane rotations
+ */
+#define B2ROTR24(x) _mm256_shuffle_epi8((x), rot24)
+#define B2ROTR16(x) _mm256_shuffle_epi8((x), rot16)
+#define B2ROTR63(x) _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+#define B2HALF(a, b, c, d, mx, my) do { \
+	a = _mm256_add_epi64(_mm256_add_epi64(a, b), mx); \
+	d = _mm256_shuffle_epi32(_mm256_xor_si256(d, a), _MM_SHUFFLE(2, 3, 0, 1)); \
+	c = _mm256_add_epi64(c, d); \
+	b = B2ROTR24(_mm256_xor_si256(b, c)); \
+	a = _mm256_add_epi64(_mm256_add_epi64(a, b), (my)); \
+	d = B2ROTR16(_mm256_xor_si256(d, a)); \
+	c = _mm256_add_epi64(c, d); \
+	b = B2ROTR63(_mm256_xor_si256(b, c)); \
+} while (0)
+
+__attribute__((target("avx2")))
+static void
+blake2b_avx2(uint64_t h[8], const unsigned char *block, uint64_t t0, uint64_t t1, uint64_t last) {
+	int i, r;
+	uint64_t m[16];
+	const uint8_t *s;
+	__m256i a, b, c, d, ia, ib, rot24, rot16;
+
+	for (i = 0; i < 16; i++) {
+		m[i] = load64le(block + i * 8);
+	}
+	rot24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+	                         3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	rot16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+	                         2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	a = ia = _mm256_loadu_si256((const __m256i *)(const void *)&h[0]);
+	b = ib = _mm256_loadu_si256((const __m256i *)(const void *)&h[4]);
+	c = _mm256_loadu_si256((const __m256i *)(const void *)&sha512iv[0]);
+	d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(const void *)&sha512iv[4]),
+	                     _mm256_setr_epi64x((long long)t0, (long long)t1, (long long)last, 0));
+	for (r = 0; r < 12; r++) {
+		s = blake2bsigma[r];
+		/* columns */
+		B2HALF(a, b, c, d,
+		       _mm256_setr_epi64x((long long)m[s[0]], (long long)m[s[2]], (long long)m[s[4]], (long long)m[s[6]]),
+		       _mm256_setr_epi64x((long long)m[s[1]], (long long)m[s[3]], (long long)m[s[5]], (long long)m[s[7]]));
+		/* rotate rows so the diagonals line up as columns */
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));
+		B2HALF(a, b, c, d,
+		       _mm256_setr_epi64x((long long)m[s[8]], (long long)m[s[10]], (long long)m[s[12]], (long long)m[s[14]]),
+		       _mm256_setr_epi64x((long long)m[s[9]], (long long)m[s[11]], (long long)m[s[13]], (long long)m[s[15]]));
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1));
+	}
+	_mm256_storeu_si256((__m256i *)(void *)&h[0], _mm256_xor_si256(ia, _mm256_xor_si256(a, c)));
+	_mm256_storeu_si256((__m256i *)(void *)&h[4], _mm256_xor_si256(ib, _mm256_xor_si256(b, d)));
+}
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Message digests for the record database and manifests, implemented in
+ * tree so every hashspec value works no matter which crypto library the
+ * host has. Kernels with a vectorized variant pick it once, at the first
+ * digest_init(), by what the CPU supports.
+ */
+
+#define DFBEADM_FSDIGEST_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* every algorithm is used with a 512 bit digest */
+#define DIGEST_MAXLEN 64
+/* largest block of any algorithm, the SHAKE256 rate */
+#define DIGEST_MAXBLOCK 136
+/* set in the environment to keep to the portable kernels */
+#define DIGEST_PORTABLE_ENV "DFBEADM_DIGEST_PORTABLE"
+
+/* 
+ * Define enumeration values for the accepted hashing algorithms,
+ * the ids are stored in the record database
+ */
+typedef enum dfbeadm_hashspec_t {
+	whirlpool = 0,
+	sha3_512 = 1,
+	blake2k512 = 2,
+	shake256 = 3,
+	sha2_512 = 4,
+} hashspec;
+
+struct digest_ctx {
+	hashspec algo;
+	size_t blocklen;
+	size_t buffered;
+	uint64_t count[2]; /* bytes compressed so far, low word first */
+	union {
+		uint64_t sha512[8];
+		uint64_t blake2b[8];
+		uint64_t whirlpool[8];
+		uint64_t keccak[25];
+	} h;
+	unsigned char buf[DIGEST_MAXBLOCK];
+};
+
+typedef struct digest_ctx digest;
+
+int digest_init(digest *ctx, hashspec algo);
+void digest_update(digest *ctx, const void *data, size_t len);
+size_t digest_final(digest *ctx, unsigned char *md);
+const char *digest_name(hashspec algo);
+const char *digest_kernel(hashspec algo);
@@ -0,0 +1,965 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifndef DFBEADM_FSEXPORT_H
+#include "fsexport.h"
+#endif
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+#define SLOT_FREE 0
+#define SLOT_FILLED 1
+#define SLOT_BUSY 2
+#define SLOT_DONE 3
+
+struct export_slot {
+	unsigned char *raw;
+	unsigned char *z;
+	size_t rawlen;
+	unsigned long zlen;
+	uint64_t seq;
+	uint32_t type;
+	uint32_t crc;
+	int state;
+};
+
+/* blocks travel producer -> compression workers -> writer, in seq order on output */
+struct export_stream {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct export_slot slots[EXPORT_INFLIGHT];
+	struct export_slot *cur; /* being filled by the producer */
+	uint64_t nextseq;
+	uint64_t written;
+	int out;
+	int failed;
+	bool closing;
+};
+
+/* what an import needs to remember between records */
+struct import_state {
+	const char *dest;
+	int destfd; /* every record is resolved beneath this */
+	char label[NAME_MAX + 1];
+	uint64_t applied; /* frames below this were applied by an earlier run */
+	int fd; /* the file chunks are currently being written to */
+	char fdpath[MAXPATHLEN];
+};
+
+static int getslot(struct export_stream *xs);
+static int flushblock(struct export_stream *xs, uint32_t type);
+static unsigned char *reserve(struct export_stream *xs, size_t need);
+static int emit(struct export_stream *xs, char type, const char *path, const uint64_t *fixed, int nfixed, const void *data, size_t datalen);
+static int exportpfs(struct export_stream *xs, const char *altroot, const char *fsfile, char pfses[][MNAMELEN], int npfs);
+static int exportfile(struct export_stream *xs, const char *file, const char *rel, const struct stat *st);
+static int emitattr(struct export_stream *xs, const char *rel, const struct stat *st);
+static int listpfs(const char *payload, const char *label, char pfses[][MNAMELEN], int max);
+static void *compressworker(void *arg);
+static void *writeworker(void *arg);
+static int applyframe(struct import_state *is, const unsigned char *raw, size_t rawlen);
+static int applyrecord(struct import_state *is, char type, const char *path, const uint64_t *fixed, int nfixed, const unsigned char *data, size_t datalen);
+static int checkpoint(struct import_state *is, uint64_t applied);
+static bool saferel(const char *path);
+static int openparent(const struct import_state *is, const char *path, const char **leaf, bool create);
+static int readfull(int fd, void *buf, size_t len);
+static int writefull(int fd, const void *buf, size_t len);
+
+/*
+ * Write the environment label, with its PFSes mounted under altroot as its
+ * fstab lays them out, to stdout. Environments with no record are
+ * exported as a single tree rooted at altroot.
+ * returns 0 on success
+ */
+int
+exportenv(const char *label, const char *altroot) {
+	int i, npfs, nworkers, retc;
+	size_t maxpfs, payloadlen;
+	bool active;
+	char *payload, (*pfses)[MNAMELEN];
+	const char *cur;
+	unsigned char *hdr, count[8];
+	pthread_t workers[EXPORT_WORKERS], writer;
+	struct export_stream xs;
+
+	assert((label != NULL) && (altroot != NULL));
+	DBGTRACE("Entering with label = %s, altroot = %s", label, altroot);
+	payload = NULL;
+	payloadlen = 0;
+	retc = 0;
+	if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Refusing to write an archive to a terminal\n",__progname,__FILE__,__LINE__,__func__);
+		return(-1);
+	}
+	if (load_bepayload(label, &payload, &payloadlen, &active) != 0) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: %s is not recorded, exporting %s as a single tree without an fstab\n",__progname,__FILE__,__LINE__,__func__,label,altroot);
+	}
+	/* one PFS per fstab line at most */
+	for (maxpfs = 1, cur = payload; cur != NULL && (cur = strchr(cur, '\n')) != NULL; cur++) {
+		maxpfs++;
+	}
+	if ((pfses = calloc(maxpfs, MNAMELEN)) == NULL) {
+		free(payload);
+		return(-2);
+	}
+	if ((npfs = listpfs(payload, label, pfses, (int)maxpfs)) == 0) {
+		strlcpy(pfses[0], "/", MNAMELEN);
+		npfs = 1;
+	}
+
+	memset(&xs, 0, sizeof(xs));
+	xs.out = STDOUT_FILENO;
+	for (i = 0; i < EXPORT_INFLIGHT; i++) {
+		if ((xs.slots[i].raw = malloc(EXPORT_BLOCK)) == NULL || (xs.slots[i].z = malloc(compressBound(EXPORT_BLOCK))) == NULL) {
+			retc = -2;
+		}
+	}
+	pthread_mutex_init(&xs.lock, NULL);
+	pthread_cond_init(&xs.changed, NULL);
+	if (retc != 0 || pthread_create(&writer, NULL, writeworker, &xs) != 0) {
+		retc = -2;
+		goto done;
+	}
+	for (nworkers = 0; nworkers < EXPORT_WORKERS; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, compressworker, &xs) != 0) {
+			break;
+		}
+	}
+
+	/* the header frame: version, label and the stored fstab */
+	if (nworkers == 0 || payloadlen + strlen(label) + 10 > EXPORT_BLOCK || getslot(&xs) != 0 || (hdr = reserve(&xs, 10 + strlen(label) + payloadlen)) == NULL) {
+		xs.failed = -3;
+	} else {
+		put32(hdr, EXPORT_VERSION);
+		put16(hdr + 4, (uint16_t)strlen(label));
+		memcpy(hdr + 6, label, strlen(label));
+		put32(hdr + 6 + strlen(label), (uint32_t)payloadlen);
+		if (payloadlen > 0) {
+			memcpy(hdr + 10 + strlen(label), payload, payloadlen);
+		}
+		flushblock(&xs, FRAME_HEADER);
+	}
+	for (i = 0; xs.failed == 0 && i < npfs; i++) {
+		exportpfs(&xs, altroot, pfses[i], pfses, npfs);
+	}
+	/* the trailer tells the importer how many frames it should have seen */
+	if (xs.failed == 0 && flushblock(&xs, FRAME_DATA) == 0 && getslot(&xs) == 0) {
+		put64(count, xs.nextseq);
+		memcpy(reserve(&xs, sizeof(count)), count, sizeof(count));
+		flushblock(&xs, FRAME_END);
+	}
+
+	pthread_mutex_lock(&xs.lock);
+	xs.closing = true;
+	pthread_cond_broadcast(&xs.changed);
+	pthread_mutex_unlock(&xs.lock);
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_join(writer, NULL);
+	retc = xs.failed;
+	fprintf(stderr,"INF: %s [%s:%u] %s: Exported %d PFSes of %s in %llu frames\n",__progname,__FILE__,__LINE__,__func__,npfs,label,(unsigned long long)xs.written);
+
+done:
+	for (i = 0; i < EXPORT_INFLIGHT; i++) {
+		free(xs.slots[i].raw);
+		free(xs.slots[i].z);
+	}
+	pthread_cond_destroy(&xs.changed);
+	pthread_mutex_destroy(&xs.lock);
+	free(pfses);
+	free(payload);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Restore an exported environment from stdin into dest, where the target
+ * PFSes are expected to be mounted as the archived fstab lays them out.
+ * A rerun with the same stream skips every frame already applied.
+ * returns 0 once the whole archive has been applied
+ */
+int
+importenv(const char *dest) {
+	int retc, fd;
+	uint64_t seq, expect;
+	uint32_t type, rawlen, zlen;
+	unsigned long outlen;
+	char path[MAXPATHLEN], saved[NAME_MAX + 1];
+	unsigned char frame[EXPORT_FRAMELEN], *raw, *z;
+	unsigned long long savedseq;
+	FILE *state;
+	struct import_state is;
+
+	assert(dest != NULL);
+	DBGTRACE("Entering with dest = %s", dest);
+	memset(&is, 0, sizeof(is));
+	is.dest = dest;
+	is.fd = -1;
+	is.destfd = -1;
+	retc = 0;
+	expect = 0;
+	if (!noop && (is.destfd = open(dest, O_RDONLY|O_DIRECTORY)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s)\n",__progname,__FILE__,__LINE__,__func__,dest,strerror(errno));
+		return(-1);
+	}
+	raw = malloc(EXPORT_BLOCK);
+	z = malloc(compressBound(EXPORT_BLOCK));
+	if (raw == NULL || z == NULL) {
+		free(raw);
+		free(z);
+		if (is.destfd >= 0) {
+			close(is.destfd);
+		}
+		return(-2);
+	}
+	/* the state file is ours, but the tree beneath dest came from the archive */
+	snprintf(path, sizeof(path), "%s/%s", dest, IMPORT_STATE);
+	fd = (is.destfd >= 0) ? openat(is.destfd, IMPORT_STATE, O_RDONLY|O_NOFOLLOW) : open(path, O_RDONLY|O_NOFOLLOW);
+	if (fd >= 0 && (state = fdopen(fd, "r")) == NULL) {
+		close(fd);
+	} else if (fd >= 0) {
+		if (fscanf(state, "%255s %llu", saved, &savedseq) == 2 && checklabel(saved) == LABEL_OK) {
+			strlcpy(is.label, saved, sizeof(is.label));
+			is.applied = (uint64_t)savedseq;
+			fprintf(stderr,"INF: %s [%s:%u] %s: Resuming import of %s after %llu frames\n",__progname,__FILE__,__LINE__,__func__,is.label,savedseq);
+		}
+		fclose(state);
+	}
+
+	for (;;) {
+		if ((retc = readfull(STDIN_FILENO, frame, sizeof(frame))) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Archive ended after %llu frames without a trailer\n",__progname,__FILE__,__LINE__,__func__,(unsigned long long)expect);
+			/* everything before the cut was applied, a rerun only needs what follows */
+			if (expect > is.applied) {
+				checkpoint(&is, expect);
+			}
+			break;
+		}
+		type = get32(frame + 4);
+		seq = get64(frame + 8);
+		rawlen = get32(frame + 16);
+		zlen = get32(frame + 20);
+		if (get32(frame) != EXPORT_MAGIC || seq != expect || rawlen > EXPORT_BLOCK || zlen > compressBound(EXPORT_BLOCK)) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Frame %llu is damaged or out of order\n",__progname,__FILE__,__LINE__,__func__,(unsigned long long)expect);
+			retc = -3;
+			break;
+		}
+		outlen = rawlen;
+		if ((retc = readfull(STDIN_FILENO, z, zlen)) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Archive ended inside frame %llu\n",__progname,__FILE__,__LINE__,__func__,(unsigned long long)seq);
+			if (expect > is.applied) {
+				checkpoint(&is, expect);
+			}
+			break;
+		}
+		if (uncompress(raw, &outlen, z, zlen) != Z_OK || outlen != rawlen ||
+		    crc32(crc32(0L, Z_NULL, 0), raw, rawlen) != get32(frame + 24)) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Frame %llu fails its checksum\n",__progname,__FILE__,__LINE__,__func__,(unsigned long long)seq);
+			retc = -4;
+			break;
+		}
+		expect++;
+		if (type == FRAME_HEADER) {
+			if (rawlen < 6 || (size_t)get16(raw + 4) + 10 > rawlen || get32(raw) != EXPORT_VERSION) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Unsupported archive\n",__progname,__FILE__,__LINE__,__func__);
+				retc = -5;
+				break;
+			}
+			snprintf(saved, sizeof(saved), "%.*s", (int)get16(raw + 4), (const char *)raw + 6);
+			if (checklabel(saved) != LABEL_OK) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Archive label %s is not usable: %s\n",__progname,__FILE__,__LINE__,__func__,saved,labelerr(checklabel(saved)));
+				retc = -5;
+				break;
+			}
+			if (is.label[0] != 0 && strcmp(is.label, saved) != 0) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: %s holds an unfinished import of %s, not %s\n",__progname,__FILE__,__LINE__,__func__,dest,is.label,saved);
+				retc = -6;
+				break;
+			}
+			strlcpy(is.label, saved, sizeof(is.label));
+			/* the source host's fstab names its own devices, keep it for reference */
+			snprintf(path, sizeof(path), ".dfbeadm-%s.fstab", is.label);
+			if (!noop && get32(raw + 6 + get16(raw + 4)) > 0) {
+				if ((fd = openat(is.destfd, path, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) < 0) {
+					fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to keep the source fstab in %s/%s (%s)\n",__progname,__FILE__,__LINE__,__func__,dest,path,strerror(errno));
+				} else {
+					writefull(fd, raw + 10 + get16(raw + 4), strnlen((const char *)raw + 10 + get16(raw + 4), get32(raw + 6 + get16(raw + 4))));
+					close(fd);
+				}
+			}
+		} else if (type == FRAME_END) {
+			if (rawlen != 8 || get64(raw) != seq) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Archive trailer doesn't match the frames received\n",__progname,__FILE__,__LINE__,__func__);
+				retc = -7;
+			}
+			break;
+		} else if (seq >= is.applied && (retc = applyframe(&is, raw, rawlen)) != 0) {
+			break;
+		}
+		if (seq >= is.applied && expect % IMPORT_CHECKPOINT == 0) {
+			checkpoint(&is, expect);
+		}
+	}
+	if (is.fd >= 0) {
+		close(is.fd);
+	}
+	if (retc == 0 && is.destfd >= 0) {
+		sync();
+		unlinkat(is.destfd, IMPORT_STATE, 0);
+	}
+	if (is.destfd >= 0) {
+		close(is.destfd);
+	}
+	if (retc == 0) {
+		fprintf(stderr,"INF: %s [%s:%u] %s: Imported %s into %s, the source host's fstab, if any, is in %s/.dfbeadm-%s.fstab\n",
+				__progname,__FILE__,__LINE__,__func__,is.label,dest,dest,is.label);
+	} else if (is.label[0] != 0) {
+		fprintf(stderr,"INF: %s [%s:%u] %s: Feed the same archive again to resume\n",__progname,__FILE__,__LINE__,__func__);
+	}
+	free(raw);
+	free(z);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Wait for the slot of the next block to drain and make it current
+ */
+static int
+getslot(struct export_stream *xs) {
+	struct export_slot *slot;
+
+	pthread_mutex_lock(&xs->lock);
+	slot = &xs->slots[xs->nextseq % EXPORT_INFLIGHT];
+	while (slot->state != SLOT_FREE && xs->failed == 0) {
+		pthread_cond_wait(&xs->changed, &xs->lock);
+	}
+	pthread_mutex_unlock(&xs->lock);
+	slot->rawlen = 0;
+	xs->cur = slot;
+	return(xs->failed);
+}
+
+/*
+ * Hand the current block to the compression workers, empty blocks are dropped
+ */
+static int
+flushblock(struct export_stream *xs, uint32_t type) {
+	if (xs->cur == NULL || (xs->cur->rawlen == 0 && type == FRAME_DATA)) {
+		return(xs->failed);
+	}
+	pthread_mutex_lock(&xs->lock);
+	xs->cur->type = type;
+	xs->cur->seq = xs->nextseq++;
+	xs->cur->state = SLOT_FILLED;
+	xs->cur = NULL;
+	pthread_cond_broadcast(&xs->changed);
+	pthread_mutex_unlock(&xs->lock);
+	return(xs->failed);
+}
+
+/*
+ * Room for need more bytes in the current block, starting a new one if necessary
+ */
+static unsigned char *
+reserve(struct export_stream *xs, size_t need) {
+	unsigned char *p;
+
+	if (need > EXPORT_BLOCK) {
+		return(NULL);
+	}
+	if (xs->cur != NULL && xs->cur->rawlen + need > EXPORT_BLOCK) {
+		flushblock(xs, FRAME_DATA);
+	}
+	if (xs->cur == NULL && getslot(xs) != 0) {
+		return(NULL);
+	}
+	p = xs->cur->raw + xs->cur->rawlen;
+	xs->cur->rawlen += need;
+	return(p);
+}
+
+static int
+emit(struct export_stream *xs, char type, const char *path, const uint64_t *fixed, int nfixed, const void *data, size_t datalen) {
+	int i;
+	size_t pathlen;
+	unsigned char *rec;
+
+	pathlen = strlen(path);
+	if ((rec = reserve(xs, 8 + (size_t)nfixed * 8 + pathlen + datalen)) == NULL) {
+		xs->failed = (xs->failed != 0) ? xs->failed : -1;
+		return(-1);
+	}
+	rec[0] = (unsigned char)type;
+	put16(rec + 1, (uint16_t)pathlen);
+	put32(rec + 3, (uint32_t)datalen);
+	rec[7] = (unsigned char)nfixed;
+	for (i = 0; i < nfixed; i++) {
+		put64(rec + 8 + i * 8, fixed[i]);
+	}
+	memcpy(rec + 8 + nfixed * 8, path, pathlen);
+	if (datalen > 0) {
+		memcpy(rec + 8 + (size_t)nfixed * 8 + pathlen, data, datalen);
+	}
+	return(0);
+}
+
+/*
+ * Emit every entry of the PFS mounted at altroot/fsfile, nested PFSes
+ * are left to their own pass
+ */
+static int
+exportpfs(struct export_stream *xs, const char *altroot, const char *fsfile, char pfses[][MNAMELEN], int npfs) {
+	int i, failed;
+	size_t rootlen;
+	uint64_t fixed[1];
+	char top[MAXPATHLEN], target[MAXPATHLEN], *argv[2];
+	const char *rel;
+	FTS *walk;
+	FTSENT *ent;
+
+	failed = 0;
+	snprintf(top, sizeof(top), "%s%s", altroot, (strcmp(fsfile, "/") == 0) ? "" : fsfile);
+	rootlen = strlen(altroot);
+	argv[0] = top; argv[1] = NULL;
+	if ((walk = fts_open(argv, FTS_PHYSICAL|FTS_NOCHDIR|FTS_XDEV, NULL)) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to walk %s (%s)\n",__progname,__FILE__,__LINE__,__func__,top,strerror(errno));
+		return(-1);
+	}
+	emit(xs, REC_PFS, fsfile + 1, NULL, 0, NULL, 0);
+	while (xs->failed == 0 && (ent = fts_read(walk)) != NULL) {
+		rel = ent->fts_path + rootlen;
+		rel += (*rel == '/') ? 1 : 0;
+		if ((ent->fts_info == FTS_D || ent->fts_info == FTS_DP) && ent->fts_level > 0) {
+			for (i = 0; i < npfs; i++) {
+				if (strcmp(pfses[i], fsfile) != 0 && strcmp(pfses[i] + 1, rel) == 0) {
+					break;
+				}
+			}
+			/* some fts(3) implementations still visit a skipped directory in postorder */
+			if (i < npfs) {
+				fts_set(walk, ent, FTS_SKIP);
+				continue;
+			}
+		}
+		switch (ent->fts_info) {
+			case FTS_D:
+				fixed[0] = (uint64_t)ent->fts_statp->st_mode;
+				emit(xs, REC_DIR, rel, fixed, 1, NULL, 0);
+				break;
+			case FTS_DP:
+				emitattr(xs, rel, ent->fts_statp);
+				break;
+			case FTS_F:
+				if (exportfile(xs, ent->fts_accpath, rel, ent->fts_statp) != 0) {
+					failed++;
+				}
+				break;
+			case FTS_SL:
+			case FTS_SLNONE:
+				if ((ent->fts_statp->st_size < MAXPATHLEN) && (i = (int)readlink(ent->fts_accpath, target, sizeof(target))) >= 0) {
+					emit(xs, REC_LINK, rel, NULL, 0, target, (size_t)i);
+					emitattr(xs, rel, ent->fts_statp);
+				}
+				break;
+			case FTS_DNR:
+			case FTS_ERR:
+			case FTS_NS:
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to export %s (%s)\n",__progname,__FILE__,__LINE__,__func__,ent->fts_path,strerror(ent->fts_errno));
+				failed++;
+				break;
+			default:
+				fprintf(stderr,"WRN: %s [%s:%u] %s: Skipping special file %s\n",__progname,__FILE__,__LINE__,__func__,ent->fts_path);
+		}
+	}
+	fts_close(walk);
+	if (failed != 0 && xs->failed == 0) {
+		xs->failed = -1;
+	}
+	return(failed);
+}
+
+/*
+ * A regular file is a header, its contents in chunks read straight
+ * into the block, then its attributes
+ */
+static int
+exportfile(struct export_stream *xs, const char *file, const char *rel, const struct stat *st) {
+	int fd, retc;
+	ssize_t got;
+	size_t pathlen;
+	uint64_t fixed[2], offset;
+	unsigned char *rec;
+
+	if ((fd = open(file, O_RDONLY|O_NOFOLLOW)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s)\n",__progname,__FILE__,__LINE__,__func__,file,strerror(errno));
+		return(-1);
+	}
+	retc = 0;
+	pathlen = strlen(rel);
+	fixed[0] = (uint64_t)st->st_mode;
+	fixed[1] = (uint64_t)st->st_size;
+	emit(xs, REC_FILE, rel, fixed, 2, NULL, 0);
+	for (offset = 0; xs->failed == 0; offset += (uint64_t)got) {
+		if ((rec = reserve(xs, 16 + pathlen + EXPORT_CHUNK)) == NULL) {
+			retc = -1;
+			break;
+		}
+		if ((got = read(fd, rec + 16 + pathlen, EXPORT_CHUNK)) <= 0) {
+			/* give back what wasn't used */
+			xs->cur->rawlen -= 16 + pathlen + EXPORT_CHUNK;
+			retc = (got < 0) ? -1 : 0;
+			break;
+		}
+		xs->cur->rawlen -= (size_t)(EXPORT_CHUNK - got);
+		rec[0] = REC_CHUNK;
+		put16(rec + 1, (uint16_t)pathlen);
+		put32(rec + 3, (uint32_t)got);
+		rec[7] = 1;
+		put64(rec + 8, offset);
+		memcpy(rec + 16, rel, pathlen);
+	}
+	close(fd);
+	if (retc != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read %s (%s)\n",__progname,__FILE__,__LINE__,__func__,file,strerror(errno));
+		return(retc);
+	}
+	return(emitattr(xs, rel, st));
+}
+
+static int
+emitattr(struct export_stream *xs, const char *rel, const struct stat *st) {
+	uint64_t fixed[5];
+
+	fixed[0] = (uint64_t)st->st_mode;
+	fixed[1] = (uint64_t)st->st_uid;
+	fixed[2] = (uint64_t)st->st_gid;
+	fixed[3] = (uint64_t)st->st_mtim.tv_sec;
+	fixed[4] = (uint64_t)st->st_mtim.tv_nsec;
+	return(emit(xs, REC_ATTR, rel, fixed, 5, NULL, 0));
+}
+
+/*
+ * Mountpoints of the environment's PFSes in a stored payload, parents first
+ * returns the number found
+ */
+static int
+listpfs(const char *payload, const char *label, char pfses[][MNAMELEN], int max) {
+	int n, i, j;
+	size_t lablen, speclen;
+	char line[MAXPATHLEN * 3], spec[MAXPATHLEN], file[MAXPATHLEN], vfstype[MAXPATHLEN], swap[MNAMELEN];
+	const char *cur, *eol;
+
+	n = 0;
+	lablen = strlen(label);
+	for (cur = payload; cur != NULL && *cur != 0 && n < max; cur = (*eol != 0) ? eol + 1 : eol) {
+		eol = cur + strcspn(cur, "\n");
+		snprintf(line, sizeof(line), "%.*s", (int)(eol - cur), cur);
+		if (sscanf(line, "%1023s %1023s %1023s", spec, file, vfstype) != 3 || *file != '/' || strcmp(vfstype, "hammer2") != 0) {
+			continue;
+		}
+		speclen = strlen(spec);
+		if (speclen > lablen + 1 && spec[speclen - lablen - 1] == BESEP && strcmp(spec + speclen - lablen, label) == 0) {
+			strlcpy(pfses[n++], file, MNAMELEN);
+		}
+	}
+	/* shorter mountpoints can only be parents, so this puts parents first */
+	for (i = 1; i < n; i++) {
+		for (j = i; j > 0 && strlen(pfses[j - 1]) > strlen(pfses[j]); j--) {
+			memcpy(swap, pfses[j], MNAMELEN);
+			memcpy(pfses[j], pfses[j - 1], MNAMELEN);
+			memcpy(pfses[j - 1], swap, MNAMELEN);
+		}
+	}
+	return(n);
+}
+
+static void *
+compressworker(void *arg) {
+	int i;
+	struct export_slot *slot;
+	struct export_stream *xs;
+
+	xs = arg;
+	pthread_mutex_lock(&xs->lock);
+	for (;;) {
+		for (slot = NULL, i = 0; i < EXPORT_INFLIGHT; i++) {
+			if (xs->slots[i].state == SLOT_FILLED) {
+				slot = &xs->slots[i];
+				break;
+			}
+		}
+		if (slot == NULL) {
+			if (xs->closing || xs->failed != 0) {
+				break;
+			}
+			pthread_cond_wait(&xs->changed, &xs->lock);
+			continue;
+		}
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&xs->lock);
+		slot->zlen = compressBound(EXPORT_BLOCK);
+		slot->crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), slot->raw, (uInt)slot->rawlen);
+		i = compress2(slot->z, &slot->zlen, slot->raw, slot->rawlen, Z_DEFAULT_COMPRESSION);
+		pthread_mutex_lock(&xs->lock);
+		if (i != Z_OK) {
+			xs->failed = -4;
+		}
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&xs->changed);
+	}
+	pthread_mutex_unlock(&xs->lock);
+	return(NULL);
+}
+
+static void *
+writeworker(void *arg) {
+	unsigned char frame[EXPORT_FRAMELEN];
+	struct export_slot *slot;
+	struct export_stream *xs;
+
+	xs = arg;
+	pthread_mutex_lock(&xs->lock);
+	for (;;) {
+		slot = &xs->slots[xs->written % EXPORT_INFLIGHT];
+		if (slot->state != SLOT_DONE || slot->seq != xs->written) {
+			if ((xs->closing && xs->written == xs->nextseq) || xs->failed != 0) {
+				break;
+			}
+			pthread_cond_wait(&xs->changed, &xs->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&xs->lock);
+		put32(frame, EXPORT_MAGIC);
+		put32(frame + 4, slot->type);
+		put64(frame + 8, slot->seq);
+		put32(frame + 16, (uint32_t)slot->rawlen);
+		put32(frame + 20, (uint32_t)slot->zlen);
+		put32(frame + 24, slot->crc);
+		if (writefull(xs->out, frame, sizeof(frame)) != 0 || writefull(xs->out, slot->z, slot->zlen) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to write the archive (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+			pthread_mutex_lock(&xs->lock);
+			xs->failed = -5;
+			pthread_cond_broadcast(&xs->changed);
+			break;
+		}
+		pthread_mutex_lock(&xs->lock);
+		slot->state = SLOT_FREE;
+		xs->written++;
+		pthread_cond_broadcast(&xs->changed);
+	}
+	pthread_mutex_unlock(&xs->lock);
+	return(NULL);
+}
+
+static int
+applyframe(struct import_state *is, const unsigned char *raw, size_t rawlen) {
+	int i, nfixed, retc;
+	size_t pathlen, datalen, off;
+	uint64_t fixed[5];
+	char path[MAXPATHLEN];
+
+	retc = nfixed = 0;
+	pathlen = datalen = 0;
+	for (off = 0; retc == 0 && off < rawlen; off += 8 + (size_t)nfixed * 8 + pathlen + datalen) {
+		if (rawlen - off < 8) {
+			return(-1);
+		}
+		pathlen = get16(raw + off + 1);
+		datalen = get32(raw + off + 3);
+		nfixed = raw[off + 7];
+		if (nfixed > 5 || pathlen >= MAXPATHLEN || rawlen - off < 8 + (size_t)nfixed * 8 + pathlen + datalen) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Malformed record\n",__progname,__FILE__,__LINE__,__func__);
+			return(-1);
+		}
+		for (i = 0; i < nfixed; i++) {
+			fixed[i] = get64(raw + off + 8 + i * 8);
+		}
+		memcpy(path, raw + off + 8 + nfixed * 8, pathlen);
+		path[pathlen] = 0;
+		if (!saferel(path)) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Refusing to write outside of %s: %s\n",__progname,__FILE__,__LINE__,__func__,is->dest,path);
+			return(-1);
+		}
+		retc = applyrecord(is, (char)raw[off], path, fixed, nfixed, raw + off + 8 + nfixed * 8 + pathlen, datalen);
+	}
+	return(retc);
+}
+
+static int
+applyrecord(struct import_state *is, char type, const char *path, const uint64_t *fixed, int nfixed, const unsigned char *data, size_t datalen) {
+	int dirfd, retc;
+	const char *leaf;
+	char full[MAXPATHLEN], target[MAXPATHLEN];
+	struct timespec times[2];
+
+	retc = 0;
+	snprintf(full, sizeof(full), "%s%s%s", is->dest, (*path != 0) ? "/" : "", path);
+	if (noop) {
+		if (type != REC_CHUNK && type != REC_ATTR) {
+			fprintf(stdout,"INF: %s: Would restore %c %s\n",__progname,type,full);
+		}
+		return(0);
+	}
+	/* chunks of the same file keep its descriptor open */
+	if (is->fd >= 0 && (type != REC_CHUNK || strcmp(is->fdpath, full) != 0)) {
+		close(is->fd);
+		is->fd = -1;
+	}
+	if (type == REC_CHUNK && is->fd >= 0) {
+		if (nfixed < 1) {
+			return(-1);
+		}
+		return((pwrite(is->fd, data, datalen, (off_t)fixed[0]) == (ssize_t)datalen) ? 0 : -1);
+	}
+	/* a symlink restored earlier must not carry later records out of dest */
+	if ((dirfd = openparent(is, path, &leaf, type == REC_PFS)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Refusing to write outside of %s: %s (%s)\n",__progname,__FILE__,__LINE__,__func__,is->dest,path,strerror(errno));
+		return(-1);
+	}
+	switch (type) {
+		case REC_PFS:
+		case REC_DIR:
+			retc = (mkdirat(dirfd, leaf, S_IRWXU) == 0 || errno == EEXIST) ? 0 : -1;
+			break;
+		case REC_FILE:
+			if ((is->fd = openat(dirfd, leaf, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, S_IRUSR|S_IWUSR)) >= 0) {
+				strlcpy(is->fdpath, full, sizeof(is->fdpath));
+			} else {
+				retc = -1;
+			}
+			break;
+		case REC_CHUNK:
+			if (nfixed < 1 || (is->fd = openat(dirfd, leaf, O_WRONLY|O_NOFOLLOW)) < 0) {
+				retc = -1;
+				break;
+			}
+			strlcpy(is->fdpath, full, sizeof(is->fdpath));
+			retc = (pwrite(is->fd, data, datalen, (off_t)fixed[0]) == (ssize_t)datalen) ? 0 : -1;
+			break;
+		case REC_LINK:
+			snprintf(target, sizeof(target), "%.*s", (int)datalen, (const char *)data);
+			unlinkat(dirfd, leaf, 0);
+			retc = symlinkat(target, dirfd, leaf);
+			break;
+		case REC_ATTR:
+			if (nfixed < 5) {
+				retc = -1;
+				break;
+			}
+			times[0].tv_sec = times[1].tv_sec = (time_t)fixed[3];
+			times[0].tv_nsec = times[1].tv_nsec = (long)fixed[4];
+			if (fchownat(dirfd, leaf, (uid_t)fixed[1], (gid_t)fixed[2], AT_SYMLINK_NOFOLLOW) != 0 ||
+			    (!S_ISLNK((mode_t)fixed[0]) && fchmodat(dirfd, leaf, (mode_t)fixed[0] & ALLPERMS, 0) != 0) ||
+			    utimensat(dirfd, leaf, times, AT_SYMLINK_NOFOLLOW) != 0) {
+				retc = -1;
+			}
+			break;
+		default:
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unknown record type %c for %s\n",__progname,__FILE__,__LINE__,__func__,type,full);
+			close(dirfd);
+			return(-1);
+	}
+	if (retc != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to restore %s (%s)\n",__progname,__FILE__,__LINE__,__func__,full,strerror(errno));
+	}
+	close(dirfd);
+	return(retc);
+}
+
+/*
+ * Make everything applied so far durable, then record how far that is
+ */
+static int
+checkpoint(struct import_state *is, uint64_t applied) {
+	int fd;
+
+	if (noop) {
+		return(0);
+	}
+	if (is->fd >= 0) {
+		fsync(is->fd);
+	}
+	sync();
+	/* a fresh file beside the state, never whatever the archive may have left under that name */
+	unlinkat(is->destfd, IMPORT_STATE ".tmp", 0);
+	if ((fd = openat(is->destfd, IMPORT_STATE ".tmp", O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IRUSR|S_IWUSR)) < 0) {
+		return(-1);
+	}
+	dprintf(fd, "%s %llu\n", is->label, (unsigned long long)applied);
+	if (fsync(fd) != 0 || renameat(is->destfd, IMPORT_STATE ".tmp", is->destfd, IMPORT_STATE) != 0) {
+		close(fd);
+		unlinkat(is->destfd, IMPORT_STATE ".tmp", 0);
+		return(-1);
+	}
+	close(fd);
+	DBGTRACE("Checkpointed %s at frame %llu", is->label, (unsigned long long)applied);
+	return(0);
+}
+
+/* relative, and no component climbs out of the destination */
+static bool
+saferel(const char *path) {
+	const char *cur;
+
+	if (*path == '/') {
+		return(false);
+	}
+	for (cur = path; *cur != 0; cur += strcspn(cur, "/"), cur += (*cur == '/') ? 1 : 0) {
+		if (strncmp(cur, "..", 2) == 0 && (cur[2] == '/' || cur[2] == 0)) {
+			return(false);
+		}
+	}
+	return(true);
+}
+
+/*
+ * Walk to the directory holding path from the destination, one component
+ * at a time and never through a symlink, creating missing ones if asked.
+ * *leaf is left on the last component.
+ * returns a descriptor for that directory, or -1
+ */
+static int
+openparent(const struct import_state *is, const char *path, const char **leaf, bool create) {
+	int dirfd, next;
+	size_t len;
+	const char *cur, *slash;
+	char comp[NAME_MAX + 1];
+
+	if ((dirfd = dup(is->destfd)) < 0) {
+		return(-1);
+	}
+	for (cur = path; (slash = strchr(cur, '/')) != NULL; cur = slash + 1) {
+		if ((len = (size_t)(slash - cur)) == 0) {
+			continue;
+		}
+		if (len > NAME_MAX) {
+			close(dirfd);
+			errno = ENAMETOOLONG;
+			return(-1);
+		}
+		memcpy(comp, cur, len);
+		comp[len] = 0;
+		if (create && mkdirat(dirfd, comp, S_IRWXU) != 0 && errno != EEXIST) {
+			close(dirfd);
+			return(-1);
+		}
+		next = openat(dirfd, comp, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+		close(dirfd);
+		if ((dirfd = next) < 0) {
+			return(-1);
+		}
+	}
+	*leaf = (*cur != 0) ? cur : ".";
+	return(dirfd);
+}
+
+static int
+readfull(int fd, void *buf, size_t len) {
+	ssize_t got;
+	unsigned char *p;
+
+	for (p = buf; len > 0; p += got, len -= (size_t)got) {
+		if ((got = read(fd, p, len)) <= 0) {
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+static int
+writefull(int fd, const void *buf, size_t len) {
+	ssize_t put;
+	const unsigned char *p;
+
+	for (p = buf; len > 0; p += put, len -= (size_t)put) {
+		if ((put = write(fd, p, len)) <= 0) {
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/*
+ * Little endian field helpers, shared with the iotrace format in fsreplay.c
+ * put* return nothing, get* return the decoded value
+ */
+void
+put16(unsigned char *p, uint16_t v) {
+	p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+}
+
+void
+put32(unsigned char *p, uint32_t v) {
+	put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16));
+}
+
+void
+put64(unsigned char *p, uint64_t v) {
+	put32(p, (uint32_t)v); put32(p + 4, (uint32_t)(v >> 32));
+}
+
+uint16_t
+get16(const unsigned char *p) {
+	return((uint16_t)(p[0] | (p[1] << 8)));
+}
+
+uint32_t
+get32(const unsigned char *p) {
+	return((uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16));
+}
+
+uint64_t
+get64(const unsigned char *p) {
+	return((uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32));
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Moving boot environments between hosts. An export is a stream of frames,
+ * each a zlib compressed block of whole records, numbered so that an
+ * interrupted import can be fed the same stream again and pick up after
+ * the last block it applied. The first frame carries the environment's
+ * stored fstab.
+ *
+ * frame:  magic, type, seq, rawlen, zlen, crc32(raw), then zlen bytes
+ * record: type, pathlen, datalen, nfixed, nfixed 64 bit fields, path, data
+ * everything is little endian, paths are relative to the environment's root
+ */
+
+#define DFBEADM_FSEXPORT_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#include <stdint.h>
+
+/* "DFBF" */
+#define EXPORT_MAGIC 0x46424644U
+#define EXPORT_VERSION 1
+#define EXPORT_FRAMELEN 28
+/* raw bytes per frame, file contents are cut into EXPORT_CHUNK sized records */
+#define EXPORT_BLOCK (1024 * 1024)
+#define EXPORT_CHUNK (EXPORT_BLOCK / 2)
+#define EXPORT_WORKERS 4
+/* blocks compressed or waiting to be written at any time */
+#define EXPORT_INFLIGHT (EXPORT_WORKERS * 2)
+/* applied frames between durable resume points */
+#define IMPORT_CHECKPOINT 16
+#define IMPORT_STATE ".dfbeadm-import"
+
+/* frame types */
+#define FRAME_HEADER 1
+#define FRAME_DATA 2
+#define FRAME_END 3
+
+/* record types */
+#define REC_PFS 'P' /* a PFS begins at path */
+#define REC_DIR 'D' /* mode */
+#define REC_FILE 'F' /* mode, size */
+#define REC_CHUNK 'C' /* offset, then the bytes */
+#define REC_LINK 'L' /* the target as data */
+#define REC_ATTR 'T' /* mode, uid, gid, mtime sec, mtime nsec, set once a path is complete */
+
+int exportenv(const char *label, const char *altroot);
+int importenv(const char *dest);
+void put16(unsigned char *p, uint16_t v);
+void put32(unsigned char *p, uint32_t v);
+void put64(unsigned char *p, uint64_t v);
+uint16_t get16(const unsigned char *p);
+uint32_t get32(const unsigned char *p);
+uint64_t get64(const unsigned char *p);
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSGROUP_H
+#include "fsgroup.h"
+#endif
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+#ifndef DFBEADM_SNAPFS_H
+#include "snapfs.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+/* groups are read once per process, scope workers share them */
+static cgroup *cgroups = NULL;
+static int ncgroups = 0;
+static bool cgroups_bad = false; /* the file exists but couldn't be parsed */
+static pthread_once_t cgroups_once = PTHREAD_ONCE_INIT;
+
+static void groupinit(void);
+
+/*
+ * Parse the consistency groups out of the configuration file,
+ * a missing file simply means there are no groups
+ * returns 0 on success, nonzero on a malformed file
+ */
+int
+loadgroups(const char *path, cgroup **groups, int *ngroups) {
+	int lineno, retc;
+	char line[GROUP_HOOKLEN + 16], *key, *value, *end;
+	cgroup *cur, *grown;
+	FILE *conf;
+
+	assert((path != NULL) && (groups != NULL) && (ngroups != NULL));
+	lineno = retc = 0;
+	cur = NULL;
+	*groups = NULL; *ngroups = 0;
+	if ((conf = fopen(path, "r")) == NULL) {
+		return((errno == ENOENT) ? 0 : -1);
+	}
+	while (retc == 0 && fgets(line, sizeof(line), conf) != NULL) {
+		lineno++;
+		key = line + strspn(line, " \t");
+		if (*key == '#' || *key == '\n' || *key == 0) {
+			continue;
+		}
+		value = key + strcspn(key, " \t\n");
+		if (*value != 0) {
+			*value++ = 0;
+		}
+		value += strspn(value, " \t");
+		/* trim the trailing newline and whitespace */
+		for (end = value + strlen(value); end > value && (end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t'); end--) {
+			end[-1] = 0;
+		}
+		if (*value == 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %s:%d: \"%s\" needs a value\n",__progname,__FILE__,__LINE__,__func__,path,lineno,key);
+			retc = -1;
+		} else if (strcmp(key, "group") == 0) {
+			if ((grown = reallocarray(*groups, (size_t)*ngroups + 1, sizeof(cgroup))) == NULL) {
+				retc = -2;
+				break;
+			}
+			*groups = grown;
+			cur = &(*groups)[(*ngroups)++];
+			memset(cur, 0, sizeof(cgroup));
+			strlcpy(cur->name, value, sizeof(cur->name));
+		} else if (cur == NULL) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %s:%d: \"%s\" outside of a group\n",__progname,__FILE__,__LINE__,__func__,path,lineno,key);
+			retc = -1;
+		} else if (strcmp(key, "mount") == 0 && cur->nmounts < GROUP_MAXMOUNTS) {
+			strlcpy(cur->mounts[cur->nmounts++], value, MNAMELEN);
+		} else if (strcmp(key, "freeze") == 0 && cur->nfreeze < GROUP_MAXHOOKS) {
+			strlcpy(cur->freeze[cur->nfreeze++], value, GROUP_HOOKLEN);
+		} else if (strcmp(key, "thaw") == 0 && cur->nthaw < GROUP_MAXHOOKS) {
+			strlcpy(cur->thaw[cur->nthaw++], value, GROUP_HOOKLEN);
+		} else {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %s:%d: unknown or repeated too often: \"%s\"\n",__progname,__FILE__,__LINE__,__func__,path,lineno,key);
+			retc = -1;
+		}
+	}
+	fclose(conf);
+	if (retc != 0) {
+		free(*groups);
+		*groups = NULL; *ngroups = 0;
+	}
+	return(retc);
+}
+
+/*
+ * Snapshot every marked target, consistency groups first.
+ * For each group all freeze hooks run, the group's PFSes are snapshotted
+ * concurrently and the thaw hooks run right away, so an application is only 
+ * frozen for as long as its own snapshots take. Everything outside of a group
+ * is snapshotted afterwards, with no application frozen.
+ * returns the number of snapshots that failed
+ */
+int
+groupsnaps(bedata *fstarget, int fscount) {
+	int failed, g, i, m, nset, retc;
+	bool *grouped;
+	bedata **set;
+	struct timespec frozen, thawed;
+
+	assert(fstarget != NULL);
+	failed = 0;
+	pthread_once(&cgroups_once, groupinit);
+	/* snapshotting without the freezes the groups ask for would look consistent when it isn't */
+	if (cgroups_bad) {
+		for (i = 0; i < fscount; i++) {
+			failed += (fstarget[i].snap) ? 1 : 0;
+		}
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Consistency groups in %s/%s can't be parsed, not snapshotting anything\n",
+				__progname,__FILE__,__LINE__,__func__,DFBEADM_CONFIG_DIR,DFBEADM_CONFIG_FILE);
+		return(failed);
+	}
+	if (ncgroups == 0) {
+		return(mksnaps(fstarget, fscount));
+	}
+	if ((grouped = calloc((size_t)fscount, sizeof(bool))) == NULL || (set = calloc((size_t)fscount, sizeof(bedata *))) == NULL) {
+		free(grouped);
+		return(mksnaps(fstarget, fscount));
+	}
+
+	for (g = 0; g < ncgroups; g++) {
+		for (nset = i = 0; i < fscount; i++) {
+			for (m = 0; !grouped[i] && fstarget[i].snap && m < cgroups[g].nmounts; m++) {
+				if (strcmp(fstarget[i].fstab.fs_file, cgroups[g].mounts[m]) == 0) {
+					set[nset++] = &fstarget[i];
+					grouped[i] = true;
+				}
+			}
+		}
+		if (nset == 0) {
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &frozen);
+		if ((retc = runhooks(cgroups[g].name, cgroups[g].freeze, cgroups[g].nfreeze)) != 0) {
+			/* hooks that did succeed must still be undone */
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %d freeze hooks failed for group %s, not snapshotting it\n",
+					__progname,__FILE__,__LINE__,__func__,retc,cgroups[g].name);
+			failed += nset;
+		} else {
+			failed += parsnaps(set, nset);
+		}
+		if ((retc = runhooks(cgroups[g].name, cgroups[g].thaw, cgroups[g].nthaw)) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %d thaw hooks failed for group %s, check the application!\n",
+					__progname,__FILE__,__LINE__,__func__,retc,cgroups[g].name);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &thawed);
+		fprintf(stdout,"INF: %s [%s:%u] %s: Group %s was frozen for %.3fs while %d PFSes were snapshotted\n",
+				__progname,__FILE__,__LINE__,__func__,cgroups[g].name,tsdiff(&frozen, &thawed),nset);
+	}
+	/* everything else, outside of any freeze window */
+	for (i = 0; i < fscount; i++) {
+		if (!grouped[i]) {
+			failed += mksnaps(&fstarget[i], 1);
+		}
+	}
+	free(set);
+	free(grouped);
+	return(failed);
+}
+
+/*
+ * Check that no consistency group is spread over more than one of the parts 
+ * fstarget is divided into, part[i] < 0 meaning the entry isn't taken at all.
+ * Each part is snapshotted on its own, so a split group would be frozen and
+ * thawed once per part, and one part could thaw it while another is still
+ * snapshotting it.
+ * returns the number of groups that are split
+ */
+int
+splitgroups(const bedata *fstarget, int fscount, const int *part) {
+	int first, g, i, m, split;
+
+	assert((fstarget != NULL) && (part != NULL));
+	pthread_once(&cgroups_once, groupinit);
+	for (split = g = 0; g < ncgroups; g++) {
+		for (first = -1, i = 0; i < fscount; i++) {
+			for (m = 0; part[i] >= 0 && m < cgroups[g].nmounts && strcmp(fstarget[i].fstab.fs_file, cgroups[g].mounts[m]) != 0; m++) { ; }
+			if (part[i] < 0 || m == cgroups[g].nmounts) {
+				continue;
+			}
+			if (first < 0) {
+				first = part[i];
+			} else if (part[i] != first) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Group %s would be split, %s is not snapshotted with the rest of it\n",
+						__progname,__FILE__,__LINE__,__func__,cgroups[g].name,fstarget[i].fstab.fs_file);
+				split++;
+				break;
+			}
+		}
+	}
+	return(split);
+}
+
+/*
+ * Start every hook of a group at once and wait for all of them,
+ * each hook is handed to sh(1) with the group name as $1
+ * returns the number of hooks that failed
+ */
+int
+runhooks(const char *group, char hooks[][GROUP_HOOKLEN], int nhooks) {
+	int failed, i, status;
+	pid_t pids[GROUP_MAXHOOKS];
+
+	assert((group != NULL) && (hooks != NULL));
+	failed = 0;
+	for (i = 0; i < nhooks; i++) {
+		if (noop) {
+			fprintf(stdout,"INF: %s [%s:%u] %s: Would run \"%s\" for group %s\n",__progname,__FILE__,__LINE__,__func__,hooks[i],group);
+			pids[i] = -1;
+			continue;
+		}
+		DBGTRACE("Running \"%s\" for group %s", hooks[i], group);
+		if ((pids[i] = fork()) == 0) {
+			execl("/bin/sh", "sh", "-c", hooks[i], "sh", group, (char *)NULL);
+			_exit(127);
+		} else if (pids[i] < 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to run \"%s\" (%s)\n",__progname,__FILE__,__LINE__,__func__,hooks[i],strerror(errno));
+			failed++;
+		}
+	}
+	for (i = 0; i < nhooks; i++) {
+		if (pids[i] > 0 && (waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: \"%s\" failed for group %s\n",__progname,__FILE__,__LINE__,__func__,hooks[i],group);
+			failed++;
+		}
+	}
+	return(failed);
+}
+
+static void
+groupinit(void) {
+	char path[MAXPATHLEN];
+
+	snprintf(path, sizeof(path), "%s/%s", DFBEADM_CONFIG_DIR, DFBEADM_CONFIG_FILE);
+	cgroups_bad = (loadgroups(path, &cgroups, &ncgroups) != 0);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Consistency groups: sets of mountpoints whose snapshots must be taken
+ * together while the applications using them are quiesced. Groups are
+ * read from DFBEADM_CONFIG_DIR/DFBEADM_CONFIG_FILE, for example:
+ *
+ *   group postgres
+ *       mount /var/db/postgres
+ *       mount /var/db/postgres/wal
+ *       freeze /usr/local/libexec/pg-freeze
+ *       thaw /usr/local/libexec/pg-thaw
+ */
+
+#define DFBEADM_FSGROUP_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+/* limits per group, a group is expected to be one application */
+#define GROUP_MAXMOUNTS 32
+#define GROUP_MAXHOOKS 8
+#define GROUP_NAMELEN 64
+#define GROUP_HOOKLEN 1024
+
+struct consistency_group {
+	char name[GROUP_NAMELEN];
+	char mounts[GROUP_MAXMOUNTS][MNAMELEN];
+	char freeze[GROUP_MAXHOOKS][GROUP_HOOKLEN];
+	char thaw[GROUP_MAXHOOKS][GROUP_HOOKLEN];
+	int nmounts;
+	int nfreeze;
+	int nthaw;
+};
+
+typedef struct consistency_group cgroup;
+
+int loadgroups(const char *path, cgroup **groups, int *ngroups);
+int groupsnaps(bedata *fstarget, int fscount);
+int splitgroups(const bedata *fstarget, int fscount, const int *part);
+int runhooks(const char *group, char hooks[][GROUP_HOOKLEN], int nhooks);
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+#ifndef DFBEADM_SNAPFS_H
+#include "snapfs.h"
+#endif
+#ifndef DFBEADM_FSSIM_H
+#include "fssim.h"
+#endif
+#ifndef DFBEADM_FSREPLAY_H
+#include "fsreplay.h"
+#endif
+#ifndef DFBEADM_FSWATCH_H
+#include "fswatch.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+extern bool noop;
+extern bool progress;
+
+/* snapshots and scopes run concurrently, everything below is under statlock */
+static pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+static struct ioctl_stats devstats[IOSTAT_MAXDEVS];
+static int ndevs = 0;
+
+static struct {
+	const char *op;
+	int total;
+	int done;
+	int failed;
+	struct timespec start;
+	struct timespec written;
+} prog;
+
+static const char *const opnames[H2OP_COUNT] = { "snapshot", "pfs-get", "delete", "other" };
+
+/* what a watched call needs, the descriptors are the runner's own duplicates */
+struct ioctl_call {
+	int fd;
+	unsigned long request;
+	union {
+		hammer2_ioc_pfs_t pfs;
+		hammer2_ioc_inode_t inode;
+	} arg;
+};
+
+struct open_call {
+	char path[MNAMELEN];
+	int flags;
+};
+
+static int doioctl(void *ctx);
+static int doopen(void *ctx);
+static void closedup(void *ctx, int retc, bool abandoned);
+static void closeopened(void *ctx, int retc, bool abandoned);
+static struct ioctl_stats *devslot(const char *dev);
+static void writestatus(const char *state, bool force);
+
+/*
+ * ioctl(2) wrapper for HAMMER2 requests, dev names the device or mountpoint
+ * the request ends up on, anything after PFSDELIM is dropped so every PFS of
+ * a device shares its histogram. Under DFBEADM_SIM the model answers instead.
+ * With a deadline set, the request runs under the watchdog on its own copy of arg.
+ * returns whatever ioctl(2) returned, with errno intact, or -1 and ETIMEDOUT
+ */
+int
+h2ioctl(int fd, unsigned long request, void *arg, const char *dev) {
+	int retc, saved, bucket;
+	unsigned long usec;
+	size_t arglen;
+	double elapsed;
+	h2op op;
+	struct timespec before, after;
+	struct ioctl_stats *slot;
+	struct ioctl_call call;
+
+	switch (request) {
+		case HAMMER2IOC_PFS_SNAPSHOT:
+			op = H2OP_SNAPSHOT;
+			break;
+		case HAMMER2IOC_PFS_GET:
+			op = H2OP_PFSGET;
+			break;
+		case HAMMER2IOC_PFS_DELETE:
+			op = H2OP_DELETE;
+			break;
+		default:
+			op = H2OP_OTHER;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	arglen = IOCPARM_LEN(request);
+	if (!watching() || arglen > sizeof(call.arg)) {
+		retc = (simactive()) ? simioctl(fd, request, arg) : ioctl(fd, request, arg);
+		saved = errno;
+	} else if ((call.fd = dup(fd)) < 0) {
+		retc = -1;
+		saved = errno;
+	} else {
+		/* a descriptor closed and reused behind an abandoned runner must not get its request */
+		call.request = request;
+		memcpy(&call.arg, arg, arglen);
+		if ((retc = watchcall(doioctl, closedup, &call, sizeof(call), (dev != NULL) ? dev : "?", opnames[op])) != -1 || errno != ETIMEDOUT) {
+			memcpy(arg, &call.arg, arglen);
+		}
+		saved = errno;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &after);
+
+	elapsed = tsdiff(&before, &after);
+	iotrace_call(dev, request, arg, retc, saved, &before, elapsed);
+	usec = (unsigned long)(elapsed * 1e6);
+	for (bucket = 0; usec > 1 && bucket < IOSTAT_BUCKETS - 1; bucket++) {
+		usec >>= 1;
+	}
+	pthread_mutex_lock(&statlock);
+	slot = devslot((dev != NULL) ? dev : "?");
+	slot->calls[op]++;
+	slot->hist[op][bucket]++;
+	if (elapsed > slot->maxsec[op]) {
+		slot->maxsec[op] = elapsed;
+	}
+	pthread_mutex_unlock(&statlock);
+	DBGTRACE("%s on %s took %.6fs (retc = %d)", opnames[op], dev, elapsed, retc);
+	errno = saved;
+	return(retc);
+}
+
+/*
+ * open(2) a mountpoint, under the watchdog if a deadline is set,
+ * dev is what a hang is blamed on
+ * returns the descriptor, or -1 with errno set
+ */
+int
+h2open(const char *path, int flags, const char *dev) {
+	struct open_call call;
+
+	assert(path != NULL);
+	if (!watching()) {
+		return(open(path, flags));
+	}
+	if (strlcpy(call.path, path, sizeof(call.path)) >= sizeof(call.path)) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	call.flags = flags;
+	return(watchcall(doopen, closeopened, &call, sizeof(call), (dev != NULL) ? dev : path, "open"));
+}
+
+static int
+doioctl(void *ctx) {
+	struct ioctl_call *call;
+
+	call = ctx;
+	return((simactive()) ? simioctl(call->fd, call->request, &call->arg) : ioctl(call->fd, call->request, &call->arg));
+}
+
+static int
+doopen(void *ctx) {
+	const struct open_call *call;
+
+	call = ctx;
+	return(open(call->path, call->flags));
+}
+
+/* struct ioctl_call starts with the duplicate */
+static void
+closedup(void *ctx, int retc, bool abandoned) {
+	(void)retc; (void)abandoned;
+	close(*(int *)ctx);
+}
+
+static void
+closeopened(void *ctx, int retc, bool abandoned) {
+	(void)ctx;
+	if (abandoned && retc >= 0) {
+		close(retc);
+	}
+}
+
+/*
+ * getfsstat(2), or the simulated mounts under DFBEADM_SIM
+ */
+int
+vfsstat(struct statfs *buf, long bufsize, int mode) {
+	return((simactive()) ? simfsstat(buf, bufsize) : getfsstat(buf, bufsize, mode));
+}
+
+/*
+ * Print the latency histogram of every device and request seen so far
+ */
+void
+iostats(FILE *out) {
+	int d, b, op;
+	unsigned long peak;
+
+	pthread_mutex_lock(&statlock);
+	for (d = 0; d < ndevs; d++) {
+		for (op = 0; op < H2OP_COUNT; op++) {
+			if (devstats[d].calls[op] == 0) {
+				continue;
+			}
+			fprintf(out,"INF: %s: %s latency on %s, %lu calls, slowest %.3fms\n",
+					__progname,opnames[op],devstats[d].dev,devstats[d].calls[op],devstats[d].maxsec[op] * 1e3);
+			for (peak = 0, b = 0; b < IOSTAT_BUCKETS; b++) {
+				peak = (devstats[d].hist[op][b] > peak) ? devstats[d].hist[op][b] : peak;
+			}
+			for (b = 0; b < IOSTAT_BUCKETS; b++) {
+				if (devstats[d].hist[op][b] == 0) {
+					continue;
+				}
+				fprintf(out,"\t%10luus - %10luus %6lu |%.*s\n",(b == 0) ? 0UL : 1UL << b,(1UL << (b + 1)) - 1,
+						devstats[d].hist[op][b],(int)(devstats[d].hist[op][b] * 40 / peak),
+						"########################################");
+			}
+		}
+	}
+	pthread_mutex_unlock(&statlock);
+}
+
+/*
+ * Announce count more units of work for the running operation,
+ * may be called by several workers, the first call starts the clock
+ */
+void
+progress_add(const char *op, int count) {
+	pthread_mutex_lock(&statlock);
+	if (prog.total == 0) {
+		prog.op = op;
+		clock_gettime(CLOCK_MONOTONIC, &prog.start);
+	}
+	prog.total += count;
+	writestatus("running", true);
+	pthread_mutex_unlock(&statlock);
+}
+
+/*
+ * Record a finished unit of work, print the progress with -p
+ * and refresh the status file
+ */
+void
+progress_step(const char *what, bool ok) {
+	double elapsed, eta;
+	struct timespec now;
+
+	pthread_mutex_lock(&statlock);
+	prog.done++;
+	prog.failed += (ok) ? 0 : 1;
+	if (progress) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = tsdiff(&prog.start, &now);
+		eta = (prog.done < prog.total) ? elapsed / prog.done * (prog.total - prog.done) : 0;
+		fprintf(stdout,"INF: %s: [%d/%d] %s %s, %d failed, %.1fs elapsed, ETA %.1fs\n",
+				__progname,prog.done,prog.total,what,(ok) ? "done" : "FAILED",prog.failed,elapsed,eta);
+	}
+	writestatus("running", prog.done >= prog.total);
+	pthread_mutex_unlock(&statlock);
+}
+
+/*
+ * Mark the operation as finished for pollers,
+ * and show the latency histograms with -p or -D
+ */
+void
+progress_finish(void) {
+	pthread_mutex_lock(&statlock);
+	if (prog.total > 0) {
+		writestatus((prog.failed == 0) ? "finished" : "failed", true);
+	}
+	pthread_mutex_unlock(&statlock);
+	if (progress || dbg) {
+		iostats(stdout);
+	}
+}
+
+/*
+ * Find or claim the statistics slot of a device, called with statlock held
+ */
+static struct ioctl_stats *
+devslot(const char *dev) {
+	int d;
+	size_t len;
+
+	len = strcspn(dev, "@");
+	for (d = 0; d < ndevs; d++) {
+		if (strlen(devstats[d].dev) == len && strncmp(devstats[d].dev, dev, len) == 0) {
+			return(&devstats[d]);
+		}
+	}
+	if (ndevs == IOSTAT_MAXDEVS) {
+		return(&devstats[IOSTAT_MAXDEVS - 1]);
+	}
+	snprintf(devstats[ndevs].dev, sizeof(devstats[ndevs].dev), "%.*s", (int)len, dev);
+	return(&devstats[ndevs++]);
+}
+
+/*
+ * Replace the status file, pollers only ever see a complete one,
+ * called with statlock held
+ */
+static void
+writestatus(const char *state, bool force) {
+	int sfd;
+	double elapsed;
+	char tmpstatus[MAXPATHLEN];
+	FILE *status;
+	struct timespec now;
+
+	if (noop) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!force && tsdiff(&prog.written, &now) * 1e3 < STATUS_INTERVAL) {
+		return;
+	}
+	prog.written = now;
+	elapsed = tsdiff(&prog.start, &now);
+	snprintf(tmpstatus, sizeof(tmpstatus), "%s.XXXXXX", DFBEADM_STATUS);
+	if ((sfd = mkstemp(tmpstatus)) < 0) {
+		return;
+	}
+	if ((status = fdopen(sfd, "w")) == NULL) {
+		close(sfd);
+		unlink(tmpstatus);
+		return;
+	}
+	fchmod(sfd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	fprintf(status,"pid=%ld\nop=%s\nstate=%s\ndone=%d\ntotal=%d\nfailed=%d\nelapsed=%.3f\neta=%.3f\nupdated=%lld\n",
+			(long)getpid(),(prog.op != NULL) ? prog.op : "",state,prog.done,prog.total,prog.failed,elapsed,
+			(prog.done > 0 && prog.done < prog.total) ? elapsed / prog.done * (prog.total - prog.done) : 0.0,
+			(long long)time(NULL));
+	if (fclose(status) != 0 || rename(tmpstatus, DFBEADM_STATUS) != 0) {
+		unlink(tmpstatus);
+	}
+}
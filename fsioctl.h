@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Every HAMMER2 ioctl goes through h2ioctl(), which times the call and keeps
+ * a log2 latency histogram per device and request, so a slow disk shows up
+ * on its own. Long operations also report their progress here, both on the
+ * terminal with -p and in a status file that other processes can poll.
+ */
+
+#define DFBEADM_FSIOCTL_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#include <sys/mount.h>
+#include <stdio.h>
+
+#define DFBEADM_STATUS "/var/run/dfbeadm.status"
+/* distinct devices tracked, the rest are folded into the last slot */
+#define IOSTAT_MAXDEVS 32
+/* bucket n holds calls that took [2^n, 2^(n+1)) microseconds */
+#define IOSTAT_BUCKETS 24
+/* don't rewrite the status file more often than this, in milliseconds */
+#define STATUS_INTERVAL 100
+
+typedef enum dfbeadm_h2op_t {
+	H2OP_SNAPSHOT = 0,
+	H2OP_PFSGET = 1,
+	H2OP_DELETE = 2,
+	H2OP_OTHER = 3,
+	H2OP_COUNT = 4,
+} h2op;
+
+struct ioctl_stats {
+	char dev[MNAMELEN];
+	unsigned long calls[H2OP_COUNT];
+	unsigned long hist[H2OP_COUNT][IOSTAT_BUCKETS];
+	double maxsec[H2OP_COUNT];
+};
+
+int h2ioctl(int fd, unsigned long request, void *arg, const char *dev);
+int h2open(const char *path, int flags, const char *dev);
+int vfsstat(struct statfs *buf, long bufsize, int mode);
+void iostats(FILE *out);
+void progress_add(const char *op, int count);
+void progress_step(const char *what, bool ok);
+void progress_finish(void);
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+
+/*
+ * Split a fstab spec into its device, PFS and label parts in a single pass.
+ * returns 0 on success, -1 if the spec has no PFSDELIM and so names no PFS
+ */
+int
+parselabel(const char *spec, labelview *view) {
+	const char *p, *pfsdelim, *besep;
+
+	assert((spec != NULL) && (view != NULL));
+	memset(view, 0, sizeof(labelview));
+	view->spec = spec;
+	pfsdelim = besep = NULL;
+
+	for (p = spec; *p != 0 && (p - spec) < MNAMELEN; p++) {
+		if (*p == PFSDELIM && pfsdelim == NULL) {
+			pfsdelim = p;
+		} else if (*p == BESEP && pfsdelim != NULL && besep == NULL) {
+			besep = p;
+		}
+	}
+	if (pfsdelim == NULL) {
+		view->devlen = (uint16_t)(p - spec);
+		return(-1);
+	}
+	view->devlen = (uint16_t)(pfsdelim - spec);
+	view->pfsoff = (uint16_t)(pfsdelim - spec + 1);
+	if (besep == NULL) {
+		view->pfslen = (uint16_t)(p - pfsdelim - 1);
+	} else {
+		view->pfslen = (uint16_t)(besep - pfsdelim - 1);
+		view->beoff = (uint16_t)(besep - spec + 1);
+		view->belen = (uint16_t)(p - besep - 1);
+	}
+	return(0);
+}
+
+/*
+ * Write "<pfs>:<label>" into dst, typically hammer2_ioc_pfs.name
+ * returns the length written, or -1 if it would not fit
+ */
+int
+fmtsnapname(const labelview *view, const char *label, char *dst, size_t dstlen) {
+	size_t lablen, total;
+
+	assert((view != NULL) && (label != NULL) && (dst != NULL));
+	lablen = strlen(label);
+	total = (size_t)view->pfslen + 1 + lablen;
+	if (view->pfslen == 0 || total >= dstlen) {
+		return(-1);
+	}
+	memcpy(dst, view->spec + view->pfsoff, view->pfslen);
+	dst[view->pfslen] = BESEP;
+	memcpy(dst + view->pfslen + 1, label, lablen + 1);
+	return((int)total);
+}
+
+/*
+ * Validate a user supplied label before anything is named after it
+ */
+int
+checklabel(const char *label) {
+	size_t len;
+
+	assert(label != NULL);
+	if ((len = strlen(label)) == 0) {
+		return(LABEL_EMPTY);
+	}
+	if (strcspn(label, LABEL_FORBIDDEN) != len) {
+		return(LABEL_BADCHAR);
+	}
+	/* the shortest possible snapshot name is a single character PFS */
+	if (len + 2 > NAME_MAX) {
+		return(LABEL_TOOLONG);
+	}
+	return(LABEL_OK);
+}
+
+const char *
+labelerr(int code) {
+	switch (code) {
+		case LABEL_OK:
+			return("valid");
+		case LABEL_EMPTY:
+			return("label is empty");
+		case LABEL_BADCHAR:
+			return("label contains one of the reserved characters \"/ @ - :\" or whitespace");
+		case LABEL_TOOLONG:
+			return("label is too long");
+		default:
+			return("unknown error");
+	}
+}
+
+/*
+ * Build "<prefix>.<timestamp>" as described in design.txt
+ * returns the length written, or -1 if it would not fit
+ */
+int
+stamplabel(const char *prefix, time_t when, char *dst, size_t dstlen) {
+	char stamp[TMAX];
+	struct tm utc;
+	int len;
+
+	assert((prefix != NULL) && (dst != NULL));
+	if (gmtime_r(&when, &utc) == NULL || strftime(stamp, sizeof(stamp), BETIME_FMT, &utc) == 0) {
+		return(-1);
+	}
+	if ((len = snprintf(dst, dstlen, "%s%c%s", prefix, TSEP, stamp)) < 0 || (size_t)len >= dstlen) {
+		return(-1);
+	}
+	return(len);
+}
+
+/*
+ * Recover the creation time from a label built by stamplabel()
+ * returns seconds since the epoch, or -1 if the label carries no timestamp
+ */
+int64_t
+labeltime(const char *label) {
+	size_t len;
+
+	assert(label != NULL);
+	/* the suffix is fixed width, so there's no need to search for it */
+	if ((len = strlen(label)) < TMAX || label[len - TMAX] != TSEP) {
+		return(-1);
+	}
+	return(parsebetime(label + len - TMAX + 1));
+}
+
+/*
+ * Parse a time given as a full BETIME_FMT stamp, a bare "%Y.%m.%d" date, 
+ * or "@<seconds>" since the epoch, interpreted as UTC
+ * returns seconds since the epoch, or -1 if the string is none of those
+ */
+int64_t
+parsebetime(const char *str) {
+	const char *end;
+	char *nend;
+	long long secs;
+	struct tm utc;
+
+	assert(str != NULL);
+	if (*str == '@') {
+		secs = strtoll(str + 1, &nend, 10);
+		return((nend != str + 1 && *nend == 0 && secs >= 0) ? (int64_t)secs : -1);
+	}
+	memset(&utc, 0, sizeof(utc));
+	if (((end = strptime(str, BETIME_FMT, &utc)) == NULL || *end != 0)) {
+		memset(&utc, 0, sizeof(utc));
+		if ((end = strptime(str, "%Y.%m.%d", &utc)) == NULL || *end != 0) {
+			return(-1);
+		}
+	}
+	return((int64_t)timegm(&utc));
+}
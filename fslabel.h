@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Boot environment labels, a fstab spec of the form "device@pfs:label" is parsed
+ * once into offsets into the original string, and snapshot names are formatted
+ * straight into their destination buffer without intermediate copies.
+ */
+
+#define DFBEADM_FSLABEL_H
+/* 
+ * Deliberately doesn't include dfbeadm.h, so labelbench builds without the
+ * HAMMER2 headers. dfbeadm.h picks these up from here instead.
+ */
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+
+#define PFSDELIM '@'
+#define BESEP ':'
+#define TMAX 18
+/* Timestamp suffix for generated labels, TMAX bytes including the NUL, always UTC */
+#define BETIME_FMT "%Y.%m.%d.%H%M%S"
+#define TSEP '.'
+
+/* DragonFly's, for building labelbench where sys/mount.h has none */
+#ifndef MNAMELEN
+#define MNAMELEN 80
+#endif
+
+/* Characters design.txt reserves, plus our own separator and the fstab field separators */
+#define LABEL_FORBIDDEN "/@-: \t\n"
+
+/* return codes for checklabel() */
+#define LABEL_OK 0
+#define LABEL_EMPTY 1
+#define LABEL_BADCHAR 2
+#define LABEL_TOOLONG 3
+
+/* a parsed fstab spec, the offsets point into spec which is not owned */
+struct label_view {
+	const char *spec;
+	uint16_t devoff, devlen; /* everything up to PFSDELIM */
+	uint16_t pfsoff, pfslen; /* the PFS name proper */
+	uint16_t beoff, belen; /* the boot environment label after BESEP, belen is 0 without one */
+};
+
+typedef struct label_view labelview;
+
+int parselabel(const char *spec, labelview *view);
+int fmtsnapname(const labelview *view, const char *label, char *dst, size_t dstlen);
+int checklabel(const char *label);
+const char *labelerr(int code);
+int stamplabel(const char *prefix, time_t when, char *dst, size_t dstlen);
+int64_t labeltime(const char *label);
+int64_t parsebetime(const char *str);
@@ -31,6 +31,8 @@
  * DAMAGE.
  */
 
+#include <sys/param.h>
+#include <sys/mount.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -43,10 +45,12 @@
 #ifndef DFBEADM_DF_LIST_H
 #include "fslist.h"
 #endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
 
 extern char **environ;
 extern char *__progname;
-extern bool dbg;
 
 /*
  * list the available boot environments
@@ -56,16 +60,18 @@ extern bool dbg;
 int
 list(void) { 
 	int rootfd, found;
+	const char *dev;
+	struct statfs rootfs;
 	struct hammer2_ioc_pfs h2be;
 
 	found = rootfd = 0;
 
 	/* Should not be necessary with envtest() */
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering to scan possible boot environments on /\n",__progname,__FILE__,__LINE__,__func__);
-	}
+	DBGTRACE("Entering to scan possible boot environments on /");
 	assert(geteuid() == 0);
-	if ((rootfd = open("/", O_RDONLY|O_NONBLOCK)) < 0) { 
+	/* a deadline is kept per device, not per mountpoint */
+	dev = (statfs("/", &rootfs) == 0) ? rootfs.f_mntfromname : "/";
+	if ((rootfd = h2open("/", O_RDONLY|O_NONBLOCK, dev)) < 0) { 
 		fprintf(stderr, "%s [%s:%u] %s: Unable to open \"/\"!\n%s\n", __progname,__FILE__,__LINE__,__func__,strerror(errno));
 		return(-3);
 	}
@@ -76,7 +82,7 @@ list(void) {
 	 * than one PFS on the root partition
 	 */
 	for (; h2be.name_key != (hammer2_key_t)-1; h2be.name_key = h2be.name_next) { 
-		if (ioctl(rootfd, HAMMER2IOC_PFS_GET, &h2be) < 0) {
+		if (h2ioctl(rootfd, HAMMER2IOC_PFS_GET, &h2be, dev) < 0) {
 			fprintf(stderr, "Unable to get any pfs data from /, is it a HAMMER2 FS?\n");
 			return(-3);
 		}
@@ -90,8 +96,6 @@ list(void) {
 	/* Enforce return code of 0 */
 	found = (found != 0) ? found ^ found : found;
 	close(rootfd);
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,found);
-	}
+	DBGTRACE("Returning %d to caller", found);
 	return(found);
 }
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSLOCK_H
+#include "fslock.h"
+#endif
+
+extern char *__progname;
+
+static long holder(void);
+
+static int lockfd = -1;
+static bool lockex;
+
+/*
+ * Take the lock, shared or exclusive, retrying with a growing backoff until
+ * LOCK_WAIT seconds have passed. The exclusive holder leaves its pid in the
+ * lock file so whoever is kept waiting can name it.
+ * returns LOCK_HELD, LOCK_TIMEOUT if someone else kept it, or LOCK_ERROR
+ */
+int
+belock(bool exclusive) {
+	int naps;
+	long pid;
+	char pidstr[24];
+	struct timespec start, now, nap;
+
+	DBGTRACE("Entering with exclusive = %d", exclusive);
+	if ((lockfd = open(DFBEADM_LOCK, O_RDWR|O_CREAT|O_CLOEXEC, 0644)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s)\n",__progname,__FILE__,__LINE__,__func__,DFBEADM_LOCK,strerror(errno));
+		return(LOCK_ERROR);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	nap.tv_sec = 0;
+	nap.tv_nsec = LOCK_NAP_MIN * 1000000L;
+	for (naps = 0; flock(lockfd, ((exclusive) ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0; naps++) {
+		if (errno != EWOULDBLOCK && errno != EINTR) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to lock %s (%s)\n",__progname,__FILE__,__LINE__,__func__,DFBEADM_LOCK,strerror(errno));
+			close(lockfd);
+			lockfd = -1;
+			return(LOCK_ERROR);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - start.tv_sec >= LOCK_WAIT) {
+			if ((pid = holder()) > 0) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: %s (pid %ld) is still changing boot environments, gave up after %ds\n",
+						__progname,__FILE__,__LINE__,__func__,__progname,pid,LOCK_WAIT);
+			} else {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Other %s runs are still reading the record database, gave up after %ds\n",
+						__progname,__FILE__,__LINE__,__func__,__progname,LOCK_WAIT);
+			}
+			close(lockfd);
+			lockfd = -1;
+			return(LOCK_TIMEOUT);
+		}
+		if (naps == 0) {
+			fprintf(stderr,"INF: %s [%s:%u] %s: Waiting up to %ds for %s to be released\n",__progname,__FILE__,__LINE__,__func__,LOCK_WAIT,DFBEADM_LOCK);
+		}
+		nanosleep(&nap, NULL);
+		if ((nap.tv_nsec *= 2) > LOCK_NAP_MAX * 1000000L) {
+			nap.tv_nsec = LOCK_NAP_MAX * 1000000L;
+		}
+	}
+	if ((lockex = exclusive)) {
+		snprintf(pidstr, sizeof(pidstr), "%ld\n", (long)getpid());
+		if (ftruncate(lockfd, 0) != 0 || pwrite(lockfd, pidstr, strlen(pidstr), 0) < 0) {
+			fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to record our pid in %s (%s)\n",__progname,__FILE__,__LINE__,__func__,DFBEADM_LOCK,strerror(errno));
+		}
+	}
+	DBGTRACE("Locked %s after %d naps", DFBEADM_LOCK, naps);
+	return(LOCK_HELD);
+}
+
+/*
+ * Drop the lock, clearing the pid first so a stale one is never reported
+ */
+void
+beunlock(void) {
+	if (lockfd < 0) {
+		return;
+	}
+	if (lockex && ftruncate(lockfd, 0) != 0) {
+		DBGTRACE("Unable to clear %s (%s)", DFBEADM_LOCK, strerror(errno));
+	}
+	flock(lockfd, LOCK_UN);
+	close(lockfd);
+	lockfd = -1;
+	lockex = false;
+}
+
+/*
+ * The pid an exclusive holder left behind, 0 if the lock is only shared
+ */
+static long
+holder(void) {
+	char pidstr[24];
+	ssize_t len;
+
+	if ((len = pread(lockfd, pidstr, sizeof(pidstr) - 1, 0)) <= 0) {
+		return(0);
+	}
+	pidstr[len] = 0;
+	return(strtol(pidstr, NULL, 10));
+}
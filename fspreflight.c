@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSPREFLIGHT_H
+#include "fspreflight.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+
+extern char *__progname;
+
+/* a PFS PFS_GET reported */
+struct known_pfs {
+	char device[MNAMELEN];
+	char name[NAME_MAX + 1];
+};
+
+/* everything the checks are answered from, read once */
+struct pfs_inventory {
+	struct statfs *vfs;
+	int nvfs;
+	struct known_pfs *pfs; /* sorted by device and name */
+	int npfs;
+	char (*devices)[MNAMELEN]; /* devices whose PFSes were all listed */
+	int ndevs;
+};
+
+static int scan(struct pfs_inventory *inv);
+static void release(struct pfs_inventory *inv);
+static bool reachable(const struct pfs_inventory *inv, const char *device, size_t devlen);
+static bool haspfs(const struct pfs_inventory *inv, const char *device, size_t devlen, const char *name, size_t namelen);
+static bool mountedh2(const struct pfs_inventory *inv, const char *mountpoint);
+static int checkspec(const struct pfs_inventory *inv, const char *spec, size_t speclen, const char *what);
+static int cmppfs(const void *a, const void *b);
+
+/*
+ * Check a boot environment marked by marktargets() before its fstab is
+ * installed or any snapshot is taken: every HAMMER2 entry has to be
+ * reachable and name an existing PFS, and every snapshot to be taken
+ * needs a free name that still fits a mount spec.
+ * returns the number of problems found, 0 if the environment can be created
+ */
+int
+preflight_create(const bedata *fs, int fscount, const char *label) {
+	int i, j, problems;
+	size_t devlen, namelen;
+	const char *spec;
+	struct pfs_inventory inv;
+
+	assert((fs != NULL) && (label != NULL));
+	DBGTRACE("Entering with fs = %p, fscount = %d, label = %s", (void *)fs, fscount, label);
+	if ((problems = scan(&inv)) != 0) {
+		return(problems);
+	}
+	for (i = 0; i < fscount; i++) {
+		if (strncmp(fs[i].fstab.fs_vfstype, "hammer2", MFSNAMELEN) != 0) {
+			continue;
+		}
+		spec = fs[i].fstab.fs_spec;
+		devlen = strcspn(spec, "@");
+		if (!fs[i].snap) {
+			/* marktargets() had to give up on a mounted PFS, most likely the label didn't fit */
+			if (mountedh2(&inv, fs[i].fstab.fs_file)) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: %s could not be prepared for %s\n",__progname,__FILE__,__LINE__,__func__,fs[i].fstab.fs_file,label);
+				problems++;
+			} else if (strstr(fs[i].fstab.fs_mntops, "noauto") == NULL) {
+				problems += checkspec(&inv, spec, strlen(spec), fs[i].fstab.fs_file);
+			}
+			continue;
+		}
+		if (checkspec(&inv, spec, strlen(spec), fs[i].fstab.fs_file) != 0) {
+			problems++;
+			continue;
+		}
+		if (spec[devlen] == 0) {
+			continue;
+		}
+		namelen = strlen(fs[i].snapshot.name);
+		if (fs[i].mountfd <= 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %s could not be opened\n",__progname,__FILE__,__LINE__,__func__,fs[i].fstab.fs_file);
+			problems++;
+		}
+		/* the new fstab mounts it as device@pfs:label */
+		if (namelen == 0 || devlen + 1 + namelen >= MNAMELEN) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %.*s%c%s is too long to be mounted\n",__progname,__FILE__,__LINE__,__func__,(int)devlen,spec,PFSDELIM,fs[i].snapshot.name);
+			problems++;
+		} else if (haspfs(&inv, spec, devlen, fs[i].snapshot.name, namelen)) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %.*s%c%s already exists\n",__progname,__FILE__,__LINE__,__func__,(int)devlen,spec,PFSDELIM,fs[i].snapshot.name);
+			problems++;
+		}
+		for (j = 0; j < i; j++) {
+			if (fs[j].snap && strcspn(fs[j].fstab.fs_spec, "@") == devlen && strncmp(fs[j].fstab.fs_spec, spec, devlen) == 0 &&
+			    strcmp(fs[j].snapshot.name, fs[i].snapshot.name) == 0) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: %s and %s would both be snapshotted as %s\n",__progname,__FILE__,__LINE__,__func__,fs[j].fstab.fs_file,fs[i].fstab.fs_file,fs[i].snapshot.name);
+				problems++;
+				break;
+			}
+		}
+	}
+	release(&inv);
+	DBGTRACE("Returning %d to caller", problems);
+	return(problems);
+}
+
+/*
+ * Check a stored fstab, and the loader.conf root spec if there is one,
+ * before they're installed: every HAMMER2 spec mounted at boot has to name
+ * an existing PFS on a reachable device.
+ * returns the number of problems found, 0 if the environment can be activated
+ */
+int
+preflight_activate(const char *fstab, size_t fstablen, const char *rootspec) {
+	int problems;
+	size_t speclen, filelen, typelen;
+	const char *line, *end, *file, *type, *opts;
+	char optbuf[MNAMELEN];
+	struct pfs_inventory inv;
+
+	assert(fstab != NULL);
+	DBGTRACE("Entering with fstablen = %zu, rootspec = %s", fstablen, (rootspec != NULL) ? rootspec : "(none)");
+	if ((problems = scan(&inv)) != 0) {
+		return(problems);
+	}
+	for (line = fstab; line < fstab + fstablen; line = end + 1) {
+		if ((end = memchr(line, '\n', (size_t)(fstab + fstablen - line))) == NULL) {
+			end = fstab + fstablen;
+		}
+		line += strspn(line, " \t");
+		if (line >= end || *line == '#') {
+			continue;
+		}
+		/* fs_spec, fs_file and fs_vfstype are the first three fields */
+		speclen = strcspn(line, " \t\n");
+		file = line + speclen + strspn(line + speclen, " \t");
+		filelen = strcspn(file, " \t\n");
+		type = file + filelen + strspn(file + filelen, " \t");
+		typelen = strcspn(type, " \t\n");
+		if (type >= end || typelen != strlen("hammer2") || strncmp(type, "hammer2", typelen) != 0) {
+			continue;
+		}
+		/* mount(8) never touches noauto entries at boot, so they may well be offline */
+		opts = type + typelen + strspn(type + typelen, " \t");
+		snprintf(optbuf, sizeof(optbuf), "%.*s", (int)strcspn(opts, " \t\n"), opts);
+		if (strstr(optbuf, "noauto") != NULL) {
+			continue;
+		}
+		problems += checkspec(&inv, line, speclen, file);
+	}
+	if (rootspec != NULL) {
+		problems += checkspec(&inv, rootspec, strlen(rootspec), "/");
+	}
+	release(&inv);
+	DBGTRACE("Returning %d to caller", problems);
+	return(problems);
+}
+
+/*
+ * Check that a device@pfs spec names an existing PFS on a reachable device,
+ * specs without a PFS are left to mount(8)
+ * returns 1 and complains if it doesn't, 0 otherwise
+ */
+static int
+checkspec(const struct pfs_inventory *inv, const char *spec, size_t speclen, const char *what) {
+	size_t devlen, whatlen;
+
+	devlen = strcspn(spec, "@");
+	whatlen = strcspn(what, " \t\n");
+	if (devlen >= speclen) {
+		return(0);
+	}
+	if (!reachable(inv, spec, devlen)) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %.*s (%.*s) is on %.*s, which has no reachable mounts\n",__progname,__FILE__,__LINE__,__func__,
+				(int)speclen,spec,(int)whatlen,what,(int)devlen,spec);
+		return(1);
+	}
+	if (!haspfs(inv, spec, devlen, spec + devlen + 1, speclen - devlen - 1)) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %.*s (%.*s) names a PFS that doesn't exist\n",__progname,__FILE__,__LINE__,__func__,
+				(int)speclen,spec,(int)whatlen,what);
+		return(1);
+	}
+	return(0);
+}
+
+/*
+ * List the PFSes of every mounted HAMMER2 device, asking one mount per device
+ * returns 0 on success, nonzero if the mount table couldn't be read
+ */
+static int
+scan(struct pfs_inventory *inv) {
+	int i, j, fd, alloc;
+	size_t devlen;
+	bool complete;
+	struct known_pfs *grown;
+	hammer2_ioc_pfs_t pfs;
+
+	memset(inv, 0, sizeof(struct pfs_inventory));
+	alloc = 0;
+	if ((inv->nvfs = vfsstat(NULL, 0, MNT_NOWAIT)) <= 0 ||
+	    (inv->vfs = calloc((size_t)inv->nvfs, sizeof(struct statfs))) == NULL ||
+	    (inv->nvfs = vfsstat(inv->vfs, (long)((size_t)inv->nvfs * sizeof(struct statfs)), MNT_NOWAIT)) <= 0 ||
+	    (inv->devices = calloc((size_t)inv->nvfs, MNAMELEN)) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the mount table (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+		release(inv);
+		return(1);
+	}
+	for (i = 0; i < inv->nvfs; i++) {
+		if (strncmp(inv->vfs[i].f_fstypename, "hammer2", MFSNAMELEN) != 0) {
+			continue;
+		}
+		devlen = strcspn(inv->vfs[i].f_mntfromname, "@");
+		if (reachable(inv, inv->vfs[i].f_mntfromname, devlen)) {
+			continue;
+		}
+		/* a device whose first mount can't be opened gets another chance through its next one */
+		if ((fd = h2open(inv->vfs[i].f_mntonname, O_RDONLY, inv->vfs[i].f_mntfromname)) < 0) {
+			DBGTRACE("Unable to open %s (%s)", inv->vfs[i].f_mntonname, strerror(errno));
+			continue;
+		}
+		complete = true;
+		j = inv->npfs;
+		memset(&pfs, 0, sizeof(pfs));
+		for (; pfs.name_key != (hammer2_key_t)-1; pfs.name_key = pfs.name_next) {
+			if (h2ioctl(fd, HAMMER2IOC_PFS_GET, &pfs, inv->vfs[i].f_mntfromname) < 0) {
+				DBGTRACE("Unable to list the PFSes of %s (%s)", inv->vfs[i].f_mntfromname, strerror(errno));
+				complete = false;
+				break;
+			}
+			if (inv->npfs == alloc) {
+				alloc = (alloc == 0) ? 256 : alloc * 2;
+				if ((grown = reallocarray(inv->pfs, (size_t)alloc, sizeof(struct known_pfs))) == NULL) {
+					close(fd);
+					release(inv);
+					return(2);
+				}
+				inv->pfs = grown;
+			}
+			snprintf(inv->pfs[inv->npfs].device, MNAMELEN, "%.*s", (int)devlen, inv->vfs[i].f_mntfromname);
+			strlcpy(inv->pfs[inv->npfs].name, pfs.name, NAME_MAX + 1);
+			inv->npfs++;
+		}
+		close(fd);
+		/* a partial listing can't prove a name is free, so the device counts as unreachable */
+		if (complete) {
+			snprintf(inv->devices[inv->ndevs++], MNAMELEN, "%.*s", (int)devlen, inv->vfs[i].f_mntfromname);
+		} else {
+			inv->npfs = j;
+		}
+	}
+	qsort(inv->pfs, (size_t)inv->npfs, sizeof(struct known_pfs), cmppfs);
+	DBGTRACE("Found %d PFSes on %d devices", inv->npfs, inv->ndevs);
+	return(0);
+}
+
+static void
+release(struct pfs_inventory *inv) {
+	free(inv->vfs);
+	free(inv->pfs);
+	free(inv->devices);
+	memset(inv, 0, sizeof(struct pfs_inventory));
+}
+
+static bool
+reachable(const struct pfs_inventory *inv, const char *device, size_t devlen) {
+	int i;
+
+	for (i = 0; i < inv->ndevs; i++) {
+		if (strlen(inv->devices[i]) == devlen && strncmp(inv->devices[i], device, devlen) == 0) {
+			return(true);
+		}
+	}
+	return(false);
+}
+
+/*
+ * Binary search of the inventory for device@name, neither needs to be NUL terminated
+ */
+static bool
+haspfs(const struct pfs_inventory *inv, const char *device, size_t devlen, const char *name, size_t namelen) {
+	int lo, hi, mid, cmp;
+	struct known_pfs key;
+
+	if (devlen >= MNAMELEN || namelen > NAME_MAX) {
+		return(false);
+	}
+	memset(&key, 0, sizeof(key));
+	memcpy(key.device, device, devlen);
+	memcpy(key.name, name, namelen);
+	for (lo = 0, hi = inv->npfs - 1; lo <= hi;) {
+		mid = lo + (hi - lo) / 2;
+		if ((cmp = cmppfs(&key, &inv->pfs[mid])) == 0) {
+			return(true);
+		}
+		if (cmp < 0) {
+			hi = mid - 1;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return(false);
+}
+
+static bool
+mountedh2(const struct pfs_inventory *inv, const char *mountpoint) {
+	int i;
+
+	for (i = 0; i < inv->nvfs; i++) {
+		if (strncmp(inv->vfs[i].f_fstypename, "hammer2", MFSNAMELEN) == 0 && strcmp(inv->vfs[i].f_mntonname, mountpoint) == 0) {
+			return(true);
+		}
+	}
+	return(false);
+}
+
+static int
+cmppfs(const void *a, const void *b) {
+	int cmp;
+	const struct known_pfs *pa, *pb;
+
+	pa = a; pb = b;
+	if ((cmp = strcmp(pa->device, pb->device)) == 0) {
+		cmp = strcmp(pa->name, pb->name);
+	}
+	return(cmp);
+}
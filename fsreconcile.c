@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mount.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSRECONCILE_H
+#include "fsreconcile.h"
+#endif
+#ifndef DFBEADM_FSCOLLECT_H
+#include "fscollect.h"
+#endif
+#ifndef DFBEADM_H2TEST_H
+#include "fstest.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+/* a snapshot PFS_GET reported, named <pfs>:<label> */
+struct disk_snap {
+	char device[MNAMELEN];
+	char name[NAME_MAX + 1];
+	const char *label; /* points into name */
+	bool tracked; /* an h2pfs row names it */
+};
+
+/* the h2pfs rows of one environment, after the first merge */
+struct env_tally {
+	char *belabel;
+	int present;
+	int missing;
+	int unknown; /* rows on devices that weren't inventoried, neither present nor missing */
+};
+
+/* what the second merge decided, applied once both reads are finished */
+struct recon_action {
+	char kind;
+	char belabel[NAME_MAX + 1];
+	struct disk_snap **untracked; /* its snapshots without an h2pfs row */
+	int nuntracked;
+	int present;
+	int total;
+};
+
+static int inventory(struct disk_snap **snaps, int *count);
+static int tallyrows(sqlite3 *recdb, struct disk_snap *snaps, int nsnaps, struct env_tally **tally, int *ntally);
+static int decide(sqlite3 *recdb, struct env_tally *tally, int ntally, struct disk_snap **orphans, int norphans, struct recon_action **acts, int *nacts);
+static int apply(sqlite3 *recdb, struct recon_action *act);
+static int adopt(sqlite3 *recdb, struct recon_action *act);
+static int snapkey(const struct disk_snap *snap, const char *device, const char *name);
+static int cmpsnaps(const void *a, const void *b);
+static int cmporphans(const void *a, const void *b);
+static int cmptally(const void *a, const void *b);
+
+/* every device inventory() listed, rows naming any other can't be judged */
+static char (*seendevs)[MNAMELEN];
+static int nseendevs;
+/* the live fstab, stripped of its labels, shared by every adoption */
+static bedata *livefs;
+static int nlivefs;
+/* prepared once, reset after every row */
+static sqlite3_stmt *extantq;
+static sqlite3_stmt *fillq;
+
+/*
+ * Mark environments whose snapshots are gone as non-extant, and ones whose
+ * snapshots came back as extant again. Untracked snapshots of a recorded
+ * environment are added to it, and untracked snapshots covering every
+ * HAMMER2 filesystem in the fstab are recorded as a new environment.
+ * Environments missing only some of their snapshots are reported, not touched.
+ * Everything happens in one transaction, rolled back with -n.
+ * returns 0 on success
+ */
+int
+reconcile(void) {
+	int retc, nsnaps, ntally, norphans, nacts, i, changed;
+	struct disk_snap *snaps, **orphans;
+	struct env_tally *tally;
+	struct recon_action *acts;
+	sqlite3 *recdb;
+
+	retc = nsnaps = ntally = norphans = nacts = changed = 0;
+	snaps = NULL; orphans = NULL; tally = NULL; acts = NULL; recdb = NULL;
+	DBGTRACE("Entering");
+	if ((retc = inventory(&snaps, &nsnaps)) != 0 || connect_bedb(&recdb) != SQLITE_OK) {
+		free(snaps);
+		free(seendevs);
+		seendevs = NULL; nseendevs = 0;
+		return((retc != 0) ? retc : -1);
+	}
+	/* both reads and every write see the same database */
+	sqlite3_exec(recdb, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+	if ((retc = tallyrows(recdb, snaps, nsnaps, &tally, &ntally)) != 0) {
+		goto done;
+	}
+	if ((orphans = calloc((size_t)nsnaps + 1, sizeof(struct disk_snap *))) == NULL) {
+		retc = -2;
+		goto done;
+	}
+	for (i = 0; i < nsnaps; i++) {
+		if (!snaps[i].tracked) {
+			orphans[norphans++] = &snaps[i];
+		}
+	}
+	qsort(orphans, (size_t)norphans, sizeof(struct disk_snap *), cmporphans);
+	if ((retc = decide(recdb, tally, ntally, orphans, norphans, &acts, &nacts)) != 0) {
+		goto done;
+	}
+	if (sqlite3_prepare_v2(recdb, "UPDATE " DFBEADM_BEINFO_TABLE " SET extant = ?1 WHERE belabel = ?2;", -1, &extantq, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(recdb, "INSERT OR IGNORE INTO " DFBEADM_PFS_TABLE " (belabel,device,pfs,snapshot,mountpoint,tid,ctime,datasize) "
+	                       "VALUES (?1,?2,?3,?4,'',0,0,0);", -1, &fillq, NULL) != SQLITE_OK) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to prepare updates (%s)\n",__progname,__FILE__,__LINE__,__func__,sqlite3_errmsg(recdb));
+		retc = -1;
+		goto done;
+	}
+	for (i = 0; i < nacts; i++) {
+		if (apply(recdb, &acts[i]) != 0) {
+			retc = 1;
+		}
+		changed += (acts[i].kind != RECON_HALF) ? 1 : 0;
+	}
+	fprintf(stdout,"INF: %s [%s:%u] %s: %d snapshots on disk, %d untracked, %d environments changed%s\n",
+			__progname,__FILE__,__LINE__,__func__,nsnaps,norphans,changed,(noop) ? " (dry run)" : "");
+
+done:
+	sqlite3_finalize(extantq);
+	sqlite3_finalize(fillq);
+	extantq = NULL; fillq = NULL;
+	sqlite3_exec(recdb, (retc == 0 && !noop) ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+	sqlite3_close(recdb);
+	for (i = 0; i < ntally; i++) {
+		free(tally[i].belabel);
+	}
+	free(tally);
+	free(acts);
+	free(orphans);
+	free(snaps);
+	freefs(livefs, nlivefs);
+	livefs = NULL; nlivefs = 0;
+	free(seendevs);
+	seendevs = NULL; nseendevs = 0;
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * List the snapshots on every mounted HAMMER2 device, sorted by device and name.
+ * A device that can't be listed completely fails the whole inventory, its
+ * snapshots would otherwise look deleted. The devices listed are kept in seendevs.
+ * returns 0 on success
+ */
+static int
+inventory(struct disk_snap **snaps, int *count) {
+	int i, j, nvfs, fd, alloc;
+	size_t devlen;
+	struct statfs *vfs;
+	struct disk_snap *grown;
+	hammer2_ioc_pfs_t pfs;
+
+	*snaps = NULL;
+	*count = alloc = 0;
+	if ((nvfs = vfsstat(NULL, 0, MNT_NOWAIT)) <= 0 ||
+	    (vfs = calloc((size_t)nvfs, sizeof(struct statfs))) == NULL ||
+	    (nvfs = vfsstat(vfs, (long)((size_t)nvfs * sizeof(struct statfs)), MNT_NOWAIT)) <= 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the mount table (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+		return(-1);
+	}
+	if ((seendevs = calloc((size_t)nvfs, MNAMELEN)) == NULL) {
+		free(vfs);
+		return(-2);
+	}
+	for (i = 0; i < nvfs; i++) {
+		if (strncmp(vfs[i].f_fstypename, "hammer2", MFSNAMELEN) != 0) {
+			continue;
+		}
+		/* any mount of a device lists all of its PFSes, so only the first one is asked */
+		devlen = strcspn(vfs[i].f_mntfromname, "@");
+		for (j = 0; j < i; j++) {
+			if (strncmp(vfs[j].f_fstypename, "hammer2", MFSNAMELEN) == 0 &&
+			    strcspn(vfs[j].f_mntfromname, "@") == devlen &&
+			    strncmp(vfs[j].f_mntfromname, vfs[i].f_mntfromname, devlen) == 0) {
+				break;
+			}
+		}
+		if (j < i) {
+			continue;
+		}
+		if ((fd = h2open(vfs[i].f_mntonname, O_RDONLY, vfs[i].f_mntfromname)) < 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s), nothing will be reconciled\n",__progname,__FILE__,__LINE__,__func__,vfs[i].f_mntonname,strerror(errno));
+			free(vfs);
+			free(*snaps);
+			*snaps = NULL;
+			return(-1);
+		}
+		snprintf(seendevs[nseendevs++], MNAMELEN, "%.*s", (int)devlen, vfs[i].f_mntfromname);
+		memset(&pfs, 0, sizeof(pfs));
+		for (; pfs.name_key != (hammer2_key_t)-1; pfs.name_key = pfs.name_next) {
+			if (h2ioctl(fd, HAMMER2IOC_PFS_GET, &pfs, vfs[i].f_mntfromname) < 0) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to list the PFSes of %s (%s), nothing will be reconciled\n",__progname,__FILE__,__LINE__,__func__,vfs[i].f_mntfromname,strerror(errno));
+				close(fd);
+				free(vfs);
+				free(*snaps);
+				*snaps = NULL;
+				return(-1);
+			}
+			if (strchr(pfs.name, BESEP) == NULL) {
+				continue;
+			}
+			if (*count == alloc) {
+				alloc = (alloc == 0) ? 256 : alloc * 2;
+				if ((grown = reallocarray(*snaps, (size_t)alloc, sizeof(struct disk_snap))) == NULL) {
+					close(fd);
+					free(vfs);
+					free(*snaps);
+					*snaps = NULL;
+					return(-2);
+				}
+				*snaps = grown;
+			}
+			snprintf((*snaps)[*count].device, MNAMELEN, "%.*s", (int)devlen, vfs[i].f_mntfromname);
+			strlcpy((*snaps)[*count].name, pfs.name, NAME_MAX + 1);
+			(*snaps)[*count].tracked = false;
+			(*count)++;
+		}
+		close(fd);
+	}
+	free(vfs);
+	qsort(*snaps, (size_t)*count, sizeof(struct disk_snap), cmpsnaps);
+	/* only now that the array won't move */
+	for (i = 0; i < *count; i++) {
+		(*snaps)[i].label = strchr((*snaps)[i].name, BESEP) + 1;
+	}
+	DBGTRACE("Found %d snapshots on disk", *count);
+	return(0);
+}
+
+/*
+ * First merge: h2pfs rows in (device,snapshot) order against the disk inventory,
+ * marking which snapshots are tracked and counting each environment's rows
+ * returns 0 on success
+ */
+static int
+tallyrows(sqlite3 *recdb, struct disk_snap *snaps, int nsnaps, struct env_tally **tally, int *ntally) {
+	int retc, state, i, d, cmp, nrows, alloc;
+	struct env_tally *rows, *grown;
+	sqlite3_stmt *rowq;
+	const char *device, *snapshot;
+
+	rows = NULL; rowq = NULL;
+	retc = nrows = alloc = i = 0;
+	/* walks pfs_inventory, the table itself is never touched */
+	if (sqlite3_prepare_v2(recdb, "SELECT device,snapshot,belabel FROM " DFBEADM_PFS_TABLE " ORDER BY device,snapshot;", -1, &rowq, NULL) != SQLITE_OK) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the recorded snapshots (%s)\n",__progname,__FILE__,__LINE__,__func__,sqlite3_errmsg(recdb));
+		return(-1);
+	}
+	for (state = sqlite3_step(rowq); state == SQLITE_ROW; state = sqlite3_step(rowq)) {
+		device = (const char *)sqlite3_column_text(rowq, 0);
+		snapshot = (const char *)sqlite3_column_text(rowq, 1);
+		/* snapshots nothing recorded stay untracked */
+		for (cmp = 1; i < nsnaps && (cmp = snapkey(&snaps[i], device, snapshot)) < 0; i++);
+		if (nrows == alloc) {
+			alloc = (alloc == 0) ? 256 : alloc * 2;
+			if ((grown = reallocarray(rows, (size_t)alloc, sizeof(struct env_tally))) == NULL) {
+				retc = -2;
+				break;
+			}
+			rows = grown;
+		}
+		if ((rows[nrows].belabel = strdup((const char *)sqlite3_column_text(rowq, 2))) == NULL) {
+			retc = -2;
+			break;
+		}
+		rows[nrows].present = (i < nsnaps && cmp == 0) ? 1 : 0;
+		/* a device that isn't mounted wasn't looked at, its snapshots aren't missing */
+		for (d = 0; !rows[nrows].present && d < nseendevs && strcmp(seendevs[d], device) != 0; d++);
+		rows[nrows].unknown = (!rows[nrows].present && d == nseendevs) ? 1 : 0;
+		rows[nrows].missing = 1 - rows[nrows].present - rows[nrows].unknown;
+		if (rows[nrows++].present) {
+			snaps[i++].tracked = true;
+		}
+	}
+	if (retc == 0 && state != SQLITE_DONE) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the recorded snapshots (%s)\n",__progname,__FILE__,__LINE__,__func__,sqlite3_errmsg(recdb));
+		retc = -1;
+	}
+	sqlite3_finalize(rowq);
+	/* fold the rows into one tally per environment */
+	qsort(rows, (size_t)nrows, sizeof(struct env_tally), cmptally);
+	*ntally = 0;
+	for (i = 0; i < nrows; i++) {
+		if (*ntally > 0 && strcmp(rows[*ntally - 1].belabel, rows[i].belabel) == 0) {
+			rows[*ntally - 1].present += rows[i].present;
+			rows[*ntally - 1].missing += rows[i].missing;
+			rows[*ntally - 1].unknown += rows[i].unknown;
+			free(rows[i].belabel);
+		} else {
+			rows[(*ntally)++] = rows[i];
+		}
+	}
+	*tally = rows;
+	DBGTRACE("%d recorded snapshots across %d environments", nrows, *ntally);
+	return(retc);
+}
+
+/*
+ * Second merge: environments in label order against the folded tallies and
+ * the untracked snapshots, deciding what happens to each label
+ * returns 0 on success
+ */
+static int
+decide(sqlite3 *recdb, struct env_tally *tally, int ntally, struct disk_snap **orphans, int norphans, struct recon_action **acts, int *nacts) {
+	int retc, state, ti, oi, first, alloc, present, total, unknown;
+	char kind, belabel[NAME_MAX + 1];
+	bool recorded, extant;
+	const char *row, *key;
+	struct env_tally *t;
+	struct recon_action *grown;
+	sqlite3_stmt *envq;
+
+	retc = ti = oi = alloc = *nacts = 0;
+	*acts = NULL; envq = NULL;
+	/* covered by extant_bootenvs, the labels come back already in order */
+	if (sqlite3_prepare_v2(recdb, "SELECT belabel,extant FROM " DFBEADM_BEINFO_TABLE " ORDER BY belabel;", -1, &envq, NULL) != SQLITE_OK) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the recorded environments (%s)\n",__progname,__FILE__,__LINE__,__func__,sqlite3_errmsg(recdb));
+		return(-1);
+	}
+	state = sqlite3_step(envq);
+	for (;;) {
+		/* the smallest label any of the three streams is on */
+		key = row = (state == SQLITE_ROW) ? (const char *)sqlite3_column_text(envq, 0) : NULL;
+		if (ti < ntally && (key == NULL || strcmp(tally[ti].belabel, key) < 0)) {
+			key = tally[ti].belabel;
+		}
+		if (oi < norphans && (key == NULL || strcmp(orphans[oi]->label, key) < 0)) {
+			key = orphans[oi]->label;
+		}
+		if (key == NULL) {
+			break;
+		}
+		strlcpy(belabel, key, sizeof(belabel));
+		recorded = (row != NULL && strcmp(row, belabel) == 0);
+		extant = recorded && sqlite3_column_int(envq, 1) != 0;
+		t = (ti < ntally && strcmp(tally[ti].belabel, belabel) == 0) ? &tally[ti++] : NULL;
+		for (first = oi; oi < norphans && strcmp(orphans[oi]->label, belabel) == 0; oi++);
+		if (recorded) {
+			state = sqlite3_step(envq);
+		}
+
+		present = ((t != NULL) ? t->present : 0) + (oi - first);
+		total = present + ((t != NULL) ? t->missing : 0);
+		unknown = (t != NULL) ? t->unknown : 0;
+		kind = 0;
+		/* only snapshots on inventoried devices count, an unmounted device says nothing about extant */
+		if (recorded) {
+			if (present == 0) {
+				kind = (extant && unknown == 0) ? RECON_GONE : 0;
+			} else if (present < total) {
+				kind = RECON_HALF;
+			} else if (oi > first) {
+				kind = RECON_FILLED;
+			} else if (!extant && unknown == 0) {
+				kind = RECON_BACK;
+			}
+			if (unknown > 0) {
+				fprintf(stdout,"INF: %s [%s:%u] %s: %d snapshots of %s are on devices that aren't mounted, not judging them\n",
+						__progname,__FILE__,__LINE__,__func__,unknown,belabel);
+			}
+		} else if (oi > first) {
+			/* adopt() may still find it incomplete */
+			kind = RECON_ADOPTED;
+		}
+		if (kind == 0) {
+			continue;
+		}
+		if (*nacts == alloc) {
+			alloc = (alloc == 0) ? 64 : alloc * 2;
+			if ((grown = reallocarray(*acts, (size_t)alloc, sizeof(struct recon_action))) == NULL) {
+				retc = -2;
+				break;
+			}
+			*acts = grown;
+		}
+		(*acts)[*nacts].kind = kind;
+		strlcpy((*acts)[*nacts].belabel, belabel, NAME_MAX + 1);
+		(*acts)[*nacts].untracked = orphans + first;
+		(*acts)[*nacts].nuntracked = oi - first;
+		(*acts)[*nacts].present = present;
+		(*acts)[*nacts].total = total;
+		(*nacts)++;
+	}
+	if (retc == 0 && state != SQLITE_DONE && state != SQLITE_ROW) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the recorded environments (%s)\n",__progname,__FILE__,__LINE__,__func__,sqlite3_errmsg(recdb));
+		retc = -1;
+	}
+	sqlite3_finalize(envq);
+	return(retc);
+}
+
+/*
+ * Carry out one decision and report it
+ * returns 0 on success
+ */
+static int
+apply(sqlite3 *recdb, struct recon_action *act) {
+	int retc, i;
+	size_t pfslen;
+
+	retc = 0;
+	switch (act->kind) {
+		case RECON_ADOPTED:
+			retc = adopt(recdb, act);
+			break;
+		case RECON_FILLED:
+			for (i = 0; retc == 0 && i < act->nuntracked; i++) {
+				pfslen = (size_t)(act->untracked[i]->label - act->untracked[i]->name) - 1;
+				sqlite3_bind_text(fillq, 1, act->belabel, -1, SQLITE_STATIC);
+				sqlite3_bind_text(fillq, 2, act->untracked[i]->device, -1, SQLITE_STATIC);
+				sqlite3_bind_text(fillq, 3, act->untracked[i]->name, (int)pfslen, SQLITE_STATIC);
+				sqlite3_bind_text(fillq, 4, act->untracked[i]->name, -1, SQLITE_STATIC);
+				retc = (sqlite3_step(fillq) == SQLITE_DONE) ? 0 : -1;
+				sqlite3_reset(fillq);
+			}
+			/* FALLTHROUGH */
+		case RECON_BACK:
+		case RECON_GONE:
+			if (retc == 0) {
+				sqlite3_bind_int(extantq, 1, (act->kind != RECON_GONE));
+				sqlite3_bind_text(extantq, 2, act->belabel, -1, SQLITE_STATIC);
+				retc = (sqlite3_step(extantq) == SQLITE_DONE) ? 0 : -1;
+				sqlite3_reset(extantq);
+			}
+			if (retc != 0) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to update %s (%s)\n",__progname,__FILE__,__LINE__,__func__,act->belabel,sqlite3_errmsg(recdb));
+			}
+			break;
+		default:
+			break;
+	}
+	if (retc == 0 && act->kind == RECON_HALF) {
+		fprintf(stdout,"%c %s (%d of %d snapshots)\n",act->kind,act->belabel,act->present,act->total);
+	} else if (retc == 0) {
+		fprintf(stdout,"%c %s\n",act->kind,act->belabel);
+	}
+	return(retc);
+}
+
+/*
+ * Record untracked snapshots as a new environment if they cover every
+ * HAMMER2 filesystem the fstab would snapshot, downgrading act to
+ * RECON_HALF when they don't
+ * returns 0 on success
+ */
+static int
+adopt(sqlite3 *recdb, struct recon_action *act) {
+	int i, j, wanted, found;
+	size_t devlen;
+	const char *spec;
+
+	if (livefs == NULL) {
+		if (collectfs(&livefs, &nlivefs) != 0) {
+			return(-1);
+		}
+		/* cut the booted label off once, newlabel() can then name any environment */
+		for (i = 0; i < nlivefs; i++) {
+			livefs[i].snap = ish2(livefs[i].fstab.fs_file, livefs[i].fstab.fs_spec) &&
+			                 (relabel(&livefs[i], act->belabel) == 0 || newlabel(&livefs[i], act->belabel) == 0);
+		}
+	}
+	for (i = wanted = found = 0; i < nlivefs; i++) {
+		if (!livefs[i].snap || newlabel(&livefs[i], act->belabel) != 0) {
+			continue;
+		}
+		wanted++;
+		spec = livefs[i].fstab.fs_spec;
+		devlen = strcspn(spec, "@");
+		for (j = 0; j < act->nuntracked; j++) {
+			if (strncmp(act->untracked[j]->device, spec, devlen) == 0 && act->untracked[j]->device[devlen] == 0 &&
+			    strcmp(act->untracked[j]->name, livefs[i].snapshot.name) == 0) {
+				found++;
+				break;
+			}
+		}
+	}
+	if (wanted == 0 || found < wanted) {
+		act->kind = RECON_HALF;
+		act->present = found;
+		act->total = wanted;
+		return(0);
+	}
+	return(record_bedata(recdb, livefs, nlivefs, act->belabel, false));
+}
+
+static int
+snapkey(const struct disk_snap *snap, const char *device, const char *name) {
+	int cmp;
+
+	return(((cmp = strcmp(snap->device, device)) != 0) ? cmp : strcmp(snap->name, name));
+}
+
+static int
+cmpsnaps(const void *a, const void *b) {
+	const struct disk_snap *rhs = b;
+
+	return(snapkey(a, rhs->device, rhs->name));
+}
+
+static int
+cmporphans(const void *a, const void *b) {
+	const struct disk_snap *lhs = *(struct disk_snap * const *)a;
+	const struct disk_snap *rhs = *(struct disk_snap * const *)b;
+	int cmp;
+
+	return(((cmp = strcmp(lhs->label, rhs->label)) != 0) ? cmp : snapkey(lhs, rhs->device, rhs->name));
+}
+
+static int
+cmptally(const void *a, const void *b) {
+	return(strcmp(((const struct env_tally *)a)->belabel, ((const struct env_tally *)b)->belabel));
+}
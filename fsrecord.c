@@ -34,53 +34,188 @@
 #ifndef DFBEADM_RECORD_H
 #include "fsrecord.h"
 #endif
+#ifndef DFBEADM_FSUP_H
+#include "fsupdate.h"
+#endif
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+#ifndef DFBEADM_FSSIM_H
+#include "fssim.h"
+#endif
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+/* query_bedata() filters that change the shape of its statement */
+#define QF_SINCE 0x01
+#define QF_LABEL 0x02
+#define QF_ACTIVE 0x04
+#define QF_EXTANT 0x08
+#define QF_DEVICE 0x10
+#define QF_MINSIZE 0x20
+/* read_bedata()'s statement lives after every combination of the above */
+#define QS_PFSES 0x40
+#define QUERY_SHAPES (QS_PFSES + 1)
+
 extern char *__progname;
 extern char **environ;
-extern bool dbg;
 extern bool noop;
 
+/* one connection and its prepared statements for the life of the process */
+static pthread_mutex_t querylock = PTHREAD_MUTEX_INITIALIZER;
+static sqlite3 *querydb;
+static sqlite3_stmt *querycache[QUERY_SHAPES];
+
+static sqlite3_stmt *querystmt(unsigned int shape);
+
 /* 
  * Connects to the bootenv database, sets the 
  * pointer to NULL on failure, will also signal 
- * via a return code of 1
+ * via a nonzero return code. Older databases are
+ * brought up to DFBEADM_USR_VER on the way in.
  */
 int
-connect_bedb(sqlite3 *dbptr) {
+connect_bedb(sqlite3 **dbptr) {
 	int retc;
-	char recdb_path[DFBEADM_DB_PATHLEN];
+	char recdb_path[MAXPATHLEN];
 	retc = 0;
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with dbptr = %p\n", __progname, __FILE__, __LINE__, __func__, (void *)dbptr);
+	assert(dbptr != NULL);
+	DBGTRACE("Entering with dbptr = %p", (void *)*dbptr);
+	/* a simulated run records into its own copy */
+	if (simactive()) {
+		strlcpy(recdb_path, simrecdb(), sizeof(recdb_path));
+	} else {
+		snprintf(recdb_path,sizeof(recdb_path),"%s/%s", DFBEADM_CONFIG_DIR, DFBEADM_RECORD_DB);
 	}
-	snprintf(recdb_path,DFBEADM_DB_PATHLEN,"%s/%s", DFBEADM_CONFIG_DIR, DFBEADM_RECORD_DB);
-	if (dbptr != NULL) {
+	if (*dbptr != NULL) {
 		fprintf(stderr,"ERR: %s [%s:%u] %s: Database handle is not NULL! Returning to caller...\n", __progname, __FILE__, __LINE__, __func__);
 		return(retc);
 	}
-	if ((retc = sqlite3_open_v2(recdb_path, &dbptr, SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
-		/* Ensure that the pointer is set to NULL before exiting */
-		dbptr = NULL;
+	if ((retc = sqlite3_open_v2(recdb_path, dbptr, SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
 		fprintf(stderr, "ERR: %s [%s:%u] %s: Unable to connect to database %s (%s)\n", 
 				__progname, __FILE__, __LINE__, __func__, recdb_path, sqlite3_errstr(retc));
+		/* Ensure that the pointer is set to NULL before exiting */
+		sqlite3_close(*dbptr);
+		*dbptr = NULL;
 	} else {
-		if (dbg) {
-			fprintf(stderr, "INF: %s [%s%u] %s: Connected to %s with dbptr = %p\n", __progname, __FILE__, __LINE__, __func__, recdb_path, (void *)dbptr);
+		TRACE(TRACE_INFO, "Connected to %s with dbptr = %p", recdb_path, (void *)*dbptr);
+		if ((retc = migratedb(*dbptr)) != SQLITE_OK) {
+			sqlite3_close(*dbptr);
+			*dbptr = NULL;
 		}
 	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller with dbptr = %p\n", __progname, __FILE__, __LINE__, __func__, retc, (void *)dbptr);
+	DBGTRACE("Returning %d to caller with dbptr = %p", retc, (void *)*dbptr);
+	return(retc);
+}
+
+/*
+ * Check that the file at dbpath is one of our databases
+ * and bring its layout up to date
+ */
+int
+testdb(const char *dbpath) {
+	int retc;
+	sqlite3 *recdb;
+	sqlite3_stmt *appq;
+
+	assert(dbpath != NULL);
+	recdb = NULL; appq = NULL;
+	if ((retc = sqlite3_open_v2(dbpath, &recdb, SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s)\n", __progname, __FILE__, __LINE__, __func__, dbpath, sqlite3_errstr(retc));
+		sqlite3_close(recdb);
+		return(retc);
+	}
+	if ((retc = sqlite3_prepare_v2(recdb, "PRAGMA application_id;", -1, &appq, NULL)) == SQLITE_OK && 
+	    (retc = sqlite3_step(appq)) == SQLITE_ROW) {
+		if (sqlite3_column_int(appq, 0) != DFBEADM_APP_ID) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %s does not belong to %s (application_id %d)\n",
+					__progname, __FILE__, __LINE__, __func__, dbpath, __progname, sqlite3_column_int(appq, 0));
+			retc = SQLITE_MISMATCH;
+		} else {
+			retc = SQLITE_OK;
+		}
+	}
+	sqlite3_finalize(appq);
+	if (retc == SQLITE_OK) {
+		retc = migratedb(recdb);
+	}
+	sqlite3_close(recdb);
+	return(retc);
+}
+
+/*
+ * Upgrade the database layout one user_version at a time,
+ * each step runs in its own transaction
+ */
+int
+migratedb(sqlite3 *recdb) {
+	int retc, version;
+	char *errmsg;
+	sqlite3_stmt *verq;
+	/* steps[n] takes a database from user_version n to n+1 */
+	static const char *steps[DFBEADM_USR_VER] = {
+		"BEGIN;"
+		"ALTER TABLE h2be ADD COLUMN betime integer NOT NULL DEFAULT 0;"
+		"CREATE INDEX IF NOT EXISTS bootenv_times ON h2be (betime,belabel,extant);"
+		"PRAGMA user_version=1;"
+		"COMMIT;",
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS pfsusage (pfs text PRIMARY KEY NOT NULL, belabel text NOT NULL DEFAULT '', "
+		"stamp integer NOT NULL, datasize integer NOT NULL, inodes integer NOT NULL, measured integer NOT NULL);"
+		"CREATE INDEX IF NOT EXISTS usage_envs ON pfsusage (belabel,datasize,inodes);"
+		"PRAGMA user_version=2;"
+		"COMMIT;",
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS bemanifest (belabel text NOT NULL, path text NOT NULL, size integer NOT NULL, "
+		"digest text NOT NULL, hashspec integer NOT NULL DEFAULT 4, PRIMARY KEY (belabel,path));"
+		"PRAGMA user_version=3;"
+		"COMMIT;",
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS h2pfs (belabel text NOT NULL REFERENCES h2be(belabel) ON DELETE CASCADE, device text NOT NULL, "
+		"pfs text NOT NULL, snapshot text NOT NULL, mountpoint text NOT NULL, tid integer NOT NULL, ctime integer NOT NULL, "
+		"datasize integer NOT NULL, PRIMARY KEY (belabel,device,pfs)) WITHOUT ROWID;"
+		"CREATE INDEX IF NOT EXISTS pfs_times ON h2pfs (ctime,belabel,device,pfs);"
+		"CREATE INDEX IF NOT EXISTS pfs_devices ON h2pfs (device,ctime,pfs,belabel,datasize);"
+		"CREATE INDEX IF NOT EXISTS pfs_members ON h2pfs (pfs,belabel,device);"
+		"PRAGMA user_version=4;"
+		"COMMIT;",
+		"BEGIN;"
+		"CREATE INDEX IF NOT EXISTS pfs_inventory ON h2pfs (device,snapshot,belabel);"
+		"PRAGMA user_version=5;"
+		"COMMIT;",
+	};
+
+	assert(recdb != NULL);
+	errmsg = NULL; verq = NULL;
+	version = 0;
+	if ((retc = sqlite3_prepare_v2(recdb, "PRAGMA user_version;", -1, &verq, NULL)) == SQLITE_OK && sqlite3_step(verq) == SQLITE_ROW) {
+		version = sqlite3_column_int(verq, 0);
+	}
+	sqlite3_finalize(verq);
+	if (version < DFBEADM_COMPAT_MIN || version > DFBEADM_USR_VER) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Database version %d is not supported by this version of %s\n",
+				__progname, __FILE__, __LINE__, __func__, version, __progname);
+		return(SQLITE_MISMATCH);
+	}
+	for (; retc == SQLITE_OK && version < DFBEADM_USR_VER; version++) {
+		DBGTRACE("Migrating database from version %d", version);
+		if ((retc = sqlite3_exec(recdb, steps[version], NULL, NULL, &errmsg)) != SQLITE_OK) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to migrate database from version %d (%s)\n",
+					__progname, __FILE__, __LINE__, __func__, version, errmsg);
+			sqlite3_free(errmsg);
+			sqlite3_exec(recdb, "ROLLBACK;", NULL, NULL, NULL);
+		}
 	}
 	return(retc);
 }
@@ -114,9 +249,7 @@ init_bedb(void) {
 	/* This should never fail */
 	snprintf(recdb_path,DFBEADM_DB_PATHLEN,"%s/%s",DFBEADM_CONFIG_DIR, DFBEADM_RECORD_DB);
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Initializing database at %s/%s\n", __progname, __FILE__, __LINE__, __func__, DFBEADM_CONFIG_DIR, DFBEADM_RECORD_DB);
-	}
+	DBGTRACE("Initializing database at %s/%s", DFBEADM_CONFIG_DIR, DFBEADM_RECORD_DB);
 
 	/* 
 	 * Exit early if we have the wrong EUID 
@@ -183,38 +316,62 @@ init_bedb(void) {
 			close(sqlfd);
 		} else {
 			/* If the database file exists, attempt to validate its contents */
-			if (dbg) {
-				fprintf(stderr,"INF: %s [%s:%u] %s: Database already exists at %s! Running validation checks...\n",
-						__progname, __FILE__, __LINE__, __func__, recdb_path);
-			}
+			TRACE(TRACE_INFO, "Database already exists at %s! Running validation checks...", recdb_path);
 			retc = testdb(recdb_path);
 		}
 	}
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n", __progname, __FILE__, __LINE__, __func__, retc);
-	}
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
+/*
+ * Print the PFSes recorded for belabel, querylock held
+ * returns the number printed, negative on error
+ */
+static int
+showpfses(const char *belabel) {
+	int found, retc;
+	sqlite3_stmt *pfsq;
+
+	found = 0;
+	if ((pfsq = querystmt(QS_PFSES)) == NULL) {
+		return(-1);
+	}
+	sqlite3_bind_text(pfsq, 1, belabel, -1, SQLITE_TRANSIENT);
+	while ((retc = sqlite3_step(pfsq)) == SQLITE_ROW) {
+		fprintf(stdout,"\t%s%c%s\t%s\t%016llx\t%lld\n", (const char *)sqlite3_column_text(pfsq, 0), PFSDELIM,
+				(const char *)sqlite3_column_text(pfsq, 1), (const char *)sqlite3_column_text(pfsq, 2),
+				(unsigned long long)sqlite3_column_int64(pfsq, 3), (long long)sqlite3_column_int64(pfsq, 4));
+		found++;
+	}
+	if (retc != SQLITE_DONE) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %s\n", __progname, __FILE__, __LINE__, __func__, sqlite3_errmsg(querydb));
+		found = -2;
+	}
+	sqlite3_reset(pfsq);
+	return(found);
+}
+
 /*
  * Read entries out of the database, for purposes 
  * of listing boot environments or performing integrity checks 
  * such as ensuring that no boot environment is listed in the 
  * database that doesn't still exist on disk.
+ * Prints the snapshots recorded for belabel, one per line as
+ * device@snapshot, mountpoint, creation TID and bytes referenced.
+ * returns the number of snapshots, negative on error
  */
 int
 read_bedata(const char *belabel) {
 	int retc;
-	retc = 0;
-	
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with belabel = %s\n", __progname, __FILE__, __LINE__, __func__, belabel);
-	}
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n", __progname, __FILE__, __LINE__, __func__, retc);
-	}
+	assert(belabel != NULL);
+	DBGTRACE("Entering with belabel = %s", belabel);
+	pthread_mutex_lock(&querylock);
+	retc = showpfses(belabel);
+	pthread_mutex_unlock(&querylock);
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
@@ -225,15 +382,609 @@ read_bedata(const char *belabel) {
  * passed in and converted to a table entry.
  */
 int
-write_bedata(bedata *bootenv) {
+write_bedata(bedata *bootenv, int fscount, const char *label) {
 	int retc;
+	sqlite3 *recdb;
+
+	assert((bootenv != NULL) && (label != NULL));
 	retc = 0;
-	if (dbg) { 
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with bedata at %p\n", __progname, __FILE__, __LINE__, __func__, (void *)bootenv);
+	recdb = NULL;
+	DBGTRACE("Entering with bedata at %p, label = %s", (void *)bootenv, label);
+	if (noop) {
+		fprintf(stdout,"INF: %s [%s:%u] %s: Would record boot environment %s\n", __progname, __FILE__, __LINE__, __func__, label);
+		return(retc);
 	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n", __progname, __FILE__, __LINE__, __func__, retc);
+	/* bootstrap the database on first use */
+	if (connect_bedb(&recdb) != SQLITE_OK && (init_bedb() != 0 || connect_bedb(&recdb) != SQLITE_OK)) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: No record database, %s will not be tracked\n", __progname, __FILE__, __LINE__, __func__, label);
+		return(-1);
 	}
+	/* create() has just activated this environment, so it takes over the active flag */
+	sqlite3_exec(recdb, "BEGIN; UPDATE " DFBEADM_BEINFO_TABLE " SET active = false WHERE active;", NULL, NULL, NULL);
+	retc = record_bedata(recdb, bootenv, fscount, label, true);
+	sqlite3_exec(recdb, (retc == 0) ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+	sqlite3_close(recdb);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Insert the h2be row of an environment and an h2pfs row per snapshot,
+ * inside whatever transaction the caller has open on recdb
+ * returns 0 on success
+ */
+int
+record_bedata(sqlite3 *recdb, bedata *bootenv, int fscount, const char *label, bool active) {
+	int retc, i;
+	int64_t betime;
+	size_t bloblen, devlen;
+	char *blob, fshash[DFBEADM_HASH_HEXLEN];
+	sqlite3_stmt *insq, *pfsq;
+
+	assert((recdb != NULL) && (bootenv != NULL) && (label != NULL));
+	insq = NULL; pfsq = NULL;
+	/* store the finished activation artifacts, not just the fstab, so -a never has to rebuild them */
+	if ((blob = envpayload(bootenv, fscount, label, &bloblen)) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to render fstab for %s\n", __progname, __FILE__, __LINE__, __func__, label);
+		return(-2);
+	}
+	/* environments without a timestamp in their label sort by when they were recorded */
+	if ((betime = labeltime(label)) < 0) {
+		betime = (int64_t)time(NULL);
+	}
+	if ((retc = hashbuf(whirlpool, blob, bloblen, fshash, sizeof(fshash))) == 0 &&
+	    (retc = sqlite3_prepare_v2(recdb, "INSERT INTO " DFBEADM_BEINFO_TABLE " (belabel,fstab,fshash,hashspec,betime,active) VALUES (?1,?2,?3,?4,?5,?6);",
+	                               -1, &insq, NULL)) == SQLITE_OK) {
+		sqlite3_bind_text(insq, 1, label, -1, SQLITE_STATIC);
+		sqlite3_bind_blob(insq, 2, blob, (int)bloblen, SQLITE_STATIC);
+		sqlite3_bind_text(insq, 3, fshash, -1, SQLITE_STATIC);
+		sqlite3_bind_int(insq, 4, (int)whirlpool);
+		sqlite3_bind_int64(insq, 5, (sqlite3_int64)betime);
+		sqlite3_bind_int(insq, 6, active);
+		if ((retc = sqlite3_step(insq)) == SQLITE_DONE) {
+			retc = 0;
+		} else {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to record %s (%s)\n", __progname, __FILE__, __LINE__, __func__, label, sqlite3_errmsg(recdb));
+		}
+	}
+	/* one row per snapshot, fs_spec still names its origin as device@pfs */
+	if (retc == 0 &&
+	    (retc = sqlite3_prepare_v2(recdb, "INSERT INTO " DFBEADM_PFS_TABLE " (belabel,device,pfs,snapshot,mountpoint,tid,ctime,datasize) "
+	                               "VALUES (?1,?2,?3,?4,?5,?6,?7,?8);", -1, &pfsq, NULL)) == SQLITE_OK) {
+		for (i = 0; retc == SQLITE_OK && i < fscount; i++) {
+			if (!bootenv[i].snap || bootenv[i].fstab.fs_spec[(devlen = strcspn(bootenv[i].fstab.fs_spec, "@"))] == 0) {
+				continue;
+			}
+			sqlite3_bind_text(pfsq, 1, label, -1, SQLITE_STATIC);
+			sqlite3_bind_text(pfsq, 2, bootenv[i].fstab.fs_spec, (int)devlen, SQLITE_STATIC);
+			sqlite3_bind_text(pfsq, 3, bootenv[i].fstab.fs_spec + devlen + 1, -1, SQLITE_STATIC);
+			sqlite3_bind_text(pfsq, 4, bootenv[i].snapshot.name, -1, SQLITE_STATIC);
+			sqlite3_bind_text(pfsq, 5, bootenv[i].fstab.fs_file, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(pfsq, 6, (sqlite3_int64)bootenv[i].snaptid);
+			sqlite3_bind_int64(pfsq, 7, (sqlite3_int64)((bootenv[i].snaptime != 0) ? bootenv[i].snaptime : betime));
+			sqlite3_bind_int64(pfsq, 8, (sqlite3_int64)bootenv[i].snapsize);
+			retc = (sqlite3_step(pfsq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(recdb);
+			sqlite3_reset(pfsq);
+		}
+		if (retc != SQLITE_OK) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to record the PFSes of %s (%s)\n", __progname, __FILE__, __LINE__, __func__, label, sqlite3_errmsg(recdb));
+		}
+	}
+	sqlite3_finalize(insq);
+	sqlite3_finalize(pfsq);
+	free(blob);
+	return(retc);
+}
+
+/*
+ * Fetch the activation payload stored for a boot environment by create(), 
+ * see envpayload() for its layout. The payload is always NUL terminated.
+ * returns 0 on success, nonzero if there's no such extant environment
+ */
+int
+load_bepayload(const char *belabel, char **payload, size_t *payloadlen, bool *active) {
+	int retc, bloblen;
+	sqlite3 *recdb;
+	sqlite3_stmt *envq;
+
+	assert((belabel != NULL) && (payload != NULL) && (payloadlen != NULL) && (active != NULL));
+	recdb = NULL; envq = NULL;
+	*payload = NULL;
+	DBGTRACE("Entering with belabel = %s", belabel);
+	if ((retc = connect_bedb(&recdb)) != SQLITE_OK) {
+		return(retc);
+	}
+	if ((retc = sqlite3_prepare_v2(recdb, "SELECT fstab,active FROM " DFBEADM_BEINFO_TABLE " WHERE belabel = ?1 AND extant;", -1, &envq, NULL)) == SQLITE_OK) {
+		sqlite3_bind_text(envq, 1, belabel, -1, SQLITE_STATIC);
+		if ((retc = sqlite3_step(envq)) == SQLITE_ROW) {
+			bloblen = sqlite3_column_bytes(envq, 0);
+			if ((*payload = calloc((size_t)bloblen + 1, 1)) == NULL) {
+				retc = SQLITE_NOMEM;
+			} else {
+				memcpy(*payload, sqlite3_column_blob(envq, 0), (size_t)bloblen);
+				*payloadlen = (size_t)bloblen;
+				*active = (sqlite3_column_int(envq, 1) != 0);
+				retc = 0;
+			}
+		} else {
+			retc = SQLITE_NOTFOUND;
+		}
+	}
+	sqlite3_finalize(envq);
+	sqlite3_close(recdb);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Record that belabel is now the active boot environment, and no other
+ */
+int
+mark_active(const char *belabel) {
+	int retc;
+	sqlite3 *recdb;
+	sqlite3_stmt *actq;
+
+	assert(belabel != NULL);
+	recdb = NULL; actq = NULL;
+	if ((retc = connect_bedb(&recdb)) != SQLITE_OK) {
+		return(retc);
+	}
+	if ((retc = sqlite3_prepare_v2(recdb, "UPDATE " DFBEADM_BEINFO_TABLE " SET active = (belabel = ?1) WHERE active OR belabel = ?1;", -1, &actq, NULL)) == SQLITE_OK) {
+		sqlite3_bind_text(actq, 1, belabel, -1, SQLITE_STATIC);
+		retc = (sqlite3_step(actq) == SQLITE_DONE) ? 0 : sqlite3_errcode(recdb);
+	}
+	if (retc != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to mark %s active (%s)\n", __progname, __FILE__, __LINE__, __func__, belabel, sqlite3_errmsg(recdb));
+	}
+	sqlite3_finalize(actq);
+	sqlite3_close(recdb);
+	return(retc);
+}
+
+/*
+ * The statement for a combination of QF_ filters, or QS_PFSES, prepared
+ * the first time it's asked for and reset for reuse after that. Parameters
+ * keep the same numbers in every combination. Called with querylock held.
+ */
+static sqlite3_stmt *
+querystmt(unsigned int shape) {
+	char sql[1024];
+	int retc;
+
+	assert(shape < QUERY_SHAPES);
+	if (querydb == NULL && connect_bedb(&querydb) != SQLITE_OK) {
+		return(NULL);
+	}
+	if (querycache[shape] != NULL) {
+		sqlite3_reset(querycache[shape]);
+		sqlite3_clear_bindings(querycache[shape]);
+		return(querycache[shape]);
+	}
+	if (shape == QS_PFSES) {
+		strlcpy(sql, "SELECT device,snapshot,mountpoint,tid,datasize FROM " DFBEADM_PFS_TABLE " WHERE belabel = ?1 ORDER BY mountpoint;", sizeof(sql));
+	} else {
+		strlcpy(sql, "SELECT belabel,betime,active FROM " DFBEADM_BEINFO_TABLE " WHERE betime < ?1 AND betime > ?2", sizeof(sql));
+		if (shape & QF_SINCE) {
+			strlcat(sql, " AND betime > (SELECT ifnull(max(betime),-1) FROM " DFBEADM_BEINFO_TABLE " WHERE active)", sizeof(sql));
+		}
+		if (shape & QF_LABEL) {
+			/* the lower bound still lets the index seek, substr() ends the match without an upper bound to compute */
+			strlcat(sql, " AND belabel >= ?4 AND substr(belabel,1,length(?4)) = ?4", sizeof(sql));
+		}
+		if (shape & QF_ACTIVE) {
+			strlcat(sql, " AND active", sizeof(sql));
+		}
+		if (shape & QF_EXTANT) {
+			strlcat(sql, " AND extant = ?6", sizeof(sql));
+		}
+		if (shape & QF_DEVICE) {
+			strlcat(sql, " AND belabel IN (SELECT belabel FROM " DFBEADM_PFS_TABLE " WHERE device = ?7)", sizeof(sql));
+		}
+		if (shape & QF_MINSIZE) {
+			strlcat(sql, " AND (SELECT ifnull(sum(datasize),0) FROM " DFBEADM_PFS_TABLE " p WHERE p.belabel = " DFBEADM_BEINFO_TABLE ".belabel) >= ?8", sizeof(sql));
+		}
+		strlcat(sql, " ORDER BY betime DESC LIMIT ?3;", sizeof(sql));
+	}
+	DBGTRACE("Preparing query shape %u", shape);
+	if ((retc = sqlite3_prepare_v3(querydb, sql, -1, SQLITE_PREPARE_PERSISTENT, &querycache[shape], NULL)) != SQLITE_OK) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %s\n", __progname, __FILE__, __LINE__, __func__, sqlite3_errmsg(querydb));
+		querycache[shape] = NULL;
+	}
+	return(querycache[shape]);
+}
+
+/*
+ * List the boot environments matching the given filters, newest first.
+ * Every filter is bound into a cached statement and evaluated by SQLite
+ * over an index, so none of them have to compare labels of every
+ * recorded environment.
+ * returns the number of environments listed, negative on error
+ */
+int
+query_bedata(const bequery *query) {
+	int found, retc;
+	unsigned int shape;
+	char stamp[TMAX];
+	time_t when;
+	struct tm utc;
+	sqlite3_stmt *listq;
+
+	assert(query != NULL);
+	found = retc = 0;
+	DBGTRACE("Entering with newest = %d, older = %lld, newer = %lld, sinceactive = %d", query->newest, (long long)query->older, (long long)query->newer, query->sinceactive);
+	shape = 0;
+	shape |= (query->sinceactive) ? QF_SINCE : 0;
+	shape |= (query->prefix != NULL && query->prefix[0] != 0) ? QF_LABEL : 0;
+	shape |= (query->active) ? QF_ACTIVE : 0;
+	shape |= (query->extant != QUERY_ALL) ? QF_EXTANT : 0;
+	shape |= (query->device != NULL) ? QF_DEVICE : 0;
+	shape |= (query->minsize > 0) ? QF_MINSIZE : 0;
+	pthread_mutex_lock(&querylock);
+	if ((listq = querystmt(shape)) == NULL) {
+		pthread_mutex_unlock(&querylock);
+		return(-1);
+	}
+	/* unused bounds collapse to the whole index, LIMIT -1 means no limit */
+	sqlite3_bind_int64(listq, 1, (query->older < 0) ? INT64_MAX : (sqlite3_int64)query->older);
+	sqlite3_bind_int64(listq, 2, (query->newer < 0) ? -1 : (sqlite3_int64)query->newer);
+	sqlite3_bind_int(listq, 3, (query->newest > 0) ? query->newest : -1);
+	if (shape & QF_LABEL) {
+		sqlite3_bind_text(listq, 4, query->prefix, -1, SQLITE_TRANSIENT);
+	}
+	if (shape & QF_EXTANT) {
+		sqlite3_bind_int(listq, 6, (query->extant == QUERY_EXTANT) ? 1 : 0);
+	}
+	if (shape & QF_DEVICE) {
+		sqlite3_bind_text(listq, 7, query->device, -1, SQLITE_TRANSIENT);
+	}
+	if (shape & QF_MINSIZE) {
+		sqlite3_bind_int64(listq, 8, (query->minsize > INT64_MAX) ? INT64_MAX : (sqlite3_int64)query->minsize);
+	}
+	while ((retc = sqlite3_step(listq)) == SQLITE_ROW) {
+		when = (time_t)sqlite3_column_int64(listq, 1);
+		if (gmtime_r(&when, &utc) == NULL || strftime(stamp, sizeof(stamp), BETIME_FMT, &utc) == 0) {
+			stamp[0] = 0;
+		}
+		fprintf(stdout,"%s\t%s%s\n", (const char *)sqlite3_column_text(listq, 0), stamp, (sqlite3_column_int(listq, 2) != 0) ? "\tactive" : "");
+		/* the row is still current, the PFS statement is a different one */
+		if (query->pfses && showpfses((const char *)sqlite3_column_text(listq, 0)) < 0) {
+			retc = SQLITE_ERROR;
+			break;
+		}
+		found++;
+	}
+	if (retc != SQLITE_DONE) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %s\n", __progname, __FILE__, __LINE__, __func__, sqlite3_errmsg(querydb));
+		found = -3;
+	}
+	sqlite3_reset(listq);
+	pthread_mutex_unlock(&querylock);
+	DBGTRACE("Returning %d to caller", found);
+	return(found);
+}
+
+/*
+ * Drop every cached statement and the connection behind them
+ */
+void
+query_close(void) {
+	unsigned int shape;
+
+	pthread_mutex_lock(&querylock);
+	for (shape = 0; shape < QUERY_SHAPES; shape++) {
+		sqlite3_finalize(querycache[shape]);
+		querycache[shape] = NULL;
+	}
+	sqlite3_close(querydb);
+	querydb = NULL;
+	pthread_mutex_unlock(&querylock);
+}
+
+/*
+ * Finish a digest as hex, returns 0 on success
+ */
+static int
+hashhex(digest *ctx, char *hex, size_t hexlen) {
+	unsigned char md[DIGEST_MAXLEN];
+	size_t mdlen, i;
+
+	if ((mdlen = digest_final(ctx, md)) == 0 || hexlen < mdlen * 2 + 1) {
+		return(-2);
+	}
+	for (i = 0; i < mdlen; i++) {
+		snprintf(hex + i * 2, 3, "%02x", md[i]);
+	}
+	return(0);
+}
+
+/*
+ * Hex digest of a buffer with one of the hashspec algorithms
+ * returns 0 on success, nonzero if the algorithm is unknown
+ */
+int
+hashbuf(hashspec algo, const void *buf, size_t len, char *hex, size_t hexlen) {
+	digest ctx;
+
+	assert((buf != NULL) && (hex != NULL));
+	if (digest_init(&ctx, algo) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unknown hash algorithm %d\n", __progname, __FILE__, __LINE__, __func__, (int)algo);
+		return(-1);
+	}
+	digest_update(&ctx, buf, len);
+	return(hashhex(&ctx, hex, hexlen));
+}
+
+/*
+ * Hex digest of the size bytes of an open file. With map, anything past HASH_MMAP_MIN
+ * is mapped and fed to the digest a window at a time, with the pages dropped
+ * behind us so a large file doesn't push everything else out of memory.
+ * Smaller files aren't worth the mapping and are read in one go. A file that
+ * may shrink while it's hashed, anything in the running system, must not be
+ * mapped, touching a page past its new end raises SIGBUS.
+ * returns 0 on success, nonzero on read errors
+ */
+int
+hashfd(hashspec algo, int fd, uint64_t size, bool map, char *hex, size_t hexlen) {
+	int retc;
+	ssize_t got;
+	size_t done, window;
+	unsigned char *buf;
+	digest ctx;
+
+	assert(hex != NULL);
+	retc = 0;
+	buf = NULL;
+	if (digest_init(&ctx, algo) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unknown hash algorithm %d\n", __progname, __FILE__, __LINE__, __func__, (int)algo);
+		return(-1);
+	}
+	if (map && size >= HASH_MMAP_MIN && (uint64_t)(size_t)size == size &&
+	    (buf = mmap(NULL, (size_t)size, PROT_READ, MAP_NOCORE|MAP_PRIVATE, fd, (off_t)0)) != MAP_FAILED) {
+		madvise(buf, (size_t)size, MADV_SEQUENTIAL);
+		for (done = 0; done < (size_t)size; done += window) {
+			window = ((size_t)size - done < HASH_WINDOW) ? (size_t)size - done : HASH_WINDOW;
+			digest_update(&ctx, buf + done, window);
+			madvise(buf + done, window, MADV_DONTNEED);
+		}
+		munmap(buf, (size_t)size);
+	} else {
+		/* small or live files, or a mapping we couldn't get, stream through a buffer */
+		window = (size < HASH_MMAP_MIN) ? (size_t)size + 1 : HASH_WINDOW;
+		if ((buf = malloc(window)) == NULL) {
+			return(-3);
+		}
+		while ((got = read(fd, buf, window)) > 0) {
+			digest_update(&ctx, buf, (size_t)got);
+		}
+		if (got < 0) {
+			retc = -4;
+		}
+		free(buf);
+	}
+	if (retc != 0) {
+		return(retc);
+	}
+	return(hashhex(&ctx, hex, hexlen));
+}
+
+/*
+ * Read every cached PFS usage row, the caller frees *usage
+ */
+int
+load_usage(pfsusage **usage, int *count) {
+	int retc, alloc;
+	pfsusage *grown;
+	sqlite3 *recdb;
+	sqlite3_stmt *useq;
+
+	assert((usage != NULL) && (count != NULL));
+	recdb = NULL; useq = NULL;
+	*usage = NULL; *count = alloc = 0;
+	if ((retc = connect_bedb(&recdb)) != SQLITE_OK) {
+		return(retc);
+	}
+	if ((retc = sqlite3_prepare_v2(recdb, "SELECT pfs,belabel,stamp,datasize,inodes,measured FROM " DFBEADM_USAGE_TABLE ";", -1, &useq, NULL)) == SQLITE_OK) {
+		while ((retc = sqlite3_step(useq)) == SQLITE_ROW) {
+			if (*count == alloc) {
+				alloc = (alloc == 0) ? 64 : alloc * 2;
+				if ((grown = reallocarray(*usage, (size_t)alloc, sizeof(pfsusage))) == NULL) {
+					retc = SQLITE_NOMEM;
+					break;
+				}
+				*usage = grown;
+			}
+			memset(&(*usage)[*count], 0, sizeof(pfsusage));
+			strlcpy((*usage)[*count].pfs, (const char *)sqlite3_column_text(useq, 0), MNAMELEN);
+			strlcpy((*usage)[*count].belabel, (const char *)sqlite3_column_text(useq, 1), NAME_MAX + 1);
+			(*usage)[*count].stamp = (uint64_t)sqlite3_column_int64(useq, 2);
+			(*usage)[*count].datasize = (uint64_t)sqlite3_column_int64(useq, 3);
+			(*usage)[*count].inodes = (uint64_t)sqlite3_column_int64(useq, 4);
+			(*usage)[*count].measured = (int64_t)sqlite3_column_int64(useq, 5);
+			(*count)++;
+		}
+		retc = (retc == SQLITE_DONE) ? 0 : retc;
+	}
+	if (retc != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read cached usage (%s)\n", __progname, __FILE__, __LINE__, __func__, sqlite3_errmsg(recdb));
+		free(*usage);
+		*usage = NULL; *count = 0;
+	}
+	sqlite3_finalize(useq);
+	sqlite3_close(recdb);
+	return(retc);
+}
+
+/*
+ * Insert or refresh usage rows, all in one transaction
+ */
+int
+write_usage(const pfsusage *usage, int count) {
+	int retc, i;
+	sqlite3 *recdb;
+	sqlite3_stmt *upq;
+
+	assert(usage != NULL);
+	recdb = NULL; upq = NULL;
+	if (noop || count == 0) {
+		return(0);
+	}
+	if ((retc = connect_bedb(&recdb)) != SQLITE_OK) {
+		return(retc);
+	}
+	sqlite3_exec(recdb, "BEGIN;", NULL, NULL, NULL);
+	if ((retc = sqlite3_prepare_v2(recdb, "INSERT OR REPLACE INTO " DFBEADM_USAGE_TABLE " (pfs,belabel,stamp,datasize,inodes,measured) "
+	                               "VALUES (?1,?2,?3,?4,?5,?6);", -1, &upq, NULL)) == SQLITE_OK) {
+		for (i = 0; retc == SQLITE_OK && i < count; i++) {
+			sqlite3_bind_text(upq, 1, usage[i].pfs, -1, SQLITE_STATIC);
+			sqlite3_bind_text(upq, 2, usage[i].belabel, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(upq, 3, (sqlite3_int64)usage[i].stamp);
+			sqlite3_bind_int64(upq, 4, (sqlite3_int64)usage[i].datasize);
+			sqlite3_bind_int64(upq, 5, (sqlite3_int64)usage[i].inodes);
+			sqlite3_bind_int64(upq, 6, (sqlite3_int64)usage[i].measured);
+			retc = (sqlite3_step(upq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(recdb);
+			sqlite3_reset(upq);
+		}
+	}
+	if (retc != SQLITE_OK) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to cache usage (%s)\n", __progname, __FILE__, __LINE__, __func__, sqlite3_errmsg(recdb));
+	}
+	sqlite3_finalize(upq);
+	sqlite3_exec(recdb, (retc == SQLITE_OK) ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+	sqlite3_close(recdb);
+	return(retc);
+}
+
+/*
+ * Forget the usage of PFSes that no longer exist
+ */
+int
+drop_usage(char pfs[][MNAMELEN], int count) {
+	int retc, i;
+	sqlite3 *recdb;
+	sqlite3_stmt *dropq;
+
+	assert(pfs != NULL);
+	recdb = NULL; dropq = NULL;
+	if (noop || count == 0) {
+		return(0);
+	}
+	if ((retc = connect_bedb(&recdb)) != SQLITE_OK) {
+		return(retc);
+	}
+	sqlite3_exec(recdb, "BEGIN;", NULL, NULL, NULL);
+	if ((retc = sqlite3_prepare_v2(recdb, "DELETE FROM " DFBEADM_USAGE_TABLE " WHERE pfs = ?1;", -1, &dropq, NULL)) == SQLITE_OK) {
+		for (i = 0; retc == SQLITE_OK && i < count; i++) {
+			sqlite3_bind_text(dropq, 1, pfs[i], -1, SQLITE_STATIC);
+			retc = (sqlite3_step(dropq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(recdb);
+			sqlite3_reset(dropq);
+		}
+	}
+	sqlite3_finalize(dropq);
+	sqlite3_exec(recdb, (retc == SQLITE_OK) ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+	sqlite3_close(recdb);
+	return(retc);
+}
+
+/*
+ * Read the manifest recorded for belabel, sorted by path.
+ * The caller frees every path and then *files.
+ * returns 0 on success, SQLITE_NOTFOUND if there's no manifest
+ */
+int
+load_manifest(const char *belabel, bemanifest **files, int *count, hashspec *algo) {
+	int retc, alloc;
+	bemanifest *grown;
+	sqlite3 *recdb;
+	sqlite3_stmt *manq;
+
+	assert((belabel != NULL) && (files != NULL) && (count != NULL) && (algo != NULL));
+	recdb = NULL; manq = NULL;
+	*files = NULL; *count = alloc = 0;
+	if ((retc = connect_bedb(&recdb)) != SQLITE_OK) {
+		return(retc);
+	}
+	/* the primary key hands rows back in path order, ready to merge against a walk */
+	if ((retc = sqlite3_prepare_v2(recdb, "SELECT path,size,digest,hashspec FROM " DFBEADM_MANIFEST_TABLE " WHERE belabel = ?1 ORDER BY path;",
+	                               -1, &manq, NULL)) == SQLITE_OK) {
+		sqlite3_bind_text(manq, 1, belabel, -1, SQLITE_STATIC);
+		while ((retc = sqlite3_step(manq)) == SQLITE_ROW) {
+			if (*count == alloc) {
+				alloc = (alloc == 0) ? 1024 : alloc * 2;
+				if ((grown = reallocarray(*files, (size_t)alloc, sizeof(bemanifest))) == NULL) {
+					retc = SQLITE_NOMEM;
+					break;
+				}
+				*files = grown;
+			}
+			if (((*files)[*count].path = strdup((const char *)sqlite3_column_text(manq, 0))) == NULL) {
+				retc = SQLITE_NOMEM;
+				break;
+			}
+			(*files)[*count].size = (uint64_t)sqlite3_column_int64(manq, 1);
+			strlcpy((*files)[*count].digest, (const char *)sqlite3_column_text(manq, 2), DFBEADM_HASH_HEXLEN);
+			*algo = (hashspec)sqlite3_column_int(manq, 3);
+			(*count)++;
+		}
+		retc = (retc == SQLITE_DONE) ? ((*count > 0) ? 0 : SQLITE_NOTFOUND) : retc;
+	}
+	if (retc != 0) {
+		if (retc != SQLITE_NOTFOUND) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the manifest of %s (%s)\n", __progname, __FILE__, __LINE__, __func__, belabel, sqlite3_errmsg(recdb));
+		}
+		while (*count > 0) {
+			free((*files)[--(*count)].path);
+		}
+		free(*files);
+		*files = NULL;
+	}
+	sqlite3_finalize(manq);
+	sqlite3_close(recdb);
+	return(retc);
+}
+
+/*
+ * Replace the manifest of belabel, all in one transaction
+ */
+int
+write_manifest(const char *belabel, hashspec algo, const bemanifest *files, int count) {
+	int retc, i;
+	sqlite3 *recdb;
+	sqlite3_stmt *delq, *insq;
+
+	assert((belabel != NULL) && (files != NULL));
+	recdb = NULL; delq = NULL; insq = NULL;
+	if (noop) {
+		return(0);
+	}
+	if ((retc = connect_bedb(&recdb)) != SQLITE_OK) {
+		return(retc);
+	}
+	sqlite3_exec(recdb, "BEGIN;", NULL, NULL, NULL);
+	if ((retc = sqlite3_prepare_v2(recdb, "DELETE FROM " DFBEADM_MANIFEST_TABLE " WHERE belabel = ?1;", -1, &delq, NULL)) == SQLITE_OK) {
+		sqlite3_bind_text(delq, 1, belabel, -1, SQLITE_STATIC);
+		retc = (sqlite3_step(delq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(recdb);
+	}
+	if (retc == SQLITE_OK &&
+	    (retc = sqlite3_prepare_v2(recdb, "INSERT INTO " DFBEADM_MANIFEST_TABLE " (belabel,path,size,digest,hashspec) VALUES (?1,?2,?3,?4,?5);",
+	                               -1, &insq, NULL)) == SQLITE_OK) {
+		for (i = 0; retc == SQLITE_OK && i < count; i++) {
+			sqlite3_bind_text(insq, 1, belabel, -1, SQLITE_STATIC);
+			sqlite3_bind_text(insq, 2, files[i].path, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(insq, 3, (sqlite3_int64)files[i].size);
+			sqlite3_bind_text(insq, 4, files[i].digest, -1, SQLITE_STATIC);
+			sqlite3_bind_int(insq, 5, (int)algo);
+			retc = (sqlite3_step(insq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(recdb);
+			sqlite3_reset(insq);
+		}
+	}
+	if (retc != SQLITE_OK) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to record the manifest of %s (%s)\n", __progname, __FILE__, __LINE__, __func__, belabel, sqlite3_errmsg(recdb));
+	}
+	sqlite3_finalize(delq);
+	sqlite3_finalize(insq);
+	sqlite3_exec(recdb, (retc == SQLITE_OK) ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+	sqlite3_close(recdb);
 	return(retc);
 }
 
@@ -247,11 +998,7 @@ int
 drop_bootenv(const char *belabel) {
 	int retc;
 	retc = 0;
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with belabel = %s\n", __progname, __FILE__, __LINE__, __func__, belabel);
-	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n", __progname, __FILE__, __LINE__, __func__, retc);
-	}
+	DBGTRACE("Entering with belabel = %s", belabel);
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
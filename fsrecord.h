@@ -44,6 +44,11 @@
 
 #include <sqlite3.h>
 
+/* hashspec and the digests behind it */
+#ifndef DFBEADM_FSDIGEST_H
+#include "fsdigest.h"
+#endif
+
 /* Define some useful data */
 #define DFBEADM_CONFIG_DIR "/usr/local/etc/dfbeadm"
 #define DFBEADM_RECORD_DB "bootenv.data"
@@ -51,31 +56,92 @@
 /* Planned for a future release */
 #define DFBEADM_CONFIG_FILE "bootenvs.conf"
 #define DFBEADM_BEINFO_TABLE "h2be"
+#define DFBEADM_USAGE_TABLE "pfsusage"
+#define DFBEADM_MANIFEST_TABLE "bemanifest"
+#define DFBEADM_PFS_TABLE "h2pfs"
 /* Compile-time constants for database testing */
 #define DFBEADM_APP_ID 999
-#define DFBEADM_USR_VER 0;
+/* 1 added h2be.betime, 2 added pfsusage, 3 added bemanifest, 4 added h2pfs, 5 added pfs_inventory */
+#define DFBEADM_USR_VER 5
 /* 
  * Planning for some degree of backwards compatibility, 
  * allowing the database layout to change 
  */
-#define DFBEADM_COMPAT_MIN 0;
+#define DFBEADM_COMPAT_MIN 0
+/* Hex digests are at most 512 bits */
+#define DFBEADM_HASH_HEXLEN 129
+/* hashfd() maps files at least this large when asked to, and feeds the digest this much at a time */
+#define HASH_MMAP_MIN (256 * 1024)
+#define HASH_WINDOW (8 * 1024 * 1024)
+
+
+/* bootenv_query.extant */
+#define QUERY_EXTANT 0
+#define QUERY_GONE 1
+#define QUERY_ALL 2
 
 /* 
- * Define enumeration values for the accepted hashing algorithms
+ * Filters for listing boot environments out of the database. The time
+ * bounds walk the betime index, label prefixes the belabel index, and
+ * device and size filters are answered from h2pfs without reading h2be.
  */
-/* XXX: LibreSSL 2.9.1 only seems to support 0 and 4 */
-typedef enum dfbeadm_hashspec_t {
-	whirlpool = 0,
-	sha3_512 = 1,
-	blake2k512 = 2,
-	shake256 = 3,
-	sha2_512 = 4,
-} hashspec;
+struct bootenv_query {
+	int newest; /* only the N most recent, 0 for all */
+	int64_t older; /* created before this time, -1 for no limit */
+	int64_t newer; /* created after this time, -1 for no limit */
+	bool sinceactive; /* created after the active environment, i.e. since the last upgrade */
+	bool active; /* only the active environment */
+	bool pfses; /* list the PFSes of every environment found */
+	int extant; /* QUERY_EXTANT, QUERY_GONE or QUERY_ALL */
+	const char *prefix; /* labels starting with this, NULL for any */
+	const char *device; /* with a snapshot on this device, NULL for any */
+	uint64_t minsize; /* referencing at least this many bytes, 0 for any */
+};
+
+typedef struct bootenv_query bequery;
+
+/* 
+ * Space accounted to a single PFS, as measured when a snapshot was taken
+ */
+struct pfs_usage {
+	char pfs[MNAMELEN]; /* device@pfs, snapshots carry their :belabel */
+	char belabel[NAME_MAX + 1]; /* empty for PFSes outside of any boot environment */
+	uint64_t stamp; /* no longer set, the column stays so older databases load */
+	uint64_t datasize; /* bytes referenced, data_count of the PFS root */
+	uint64_t inodes;
+	int64_t measured;
+};
+
+typedef struct pfs_usage pfsusage;
+
+/* 
+ * One file of a boot environment's manifest
+ */
+struct manifest_entry {
+	char *path; /* relative to the environment's root, with a leading slash */
+	uint64_t size;
+	char digest[DFBEADM_HASH_HEXLEN];
+};
+
+typedef struct manifest_entry bemanifest;
 
 /* Now the function declarations */
-int connect_bedb(sqlite3 *dbptr);
+int connect_bedb(sqlite3 **dbptr);
 int init_bedb(void);
 int read_bedata(const char *belabel);
-int write_bedata(bedata *bootenv);
+int query_bedata(const bequery *query);
+void query_close(void);
+int load_bepayload(const char *belabel, char **payload, size_t *payloadlen, bool *active);
+int mark_active(const char *belabel);
+int write_bedata(bedata *bootenv, int fscount, const char *label);
+int record_bedata(sqlite3 *recdb, bedata *bootenv, int fscount, const char *label, bool active);
 int drop_bootenv(const char *belabal);
 int testdb(const char *dbpath);
+int migratedb(sqlite3 *recdb);
+int hashbuf(hashspec algo, const void *buf, size_t len, char *hex, size_t hexlen);
+int hashfd(hashspec algo, int fd, uint64_t size, bool map, char *hex, size_t hexlen);
+int load_usage(pfsusage **usage, int *count);
+int write_usage(const pfsusage *usage, int count);
+int drop_usage(char pfs[][MNAMELEN], int count);
+int load_manifest(const char *belabel, bemanifest **files, int *count, hashspec *algo);
+int write_manifest(const char *belabel, hashspec algo, const bemanifest *files, int count);
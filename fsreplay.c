@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mount.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSEXPORT_H
+#include "fsexport.h"
+#endif
+#ifndef DFBEADM_FSREPLAY_H
+#include "fsreplay.h"
+#endif
+#ifndef DFBEADM_FSSIM_H
+#include "fssim.h"
+#endif
+#ifndef DFBEADM_SNAPFS_H
+#include "snapfs.h"
+#endif
+
+extern char *__progname;
+
+/* one request read back from a trace */
+struct replay_call {
+	uint8_t op;
+	uint8_t mount;
+	uint8_t thread;
+	uint8_t subtype;
+	int32_t retc;
+	int32_t err;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t key;
+	uint64_t out;
+	uint64_t inodes;
+	uint64_t lsnap;
+	char name[NAME_MAX + 1];
+};
+
+/* what one replay thread saw, per kind of request */
+struct replay_stats {
+	int calls;
+	int differ;
+	double recorded;
+	double replayed;
+	double recmax;
+	double repmax;
+};
+
+struct replay_stream {
+	const struct replay_call *calls;
+	const int *simmount; /* trace mount index to simcall() mount */
+	int *idx; /* into calls, in recorded order */
+	int n;
+	const struct timespec *begin;
+	struct replay_stats stats[SIMOP_COUNT];
+};
+
+/* snapshot name events, sorted to find what existed before the trace began */
+struct replay_sighting {
+	int dev;
+	const char *name;
+	int call;
+	bool creates;
+	uint8_t subtype;
+	int mount;
+};
+
+/* indexed by simop */
+static const unsigned long oprequests[SIMOP_COUNT] = {
+	HAMMER2IOC_INODE_GET, HAMMER2IOC_PFS_GET, HAMMER2IOC_PFS_SNAPSHOT, HAMMER2IOC_PFS_DELETE
+};
+static const char *const opnames[SIMOP_COUNT] = { "inode-get", "pfs-get", "snapshot", "delete" };
+
+/* recording state, all of it under tracelock once the trace is open */
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace = NULL;
+static struct timespec tracestart;
+static char tracemounts[IOTRACE_MAXMOUNTS][MNAMELEN];
+static int ntracemounts = 0;
+static pthread_t tracethreads[IOTRACE_MAXTHREADS];
+static int ntracethreads = 0;
+
+static int readtrace(const char *path, char from[][MNAMELEN], char on[][MNAMELEN], int *nmounts, struct replay_call **calls, int *ncalls);
+static int buildmodel(const struct replay_call *calls, int ncalls, char from[][MNAMELEN], char on[][MNAMELEN], int nmounts, int *simmount);
+static void *replayworker(void *arg);
+static int cmpsightings(const void *a, const void *b);
+static uint64_t nsec(const struct timespec *from, const struct timespec *to);
+
+/*
+ * Start logging every HAMMER2 ioctl to path
+ * returns 0 on success
+ */
+int
+iotrace_open(const char *path) {
+	unsigned char hdr[IOTRACE_HDRLEN];
+
+	assert(path != NULL);
+	if ((trace = fopen(path, "w")) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to create %s (%s)\n",__progname,__FILE__,__LINE__,__func__,path,strerror(errno));
+		return(-1);
+	}
+	put32(hdr, IOTRACE_MAGIC);
+	put32(hdr + 4, IOTRACE_VERSION);
+	put64(hdr + 8, (uint64_t)time(NULL));
+	fwrite(hdr, 1, sizeof(hdr), trace);
+	clock_gettime(CLOCK_MONOTONIC, &tracestart);
+	return(0);
+}
+
+/*
+ * Log one request, called by h2ioctl() once it has returned.
+ * The mount is identified by the device@pfs name the caller gave h2ioctl(),
+ * asking the descriptor with fstatfs() could hang outside the watchdog.
+ * Its mountpoint isn't known here and is recorded empty
+ */
+void
+iotrace_call(const char *dev, unsigned long request, const void *arg, int retc, int err, const struct timespec *before, double elapsed) {
+	int op, mount, thread;
+	size_t fromlen, namelen;
+	unsigned char rec[IOTRACE_CALLLEN + NAME_MAX + 1], mrec[4 + MNAMELEN];
+	const char *name;
+	const hammer2_ioc_pfs_t *pfs;
+	const hammer2_ioc_inode_t *ino;
+	pthread_t self;
+
+	if (trace == NULL) {
+		return;
+	}
+	for (op = 0; op < SIMOP_COUNT && oprequests[op] != request; op++);
+	if (op == SIMOP_COUNT) {
+		return;
+	}
+	if (dev == NULL) {
+		dev = "?";
+	}
+	memset(rec, 0, sizeof(rec));
+	name = "";
+	if (op == SIMOP_INODE_GET) {
+		ino = arg;
+		put64(rec + 36, (uint64_t)ino->data_count);
+		put64(rec + 44, (uint64_t)ino->inode_count);
+		put64(rec + 52, (uint64_t)ino->ip_data.meta.pfs_lsnap_tid);
+		rec[60] = ino->ip_data.meta.pfs_subtype;
+	} else {
+		pfs = arg;
+		put64(rec + 28, (uint64_t)pfs->name_key);
+		put64(rec + 36, (uint64_t)pfs->name_next);
+		rec[60] = pfs->pfs_subtype;
+		name = pfs->name;
+	}
+	namelen = strnlen(name, NAME_MAX);
+	self = pthread_self();
+
+	pthread_mutex_lock(&tracelock);
+	for (mount = 0; mount < ntracemounts && strncmp(tracemounts[mount], dev, MNAMELEN) != 0; mount++);
+	if (mount == ntracemounts && ntracemounts < IOTRACE_MAXMOUNTS) {
+		/* the first request on a mount introduces it */
+		strlcpy(tracemounts[ntracemounts++], dev, MNAMELEN);
+		fromlen = strnlen(dev, MNAMELEN - 1);
+		mrec[0] = IOREC_MOUNT;
+		mrec[1] = (unsigned char)mount;
+		mrec[2] = (unsigned char)fromlen;
+		mrec[3] = 0;
+		memcpy(mrec + 4, dev, fromlen);
+		fwrite(mrec, 1, 4 + fromlen, trace);
+	}
+	for (thread = 0; thread < ntracethreads && !pthread_equal(tracethreads[thread], self); thread++);
+	if (thread == ntracethreads && ntracethreads < IOTRACE_MAXTHREADS) {
+		tracethreads[ntracethreads++] = self;
+	}
+	rec[0] = IOREC_CALL;
+	rec[1] = (unsigned char)op;
+	rec[2] = (unsigned char)((mount < IOTRACE_MAXMOUNTS) ? mount : IOTRACE_MAXMOUNTS - 1);
+	rec[3] = (unsigned char)((thread < IOTRACE_MAXTHREADS) ? thread : IOTRACE_MAXTHREADS - 1);
+	put32(rec + 4, (uint32_t)retc);
+	put32(rec + 8, (uint32_t)((retc < 0) ? err : 0));
+	put64(rec + 12, nsec(&tracestart, before));
+	put64(rec + 20, (uint64_t)(elapsed * 1e9));
+	rec[61] = (unsigned char)namelen;
+	memcpy(rec + IOTRACE_CALLLEN, name, namelen);
+	fwrite(rec, 1, IOTRACE_CALLLEN + namelen, trace);
+	pthread_mutex_unlock(&tracelock);
+}
+
+/*
+ * Finish the trace
+ * returns 0 if all of it made it to disk
+ */
+int
+iotrace_close(void) {
+	int retc;
+
+	if (trace == NULL) {
+		return(0);
+	}
+	pthread_mutex_lock(&tracelock);
+	retc = (ferror(trace) || fclose(trace) != 0) ? -1 : 0;
+	trace = NULL;
+	pthread_mutex_unlock(&tracelock);
+	if (retc != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: The ioctl trace is incomplete (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+	}
+	return(retc);
+}
+
+/*
+ * Issue the requests of a trace again against the simulated backend and
+ * compare how long they took, and what they returned, with the recording
+ * returns 0 on success
+ */
+int
+replay(const char *path) {
+	int retc, nmounts, ncalls, nstreams, i, op, differ;
+	int simmount[IOTRACE_MAXMOUNTS];
+	char from[IOTRACE_MAXMOUNTS][MNAMELEN], on[IOTRACE_MAXMOUNTS][MNAMELEN];
+	double recwall, repwall;
+	struct replay_call *calls;
+	struct replay_stream streams[IOTRACE_MAXTHREADS];
+	struct replay_stats total[SIMOP_COUNT];
+	bool started[IOTRACE_MAXTHREADS];
+	pthread_t workers[IOTRACE_MAXTHREADS];
+	struct timespec begin, end;
+
+	assert(path != NULL);
+	calls = NULL;
+	nstreams = differ = 0;
+	recwall = 0;
+	memset(streams, 0, sizeof(streams));
+	memset(total, 0, sizeof(total));
+	if ((retc = readtrace(path, from, on, &nmounts, &calls, &ncalls)) != 0 ||
+	    (retc = buildmodel(calls, ncalls, from, on, nmounts, simmount)) != 0) {
+		free(calls);
+		return(retc);
+	}
+	/* one stream per recording thread, each keeps its own order */
+	for (i = 0; i < ncalls; i++) {
+		if (calls[i].thread >= nstreams) {
+			nstreams = calls[i].thread + 1;
+		}
+		if ((double)(calls[i].start + calls[i].elapsed) / 1e9 > recwall) {
+			recwall = (double)(calls[i].start + calls[i].elapsed) / 1e9;
+		}
+	}
+	for (i = 0; i < nstreams; i++) {
+		if ((streams[i].idx = calloc((size_t)ncalls + 1, sizeof(int))) == NULL) {
+			retc = -2;
+			goto done;
+		}
+		streams[i].calls = calls;
+		streams[i].simmount = simmount;
+		streams[i].begin = &begin;
+	}
+	for (i = 0; i < ncalls; i++) {
+		streams[calls[i].thread].idx[streams[calls[i].thread].n++] = i;
+	}
+	fprintf(stdout,"INF: %s [%s:%u] %s: Replaying %d requests on %d mounts from %d threads\n",__progname,__FILE__,__LINE__,__func__,ncalls,nmounts,nstreams);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < nstreams; i++) {
+		if (!(started[i] = (pthread_create(&workers[i], NULL, replayworker, &streams[i]) == 0))) {
+			/* run it here instead, its requests will just start late */
+			replayworker(&streams[i]);
+		}
+	}
+	for (i = 0; i < nstreams; i++) {
+		if (started[i]) {
+			pthread_join(workers[i], NULL);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	repwall = tsdiff(&begin, &end);
+
+	for (i = 0; i < nstreams; i++) {
+		for (op = 0; op < SIMOP_COUNT; op++) {
+			total[op].calls += streams[i].stats[op].calls;
+			total[op].differ += streams[i].stats[op].differ;
+			total[op].recorded += streams[i].stats[op].recorded;
+			total[op].replayed += streams[i].stats[op].replayed;
+			total[op].recmax = (streams[i].stats[op].recmax > total[op].recmax) ? streams[i].stats[op].recmax : total[op].recmax;
+			total[op].repmax = (streams[i].stats[op].repmax > total[op].repmax) ? streams[i].stats[op].repmax : total[op].repmax;
+		}
+	}
+	for (op = 0; op < SIMOP_COUNT; op++) {
+		if (total[op].calls == 0) {
+			continue;
+		}
+		fprintf(stdout,"INF: %s: %s: %d calls, recorded %.3fs (slowest %.3fms), replayed %.3fs (slowest %.3fms), %d results differ\n",
+				__progname,opnames[op],total[op].calls,total[op].recorded,total[op].recmax * 1e3,total[op].replayed,total[op].repmax * 1e3,total[op].differ);
+		differ += total[op].differ;
+	}
+	fprintf(stdout,"INF: %s [%s:%u] %s: Recorded ioctls spanned %.3fs, the replay took %.3fs\n",__progname,__FILE__,__LINE__,__func__,recwall,repwall);
+	if (differ > 0) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: %d requests returned something else than when recorded\n",__progname,__FILE__,__LINE__,__func__,differ);
+	}
+
+done:
+	for (i = 0; i < nstreams; i++) {
+		free(streams[i].idx);
+	}
+	free(calls);
+	return(retc);
+}
+
+/*
+ * Load a whole trace
+ * returns 0 on success
+ */
+static int
+readtrace(const char *path, char from[][MNAMELEN], char on[][MNAMELEN], int *nmounts, struct replay_call **calls, int *ncalls) {
+	int alloc, retc;
+	unsigned char hdr[IOTRACE_HDRLEN], rec[IOTRACE_CALLLEN];
+	struct replay_call *call, *grown;
+	FILE *in;
+
+	*calls = NULL;
+	*ncalls = *nmounts = alloc = retc = 0;
+	if ((in = fopen(path, "r")) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s)\n",__progname,__FILE__,__LINE__,__func__,path,strerror(errno));
+		return(-1);
+	}
+	if (fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) || get32(hdr) != IOTRACE_MAGIC || get32(hdr + 4) != IOTRACE_VERSION) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %s is not an ioctl trace this version can read\n",__progname,__FILE__,__LINE__,__func__,path);
+		fclose(in);
+		return(-1);
+	}
+	while (retc == 0 && fread(rec, 1, 1, in) == 1) {
+		if (rec[0] == IOREC_MOUNT) {
+			if (fread(rec + 1, 1, 3, in) != 3 || rec[1] >= IOTRACE_MAXMOUNTS || rec[2] >= MNAMELEN || rec[3] >= MNAMELEN ||
+			    fread(from[rec[1]], 1, rec[2], in) != rec[2] || fread(on[rec[1]], 1, rec[3], in) != rec[3]) {
+				retc = -1;
+				break;
+			}
+			from[rec[1]][rec[2]] = 0;
+			on[rec[1]][rec[3]] = 0;
+			*nmounts = (rec[1] + 1 > *nmounts) ? rec[1] + 1 : *nmounts;
+			continue;
+		}
+		if (rec[0] != IOREC_CALL || fread(rec + 1, 1, IOTRACE_CALLLEN - 1, in) != IOTRACE_CALLLEN - 1 || rec[1] >= SIMOP_COUNT) {
+			retc = -1;
+			break;
+		}
+		if (*ncalls == alloc) {
+			alloc = (alloc == 0) ? 1024 : alloc * 2;
+			if ((grown = reallocarray(*calls, (size_t)alloc, sizeof(struct replay_call))) == NULL) {
+				retc = -2;
+				break;
+			}
+			*calls = grown;
+		}
+		call = &(*calls)[(*ncalls)++];
+		call->op = rec[1];
+		call->mount = rec[2];
+		call->thread = rec[3];
+		call->retc = (int32_t)get32(rec + 4);
+		call->err = (int32_t)get32(rec + 8);
+		call->start = get64(rec + 12);
+		call->elapsed = get64(rec + 20);
+		call->key = get64(rec + 28);
+		call->out = get64(rec + 36);
+		call->inodes = get64(rec + 44);
+		call->lsnap = get64(rec + 52);
+		call->subtype = rec[60];
+		if (fread(call->name, 1, rec[61], in) != rec[61]) {
+			retc = -1;
+			break;
+		}
+		call->name[rec[61]] = 0;
+	}
+	if (retc == -1) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %s is truncated or corrupt after %d requests\n",__progname,__FILE__,__LINE__,__func__,path,*ncalls);
+	}
+	fclose(in);
+	return(retc);
+}
+
+/*
+ * Seed the simulated backend with every mount the trace used and every PFS
+ * that must have existed before it began: ones that were listed, deleted or
+ * in the way of a snapshot before a snapshot of that name was taken
+ * returns 0 on success
+ */
+static int
+buildmodel(const struct replay_call *calls, int ncalls, char from[][MNAMELEN], char on[][MNAMELEN], int nmounts, int *simmount) {
+	int i, j, nseen, devid[IOTRACE_MAXMOUNTS];
+	size_t devlen;
+	struct replay_sighting *seen;
+
+	for (i = 0; i < nmounts; i++) {
+		if ((simmount[i] = simaddmount(from[i], on[i])) < 0) {
+			fprintf(stderr,"WRN: %s [%s:%u] %s: Requests on %s can't be replayed\n",__progname,__FILE__,__LINE__,__func__,from[i]);
+		}
+		/* mounts of the same device share a device id */
+		devlen = strcspn(from[i], "@");
+		for (devid[i] = i, j = 0; j < i; j++) {
+			if (strcspn(from[j], "@") == devlen && strncmp(from[i], from[j], devlen) == 0) {
+				devid[i] = devid[j];
+				break;
+			}
+		}
+	}
+	if ((seen = calloc((size_t)ncalls + 1, sizeof(struct replay_sighting))) == NULL) {
+		return(-2);
+	}
+	for (i = nseen = 0; i < ncalls; i++) {
+		if (calls[i].mount >= nmounts || simmount[calls[i].mount] < 0) {
+			continue;
+		}
+		if (calls[i].op == SIMOP_INODE_GET && calls[i].retc == 0) {
+			simaddpfs(simmount[calls[i].mount], from[calls[i].mount] + strcspn(from[calls[i].mount], "@") + 1,
+			          calls[i].subtype, calls[i].out);
+		} else if ((calls[i].op == SIMOP_PFS_GET && calls[i].retc == 0) ||
+		           (calls[i].op == SIMOP_DELETE && calls[i].retc == 0) ||
+		           (calls[i].op == SIMOP_SNAPSHOT && (calls[i].retc == 0 || calls[i].err == EEXIST))) {
+			seen[nseen].dev = devid[calls[i].mount];
+			seen[nseen].name = calls[i].name;
+			seen[nseen].call = i;
+			seen[nseen].creates = (calls[i].op == SIMOP_SNAPSHOT && calls[i].retc == 0);
+			seen[nseen].subtype = (calls[i].op == SIMOP_PFS_GET) ? calls[i].subtype : HAMMER2_PFSSUBTYPE_SNAPSHOT;
+			seen[nseen++].mount = simmount[calls[i].mount];
+		}
+	}
+	qsort(seen, (size_t)nseen, sizeof(struct replay_sighting), cmpsightings);
+	for (i = 0; i < nseen; i++) {
+		/* only the earliest sighting of each name decides */
+		if ((i == 0 || seen[i].dev != seen[i - 1].dev || strcmp(seen[i].name, seen[i - 1].name) != 0) && !seen[i].creates) {
+			simaddpfs(seen[i].mount, seen[i].name, seen[i].subtype, 0);
+		}
+	}
+	DBGTRACE("Seeded the model from %d sightings across %d mounts", nseen, nmounts);
+	free(seen);
+	return(0);
+}
+
+/*
+ * Issue one recording thread's requests, none earlier than it was recorded
+ */
+static void *
+replayworker(void *arg) {
+	int i, fault, retc;
+	uint64_t due, lastrec, lastsim;
+	double took;
+	struct replay_stream *rs;
+	const struct replay_call *call;
+	struct replay_stats *st;
+	struct timespec now, done, nap;
+	hammer2_ioc_pfs_t pfs;
+	hammer2_ioc_inode_t ino;
+	void *ioarg;
+
+	rs = arg;
+	lastrec = lastsim = 0;
+	for (i = 0; i < rs->n; i++) {
+		call = &rs->calls[rs->idx[i]];
+		if (rs->simmount[call->mount] < 0) {
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((due = call->start) > nsec(rs->begin, &now)) {
+			due -= nsec(rs->begin, &now);
+			nap.tv_sec = (time_t)(due / 1000000000);
+			nap.tv_nsec = (long)(due % 1000000000);
+			nanosleep(&nap, NULL);
+		}
+		memset(&pfs, 0, sizeof(pfs));
+		memset(&ino, 0, sizeof(ino));
+		ioarg = &pfs;
+		switch (call->op) {
+			case SIMOP_INODE_GET:
+				ioarg = &ino;
+				break;
+			case SIMOP_PFS_GET:
+				/* the recorded keys are the kernel's, follow the model's own chain instead */
+				pfs.name_key = (call->key != 0 && call->key == lastrec) ? lastsim : 0;
+				break;
+			default:
+				strlcpy(pfs.name, call->name, sizeof(pfs.name));
+				break;
+		}
+		/* failures the model has no reason to produce are injected as recorded */
+		fault = (call->retc != 0 && call->err != EEXIST && call->err != ENOENT) ? call->err : 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		retc = simcall(rs->simmount[call->mount], oprequests[call->op], ioarg, (unsigned long)(call->elapsed / 1000), fault);
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		if (call->op == SIMOP_PFS_GET && retc == 0) {
+			lastrec = call->out;
+			lastsim = pfs.name_next;
+		}
+		took = tsdiff(&now, &done);
+		st = &rs->stats[call->op];
+		st->calls++;
+		st->differ += ((retc == 0) != (call->retc == 0)) ? 1 : 0;
+		st->recorded += (double)call->elapsed / 1e9;
+		st->replayed += took;
+		st->recmax = ((double)call->elapsed / 1e9 > st->recmax) ? (double)call->elapsed / 1e9 : st->recmax;
+		st->repmax = (took > st->repmax) ? took : st->repmax;
+	}
+	return(NULL);
+}
+
+static int
+cmpsightings(const void *a, const void *b) {
+	const struct replay_sighting *lhs = a;
+	const struct replay_sighting *rhs = b;
+	int cmp;
+
+	if (lhs->dev != rhs->dev) {
+		return((lhs->dev < rhs->dev) ? -1 : 1);
+	}
+	if ((cmp = strcmp(lhs->name, rhs->name)) != 0) {
+		return(cmp);
+	}
+	return((lhs->call < rhs->call) ? -1 : (lhs->call > rhs->call));
+}
+
+static uint64_t
+nsec(const struct timespec *from, const struct timespec *to) {
+	int64_t ns;
+
+	ns = (int64_t)(to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+	return((ns > 0) ? (uint64_t)ns : 0);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Traces of the HAMMER2 ioctls a run makes, and replaying them offline.
+ * With -T record=file every request h2ioctl() passes on is logged with its
+ * arguments, result and latency. -T replay=file rebuilds the devices and PFSes
+ * the trace saw in the simulated backend and issues the same requests again,
+ * one replay thread per recording thread, each request taking as long as it
+ * did and starting no earlier than it did.
+ *
+ * header: magic, version, wall clock seconds when recording began
+ * mount:  'M', index, fromlen, onlen, from, on (on is left empty when recording)
+ * call:   'C', op, mount, thread, retc, errno, start ns, elapsed ns,
+ *         name_key, name_next or data_count, inode_count, pfs_lsnap_tid,
+ *         pfs_subtype, namelen, name
+ * everything is little endian, start is relative to the header
+ */
+
+#define DFBEADM_FSREPLAY_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+/* "DFBI" */
+#define IOTRACE_MAGIC 0x49424644U
+#define IOTRACE_VERSION 1
+#define IOTRACE_HDRLEN 16
+#define IOTRACE_CALLLEN 62
+/* mounts and threads beyond these are folded into the last one */
+#define IOTRACE_MAXMOUNTS 64
+#define IOTRACE_MAXTHREADS 64
+
+#define IOREC_MOUNT 'M'
+#define IOREC_CALL 'C'
+
+int iotrace_open(const char *path);
+void iotrace_call(const char *dev, unsigned long request, const void *arg, int retc, int err, const struct timespec *before, double elapsed);
+int iotrace_close(void);
+int replay(const char *path);
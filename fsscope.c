@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSSCOPE_H
+#include "fsscope.h"
+#endif
+#ifndef DFBEADM_FSCOLLECT_H
+#include "fscollect.h"
+#endif
+#ifndef DFBEADM_FSUP_H
+#include "fsupdate.h"
+#endif
+#ifndef DFBEADM_SNAPFS_H
+#include "snapfs.h"
+#endif
+#ifndef DFBEADM_FSPREFLIGHT_H
+#include "fspreflight.h"
+#endif
+#ifndef DFBEADM_FSGROUP_H
+#include "fsgroup.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+/* work queue shared by the scope workers */
+struct scope_pool {
+	pthread_mutex_t lock;
+	bescope *scopes;
+	const char *label;
+	int nscopes;
+	int next;
+};
+
+static void *scopeworker(void *arg);
+
+/*
+ * Create one boot environment per scope, where each scope only contains the 
+ * PFSes mounted at or below the given mountpoint. The fstab is only read once,
+ * every entry is handed to the most specific scope containing it, and scopes are
+ * then snapshotted concurrently by a small pool of workers.
+ * returns 0 if every scope was created, nonzero otherwise
+ */
+int
+create_scoped(const char *label, char **scopes, int nscopes) {
+	int i, j, best, fstabcount, nworkers, perr, retc;
+	size_t bestlen, len;
+	int *owner;
+	bedata *befs;
+	bescope *scope;
+	pthread_t workers[SCOPE_WORKERS];
+	struct scope_pool pool;
+
+	assert((label != NULL) && (scopes != NULL) && (nscopes > 0));
+	retc = fstabcount = nworkers = perr = 0;
+	befs = NULL; owner = NULL; scope = NULL;
+
+	DBGTRACE("Entering with label = %s, nscopes = %d", label, nscopes);
+	if ((retc = collectfs(&befs, &fstabcount)) != 0) {
+		return(retc);
+	}
+	if (((scope = calloc((size_t)nscopes, sizeof(bescope))) == NULL) ||
+	    ((owner = calloc((size_t)fstabcount, sizeof(int))) == NULL)) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to allocate scope buffers!\n",__progname,__FILE__,__LINE__,__func__);
+		free(scope);
+		freefs(befs, fstabcount);
+		return(2);
+	}
+
+	for (i = 0; i < nscopes; i++) {
+		strlcpy(scope[i].mountpoint, scopes[i], MNAMELEN);
+		/* "/usr/local/jails/" and "/usr/local/jails" are the same scope */
+		for (len = strlen(scope[i].mountpoint); len > 1 && scope[i].mountpoint[len - 1] == '/'; len--) {
+			scope[i].mountpoint[len - 1] = 0;
+		}
+		/* a failed scope still claims its entries, they must not fall through to an enclosing one */
+		if (strlen(scopes[i]) >= MNAMELEN || scopefrag(scope[i].mountpoint, scope[i].fragment, sizeof(scope[i].fragment)) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Scope %s is too long to name a fragment after\n",__progname,__FILE__,__LINE__,__func__,scopes[i]);
+			scope[i].retc = -1;
+		}
+	}
+
+	/* 
+	 * hand every entry to the longest scope that contains it, so nested scopes 
+	 * never snapshot the same PFS twice
+	 */
+	for (i = 0; i < fstabcount; i++) {
+		best = -1; bestlen = 0;
+		for (j = 0; j < nscopes; j++) {
+			len = strlen(scope[j].mountpoint);
+			if (inscope(scope[j].mountpoint, befs[i].fstab.fs_file) && (best < 0 || len > bestlen)) {
+				best = j; bestlen = len;
+			}
+		}
+		owner[i] = best;
+		if (best >= 0) {
+			scope[best].count++;
+		}
+	}
+	/* a group's freeze window has to cover all of its snapshots, which only one scope can do */
+	if (splitgroups(befs, fstabcount, owner) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: The scopes given split consistency groups, nothing was snapshotted\n",__progname,__FILE__,__LINE__,__func__);
+		retc = 3;
+		goto cleanup;
+	}
+	for (j = 0; j < nscopes; j++) {
+		if (scope[j].count == 0) {
+			fprintf(stderr,"WRN: %s [%s:%u] %s: No fstab entries found at or below %s, skipping\n",__progname,__FILE__,__LINE__,__func__,scope[j].mountpoint);
+			continue;
+		}
+		if ((scope[j].members = calloc((size_t)scope[j].count, sizeof(bedata))) == NULL) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to allocate members of %s!\n",__progname,__FILE__,__LINE__,__func__,scope[j].mountpoint);
+			retc = 2;
+			goto cleanup;
+		}
+		scope[j].count = 0;
+	}
+	for (i = 0; i < fstabcount; i++) {
+		if (owner[i] >= 0) {
+			scope[owner[i]].members[scope[owner[i]].count++] = befs[i];
+		}
+	}
+
+	pool.scopes = scope;
+	pool.nscopes = nscopes;
+	pool.label = label;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (nworkers = 0; nworkers < SCOPE_WORKERS && nworkers < nscopes; nworkers++) {
+		if ((perr = pthread_create(&workers[nworkers], NULL, scopeworker, &pool)) != 0) {
+			fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to start scope worker %d (%s)\n",__progname,__FILE__,__LINE__,__func__,nworkers,strerror(perr));
+			break;
+		}
+	}
+	/* no workers means we do the job ourselves, otherwise wait for the queue to drain */
+	if (nworkers == 0) {
+		scopeworker(&pool);
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+
+	for (j = 0; j < nscopes; j++) {
+		if (scope[j].retc != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Boot environment %s failed for scope %s\n",__progname,__FILE__,__LINE__,__func__,label,scope[j].mountpoint);
+			retc = 1;
+		}
+	}
+
+cleanup:
+	/* members are shallow copies, the strings belong to befs */
+	for (j = 0; j < nscopes; j++) {
+		free(scope[j].members);
+	}
+	free(scope);
+	free(owner);
+	freefs(befs, fstabcount);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Pull scopes off the shared queue until it's empty
+ */
+static void *
+scopeworker(void *arg) {
+	int idx;
+	struct scope_pool *pool;
+
+	pool = arg;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		idx = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (idx >= pool->nscopes) {
+			break;
+		}
+		if (pool->scopes[idx].count > 0 && pool->scopes[idx].retc == 0) {
+			pool->scopes[idx].retc = snapscope(&pool->scopes[idx], pool->label);
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * Snapshot a single scope and write its fstab fragment, 
+ * the fragment is only installed if every snapshot succeeded.
+ * A scope is checked like a whole environment before anything is taken, but it
+ * isn't recorded, the record database only knows environments covering the whole fstab
+ */
+int
+snapscope(bescope *scope, const char *label) {
+	int retc;
+
+	assert((scope != NULL) && (label != NULL));
+	retc = 0;
+	DBGTRACE("Entering with scope = %s, count = %d", scope->mountpoint, scope->count);
+	if (marktargets(scope->members, scope->count, label) == 0) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: No HAMMER2 filesystems found in scope %s\n",__progname,__FILE__,__LINE__,__func__,scope->mountpoint);
+	} else if ((retc = preflight_create(scope->members, scope->count, label)) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %d problems found in scope %s, leaving %s untouched\n",
+				__progname,__FILE__,__LINE__,__func__,retc,scope->mountpoint,scope->fragment);
+	} else if ((retc = timedsnaps(scope->members, scope->count)) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %d snapshots failed in scope %s, leaving %s untouched\n",
+				__progname,__FILE__,__LINE__,__func__,retc,scope->mountpoint,scope->fragment);
+	} else {
+		retc = writefrag(scope->members, scope->count, label, scope->fragment);
+	}
+	closefs(scope->members, scope->count);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Check whether the mountpoint lies at or below the scope
+ */
+bool
+inscope(const char *scope, const char *mountpoint) {
+	size_t len;
+
+	assert((scope != NULL) && (mountpoint != NULL));
+	len = strlen(scope);
+	if (len == 1 && *scope == '/') {
+		return(*mountpoint == '/');
+	}
+	return((strncmp(scope, mountpoint, len) == 0) && (mountpoint[len] == 0 || mountpoint[len] == '/'));
+}
+
+/*
+ * Name the fstab fragment after the scope using the dotted layout from design.txt,
+ * so "/usr/local/jails/www" is written to "/etc/fstab.usr.local.jails.www".
+ * A '.' or '%' in the scope is written as %2E or %25, and / itself as %2F,
+ * so no two scopes can share a fragment: "/a/b.c" becomes "fstab.a.b%2Ec".
+ * returns 0 on success, -1 if the name doesn't fit, as truncating it would give up that guarantee
+ */
+int
+scopefrag(const char *scope, char *fragment, size_t fraglen) {
+	size_t used, leaf;
+
+	assert((scope != NULL) && (fragment != NULL));
+	used = (size_t)snprintf(fragment, fraglen, "%s/fstab.", SCOPE_FRAGDIR);
+	/* where the file name starts, past SCOPE_FRAGDIR and its slash */
+	leaf = sizeof(SCOPE_FRAGDIR);
+	for (; *scope == '/'; scope++) { ; }
+	if (*scope == 0) {
+		return((strlcat(fragment, "%2F", fraglen) < fraglen) ? 0 : -1);
+	}
+	for (; *scope != 0 && used + 4 < fraglen; scope++) {
+		switch (*scope) {
+			case '/':
+				fragment[used++] = '.';
+				break;
+			case '.':
+			case '%':
+				used += (size_t)snprintf(fragment + used, fraglen - used, "%%%02X", (unsigned char)*scope);
+				break;
+			default:
+				fragment[used++] = *scope;
+		}
+	}
+	fragment[used] = 0;
+	return((*scope == 0 && used - leaf <= NAME_MAX) ? 0 : -1);
+}
@@ -0,0 +1,665 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fstab.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSSIM_H
+#include "fssim.h"
+#endif
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+
+extern char *__progname;
+
+struct sim_pfs {
+	char name[NAME_MAX + 1];
+	hammer2_key_t key; /* what PFS_GET iterates on, only ever grows */
+	uint8_t subtype;
+	uint64_t size;
+	uint64_t mtime;
+	hammer2_tid_t lsnap_tid;
+};
+
+struct sim_device {
+	char name[MNAMELEN];
+	int capacity; /* 0 for unlimited */
+	struct sim_pfs *pfs; /* in key order */
+	int npfs;
+	int alloc;
+	hammer2_key_t nextkey;
+	hammer2_tid_t tid;
+};
+
+struct sim_mount {
+	char from[MNAMELEN]; /* device@pfs */
+	char on[MNAMELEN];
+	const char *pfs; /* points into from */
+	int dev;
+	dev_t st_dev;
+	ino_t st_ino;
+};
+
+struct sim_fault {
+	unsigned long latency; /* microseconds */
+	unsigned long jitter;
+	double failrate;
+	int failerr;
+};
+
+static const char *const simopnames[SIMOP_COUNT] = { "inode-get", "pfs-get", "snapshot", "delete" };
+
+static const struct {
+	const char *name;
+	int err;
+} simerrs[] = {
+	{ "EIO", EIO }, { "ENOSPC", ENOSPC }, { "EBUSY", EBUSY }, { "EINVAL", EINVAL },
+	{ "ENOENT", ENOENT }, { "EEXIST", EEXIST }, { "EPERM", EPERM }, { "ETIMEDOUT", ETIMEDOUT },
+};
+
+/* the model is loaded once and only changed under simlock afterwards */
+static pthread_mutex_t simlock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	bool active;
+	unsigned int seed;
+	struct sim_device devs[SIM_MAXDEVS];
+	int ndevs;
+	struct sim_mount mounts[SIM_MAXMOUNTS];
+	int nmounts;
+	struct sim_fault faults[SIMOP_COUNT];
+	char fstab[MAXPATHLEN]; /* the model's mounts as fstab(5) */
+	char recdb[MAXPATHLEN]; /* this run's copy of the record database */
+} sim;
+
+static int simline(char *key, char *value);
+static int simscratch(void);
+static void simcleanup(void);
+static struct sim_device *simdev(const char *name, size_t namelen);
+static struct sim_pfs *addpfs(struct sim_device *dev, const char *name, uint8_t subtype, uint64_t size);
+static struct sim_pfs *findpfs(struct sim_device *dev, const char *name);
+static int simop_of(const char *name);
+static simop simop_for(unsigned long request);
+static uint64_t simsize(const char *str);
+
+/*
+ * Build the model from the file DFBEADM_SIM names, if it's set at all
+ * returns 0 on success or when not simulating, nonzero on a malformed file
+ */
+int
+siminit(void) {
+	int lineno, retc, i;
+	char line[1024], *key, *value, *end;
+	const char *path;
+	struct stat st;
+	FILE *conf;
+
+	if ((path = getenv(DFBEADM_SIM_ENV)) == NULL || *path == 0) {
+		return(0);
+	}
+	lineno = retc = 0;
+	sim.seed = (unsigned int)time(NULL);
+	if ((conf = fopen(path, "r")) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s)\n",__progname,__FILE__,__LINE__,__func__,path,strerror(errno));
+		return(-1);
+	}
+	while (retc == 0 && fgets(line, sizeof(line), conf) != NULL) {
+		lineno++;
+		key = line + strspn(line, " \t");
+		if (*key == '#' || *key == '\n' || *key == 0) {
+			continue;
+		}
+		value = key + strcspn(key, " \t\n");
+		if (*value != 0) {
+			*value++ = 0;
+		}
+		value += strspn(value, " \t");
+		for (end = value + strlen(value); end > value && (end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t'); end--) {
+			end[-1] = 0;
+		}
+		if ((retc = simline(key, value)) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %s:%d: can't make sense of \"%s %s\"\n",__progname,__FILE__,__LINE__,__func__,path,lineno,key,value);
+		}
+	}
+	fclose(conf);
+	/* descriptors are matched to mounts by the directory they were opened on */
+	for (i = 0; retc == 0 && i < sim.nmounts; i++) {
+		if (stat(sim.mounts[i].on, &st) != 0 || !S_ISDIR(st.st_mode)) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Simulated mountpoint %s has to be a directory\n",__progname,__FILE__,__LINE__,__func__,sim.mounts[i].on);
+			retc = -1;
+			break;
+		}
+		sim.mounts[i].st_dev = st.st_dev;
+		sim.mounts[i].st_ino = st.st_ino;
+	}
+	if (retc == 0) {
+		retc = simscratch();
+	}
+	if ((sim.active = (retc == 0))) {
+		fprintf(stderr,"INF: %s [%s:%u] %s: Simulating %d HAMMER2 devices and %d mounts from %s\n",__progname,__FILE__,__LINE__,__func__,sim.ndevs,sim.nmounts,path);
+	}
+	return(retc);
+}
+
+bool
+simactive(void) {
+	return(sim.active);
+}
+
+/*
+ * The fstab(5) getfsent(3) reads while simulating, built from the mounts of the model
+ */
+const char *
+simfstab(void) {
+	return(sim.fstab);
+}
+
+/*
+ * The record database connect_bedb() opens while simulating, a copy of the real
+ * one taken by siminit(), so simulated environments never reach the host's records
+ */
+const char *
+simrecdb(void) {
+	return(sim.recdb);
+}
+
+/*
+ * Answer a HAMMER2 ioctl from the model, after the configured delay
+ * returns 0 on success, -1 with errno set otherwise, like ioctl(2)
+ */
+int
+simioctl(int fd, unsigned long request, void *arg) {
+	int i, mount, err;
+	unsigned long usec;
+	struct stat st;
+	simop op;
+
+	if ((op = simop_for(request)) == SIMOP_COUNT) {
+		errno = ENOTTY;
+		return(-1);
+	}
+	if (fstat(fd, &st) != 0) {
+		return(-1);
+	}
+	for (i = 0, mount = -1; i < sim.nmounts && mount < 0; i++) {
+		if (sim.mounts[i].st_dev == st.st_dev && sim.mounts[i].st_ino == st.st_ino) {
+			mount = i;
+		}
+	}
+	if (mount < 0) {
+		/* just like asking something that isn't HAMMER2 */
+		errno = ENOTTY;
+		return(-1);
+	}
+	pthread_mutex_lock(&simlock);
+	usec = sim.faults[op].latency;
+	if (sim.faults[op].jitter > 0) {
+		usec += (unsigned long)rand_r(&sim.seed) % (sim.faults[op].jitter + 1);
+	}
+	err = (sim.faults[op].failrate > 0 && rand_r(&sim.seed) / ((double)RAND_MAX + 1) < sim.faults[op].failrate) ? sim.faults[op].failerr : 0;
+	pthread_mutex_unlock(&simlock);
+	return(simcall(mount, request, arg, usec, err));
+}
+
+/*
+ * Carry out a request on the given mount of the model, taking usec
+ * microseconds and failing with fault right after the delay if it's nonzero
+ * returns 0 on success, -1 with errno set otherwise, like ioctl(2)
+ */
+int
+simcall(int mount, unsigned long request, void *arg, unsigned long usec, int fault) {
+	int i, err;
+	struct timespec nap;
+	struct sim_mount *mnt;
+	struct sim_device *dev;
+	struct sim_pfs *pfs, *origin;
+	simop op;
+	hammer2_ioc_pfs_t *iopfs;
+	hammer2_ioc_inode_t *ioino;
+
+	if ((op = simop_for(request)) == SIMOP_COUNT || mount < 0 || mount >= sim.nmounts) {
+		errno = ENOTTY;
+		return(-1);
+	}
+	mnt = &sim.mounts[mount];
+	/* sleep outside the lock, concurrent requests overlap like they would in the kernel */
+	if (usec > 0) {
+		nap.tv_sec = (time_t)(usec / 1000000);
+		nap.tv_nsec = (long)(usec % 1000000) * 1000;
+		nanosleep(&nap, NULL);
+	}
+	if (fault != 0) {
+		DBGTRACE("Injecting %s into %s on %s", strerror(fault), simopnames[op], mnt->from);
+		errno = fault;
+		return(-1);
+	}
+
+	err = 0;
+	pthread_mutex_lock(&simlock);
+	dev = &sim.devs[mnt->dev];
+	switch (op) {
+		case SIMOP_INODE_GET:
+			ioino = arg;
+			if ((pfs = findpfs(dev, mnt->pfs)) == NULL) {
+				err = ENOENT;
+				break;
+			}
+			ioino->data_count = (hammer2_key_t)pfs->size;
+			ioino->inode_count = (hammer2_key_t)(pfs->size >> 14) + 1;
+			ioino->ip_data.meta.mtime = pfs->mtime;
+			ioino->ip_data.meta.pfs_type = HAMMER2_PFSTYPE_MASTER;
+			ioino->ip_data.meta.pfs_subtype = pfs->subtype;
+			ioino->ip_data.meta.pfs_lsnap_tid = pfs->lsnap_tid;
+			break;
+		case SIMOP_PFS_GET:
+			iopfs = arg;
+			/* the first PFS at or after name_key */
+			for (i = 0; i < dev->npfs && dev->pfs[i].key < iopfs->name_key; i++);
+			if (i == dev->npfs) {
+				err = ENOENT;
+				break;
+			}
+			strlcpy(iopfs->name, dev->pfs[i].name, sizeof(iopfs->name));
+			iopfs->pfs_type = HAMMER2_PFSTYPE_MASTER;
+			iopfs->pfs_subtype = dev->pfs[i].subtype;
+			iopfs->name_next = (i + 1 < dev->npfs) ? dev->pfs[i + 1].key : (hammer2_key_t)-1;
+			break;
+		case SIMOP_SNAPSHOT:
+			iopfs = arg;
+			if (findpfs(dev, iopfs->name) != NULL) {
+				err = EEXIST;
+			} else if (dev->capacity > 0 && dev->npfs >= dev->capacity) {
+				err = ENOSPC;
+			} else if ((origin = findpfs(dev, mnt->pfs)) == NULL) {
+				err = ENOENT;
+			} else {
+				/* addpfs() may move the array, origin is done with first */
+				origin->lsnap_tid = ++dev->tid;
+				if (addpfs(dev, iopfs->name, HAMMER2_PFSSUBTYPE_SNAPSHOT, origin->size) == NULL) {
+					err = ENOMEM;
+				}
+			}
+			break;
+		case SIMOP_DELETE:
+			iopfs = arg;
+			if ((pfs = findpfs(dev, iopfs->name)) == NULL) {
+				err = ENOENT;
+				break;
+			}
+			i = (int)(pfs - dev->pfs);
+			memmove(&dev->pfs[i], &dev->pfs[i + 1], (size_t)(dev->npfs - i - 1) * sizeof(struct sim_pfs));
+			dev->npfs--;
+			break;
+		default:
+			break;
+	}
+	pthread_mutex_unlock(&simlock);
+	if (err != 0) {
+		errno = err;
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Add a mount to the model without a host directory behind it,
+ * only reachable through simcall()
+ * returns its index, -1 if the model is full
+ */
+int
+simaddmount(const char *from, const char *on) {
+	size_t devlen;
+	struct sim_device *dev;
+	struct sim_mount *mnt;
+
+	if (sim.nmounts == SIM_MAXMOUNTS || (devlen = strcspn(from, "@")) == strlen(from) ||
+	    (dev = simdev(from, devlen)) == NULL || addpfs(dev, from + devlen + 1, HAMMER2_PFSSUBTYPE_NONE, 0) == NULL) {
+		return(-1);
+	}
+	mnt = &sim.mounts[sim.nmounts];
+	strlcpy(mnt->from, from, sizeof(mnt->from));
+	strlcpy(mnt->on, on, sizeof(mnt->on));
+	mnt->pfs = mnt->from + devlen + 1;
+	mnt->dev = (int)(dev - sim.devs);
+	sim.active = true;
+	return(sim.nmounts++);
+}
+
+/*
+ * Make sure the device a mount is on holds a PFS, a size of 0 leaves it alone
+ * returns 0 on success
+ */
+int
+simaddpfs(int mount, const char *name, uint8_t subtype, uint64_t size) {
+	struct sim_pfs *pfs;
+
+	if (mount < 0 || mount >= sim.nmounts ||
+	    (pfs = addpfs(&sim.devs[sim.mounts[mount].dev], name, subtype, 0)) == NULL) {
+		return(-1);
+	}
+	pfs->subtype = subtype;
+	pfs->size = (size > 0) ? size : pfs->size;
+	return(0);
+}
+
+/*
+ * getfsstat(2) for the simulated mounts, all of them HAMMER2
+ * returns the number of mounts, or how many were stored in buf
+ */
+int
+simfsstat(struct statfs *buf, long bufsize) {
+	int i;
+
+	if (buf == NULL) {
+		return(sim.nmounts);
+	}
+	for (i = 0; i < sim.nmounts && (long)((size_t)(i + 1) * sizeof(struct statfs)) <= bufsize; i++) {
+		memset(&buf[i], 0, sizeof(struct statfs));
+		strlcpy(buf[i].f_fstypename, "hammer2", sizeof(buf[i].f_fstypename));
+		strlcpy(buf[i].f_mntonname, sim.mounts[i].on, sizeof(buf[i].f_mntonname));
+		strlcpy(buf[i].f_mntfromname, sim.mounts[i].from, sizeof(buf[i].f_mntfromname));
+	}
+	return(i);
+}
+
+/*
+ * Write the model's fstab and copy the record database aside, both removed at exit,
+ * and point getfsent(3) at the fstab. Nothing of the host is read as the system's
+ * own configuration or written after this.
+ * returns 0 on success
+ */
+static int
+simscratch(void) {
+	int i, fd, retc;
+	char realdb[MAXPATHLEN];
+	sqlite3 *from, *to;
+	sqlite3_backup *copy;
+	FILE *fstab;
+
+	retc = 0;
+	from = to = NULL;
+	strlcpy(sim.fstab, "/tmp/dfbeadm.sim.fstab.XXXXXX", sizeof(sim.fstab));
+	strlcpy(sim.recdb, "/tmp/dfbeadm.sim.db.XXXXXX", sizeof(sim.recdb));
+	if ((fd = mkstemp(sim.fstab)) < 0 || (fstab = fdopen(fd, "w")) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to create %s (%s)\n",__progname,__FILE__,__LINE__,__func__,sim.fstab,strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(sim.fstab);
+		}
+		sim.fstab[0] = sim.recdb[0] = 0;
+		return(-1);
+	}
+	for (i = 0; i < sim.nmounts; i++) {
+		fprintf(fstab, "%s\t%s\thammer2\trw\t1\t%d\n", sim.mounts[i].from, sim.mounts[i].on, (strcmp(sim.mounts[i].on, "/") == 0) ? 1 : 2);
+	}
+	if (fclose(fstab) != 0 || (fd = mkstemp(sim.recdb)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to stage the simulated system (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+		unlink(sim.fstab);
+		sim.fstab[0] = sim.recdb[0] = 0;
+		return(-1);
+	}
+	close(fd);
+	atexit(simcleanup);
+	setfstab(sim.fstab);
+
+	/* without a real database the copy stays empty and fails to open, just as the real one would */
+	snprintf(realdb, sizeof(realdb), "%s/%s", DFBEADM_CONFIG_DIR, DFBEADM_RECORD_DB);
+	if (sqlite3_open_v2(realdb, &from, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+	    sqlite3_open_v2(sim.recdb, &to, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK &&
+	    (copy = sqlite3_backup_init(to, "main", from, "main")) != NULL) {
+		sqlite3_backup_step(copy, -1);
+		if (sqlite3_backup_finish(copy) != SQLITE_OK) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to copy %s (%s)\n",__progname,__FILE__,__LINE__,__func__,realdb,sqlite3_errmsg(to));
+			retc = -1;
+		}
+	}
+	sqlite3_close(from);
+	sqlite3_close(to);
+	if (retc == 0 && access(realdb, F_OK) != 0) {
+		unlink(sim.recdb);
+	}
+	return(retc);
+}
+
+static void
+simcleanup(void) {
+	if (sim.fstab[0] != 0) {
+		unlink(sim.fstab);
+	}
+	if (sim.recdb[0] != 0) {
+		unlink(sim.recdb);
+	}
+}
+
+/*
+ * Apply one line of the configuration
+ * returns 0 on success
+ */
+static int
+simline(char *key, char *value) {
+	int op;
+	char *word, *opt, *last, *errname;
+	size_t devlen, e;
+	struct sim_device *dev;
+	struct sim_mount *mnt;
+	struct sim_pfs *pfs;
+
+	if ((word = strtok_r(value, " \t", &last)) == NULL) {
+		return(-1);
+	}
+	if (strcmp(key, "seed") == 0) {
+		sim.seed = (unsigned int)strtoul(word, NULL, 10);
+	} else if (strcmp(key, "device") == 0) {
+		if ((dev = simdev(word, strlen(word))) == NULL) {
+			return(-1);
+		}
+		while ((opt = strtok_r(NULL, " \t", &last)) != NULL) {
+			if (strncmp(opt, "capacity=", 9) != 0) {
+				return(-1);
+			}
+			dev->capacity = atoi(opt + 9);
+		}
+	} else if (strcmp(key, "mount") == 0 || strcmp(key, "pfs") == 0) {
+		/* both name an existing PFS, a mount also says where it's mounted */
+		if ((devlen = strcspn(word, "@")) == strlen(word) || (dev = simdev(word, devlen)) == NULL) {
+			return(-1);
+		}
+		if (*key == 'm') {
+			if (sim.nmounts == SIM_MAXMOUNTS || (opt = strtok_r(NULL, " \t", &last)) == NULL) {
+				return(-1);
+			}
+			mnt = &sim.mounts[sim.nmounts++];
+			strlcpy(mnt->from, word, sizeof(mnt->from));
+			strlcpy(mnt->on, opt, sizeof(mnt->on));
+			mnt->pfs = mnt->from + devlen + 1;
+			mnt->dev = (int)(dev - sim.devs);
+		}
+		/* a PFS named again is the one already known, not the last one added */
+		if ((pfs = addpfs(dev, word + devlen + 1, HAMMER2_PFSSUBTYPE_NONE, 0)) == NULL) {
+			return(-1);
+		}
+		while ((opt = strtok_r(NULL, " \t", &last)) != NULL) {
+			if (strcmp(opt, "snapshot") == 0) {
+				pfs->subtype = HAMMER2_PFSSUBTYPE_SNAPSHOT;
+			} else if (strncmp(opt, "size=", 5) == 0) {
+				pfs->size = simsize(opt + 5);
+			} else {
+				return(-1);
+			}
+		}
+	} else if (strcmp(key, "latency") == 0) {
+		if ((op = simop_of(word)) < 0 || (opt = strtok_r(NULL, " \t", &last)) == NULL) {
+			return(-1);
+		}
+		sim.faults[op].latency = strtoul(opt, NULL, 10);
+		if ((opt = strtok_r(NULL, " \t", &last)) != NULL) {
+			sim.faults[op].jitter = strtoul(opt, NULL, 10);
+		}
+	} else if (strcmp(key, "fail") == 0) {
+		if ((op = simop_of(word)) < 0 || (opt = strtok_r(NULL, " \t", &last)) == NULL) {
+			return(-1);
+		}
+		sim.faults[op].failrate = strtod(opt, NULL);
+		sim.faults[op].failerr = EIO;
+		if ((errname = strtok_r(NULL, " \t", &last)) != NULL) {
+			for (e = 0; e < sizeof(simerrs) / sizeof(simerrs[0]) && strcmp(simerrs[e].name, errname) != 0; e++);
+			if (e == sizeof(simerrs) / sizeof(simerrs[0])) {
+				return(-1);
+			}
+			sim.faults[op].failerr = simerrs[e].err;
+		}
+	} else {
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Find a device by name, adding it the first time it's named
+ */
+static struct sim_device *
+simdev(const char *name, size_t namelen) {
+	int i;
+
+	for (i = 0; i < sim.ndevs; i++) {
+		if (strncmp(sim.devs[i].name, name, namelen) == 0 && sim.devs[i].name[namelen] == 0) {
+			return(&sim.devs[i]);
+		}
+	}
+	if (sim.ndevs == SIM_MAXDEVS || namelen >= MNAMELEN) {
+		return(NULL);
+	}
+	snprintf(sim.devs[sim.ndevs].name, MNAMELEN, "%.*s", (int)namelen, name);
+	sim.devs[sim.ndevs].nextkey = 1;
+	return(&sim.devs[sim.ndevs++]);
+}
+
+/*
+ * Append a PFS to a device, or return the one with that name if it exists
+ */
+static struct sim_pfs *
+addpfs(struct sim_device *dev, const char *name, uint8_t subtype, uint64_t size) {
+	struct sim_pfs *pfs, *grown;
+
+	if ((pfs = findpfs(dev, name)) != NULL) {
+		return(pfs);
+	}
+	if (dev->npfs == dev->alloc) {
+		dev->alloc = (dev->alloc == 0) ? 64 : dev->alloc * 2;
+		if ((grown = reallocarray(dev->pfs, (size_t)dev->alloc, sizeof(struct sim_pfs))) == NULL) {
+			return(NULL);
+		}
+		dev->pfs = grown;
+	}
+	pfs = &dev->pfs[dev->npfs++];
+	memset(pfs, 0, sizeof(struct sim_pfs));
+	strlcpy(pfs->name, name, sizeof(pfs->name));
+	pfs->key = dev->nextkey++;
+	pfs->subtype = subtype;
+	pfs->size = size;
+	pfs->mtime = (uint64_t)time(NULL) * 1000000;
+	return(pfs);
+}
+
+static struct sim_pfs *
+findpfs(struct sim_device *dev, const char *name) {
+	int i;
+
+	for (i = 0; i < dev->npfs; i++) {
+		if (strcmp(dev->pfs[i].name, name) == 0) {
+			return(&dev->pfs[i]);
+		}
+	}
+	return(NULL);
+}
+
+static simop
+simop_for(unsigned long request) {
+	switch (request) {
+		case HAMMER2IOC_INODE_GET:
+			return(SIMOP_INODE_GET);
+		case HAMMER2IOC_PFS_GET:
+			return(SIMOP_PFS_GET);
+		case HAMMER2IOC_PFS_SNAPSHOT:
+			return(SIMOP_SNAPSHOT);
+		case HAMMER2IOC_PFS_DELETE:
+			return(SIMOP_DELETE);
+		default:
+			return(SIMOP_COUNT);
+	}
+}
+
+static int
+simop_of(const char *name) {
+	int op;
+
+	for (op = 0; op < SIMOP_COUNT && strcmp(simopnames[op], name) != 0; op++);
+	return((op < SIMOP_COUNT) ? op : -1);
+}
+
+/*
+ * Bytes, with an optional K, M, G or T suffix
+ */
+static uint64_t
+simsize(const char *str) {
+	char *unit;
+	uint64_t size;
+
+	size = strtoull(str, &unit, 10);
+	switch (*unit) {
+		case 'T':
+			size <<= 10;
+			/* FALLTHROUGH */
+		case 'G':
+			size <<= 10;
+			/* FALLTHROUGH */
+		case 'M':
+			size <<= 10;
+			/* FALLTHROUGH */
+		case 'K':
+			size <<= 10;
+			break;
+		default:
+			break;
+	}
+	return(size);
+}
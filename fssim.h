@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * A simulated HAMMER2, so the whole tool can be run and measured on a machine
+ * without one. When DFBEADM_SIM names a file, h2ioctl() and vfsstat() answer
+ * from an in-memory model of devices and PFSes built from it instead of the
+ * kernel. A descriptor is matched to a simulated mount by the directory it
+ * was opened on, which has to exist on the host. For example:
+ *
+ *   seed 42
+ *   device serno/A capacity=64
+ *   mount serno/A@ROOT / size=2G
+ *   mount serno/A@USR /usr size=8G
+ *   pfs serno/A@ROOT:20190801 snapshot
+ *   latency snapshot 2000 500
+ *   fail snapshot 0.05 EIO
+ *
+ * capacity is the most PFSes a device will hold, latency is in microseconds
+ * plus up to the given jitter, fail is the chance an ioctl returns the errno.
+ * The fstab is generated from the mounts and the record database is a copy
+ * made for the run, fstab and loader.conf are never installed.
+ */
+
+#define DFBEADM_FSSIM_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#include <sys/mount.h>
+
+#define DFBEADM_SIM_ENV "DFBEADM_SIM"
+/* limits of the model, a simulated system is expected to be small */
+#define SIM_MAXDEVS 16
+#define SIM_MAXMOUNTS 64
+
+/* the ioctls the model answers, everything else fails with ENOTTY */
+typedef enum dfbeadm_simop_t {
+	SIMOP_INODE_GET = 0,
+	SIMOP_PFS_GET = 1,
+	SIMOP_SNAPSHOT = 2,
+	SIMOP_DELETE = 3,
+	SIMOP_COUNT = 4,
+} simop;
+
+int siminit(void);
+bool simactive(void);
+const char *simfstab(void);
+const char *simrecdb(void);
+int simioctl(int fd, unsigned long request, void *arg);
+int simcall(int mount, unsigned long request, void *arg, unsigned long usec, int fault);
+int simaddmount(const char *from, const char *on);
+int simaddpfs(int mount, const char *name, uint8_t subtype, uint64_t size);
+int simfsstat(struct statfs *buf, long bufsize);
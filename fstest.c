@@ -40,14 +40,34 @@
 #ifndef DFBEADM_H2TEST_H
 #include "fstest.h"
 #endif
+#ifndef DFBEADM_FSCACHE_H
+#include "fscache.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+
 
-extern bool dbg;
+/*
+ * Determine if the given mountpoint is a HAMMER2 filesystem,
+ * answered from the discovery cache whenever the mountpoint is in it.
+ * dev is what's mounted there, the device a deadline is kept for
+ */
+bool
+ish2(const char *mountpoint, const char *dev) {
+	const discovery *de;
+
+	if ((de = cachelookup(mountpoint)) != NULL) {
+		return(de->h2);
+	}
+	return(probeh2(mountpoint, dev));
+}
 
 /*
- * Determine if the given mountpoint is a HAMMER2 filesystem 
+ * Ask the mountpoint directly, this is what the discovery cache saves us from
  */
 bool
-ish2(const char *mountpoint) {
+probeh2(const char *mountpoint, const char *dev) {
 	int mp;
 	hammer2_ioc_inode_t h2ino;
 
@@ -57,10 +77,10 @@ ish2(const char *mountpoint) {
 	 * hammer2_ioc_version_t version.version integer
 	 * if successful
 	 */
-	if ((mp = open(mountpoint, O_RDONLY)) == 0) {
+	if ((mp = h2open(mountpoint, O_RDONLY, dev)) < 0) {
 		return(false);
 	}
-	if (ioctl(mp, HAMMER2IOC_INODE_GET, &h2ino) < 0) {
+	if (h2ioctl(mp, HAMMER2IOC_INODE_GET, &h2ino, dev) < 0) {
 		close(mp);
 		return(false);
 	} else {
@@ -33,5 +33,6 @@
 
 #define DFBEADM_H2TEST_H
 
-bool ish2(const char *mountpoint);
+bool ish2(const char *mountpoint, const char *dev);
+bool probeh2(const char *mountpoint, const char *dev);
 void fstrunc(char *longstring);
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef DFBEADM_FSTRACE_H
+#include "fstrace.h"
+#endif
+
+extern char *__progname;
+
+static struct trace_record ring[TRACE_RING];
+static uint64_t head = 0;
+
+static const char *const levelnames[] = { "???", "ERR", "WRN", "INF", "DBG" };
+
+static const char *nextconv(const char *fmt, const char **start, char *spec, size_t speclen, char *conv, int *longs);
+static void putlit(FILE *out, const char *from, const char *to);
+
+/*
+ * Store one trace point, the arguments are taken raw according to fmt
+ * and only formatted by tracedump()
+ */
+void
+tracerec(int level, const char *file, unsigned line, const char *func, const char *fmt, ...) {
+	int longs;
+	char conv;
+	const char *cur, *s;
+	size_t used, len;
+	uint64_t seq;
+	va_list ap;
+	struct trace_record *rec;
+
+	/* workers may trace concurrently, each one claims its own slot */
+	seq = __atomic_add_fetch(&head, 1, __ATOMIC_RELAXED);
+	rec = &ring[seq % TRACE_RING];
+	clock_gettime(CLOCK_MONOTONIC, &rec->ts);
+	rec->file = file;
+	rec->func = func;
+	rec->fmt = fmt;
+	rec->line = line;
+	rec->level = (uint8_t)level;
+	rec->nargs = 0;
+	used = 0;
+
+	va_start(ap, fmt);
+	for (cur = fmt; rec->nargs < TRACE_MAXARGS && (cur = nextconv(cur, NULL, NULL, 0, &conv, &longs)) != NULL; rec->nargs++) {
+		switch (conv) {
+			case 's':
+				s = va_arg(ap, const char *);
+				s = (s != NULL) ? s : "(null)";
+				if (used >= TRACE_STRLEN) {
+					/* out of room, the last byte is the previous string's NUL */
+					rec->args[rec->nargs].str = TRACE_STRLEN - 1;
+					break;
+				}
+				len = strnlen(s, TRACE_STRLEN - 1);
+				if (used + len + 1 > TRACE_STRLEN) {
+					len = TRACE_STRLEN - used - 1;
+				}
+				memcpy(rec->strings + used, s, len);
+				rec->strings[used + len] = 0;
+				rec->args[rec->nargs].str = (uint16_t)used;
+				used += (used + len + 1 <= TRACE_STRLEN) ? len + 1 : 0;
+				break;
+			case 'p':
+				rec->args[rec->nargs].p = va_arg(ap, const void *);
+				break;
+			case 'f': case 'e': case 'g':
+				rec->args[rec->nargs].d = va_arg(ap, double);
+				break;
+			case 'd': case 'i': case 'c':
+				rec->args[rec->nargs].i = (longs == 2) ? va_arg(ap, long long) : (longs == 1) ? va_arg(ap, long) : va_arg(ap, int);
+				break;
+			default:
+				rec->args[rec->nargs].u = (longs == 2) ? va_arg(ap, unsigned long long) : (longs == 1) ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+		}
+	}
+	va_end(ap);
+	/* publish last, so a dump never formats a half written record */
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * Format the ring, oldest record first
+ */
+void
+tracedump(FILE *out) {
+	int longs, arg;
+	char conv, spec[32];
+	const char *cur, *start, *next;
+	uint64_t seq, last, first;
+	struct trace_record *rec;
+	struct timespec *origin;
+
+	last = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	first = (last > TRACE_RING) ? last - TRACE_RING + 1 : 1;
+	origin = NULL;
+	for (seq = first; seq <= last; seq++) {
+		rec = &ring[seq % TRACE_RING];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq) {
+			continue;
+		}
+		origin = (origin == NULL) ? &rec->ts : origin;
+		fprintf(out,"%s: %s [%s:%u] %s: +%.6f ",levelnames[(rec->level <= TRACE_DEBUG) ? rec->level : 0],__progname,rec->file,rec->line,rec->func,
+				(double)(rec->ts.tv_sec - origin->tv_sec) + (double)(rec->ts.tv_nsec - origin->tv_nsec) / 1e9);
+		for (cur = rec->fmt, arg = 0; arg < rec->nargs && (next = nextconv(cur, &start, spec, sizeof(spec), &conv, &longs)) != NULL; cur = next, arg++) {
+			putlit(out, cur, start);
+			switch (conv) {
+				case 's':
+					fprintf(out, spec, rec->strings + rec->args[arg].str);
+					break;
+				case 'p':
+					fprintf(out, spec, rec->args[arg].p);
+					break;
+				case 'f': case 'e': case 'g':
+					fprintf(out, spec, rec->args[arg].d);
+					break;
+				case 'c':
+					fprintf(out, spec, (int)rec->args[arg].i);
+					break;
+				case 'd': case 'i':
+					/* spec was widened to %ll by nextconv() */
+					fprintf(out, spec, (long long)rec->args[arg].i);
+					break;
+				default:
+					fprintf(out, spec, (unsigned long long)rec->args[arg].u);
+			}
+		}
+		putlit(out, cur, cur + strlen(cur));
+		if (*rec->fmt == 0 || rec->fmt[strlen(rec->fmt) - 1] != '\n') {
+			fputc('\n', out);
+		}
+	}
+	fflush(out);
+}
+
+/*
+ * Print the literal text of a format between two conversions
+ */
+static void
+putlit(FILE *out, const char *from, const char *to) {
+	for (; from < to; from++) {
+		fputc(*from, out);
+		from += (*from == '%') ? 1 : 0;
+	}
+}
+
+/*
+ * Find the next conversion in a printf format, skipping %%
+ * start receives where the conversion begins, spec the conversion
+ * normalized for tracedump() with integer lengths widened to ll,
+ * conv the conversion character and longs the number of l's
+ * (2 for ll, j, z and t)
+ * returns a pointer just past the conversion, or NULL at the end
+ */
+static const char *
+nextconv(const char *fmt, const char **start, char *spec, size_t speclen, char *conv, int *longs) {
+	const char *conversion;
+	size_t flaglen;
+
+	for (;;) {
+		if ((fmt = strchr(fmt, '%')) == NULL) {
+			return(NULL);
+		}
+		if (fmt[1] != '%') {
+			break;
+		}
+		fmt += 2;
+	}
+	conversion = fmt++;
+	fmt += strspn(fmt, "-+ #0123456789.");
+	flaglen = (size_t)(fmt - conversion);
+	if (start != NULL) {
+		*start = conversion;
+	}
+	*longs = 0;
+	for (; strchr("hlzjtL", *fmt) != NULL && *fmt != 0; fmt++) {
+		*longs += (*fmt == 'l') ? 1 : (*fmt == 'h') ? 0 : 2;
+	}
+	*longs = (*longs > 2) ? 2 : *longs;
+	*conv = *fmt;
+	if (spec != NULL) {
+		/* integers are printed from 64 bit storage */
+		snprintf(spec, speclen, "%.*s%s%c", (int)flaglen, conversion, (strchr("diouxX", *conv) != NULL) ? "ll" : "", *conv);
+	}
+	return(fmt + 1);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Tracing into an in-memory ring of binary records. A trace point only
+ * stores its format, a timestamp and the raw arguments (strings are copied),
+ * formatting happens when the ring is dumped, on error or with -D. Points
+ * above TRACE_LEVEL are removed at compile time, e.g. -DTRACE_LEVEL=0.
+ */
+
+#define DFBEADM_FSTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define TRACE_ERROR 1
+#define TRACE_WARN 2
+#define TRACE_INFO 3
+#define TRACE_DEBUG 4
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_DEBUG
+#endif
+
+/* records kept, older ones are overwritten */
+#define TRACE_RING 1024
+#define TRACE_MAXARGS 8
+/* bytes available to the copied strings of one record */
+#define TRACE_STRLEN 192
+
+#define TRACE(lvl, ...) do { \
+	if ((lvl) <= TRACE_LEVEL) { \
+		tracerec((lvl), __FILE__, __LINE__, __func__, __VA_ARGS__); \
+	} \
+} while (0)
+#define DBGTRACE(...) TRACE(TRACE_DEBUG, __VA_ARGS__)
+
+union trace_arg {
+	int64_t i; /* every integer conversion, sign extended */
+	uint64_t u;
+	double d;
+	const void *p;
+	uint16_t str; /* offset into trace_record.strings */
+};
+
+struct trace_record {
+	uint64_t seq; /* 0 for slots never written */
+	struct timespec ts;
+	const char *file;
+	const char *func;
+	const char *fmt; /* always a string literal */
+	union trace_arg args[TRACE_MAXARGS];
+	unsigned line;
+	uint8_t level;
+	uint8_t nargs;
+	char strings[TRACE_STRLEN];
+};
+
+void tracerec(int level, const char *file, unsigned line, const char *func, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+void tracedump(FILE *out);
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSTRIGGER_H
+#include "fstrigger.h"
+#endif
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+/* the current round, and how the one before it ended */
+struct trigger_round {
+	long pid;
+	char label[MNAMELEN];
+	long long deadline;
+	char state[16];
+	int result;
+	char last[MNAMELEN];
+	int lastresult;
+};
+
+static void readround(int fd, struct trigger_round *round);
+static void writeround(int fd, const struct trigger_round *round);
+static bool alive(long pid);
+
+/*
+ * Join the current round or start one, waiting for as long as it takes.
+ * Only the caller that comes back with *leader set creates the environment,
+ * and has to report how that went with trigger_done()
+ * returns 0 for the leader, the round's outcome for everyone else
+ */
+int
+trigger(int window, const char *prefix, char *label, size_t labellen, bool *leader) {
+	int fd, retc;
+	bool joined, stale;
+	time_t now;
+	struct timespec nap;
+	struct trigger_round round;
+
+	assert((prefix != NULL) && (label != NULL) && (leader != NULL));
+	*leader = joined = false;
+	retc = 0;
+	if (noop) {
+		/* nothing will be created, so there's nothing to share */
+		if (stamplabel(prefix, time(NULL), label, labellen) < 0) {
+			return(1);
+		}
+		fprintf(stdout,"%s\n",label);
+		*leader = true;
+		return(0);
+	}
+	if ((fd = open(DFBEADM_TRIGGER, O_RDWR|O_CREAT|O_CLOEXEC, 0644)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s (%s)\n",__progname,__FILE__,__LINE__,__func__,DFBEADM_TRIGGER,strerror(errno));
+		return(1);
+	}
+	nap.tv_sec = 0;
+	nap.tv_nsec = TRIGGER_POLL * 1000000L;
+	for (;; nanosleep(&nap, NULL)) {
+		/* only ever held for a read and a write, never while waiting */
+		flock(fd, LOCK_EX);
+		readround(fd, &round);
+		now = time(NULL);
+		stale = (round.state[0] != 0 && strcmp(round.state, ROUND_DONE) != 0 && !alive(round.pid));
+		if (joined) {
+			if (strcmp(round.last, label) == 0) {
+				retc = round.lastresult;
+				break;
+			}
+			if (strcmp(round.label, label) != 0) {
+				fprintf(stderr,"WRN: %s [%s:%u] %s: Lost track of the round creating %s\n",__progname,__FILE__,__LINE__,__func__,label);
+				retc = 1;
+				break;
+			}
+			if (strcmp(round.state, ROUND_DONE) == 0) {
+				retc = round.result;
+				break;
+			}
+			if (stale && strcmp(round.state, ROUND_PENDING) == 0) {
+				/* whoever started the round is gone, finish it for everyone */
+				fprintf(stderr,"INF: %s [%s:%u] %s: pid %ld left the round for %s, taking over\n",__progname,__FILE__,__LINE__,__func__,round.pid,label);
+				round.pid = (long)getpid();
+				writeround(fd, &round);
+				*leader = true;
+			} else if (stale) {
+				/* it died creating the environment, there's no telling how far it got */
+				fprintf(stderr,"ERR: %s [%s:%u] %s: pid %ld exited while creating %s\n",__progname,__FILE__,__LINE__,__func__,round.pid,label);
+				strlcpy(round.state, ROUND_DONE, sizeof(round.state));
+				round.result = 1;
+				writeround(fd, &round);
+				retc = 1;
+				break;
+			}
+		} else if (round.state[0] == 0 || strcmp(round.state, ROUND_DONE) == 0 || stale) {
+			/* start a round, remembering how the last one ended for anyone still waiting on it */
+			if (strcmp(round.state, ROUND_DONE) == 0) {
+				strlcpy(round.last, round.label, sizeof(round.last));
+				round.lastresult = round.result;
+			}
+			if (stamplabel(prefix, now, label, labellen) < 0 || strlen(label) >= sizeof(round.label)) {
+				fprintf(stderr,"ERR: %s [%s:%u] %s: Label prefix \"%s\" is too long\n",__progname,__FILE__,__LINE__,__func__,prefix);
+				retc = 1;
+				break;
+			}
+			strlcpy(round.label, label, sizeof(round.label));
+			strlcpy(round.state, ROUND_PENDING, sizeof(round.state));
+			round.pid = (long)getpid();
+			round.deadline = (long long)now + window;
+			writeround(fd, &round);
+			joined = *leader = true;
+			fprintf(stdout,"%s\n",label);
+			fprintf(stderr,"INF: %s [%s:%u] %s: Collecting requests for %ds before creating %s\n",__progname,__FILE__,__LINE__,__func__,window,label);
+		} else if (strcmp(round.state, ROUND_PENDING) == 0) {
+			strlcpy(label, round.label, labellen);
+			joined = true;
+			fprintf(stdout,"%s\n",label);
+			fprintf(stderr,"INF: %s [%s:%u] %s: Joined pid %ld in creating %s\n",__progname,__FILE__,__LINE__,__func__,round.pid,label);
+		}
+		/* a round being created isn't joined, ours starts once it's done */
+		if (*leader && now >= round.deadline) {
+			strlcpy(round.state, ROUND_CREATING, sizeof(round.state));
+			writeround(fd, &round);
+			break;
+		}
+		flock(fd, LOCK_UN);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+	DBGTRACE("Leaving with label %s, leader = %d, returning %d", label, *leader, retc);
+	return(retc);
+}
+
+/*
+ * Publish how the round's environment came out to everyone waiting on it
+ */
+void
+trigger_done(const char *label, int result) {
+	int fd;
+	struct trigger_round round;
+
+	assert(label != NULL);
+	if (noop || (fd = open(DFBEADM_TRIGGER, O_RDWR|O_CLOEXEC)) < 0) {
+		return;
+	}
+	flock(fd, LOCK_EX);
+	readround(fd, &round);
+	if (strcmp(round.label, label) == 0) {
+		strlcpy(round.state, ROUND_DONE, sizeof(round.state));
+		round.result = result;
+		writeround(fd, &round);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+/*
+ * Parse the key=value lines of the trigger file, an empty file is no round
+ */
+static void
+readround(int fd, struct trigger_round *round) {
+	ssize_t len;
+	char buf[1024], *line, *last, *value;
+
+	memset(round, 0, sizeof(*round));
+	if ((len = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+		return;
+	}
+	buf[len] = 0;
+	for (line = strtok_r(buf, "\n", &last); line != NULL; line = strtok_r(NULL, "\n", &last)) {
+		if ((value = strchr(line, '=')) == NULL) {
+			continue;
+		}
+		*value++ = 0;
+		if (strcmp(line, "pid") == 0) {
+			round->pid = strtol(value, NULL, 10);
+		} else if (strcmp(line, "label") == 0) {
+			strlcpy(round->label, value, sizeof(round->label));
+		} else if (strcmp(line, "deadline") == 0) {
+			round->deadline = strtoll(value, NULL, 10);
+		} else if (strcmp(line, "state") == 0) {
+			strlcpy(round->state, value, sizeof(round->state));
+		} else if (strcmp(line, "result") == 0) {
+			round->result = atoi(value);
+		} else if (strcmp(line, "last") == 0) {
+			strlcpy(round->last, value, sizeof(round->last));
+		} else if (strcmp(line, "lastresult") == 0) {
+			round->lastresult = atoi(value);
+		}
+	}
+}
+
+/*
+ * Replace the trigger file's contents, the caller holds its lock
+ */
+static void
+writeround(int fd, const struct trigger_round *round) {
+	int len;
+	char buf[1024];
+
+	len = snprintf(buf, sizeof(buf), "pid=%ld\nlabel=%s\ndeadline=%lld\nstate=%s\nresult=%d\nlast=%s\nlastresult=%d\n",
+	               round->pid, round->label, round->deadline, round->state, round->result, round->last, round->lastresult);
+	if (ftruncate(fd, 0) != 0 || pwrite(fd, buf, (size_t)len, 0) != (ssize_t)len) {
+		fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to update %s (%s)\n",__progname,__FILE__,__LINE__,__func__,DFBEADM_TRIGGER,strerror(errno));
+	}
+}
+
+static bool
+alive(long pid) {
+	return(pid > 0 && (kill((pid_t)pid, 0) == 0 || errno == EPERM));
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Coalescing requests for a new boot environment. The first request starts
+ * a round: it picks a timestamped label, waits out the window and then
+ * creates the environment. Requests arriving before the window closes join
+ * the round, get the same label and wait for its outcome. Requests arriving
+ * while a round's environment is being created wait for it to finish and
+ * then start the next round, so their changes are never missed.
+ */
+
+#define DFBEADM_FSTRIGGER_H
+#ifndef DFBEADM_MAIN_H
+#include "dfbeadm.h"
+#endif
+
+#include <stddef.h>
+
+#define DFBEADM_TRIGGER "/var/run/dfbeadm.trigger"
+/* label prefix when -g doesn't give one */
+#define TRIGGER_PREFIX "auto"
+/* longest window accepted, in seconds */
+#define TRIGGER_MAXWINDOW 86400
+/* how often waiting requests look at the round, in milliseconds */
+#define TRIGGER_POLL 250
+
+/* where a round is, as kept in DFBEADM_TRIGGER */
+#define ROUND_PENDING "pending" /* still accepting requests */
+#define ROUND_CREATING "creating"
+#define ROUND_DONE "done"
+
+int trigger(int window, const char *prefix, char *label, size_t labellen, bool *leader);
+void trigger_done(const char *label, int result);
@@ -47,10 +47,21 @@
 #ifndef DFBEADM_FSUP_H
 #include "fsupdate.h"
 #endif
+#ifndef DFBEADM_FSCOMMIT_H
+#include "fscommit.h"
+#endif
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+#ifndef DFBEADM_FSPREFLIGHT_H
+#include "fspreflight.h"
+#endif
+#ifndef DFBEADM_FSSIM_H
+#include "fssim.h"
+#endif
 
 extern char *__progname;
 extern char **environ;
-extern bool dbg;
 extern bool noop;
 /* 
  * TODO: This really should just be "activate()" automatically called by create()
@@ -60,98 +71,256 @@ extern bool noop;
  */
 int
 autoactivate(bedata *snapfs, int fscount, const char *label) {
-	/* should probably have an int in there to ensure proper iteration */
-	int i, efd, retc;
-	char *efstab;
+	int retc;
+	size_t payloadlen, fstablen;
+	char *payload;
 
-	i = efd = retc = 0;
+	retc = 0;
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with snapfs = %p, fscount = %d\n",
-				__progname,__FILE__,__LINE__,__func__,(void *)snapfs,fscount);
+	DBGTRACE("Entering with snapfs = %p, fscount = %d", (void *)snapfs, fscount);
+	/* the same artifacts are stored in the record database, so -a installs exactly this */
+	if ((payload = envpayload(snapfs, fscount, label, &payloadlen)) == NULL) { 
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to allocate buffer for the new fstab!\n",__progname,__FILE__,__LINE__,__func__);
+		return(-1);
 	}
-	
-	if ((efstab = calloc((size_t)512, sizeof(char))) == NULL) { 
-		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to allocate buffer for *efstab!\n",__progname,__FILE__,__LINE__,__func__);
-		retc = -1;
-	} else {
-		/* generate the name of the ephemeral fstab file */
-		snprintf(efstab, (size_t)512, "/tmp/.fstab.%u", getpid());
+	fstablen = strlen(payload);
+	fprintf(stdout,"Installing new fstab...\n");
+	/* held until snapfs() knows every snapshot the new fstab names exists */
+	retc = installenv(payload, fstablen, (fstablen + 1 < payloadlen) ? payload + fstablen + 1 : NULL, true);
+	free(payload);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Precompute everything activation needs for a boot environment:
+ * the complete fstab, a NUL, then the root spec for loader.conf if / is part of the environment.
+ * This is what create() stores in h2be.fstab, so switching never has to rediscover mounts.
+ * returns NULL on allocation failure, the caller frees the buffer
+ */
+char *
+envpayload(bedata *fs, int fscount, const char *label, size_t *payloadlen) {
+	int i, rootlen;
+	size_t fstablen;
+	char *payload, *grown;
 
-		if ((efd = open(efstab, O_RDWR|O_CREAT|O_NONBLOCK|O_APPEND,S_IRUSR|S_IRGRP|S_IWUSR|S_IROTH)) <= 0) { 
-			fprintf(stderr, "ERR: %s [%s:%u] %s: Unable to open %s for writing!\n",__progname,__FILE__,__LINE__,__func__,efstab);
-			free(efstab);
-			retc = -2;
+	assert((fs != NULL) && (label != NULL) && (payloadlen != NULL));
+	if ((payload = fsblob(fs, fscount, label, &fstablen)) == NULL) {
+		return(NULL);
+	}
+	if ((grown = realloc(payload, fstablen + 1 + MNAMELEN + NAME_MAX + 2)) == NULL) {
+		free(payload);
+		return(NULL);
+	}
+	payload = grown;
+	payload[fstablen] = 0;
+	*payloadlen = fstablen + 1;
+	/* loader.conf only changes when the root filesystem is part of the environment */
+	for (i = 0; i < fscount; i++) {
+		if (fs[i].snap && strcmp(fs[i].fstab.fs_file, "/") == 0) {
+			rootlen = snprintf(payload + fstablen + 1, MNAMELEN + NAME_MAX + 2, "%s%c%s", fs[i].fstab.fs_spec, BESEP, label);
+			*payloadlen += (size_t)rootlen + 1;
+			break;
+		}
+	}
+	return(payload);
+}
+
+/*
+ * Install a boot environment's fstab, and point loader.conf at its root when 
+ * rootspec is given, as one atomic commit, held open with hold (see commitfiles())
+ * returns 0 on success
+ */
+int
+installenv(const char *fstab, size_t fstablen, const char *rootspec, bool hold) {
+	int nfiles, retc;
+	size_t loaderlen;
+	char *loader;
+	stagedfile files[COMMIT_MAXFILES];
+
+	assert(fstab != NULL);
+	nfiles = retc = 0;
+	loader = NULL;
+	DBGTRACE("Entering with fstablen = %zu, rootspec = %s", fstablen, (rootspec != NULL) ? rootspec : "(none)");
+	/* the host's files don't describe the simulated system, show what would be installed */
+	if (simactive()) {
+		fprintf(stdout,"INF: %s [%s:%u] %s: Simulating, %s%s%s left alone, it would read:\n",__progname,__FILE__,__LINE__,__func__,
+				_PATH_FSTAB,(rootspec != NULL) ? " and " : "",(rootspec != NULL) ? LOADER_CONF : "");
+		fwrite(fstab, 1, fstablen, stdout);
+		return(0);
+	}
+	if ((retc = stagefile(&files[nfiles++], _PATH_FSTAB, FSTAB_BACKUP, fstab, fstablen)) == 0 && rootspec != NULL) {
+		if ((loader = mkloaderconf(rootspec, &loaderlen)) == NULL) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to generate %s\n",__progname,__FILE__,__LINE__,__func__,LOADER_CONF);
+			retc = -1;
 		} else {
-			for (i = 0; i < fscount; i++) {
-				/* XXX: Some tweaking necessary, likely need to bring *label back */
-				if (snapfs[i].snap) {
-					dprintf(efd, "%s%c%s\t%s\t%s\t%s\t%d\t%d\n", snapfs[i].fstab.fs_spec, BESEP, label, snapfs[i].fstab.fs_file, 
-																											 snapfs[i].fstab.fs_vfstype, snapfs[i].fstab.fs_mntops,
-																											 snapfs[i].fstab.fs_freq, snapfs[i].fstab.fs_passno);
-				} else {
-					dprintf(efd, "%s\t%s\t%s\t%s\t%d\t%d\n", snapfs[i].fstab.fs_spec, snapfs[i].fstab.fs_file, 
-																											 snapfs[i].fstab.fs_vfstype, snapfs[i].fstab.fs_mntops,
-																											 snapfs[i].fstab.fs_freq, snapfs[i].fstab.fs_passno);
-				}
+			retc = stagefile(&files[nfiles++], LOADER_CONF, LOADER_BACKUP, loader, loaderlen);
+		}
+	}
+	if (retc != 0) {
+		unstage(files, nfiles);
+	} else {
+		if (noop) {
+			fwrite(fstab, 1, fstablen, stdout);
+		}
+		if ((retc = commitfiles(files, nfiles, hold)) == 0 && !noop) {
+			printfs(_PATH_FSTAB);
+		}
+	}
+	free(loader);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Format a single fstab(5) line for the given entry, pointing
+ * snapshotted entries at the new boot environment label
+ * returns the length of the line as snprintf(3) would
+ */
+int
+fmtfsbuf(char *buf, size_t buflen, bedata *fs, const char *label) {
+	/* XXX: Some tweaking necessary, likely need to bring *label back */
+	if (fs->snap) {
+		return(snprintf(buf, buflen, "%s%c%s\t%s\t%s\t%s\t%d\t%d\n", fs->fstab.fs_spec, BESEP, label, fs->fstab.fs_file, 
+		                fs->fstab.fs_vfstype, fs->fstab.fs_mntops, fs->fstab.fs_freq, fs->fstab.fs_passno));
+	}
+	return(snprintf(buf, buflen, "%s\t%s\t%s\t%s\t%d\t%d\n", fs->fstab.fs_spec, fs->fstab.fs_file, 
+	                fs->fstab.fs_vfstype, fs->fstab.fs_mntops, fs->fstab.fs_freq, fs->fstab.fs_passno));
+}
+
+/*
+ * Render the complete fstab of a boot environment into one allocated buffer,
+ * this is what gets stored in the record database
+ * returns NULL on allocation failure, the caller frees the buffer
+ */
+char *
+fsblob(bedata *fs, int fscount, const char *label, size_t *bloblen) {
+	int i, len;
+	size_t used, cap;
+	char *blob, *grown;
+
+	assert((fs != NULL) && (label != NULL) && (bloblen != NULL));
+	cap = (size_t)fscount * 128 + 1;
+	used = 0;
+	if ((blob = malloc(cap)) == NULL) {
+		return(NULL);
+	}
+	for (i = 0; i < fscount; i++) {
+		if ((len = fmtfsbuf(blob + used, cap - used, &fs[i], label)) < 0) {
+			free(blob);
+			return(NULL);
+		}
+		/* the line didn't fit, make room for it and try again */
+		if ((size_t)len >= cap - used) {
+			cap = (cap + (size_t)len) * 2;
+			if ((grown = realloc(blob, cap)) == NULL) {
+				free(blob);
+				return(NULL);
 			}
+			blob = grown;
+			i--;
+			continue;
+		}
+		used += (size_t)len;
+	}
+	*bloblen = used;
+	return(blob);
+}
+
+/*
+ * Write an fstab(5) fragment holding only the given entries, used by scoped
+ * boot environments in place of rewriting /etc/fstab. The fragment is staged
+ * next to its final path and renamed over it, so readers never see a partial file.
+ */
+int
+writefrag(bedata *fs, int fscount, const char *label, const char *fragment) {
+	int ffd, retc;
+	size_t done, fraglen;
+	ssize_t wrote;
+	char *frag, tmpfrag[MAXPATHLEN];
 
-			/* 
-			 * new funciton, specifically dumps current fstab into a file with a timestamp of when it was created
-			 * ideally will include the BE label in the future a swell, though that would require some extra parsing
-			 */
-			fprintf(stdout,"Installing new fstab...\n");
-			swapfstab("/etc/fstab", &efd);
-			printfs(efstab);
-			/* unlink(efstab); Do not unlink, as we can't be sure it's written properly now */
-			close(efd);
+	assert((fs != NULL) && (label != NULL) && (fragment != NULL));
+	retc = 0;
+	DBGTRACE("Entering with fs = %p, fscount = %d, fragment = %s", (void *)fs, fscount, fragment);
+	if ((frag = fsblob(fs, fscount, label, &fraglen)) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to generate %s\n",__progname,__FILE__,__LINE__,__func__,fragment);
+		return(-1);
+	}
+	/* scope workers get here concurrently, so print straight from the buffer and keep each fragment in one piece */
+	if (simactive() || noop) {
+		flockfile(stdout);
+		fprintf(stdout,"INF: %s [%s:%u] %s: %s %s:\n",__progname,__FILE__,__LINE__,__func__,(simactive()) ? "Simulating, would install" : "Would install",fragment);
+		fwrite(frag, 1, fraglen, stdout);
+		funlockfile(stdout);
+		free(frag);
+		return(0);
+	}
+
+	snprintf(tmpfrag, sizeof(tmpfrag), "%s.XXXXXX", fragment);
+	if ((ffd = mkstemp(tmpfrag)) < 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to stage %s (%s)\n",__progname,__FILE__,__LINE__,__func__,fragment,strerror(errno));
+		free(frag);
+		return(-1);
+	}
+	for (done = 0; done < fraglen; done += (size_t)wrote) {
+		if ((wrote = write(ffd, frag + done, fraglen - done)) <= 0) {
+			break;
 		}
-		free(efstab);
 	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
+	/* a short fragment must never replace a complete one */
+	if (done < fraglen) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to write %s (%s)\n",__progname,__FILE__,__LINE__,__func__,tmpfrag,strerror(errno));
+		unlink(tmpfrag);
+		retc = -3;
+	} else if ((fchmod(ffd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH) != 0) || (fsync(ffd) != 0) || (rename(tmpfrag, fragment) != 0)) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to install %s (%s)\n",__progname,__FILE__,__LINE__,__func__,fragment,strerror(errno));
+		unlink(tmpfrag);
+		retc = -2;
+	} else {
+		fprintf(stdout,"INF: %s [%s:%u] %s: Installed %s\n",__progname,__FILE__,__LINE__,__func__,fragment);
 	}
+	close(ffd);
+	free(frag);
+
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
 /*
  * activate a given boot environment
+ * Everything needed was computed when the environment was created, so this is
+ * a single lookup followed by one staged commit, no mounts are scanned and no ioctls issued
  */
 int
 activate(const char *label) { 
-	/* 
-	 * the *label parameter is only used for the pfs lookups, by default this is called by create()
-	 * we'll scan currently mounted filesystems for the given boot environment label, and use that to 
-	 * create the ephemeral fstab, which then replaces the current fstab, putting it in fstab.label
-	 * assuming there was a label. If no label exists for the existing fstab, we'll simply call it 
-	 * fstab.bak
-	 */
 	int retc;
-	char *efstab;
-	FILE *efd;
+	size_t payloadlen, fstablen;
+	char *payload;
+	bool active;
 
+	assert(label != NULL);
 	retc = 0;
+	payload = NULL;
+	active = false;
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with label = %s\n",__progname,__FILE__,__LINE__,__func__,label);
-	}
-
-	if ((efstab = calloc((size_t)512, sizeof(char))) == NULL) {
-		fprintf(stderr,"Error Allocating Ephemeral fstab\n");
+	DBGTRACE("Entering with label = %s", label);
+	if ((retc = load_bepayload(label, &payload, &payloadlen, &active)) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: No recorded boot environment named %s\n",__progname,__FILE__,__LINE__,__func__,label);
+		return(retc);
 	}
-
-	snprintf(efstab, (size_t)512, "/tmp/.fstab.%d.%s", getpid(), label);
-	fprintf(stderr, "Created Ephemeral fstab at %s", efstab);
-
-	if ((efd = fopen(efstab, "a")) == NULL) { 
-		err(errno, "%s: %s: ", __progname, efstab);
-	}
-
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
+	/* as design.txt puts it, switching to the current environment is a no-op */
+	if (active) {
+		fprintf(stdout,"INF: %s [%s:%u] %s: %s is already the active boot environment\n",__progname,__FILE__,__LINE__,__func__,label);
+	} else {
+		fstablen = strnlen(payload, payloadlen);
+		if ((retc = preflight_activate(payload, fstablen, (fstablen + 1 < payloadlen) ? payload + fstablen + 1 : NULL)) != 0) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: %d problems found, %s was not activated\n",__progname,__FILE__,__LINE__,__func__,retc,label);
+		} else if ((retc = installenv(payload, fstablen, (fstablen + 1 < payloadlen) ? payload + fstablen + 1 : NULL, false)) == 0 && !noop) {
+			retc = mark_active(label);
+		}
 	}
-	fclose(efd);
-	free(efstab);
+	free(payload);
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
@@ -167,12 +336,8 @@ deactivate(const char *label) {
 	 */
 	int retc;
 	retc = 0;
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with label = %s\n",__progname,__FILE__,__LINE__,__func__,label);
-	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
-	}
+	DBGTRACE("Entering with label = %s", label);
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
@@ -184,12 +349,8 @@ rmenv(const char *label) {
 	/* TODO: Implement PFS deletion for the given label */
 	int retc;
 	retc = 0;
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with label = %s\n",__progname,__FILE__,__LINE__,__func__,label);
-	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
-	}
+	DBGTRACE("Entering with label = %s", label);
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
@@ -201,12 +362,8 @@ rmsnap(const char *pfs) {
 	/* TODO: Implement PFS deletion for the given label */
 	int retc;
 	retc = 0;
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with pfs = %s\n",__progname,__FILE__,__LINE__,__func__,pfs);
-	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
-	}
+	DBGTRACE("Entering with pfs = %s", pfs);
+	DBGTRACE("Returning %d to caller", retc);
 	return(retc);
 }
 
@@ -214,9 +371,7 @@ void
 printfs(const char *fstab) { 
 	struct fstab *fsent;
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with fstab = %s\n",__progname,__FILE__,__LINE__,__func__,fstab);
-	}
+	DBGTRACE("Entering with fstab = %s", fstab);
 
 	fsent = NULL;
 	setfstab(fstab);
@@ -228,77 +383,5 @@ printfs(const char *fstab) {
 	}
 	endfsent();
 
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning to caller\n",__progname,__FILE__,__LINE__,__func__);
-	}
-}
-
-/* 
- * TODO: Verify proper control logic
- */
-int
-swapfstab(const char *current, int *newfd) {
-	/*
-	 * this function will open the old fstab, clean it out after dumpting contents to a new 
-	 * backup file, then write the contents of the ephemeral fstab into it
-	 */
-	int bfd, cfd, retc;
-	struct stat curfstab;
-	ssize_t written;
-	size_t readsize;
-	off_t writepoint;
-	char tmpbuf[PAGESIZE]; /* work with a page of data at a time, defaulting to 4096 if not otherwise defined */
-
-	readsize = 0;
-	written = 0; writepoint = 0;
-	bfd = cfd = retc = 0;
-
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with current = %s, newfd = %d\n",__progname,__FILE__,__LINE__,__func__,current,*newfd);
-	}
-	/* First ensure the fstab even exists, with no dynamic allocations, we can simply bail early */
-	if ((stat(current,&curfstab)) != 0) {
-		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to stat %s (%s)\n",
-				__progname,__FILE__,__LINE__,__func__,current,strerror(errno));
-		retc = -1;
-	}
-	/* Detect whether or not we should read in a full PAGE */
-	readsize = (curfstab.st_size > PAGESIZE) ? PAGESIZE : curfstab.st_size;
-	if ((cfd = open(current, O_RDWR)) <= 0) { 
-		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to open %s r/w, %s\n",__progname,__FILE__,__LINE__,__func__,current,strerror(errno));
-		retc = -1;
-	}
-	if (retc == 0 && (bfd = open("/etc/fstab.bak", O_TRUNC|O_CREAT|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) <= 0) {
-		fprintf(stderr, "ERR: %s [%s:%u] %s: /etc/fstab.bak could not be created, verify file and user permissions are set properly!\n",__progname,__FILE__,__LINE__,__func__);
-		retc = -2;
-	}
-
-	/* read cfd into bfd, close bfd, rewind cfd, dump newfd into it */
-	for (;!noop && retc == 0 && written < curfstab.st_size;) {
-		pread(cfd, &tmpbuf, readsize, writepoint);
-		written += pwrite(bfd, &tmpbuf, readsize, writepoint);
-		writepoint = written; /* after writing, record the location to read from in the next iteration */
-	}
-	writepoint ^= writepoint; written ^= written;
-	/* Now we can close bfd, and dump newfd into cfd */
-	close(bfd);
-	/* stat the efstab, reuising curfstab struct */
-	if ((fstat(*newfd,&curfstab)) != 0) {
-		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to stat new fstab fd %d (%s)\n",__progname,__FILE__,__LINE__,__func__,*newfd,strerror(errno));
-		retc = -3;
-	}
-	for (;!noop && written < curfstab.st_size;) {
-		pread(*newfd, &tmpbuf, readsize, writepoint);
-		written += pwrite(cfd, &tmpbuf, readsize, writepoint);
-		writepoint = written;
-		if (dbg) {
-			fprintf(stderr,"DBG: %s [%s:%u] %s: writepoint = %lu, filesize = %lu\n",__progname,__FILE__,__LINE__,__func__,writepoint,curfstab.st_size);
-		}
-	}
-
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
-	}
-	close(cfd);
-	return(retc);
+	DBGTRACE("Returning to caller");
 }
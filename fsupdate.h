@@ -41,8 +41,12 @@
 
 int activate(const char *label);
 int autoactivate(bedata *snapfs, int fscount, const char *label);
+int installenv(const char *fstab, size_t fstablen, const char *rootspec, bool hold);
 int deactivate(const char *label);
 int rmenv(const char *label);
 int rmsnap(const char *pfs);
+int fmtfsbuf(char *buf, size_t buflen, bedata *fs, const char *label);
+char *fsblob(bedata *fs, int fscount, const char *label, size_t *bloblen);
+char *envpayload(bedata *fs, int fscount, const char *label, size_t *payloadlen);
 void printfs(const char *fstab);
-int swapfstab(const char *current, int *newfd);
+int writefrag(bedata *fs, int fscount, const char *label, const char *fragment);
@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSUSAGE_H
+#include "fsusage.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+/* the mounts of one HAMMER2 device, measured by a single worker */
+struct usage_device {
+	const struct statfs *mounts; /* sorted by f_mntfromname, so a device is a contiguous run */
+	int nmounts;
+	pfsusage *live; /* one per mount */
+	char (*extant)[NAME_MAX + 1]; /* every PFS PFS_GET reports on the device */
+	int nextant;
+	bool walked; /* extant is complete */
+};
+
+struct usage_pool {
+	pthread_mutex_t lock;
+	struct usage_device *devices;
+	int count;
+	int next;
+};
+
+/* an environment's figures, summed over its PFSes */
+struct env_usage {
+	const char *belabel;
+	int pfscount;
+	uint64_t datasize;
+	uint64_t inodes;
+	uint64_t delta; /* summed |live - snapshot| data size, not what deleting it frees */
+};
+
+static void *usageworker(void *arg);
+static void walkpfs(int fd, struct usage_device *dev);
+static const pfsusage *liveorigin(const pfsusage *live, int count, const char *pfs);
+static int cmpmounts(const void *a, const void *b);
+static int cmpenvs(const void *a, const void *b);
+static void fmtsize(uint64_t bytes, char *dst, size_t len);
+
+/*
+ * Measure the PFS mounted on fd through its root inode, dev names
+ * what fd is on for h2ioctl(), pfs the device@pfs name the figures are filed under.
+ * lsnaptid, if given, gets the TID of the last snapshot taken of the PFS
+ * returns 0 on success
+ */
+int
+measurepfs(int fd, const char *dev, const char *pfs, pfsusage *usage, uint64_t *lsnaptid) {
+	labelview view;
+	hammer2_ioc_inode_t ino;
+
+	assert((dev != NULL) && (pfs != NULL) && (usage != NULL));
+	memset(&ino, 0, sizeof(ino));
+	memset(usage, 0, sizeof(pfsusage));
+	if (h2ioctl(fd, HAMMER2IOC_INODE_GET, &ino, dev) < 0) {
+		return(-1);
+	}
+	strlcpy(usage->pfs, pfs, sizeof(usage->pfs));
+	if (parselabel(pfs, &view) == 0 && view.belen > 0) {
+		snprintf(usage->belabel, sizeof(usage->belabel), "%.*s", (int)view.belen, pfs + view.beoff);
+	}
+	usage->datasize = (uint64_t)ino.data_count;
+	usage->inodes = (uint64_t)ino.inode_count;
+	usage->measured = (int64_t)time(NULL);
+	if (lsnaptid != NULL) {
+		*lsnaptid = (uint64_t)ino.ip_data.meta.pfs_lsnap_tid;
+	}
+	return(0);
+}
+
+/*
+ * File the figures of freshly taken snapshots, a snapshot references
+ * exactly what its origin did, so the origin is measured in its place.
+ * The origin's last snapshot TID is the new snapshot's, and is kept in
+ * the target for write_bedata(). Called with the mount descriptors still open.
+ * returns the number of snapshots that couldn't be measured
+ */
+int
+snapusage(bedata *fstarget, int fscount) {
+	int i, n, failed;
+	uint64_t tid;
+	char pfs[MNAMELEN];
+	pfsusage *usage;
+
+	assert(fstarget != NULL);
+	if (noop) {
+		return(0);
+	}
+	if ((usage = calloc((size_t)fscount, sizeof(pfsusage))) == NULL) {
+		return(fscount);
+	}
+	for (n = failed = i = 0; i < fscount; i++) {
+		if (!fstarget[i].snap) {
+			continue;
+		}
+		/* fs_spec still names the origin, without any label */
+		snprintf(pfs, sizeof(pfs), "%.*s%c%s", (int)strcspn(fstarget[i].fstab.fs_spec, "@"), fstarget[i].fstab.fs_spec, PFSDELIM, fstarget[i].snapshot.name);
+		/* bedata is packed, so the TID can't be written through a pointer into it */
+		if (measurepfs(fstarget[i].mountfd, fstarget[i].fstab.fs_spec, pfs, &usage[n], &tid) == 0) {
+			fstarget[i].snaptid = tid;
+			fstarget[i].snaptime = usage[n].measured;
+			fstarget[i].snapsize = usage[n].datasize;
+			n++;
+		} else {
+			failed++;
+		}
+	}
+	write_usage(usage, n);
+	free(usage);
+	return(failed);
+}
+
+/*
+ * Show what every boot environment references, and how much the data size of
+ * each of its snapshots differs from the PFS mounted in its place now.
+ * That difference is only a hint at how far an environment has drifted, 
+ * HAMMER2 can't tell how many blocks a snapshot still shares, so it is 
+ * not what deleting the environment would free.
+ * Mounted PFSes are measured every time, one device per worker, and used in
+ * place of their stored figures without being filed. The record database only
+ * keeps what snapusage() measured when each snapshot was taken, which can't
+ * be had again without mounting it. Stored snapshots a device no longer has are dropped.
+ * returns 0 on success
+ */
+int
+usage_report(void) {
+	int i, j, d, nvfs, nh2, ndevs, ncached, nenvs, nworkers, nlive, ngone, retc;
+	size_t len;
+	char refs[16], delta[16];
+	const char *at;
+	const pfsusage *origin;
+	pfsusage *cached, *fresh, *grown;
+	pthread_t workers[USAGE_WORKERS];
+	struct statfs *vfs;
+	struct usage_device *devs;
+	struct usage_pool pool;
+	struct env_usage *envs;
+	char (*gone)[MNAMELEN];
+
+	retc = ndevs = ncached = nenvs = nlive = ngone = 0;
+	vfs = NULL; devs = NULL; cached = fresh = NULL; envs = NULL; gone = NULL;
+	DBGTRACE("Entering");
+	if ((nvfs = vfsstat(NULL, 0, MNT_NOWAIT)) <= 0 ||
+	    (vfs = calloc((size_t)nvfs, sizeof(struct statfs))) == NULL ||
+	    (nvfs = vfsstat(vfs, (long)((size_t)nvfs * sizeof(struct statfs)), MNT_NOWAIT)) <= 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to read the mount table (%s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno));
+		free(vfs);
+		return(-1);
+	}
+	for (nh2 = i = 0; i < nvfs; i++) {
+		if (strncmp(vfs[i].f_fstypename, "hammer2", MFSNAMELEN) == 0) {
+			vfs[nh2++] = vfs[i];
+		}
+	}
+	qsort(vfs, (size_t)nh2, sizeof(struct statfs), cmpmounts);
+	if ((devs = calloc((size_t)nh2 + 1, sizeof(struct usage_device))) == NULL || (fresh = calloc((size_t)nh2 + 1, sizeof(pfsusage))) == NULL) {
+		retc = -2;
+		goto done;
+	}
+	for (i = 0; i < nh2; i++) {
+		if (i == 0 || strcspn(vfs[i].f_mntfromname, "@") != strcspn(vfs[i - 1].f_mntfromname, "@") ||
+		    strncmp(vfs[i].f_mntfromname, vfs[i - 1].f_mntfromname, strcspn(vfs[i].f_mntfromname, "@")) != 0) {
+			devs[ndevs].mounts = &vfs[i];
+			devs[ndevs].live = &fresh[i];
+			ndevs++;
+		}
+		devs[ndevs - 1].nmounts++;
+	}
+
+	pool.devices = devs;
+	pool.count = ndevs;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (nworkers = 0; nworkers < USAGE_WORKERS && nworkers < ndevs; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, usageworker, &pool) != 0) {
+			break;
+		}
+	}
+	if (nworkers == 0) {
+		usageworker(&pool);
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+
+	if (load_usage(&cached, &ncached) != 0) {
+		retc = -3;
+		goto done;
+	}
+	/* what's mounted was just measured, those figures replace the stored ones for this report only */
+	if ((grown = reallocarray(cached, (size_t)(ncached + nh2) + 1, sizeof(pfsusage))) == NULL) {
+		retc = -2;
+		goto done;
+	}
+	cached = grown;
+	for (i = 0; i < nh2; i++) {
+		if (fresh[i].pfs[0] == 0) {
+			continue;
+		}
+		for (j = 0; j < ncached && strcmp(cached[j].pfs, fresh[i].pfs) != 0; j++);
+		cached[j] = fresh[i];
+		ncached += (j == ncached) ? 1 : 0;
+		nlive++;
+	}
+	/* snapshots deleted behind our back, only judged for devices that could be walked */
+	if ((gone = calloc((size_t)ncached + 1, MNAMELEN)) == NULL) {
+		retc = -2;
+		goto done;
+	}
+	for (i = 0; i < ncached; i++) {
+		if ((at = strchr(cached[i].pfs, PFSDELIM)) == NULL) {
+			continue;
+		}
+		for (d = 0; d < ndevs; d++) {
+			len = strcspn(devs[d].mounts[0].f_mntfromname, "@");
+			if (devs[d].walked && (size_t)(at - cached[i].pfs) == len && strncmp(cached[i].pfs, devs[d].mounts[0].f_mntfromname, len) == 0) {
+				for (j = 0; j < devs[d].nextant && strcmp(devs[d].extant[j], at + 1) != 0; j++);
+				if (j == devs[d].nextant) {
+					strlcpy(gone[ngone++], cached[i].pfs, MNAMELEN);
+					cached[i].belabel[0] = 0;
+				}
+			}
+		}
+	}
+	if (!noop) {
+		drop_usage(gone, ngone);
+	}
+
+	if ((envs = calloc((size_t)ncached + 1, sizeof(struct env_usage))) == NULL) {
+		retc = -2;
+		goto done;
+	}
+	for (i = 0; i < ncached; i++) {
+		if (cached[i].belabel[0] == 0) {
+			continue;
+		}
+		for (j = 0; j < nenvs && strcmp(envs[j].belabel, cached[i].belabel) != 0; j++);
+		if (j == nenvs) {
+			envs[nenvs++].belabel = cached[i].belabel;
+		}
+		envs[j].pfscount++;
+		envs[j].datasize += cached[i].datasize;
+		envs[j].inodes += cached[i].inodes;
+		/* compare against whichever environment's copy of the same PFS is mounted now */
+		if ((origin = liveorigin(fresh, nh2, cached[i].pfs)) != NULL) {
+			envs[j].delta += (origin->datasize > cached[i].datasize) ? origin->datasize - cached[i].datasize : cached[i].datasize - origin->datasize;
+		}
+	}
+	qsort(envs, (size_t)nenvs, sizeof(struct env_usage), cmpenvs);
+	fprintf(stdout,"%-32s %6s %10s %12s %10s\n","ENVIRONMENT","PFSES","REFERENCED","INODES","SIZEDELTA");
+	for (i = 0; i < nenvs; i++) {
+		fmtsize(envs[i].datasize, refs, sizeof(refs));
+		fmtsize(envs[i].delta, delta, sizeof(delta));
+		fprintf(stdout,"%-32s %6d %10s %12llu %10s\n",envs[i].belabel,envs[i].pfscount,refs,(unsigned long long)envs[i].inodes,delta);
+	}
+	fprintf(stdout,"INF: %s: %d PFSes measured on %d devices, %d deleted snapshots forgotten\n",
+			__progname,nlive,ndevs,ngone);
+
+done:
+	for (d = 0; devs != NULL && d < ndevs; d++) {
+		free(devs[d].extant);
+	}
+	free(gone);
+	free(envs);
+	free(cached);
+	free(fresh);
+	free(devs);
+	free(vfs);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+static void *
+usageworker(void *arg) {
+	int idx, m, fd;
+	struct usage_device *dev;
+	struct usage_pool *pool;
+
+	pool = arg;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		idx = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (idx >= pool->count) {
+			break;
+		}
+		dev = &pool->devices[idx];
+		for (m = 0; m < dev->nmounts; m++) {
+			if ((fd = h2open(dev->mounts[m].f_mntonname, O_RDONLY, dev->mounts[m].f_mntfromname)) < 0) {
+				fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to open %s (%s)\n",__progname,__FILE__,__LINE__,__func__,
+						dev->mounts[m].f_mntonname,strerror(errno));
+				continue;
+			}
+			if (measurepfs(fd, dev->mounts[m].f_mntfromname, dev->mounts[m].f_mntfromname, &dev->live[m], NULL) != 0) {
+				fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to measure %s (%s)\n",__progname,__FILE__,__LINE__,__func__,
+						dev->mounts[m].f_mntfromname,strerror(errno));
+			}
+			if (!dev->walked) {
+				walkpfs(fd, dev);
+			}
+			close(fd);
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * Collect the name of every PFS on the device fd lives on
+ */
+static void
+walkpfs(int fd, struct usage_device *dev) {
+	int alloc;
+	char (*grown)[NAME_MAX + 1];
+	hammer2_ioc_pfs_t pfs;
+
+	memset(&pfs, 0, sizeof(pfs));
+	alloc = 0;
+	for (; pfs.name_key != (hammer2_key_t)-1; pfs.name_key = pfs.name_next) {
+		if (h2ioctl(fd, HAMMER2IOC_PFS_GET, &pfs, dev->mounts[0].f_mntfromname) < 0) {
+			return;
+		}
+		if (dev->nextant == alloc) {
+			alloc = (alloc == 0) ? 64 : alloc * 2;
+			if ((grown = reallocarray(dev->extant, (size_t)alloc, sizeof(*grown))) == NULL) {
+				return;
+			}
+			dev->extant = grown;
+		}
+		strlcpy(dev->extant[dev->nextant++], pfs.name, NAME_MAX + 1);
+	}
+	dev->walked = true;
+}
+
+/*
+ * Find the mounted PFS a snapshot was taken from, i.e. the same
+ * device and PFS name with whatever label is booted right now
+ */
+static const pfsusage *
+liveorigin(const pfsusage *live, int count, const char *pfs) {
+	int i;
+	size_t base;
+
+	base = strcspn(pfs, ":");
+	for (i = 0; i < count; i++) {
+		if (strcmp(live[i].pfs, pfs) != 0 && strcspn(live[i].pfs, ":") == base && strncmp(live[i].pfs, pfs, base) == 0) {
+			return(&live[i]);
+		}
+	}
+	return(NULL);
+}
+
+static int
+cmpmounts(const void *a, const void *b) {
+	return(strcmp(((const struct statfs *)a)->f_mntfromname, ((const struct statfs *)b)->f_mntfromname));
+}
+
+/* largest size delta first */
+static int
+cmpenvs(const void *a, const void *b) {
+	const struct env_usage *x, *y;
+
+	x = a; y = b;
+	if (x->delta != y->delta) {
+		return((x->delta > y->delta) ? -1 : 1);
+	}
+	return(strcmp(x->belabel, y->belabel));
+}
+
+static void
+fmtsize(uint64_t bytes, char *dst, size_t len) {
+	int unit;
+	double size;
+	static const char units[] = "BKMGTPE";
+
+	for (size = (double)bytes, unit = 0; size >= 1024 && units[unit + 1] != 0; unit++) {
+		size /= 1024;
+	}
+	snprintf(dst, len, (unit == 0) ? "%.0f%c" : "%.1f%c", size, units[unit]);
+}
@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DFBEADM_FSVERIFY_H
+#include "fsverify.h"
+#endif
+#ifndef DFBEADM_RECORD_H
+#include "fsrecord.h"
+#endif
+#ifndef DFBEADM_SNAPFS_H
+#include "snapfs.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+
+extern char *__progname;
+extern bool noop;
+
+struct hash_pool {
+	pthread_mutex_t lock;
+	const char *root;
+	hashspec algo;
+	bemanifest *files;
+	bemanifest **order; /* the same files, largest first */
+	char *failed; /* indexed like files, set if the file couldn't be hashed */
+	int nfiles;
+	int next;
+	uint64_t bytes;
+};
+
+static int walkmanifest(const char *root, bemanifest **files, int *count);
+static int hashall(const char *root, hashspec algo, bemanifest *files, char *failed, int count, uint64_t *bytes);
+static void *hashworker(void *arg);
+static int hashlink(hashspec algo, const char *path, bemanifest *file);
+static void freemanifest(bemanifest *files, int count);
+static int cmppaths(const void *a, const void *b);
+static int cmpsizes(const void *a, const void *b);
+
+/*
+ * Record the digests of every file under MANIFEST_PATHS in the tree at root
+ * as the manifest of label, replacing any earlier one
+ * returns 0 on success, nonzero otherwise
+ */
+int
+mkmanifest(const char *label, const char *root) {
+	int retc, count, kept, i;
+	uint64_t bytes;
+	char *failed;
+	bemanifest *files;
+	struct timespec start, end;
+
+	assert((label != NULL) && (root != NULL));
+	files = NULL; failed = NULL;
+	count = kept = 0;
+	bytes = 0;
+	DBGTRACE("Entering with label = %s, root = %s", label, root);
+	if (noop) {
+		fprintf(stdout,"INF: %s [%s:%u] %s: Would record a manifest of %s for %s\n",__progname,__FILE__,__LINE__,__func__,root,label);
+		return(0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((retc = walkmanifest(root, &files, &count)) != 0) {
+		return(retc);
+	}
+	if ((failed = calloc((size_t)count + 1, 1)) == NULL) {
+		freemanifest(files, count);
+		return(-1);
+	}
+	hashall(root, MANIFEST_HASH, files, failed, count, &bytes);
+	/* a file we can't read now would only ever verify as modified, leave it out */
+	for (i = 0; i < count; i++) {
+		if (failed[i]) {
+			fprintf(stderr,"WRN: %s [%s:%u] %s: Leaving unreadable %s%s out of the manifest\n",__progname,__FILE__,__LINE__,__func__,root,files[i].path);
+			free(files[i].path);
+			continue;
+		}
+		files[kept++] = files[i];
+	}
+	if ((retc = write_manifest(label, MANIFEST_HASH, files, kept)) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stdout,"INF: %s [%s:%u] %s: Recorded %d files (%llu MiB) for %s in %.1fs\n",
+				__progname,__FILE__,__LINE__,__func__,kept,(unsigned long long)(bytes >> 20),label,tsdiff(&start, &end));
+	}
+	freemanifest(files, kept);
+	free(failed);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Rehash the files under MANIFEST_PATHS in the tree at root, the running
+ * system or an environment mounted elsewhere, and report every path that
+ * doesn't match the manifest of label
+ * returns 0 if everything matched, 1 if something didn't, negative on errors
+ */
+int
+verifyenv(const char *label, const char *root) {
+	int retc, nwant, nhave, i, j, cmp, problems;
+	uint64_t bytes;
+	char kind, *failed;
+	const char *path;
+	hashspec algo;
+	bemanifest *want, *have;
+	struct timespec start, end;
+
+	assert((label != NULL) && (root != NULL));
+	want = have = NULL; failed = NULL;
+	nwant = nhave = problems = 0;
+	bytes = 0;
+	algo = MANIFEST_HASH;
+	DBGTRACE("Entering with label = %s, root = %s", label, root);
+	if ((retc = load_manifest(label, &want, &nwant, &algo)) != 0) {
+		if (retc == SQLITE_NOTFOUND) {
+			fprintf(stderr,"ERR: %s [%s:%u] %s: No manifest recorded for %s, create environments with -m to get one\n",__progname,__FILE__,__LINE__,__func__,label);
+		}
+		return(-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (walkmanifest(root, &have, &nhave) != 0 || (failed = calloc((size_t)nhave + 1, 1)) == NULL) {
+		freemanifest(want, nwant);
+		freemanifest(have, nhave);
+		return(-2);
+	}
+	hashall(root, algo, have, failed, nhave, &bytes);
+
+	/* both lists are in path order, so one pass finds every difference */
+	for (i = j = 0; i < nwant || j < nhave;) {
+		if (i == nwant) {
+			cmp = 1;
+		} else if (j == nhave) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(want[i].path, have[j].path);
+		}
+		kind = 0;
+		if (cmp < 0) {
+			kind = VERIFY_MISSING;
+			path = want[i++].path;
+		} else if (cmp > 0) {
+			kind = VERIFY_ADDED;
+			path = have[j++].path;
+		} else {
+			if (failed[j]) {
+				kind = VERIFY_UNREADABLE;
+			} else if (want[i].size != have[j].size || strcmp(want[i].digest, have[j].digest) != 0) {
+				kind = VERIFY_MODIFIED;
+			}
+			path = have[j].path;
+			i++; j++;
+		}
+		if (kind != 0) {
+			fprintf(stdout,"%c %s\n",kind,path);
+			problems++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stdout,"INF: %s [%s:%u] %s: Checked %d files (%llu MiB) of %s in %.1fs, %d problems\n",
+			__progname,__FILE__,__LINE__,__func__,nhave,(unsigned long long)(bytes >> 20),label,tsdiff(&start, &end),problems);
+	freemanifest(want, nwant);
+	freemanifest(have, nhave);
+	free(failed);
+	retc = (problems > 0) ? 1 : 0;
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Collect the regular files and symlinks under MANIFEST_PATHS in the tree at root,
+ * sorted by path, without crossing into other filesystems
+ * returns 0 on success, nonzero otherwise
+ */
+static int
+walkmanifest(const char *root, bemanifest **files, int *count) {
+	int alloc, retc, n, i;
+	size_t skip;
+	const char *paths[] = MANIFEST_PATHS;
+	char *argv[sizeof(paths) / sizeof(paths[0])];
+	bemanifest *grown;
+	FTS *walk;
+	FTSENT *ent;
+
+	*files = NULL;
+	*count = alloc = retc = n = 0;
+	/* "/" as the root would double every slash */
+	skip = (strcmp(root, "/") == 0) ? 0 : strlen(root);
+	for (i = 0; paths[i] != NULL; i++) {
+		if (asprintf(&argv[n], "%.*s%s", (int)skip, root, paths[i]) < 0) {
+			retc = -1;
+			goto done;
+		}
+		if (access(argv[n], F_OK) != 0) {
+			DBGTRACE("Skipping %s, it doesn't exist", argv[n]);
+			free(argv[n]);
+			continue;
+		}
+		n++;
+	}
+	argv[n] = NULL;
+	if (n == 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: None of the manifest paths exist under %s\n",__progname,__FILE__,__LINE__,__func__,root);
+		return(-1);
+	}
+	if ((walk = fts_open(argv, FTS_PHYSICAL|FTS_NOCHDIR|FTS_XDEV, NULL)) == NULL) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to walk %s (%s)\n",__progname,__FILE__,__LINE__,__func__,root,strerror(errno));
+		retc = -2;
+		goto done;
+	}
+	while (retc == 0 && (ent = fts_read(walk)) != NULL) {
+		switch (ent->fts_info) {
+			case FTS_F:
+			case FTS_SL:
+			case FTS_SLNONE:
+				if (*count == alloc) {
+					alloc = (alloc == 0) ? 1024 : alloc * 2;
+					if ((grown = reallocarray(*files, (size_t)alloc, sizeof(bemanifest))) == NULL) {
+						retc = -3;
+						break;
+					}
+					*files = grown;
+				}
+				if (((*files)[*count].path = strdup(ent->fts_path + skip)) == NULL) {
+					retc = -3;
+					break;
+				}
+				(*files)[*count].size = (uint64_t)ent->fts_statp->st_size;
+				(*files)[*count].digest[0] = 0;
+				(*count)++;
+				break;
+			case FTS_DNR:
+			case FTS_ERR:
+			case FTS_NS:
+				fprintf(stderr,"WRN: %s [%s:%u] %s: Unable to read %s (%s)\n",__progname,__FILE__,__LINE__,__func__,ent->fts_path,strerror(ent->fts_errno));
+				break;
+			default:
+				/* directories are covered by what's in them, device nodes and the like aren't recorded */
+				break;
+		}
+	}
+	fts_close(walk);
+	if (retc != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to allocate the file list of %s\n",__progname,__FILE__,__LINE__,__func__,root);
+		freemanifest(*files, *count);
+		*files = NULL; *count = 0;
+	} else {
+		qsort(*files, (size_t)*count, sizeof(bemanifest), cmppaths);
+	}
+
+done:
+	while (n > 0) {
+		free(argv[--n]);
+	}
+	return(retc);
+}
+
+/*
+ * Fill in the digest of every file, failed[i] is set for the ones that couldn't be read
+ * returns the number of such files
+ */
+static int
+hashall(const char *root, hashspec algo, bemanifest *files, char *failed, int count, uint64_t *bytes) {
+	int i, nworkers, nfailed;
+	pthread_t workers[VERIFY_WORKERS];
+	struct hash_pool pool;
+
+	memset(&pool, 0, sizeof(pool));
+	nfailed = 0;
+	pool.root = (strcmp(root, "/") == 0) ? "" : root;
+	pool.algo = algo;
+	pool.files = files;
+	pool.failed = failed;
+	pool.nfiles = count;
+	if ((pool.order = calloc((size_t)count + 1, sizeof(bemanifest *))) == NULL) {
+		memset(failed, 1, (size_t)count);
+		return(count);
+	}
+	for (i = 0; i < count; i++) {
+		pool.order[i] = &files[i];
+	}
+	/* big files first, the small ones fill in around them at the end */
+	qsort(pool.order, (size_t)count, sizeof(bemanifest *), cmpsizes);
+	DBGTRACE("Hashing %d files with %s, %s kernel", count, digest_name(algo), digest_kernel(algo));
+	progress_add("hash", count);
+	pthread_mutex_init(&pool.lock, NULL);
+	for (nworkers = 0; nworkers < VERIFY_WORKERS && nworkers < count; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, hashworker, &pool) != 0) {
+			break;
+		}
+	}
+	if (nworkers == 0) {
+		hashworker(&pool);
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	for (i = 0; i < count; i++) {
+		nfailed += (failed[i] != 0);
+	}
+	*bytes = pool.bytes;
+	free(pool.order);
+	return(nfailed);
+}
+
+/*
+ * Pull files off the shared queue until it's empty
+ */
+static void *
+hashworker(void *arg) {
+	int idx, fd;
+	bool ok;
+	char path[MAXPATHLEN];
+	bemanifest *file;
+	struct stat st;
+	struct hash_pool *pool;
+
+	pool = arg;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		idx = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (idx >= pool->nfiles) {
+			break;
+		}
+		file = pool->order[idx];
+		snprintf(path, sizeof(path), "%s%s", pool->root, file->path);
+		ok = false;
+		if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode)) {
+			ok = (hashlink(pool->algo, path, file) == 0);
+		} else if ((fd = open(path, O_RDONLY|O_NOFOLLOW)) >= 0) {
+			/* the size hashed is the size now, not whatever the walk saw */
+			if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+				file->size = (uint64_t)st.st_size;
+				/* an empty root means the running system, where files can shrink under us */
+				ok = (hashfd(pool->algo, fd, file->size, *pool->root != 0, file->digest, sizeof(file->digest)) == 0);
+			}
+			close(fd);
+		}
+		if (!ok) {
+			TRACE(TRACE_WARN, "Unable to hash %s (%s)", path, strerror(errno));
+			pool->failed[file - pool->files] = 1;
+		} else {
+			pthread_mutex_lock(&pool->lock);
+			pool->bytes += file->size;
+			pthread_mutex_unlock(&pool->lock);
+		}
+		progress_step(file->path, ok);
+	}
+	return(NULL);
+}
+
+/*
+ * A link is recorded by what it points at. The target is hashed behind a NUL,
+ * which no path contains, so a regular file holding the same bytes doesn't match it.
+ * returns 0 on success
+ */
+static int
+hashlink(hashspec algo, const char *path, bemanifest *file) {
+	ssize_t len;
+	char target[MAXPATHLEN + 1];
+
+	target[0] = 0;
+	if ((len = readlink(path, target + 1, sizeof(target) - 1)) < 0) {
+		return(-1);
+	}
+	file->size = (uint64_t)len;
+	return(hashbuf(algo, target, (size_t)len + 1, file->digest, sizeof(file->digest)));
+}
+
+static void
+freemanifest(bemanifest *files, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		free(files[i].path);
+	}
+	free(files);
+}
+
+static int
+cmppaths(const void *a, const void *b) {
+	return(strcmp(((const bemanifest *)a)->path, ((const bemanifest *)b)->path));
+}
+
+static int
+cmpsizes(const void *a, const void *b) {
+	const bemanifest *x, *y;
+
+	x = *(const bemanifest * const *)a;
+	y = *(const bemanifest * const *)b;
+	return((x->size < y->size) ? 1 : (x->size > y->size) ? -1 : 0);
+}
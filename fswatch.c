@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <errno.h>
+#include <paths.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef DFBEADM_FSWATCH_H
+#include "fswatch.h"
+#endif
+#ifndef DFBEADM_SNAPFS_H
+#include "snapfs.h"
+#endif
+
+extern char *__progname;
+
+/* a call handed to a runner, freed by whichever side lets go of it last */
+struct watch_job {
+	pthread_cond_t finished;
+	int (*call)(void *);
+	void (*cleanup)(void *, int, bool);
+	void *ctx; /* the runner's own copy, the caller's is only written back on time */
+	size_t ctxlen;
+	int retc;
+	int err;
+	int hang; /* its entry in hangs once abandoned, -1 if there was no room */
+	bool done;
+	bool abandoned;
+};
+
+/* a call that outlived the deadline */
+struct watch_hang {
+	char dev[MNAMELEN];
+	char what[MNAMELEN];
+	struct timespec started;
+	struct timespec returned; /* zero while it's still blocked */
+};
+
+/* everything below is under watchlock */
+static pthread_mutex_t watchlock = PTHREAD_MUTEX_INITIALIZER;
+static int deadline = 0;
+static struct watch_hang *hangs = NULL;
+static int nhangs = 0;
+static int ahangs = 0;
+static bool hangsfull = false; /* a hang couldn't be recorded, so every device is treated as hung */
+
+static void *runner(void *arg);
+static void freejob(struct watch_job *job);
+static int refuse(void (*cleanup)(void *, int, bool), void *ctx, int err);
+static int findhang(const char *dev, size_t devlen);
+static const char *devkey(const char *dev, size_t *devlen);
+
+/*
+ * Put every watched call under a deadline of the given number of seconds,
+ * 0 runs them directly in the caller as before
+ * returns 0 on success, -1 if seconds is out of range
+ */
+int
+watch_init(int seconds) {
+	if (seconds < 0 || seconds > WATCH_MAXDEADLINE) {
+		return(-1);
+	}
+	pthread_mutex_lock(&watchlock);
+	deadline = seconds;
+	pthread_mutex_unlock(&watchlock);
+	DBGTRACE("Deadline set to %d seconds", seconds);
+	return(0);
+}
+
+bool
+watching(void) {
+	return(deadline > 0);
+}
+
+/*
+ * Check whether a call on dev has already been abandoned, see devkey()
+ * for how the device is told apart from any PFS or label it names
+ */
+bool
+watchhung(const char *dev) {
+	bool hung;
+	size_t devlen;
+
+	if (dev == NULL || !watching()) {
+		return(false);
+	}
+	dev = devkey(dev, &devlen);
+	pthread_mutex_lock(&watchlock);
+	hung = hangsfull || (findhang(dev, devlen) >= 0);
+	pthread_mutex_unlock(&watchlock);
+	return(hung);
+}
+
+/*
+ * Run call(ctx) under the deadline. The runner works on a copy of the ctxlen
+ * bytes at ctx, which are copied back if it finishes in time. cleanup, if given,
+ * is run once the call returns or is refused, told whether it was abandoned,
+ * and is where anything the call acquired has to be released when nobody's left to take it.
+ * returns what call returned with errno intact, or -1 and ETIMEDOUT if dev is hung
+ */
+int
+watchcall(int (*call)(void *), void (*cleanup)(void *, int, bool), void *ctx, size_t ctxlen, const char *dev, const char *what) {
+	int retc, err;
+	size_t devlen;
+	const char *key;
+	pthread_t tid;
+	pthread_attr_t attr;
+	struct timespec until, started;
+	struct watch_job *job;
+	struct watch_hang *grown;
+
+	assert((call != NULL) && (ctx != NULL) && (dev != NULL) && (what != NULL));
+	if (!watching()) {
+		retc = call(ctx);
+		err = errno;
+		if (cleanup != NULL) {
+			cleanup(ctx, retc, false);
+		}
+		errno = err;
+		return(retc);
+	}
+	if (watchhung(dev)) {
+		DBGTRACE("%s on %s refused, the device is hung", what, dev);
+		return(refuse(cleanup, ctx, ETIMEDOUT));
+	}
+	if ((job = calloc(1, sizeof(struct watch_job))) == NULL || (job->ctx = malloc(ctxlen)) == NULL) {
+		free(job);
+		return(refuse(cleanup, ctx, ENOMEM));
+	}
+	memcpy(job->ctx, ctx, ctxlen);
+	job->ctxlen = ctxlen;
+	job->call = call;
+	job->cleanup = cleanup;
+	pthread_cond_init(&job->finished, NULL);
+	/* nobody joins a runner, an abandoned one may never return */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += deadline;
+	pthread_mutex_lock(&watchlock);
+	if ((err = pthread_create(&tid, &attr, runner, job)) != 0) {
+		pthread_mutex_unlock(&watchlock);
+		pthread_attr_destroy(&attr);
+		freejob(job);
+		return(refuse(cleanup, ctx, err));
+	}
+	pthread_attr_destroy(&attr);
+	for (err = 0; !job->done && err != ETIMEDOUT;) {
+		err = pthread_cond_timedwait(&job->finished, &watchlock, &until);
+	}
+	if (job->done) {
+		/* the runner let go of the job when it signalled */
+		pthread_mutex_unlock(&watchlock);
+		retc = job->retc;
+		err = job->err;
+		if (cleanup != NULL) {
+			cleanup(job->ctx, retc, false);
+		}
+		memcpy(ctx, job->ctx, ctxlen);
+		freejob(job);
+		errno = err;
+		return(retc);
+	}
+	/* the runner owns the job from here on */
+	job->abandoned = true;
+	key = devkey(dev, &devlen);
+	if ((job->hang = findhang(key, devlen)) < 0) {
+		if (nhangs == ahangs) {
+			if ((grown = reallocarray(hangs, (size_t)ahangs + WATCH_HANGSTEP, sizeof(struct watch_hang))) != NULL) {
+				hangs = grown;
+				ahangs += WATCH_HANGSTEP;
+			}
+		}
+		if (nhangs < ahangs) {
+			job->hang = nhangs++;
+			memset(&hangs[job->hang], 0, sizeof(struct watch_hang));
+			snprintf(hangs[job->hang].dev, MNAMELEN, "%.*s", (int)devlen, key);
+			strlcpy(hangs[job->hang].what, what, MNAMELEN);
+			hangs[job->hang].started = started;
+		} else {
+			/* refusing too much beats letting a hung device take down another runner */
+			hangsfull = true;
+		}
+	}
+	pthread_mutex_unlock(&watchlock);
+	fprintf(stderr,"ERR: %s [%s:%u] %s: %s on %s didn't finish within %d seconds, abandoning %.*s\n",__progname,__FILE__,__LINE__,__func__,
+			what,dev,deadline,(int)devlen,key);
+	errno = ETIMEDOUT;
+	return(-1);
+}
+
+/*
+ * List every abandoned call and the device it hung, once the run is over
+ * returns the number of hung devices
+ */
+int
+watch_report(FILE *out) {
+	int i, count;
+	struct timespec now;
+
+	assert(out != NULL);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&watchlock);
+	for (i = 0; i < nhangs; i++) {
+		if (hangs[i].returned.tv_sec != 0) {
+			fprintf(out, "Hung: %s, %s returned after %.3fs\n", hangs[i].dev, hangs[i].what, tsdiff(&hangs[i].started, &hangs[i].returned));
+		} else {
+			fprintf(out, "Hung: %s, %s still blocked after %.3fs\n", hangs[i].dev, hangs[i].what, tsdiff(&hangs[i].started, &now));
+		}
+	}
+	if (hangsfull) {
+		fprintf(out, "Hung: more devices that couldn't be recorded, every device was refused after them\n");
+	}
+	count = nhangs + ((hangsfull) ? 1 : 0);
+	pthread_mutex_unlock(&watchlock);
+	return(count);
+}
+
+static void *
+runner(void *arg) {
+	int retc, err;
+	struct watch_job *job;
+
+	job = arg;
+	retc = job->call(job->ctx);
+	err = errno;
+	pthread_mutex_lock(&watchlock);
+	job->retc = retc;
+	job->err = err;
+	job->done = true;
+	if (!job->abandoned) {
+		/* the caller takes it from here, the job can't be touched past this point */
+		pthread_cond_signal(&job->finished);
+		pthread_mutex_unlock(&watchlock);
+		return(NULL);
+	}
+	/* nobody's waiting anymore, just note that it came back */
+	if (job->hang >= 0 && hangs[job->hang].returned.tv_sec == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &hangs[job->hang].returned);
+	}
+	pthread_mutex_unlock(&watchlock);
+	if (job->cleanup != NULL) {
+		job->cleanup(job->ctx, retc, true);
+	}
+	freejob(job);
+	return(NULL);
+}
+
+/*
+ * Give up on a call before it was ever made, cleanup still gets to release what ctx holds
+ * returns -1 with errno set to err
+ */
+static int
+refuse(void (*cleanup)(void *, int, bool), void *ctx, int err) {
+	if (cleanup != NULL) {
+		cleanup(ctx, -1, false);
+	}
+	errno = err;
+	return(-1);
+}
+
+static void
+freejob(struct watch_job *job) {
+	pthread_cond_destroy(&job->finished);
+	free(job->ctx);
+	free(job);
+}
+
+/*
+ * The part of dev that names the device: anything from PFSDELIM on is dropped
+ * so every PFS of a device is hung along with it, and so is a leading /dev/,
+ * mount(8) and fstab(5) don't always agree on it
+ * returns the start of that part, its length in devlen
+ */
+static const char *
+devkey(const char *dev, size_t *devlen) {
+	if (strncmp(dev, _PATH_DEV, sizeof(_PATH_DEV) - 1) == 0) {
+		dev += sizeof(_PATH_DEV) - 1;
+	}
+	*devlen = strcspn(dev, "@");
+	return(dev);
+}
+
+/*
+ * returns the index of dev's entry in hangs, -1 if it isn't hung
+ */
+static int
+findhang(const char *dev, size_t devlen) {
+	int i;
+
+	for (i = 0; i < nhangs; i++) {
+		if (strlen(hangs[i].dev) == devlen && strncmp(hangs[i].dev, dev, devlen) == 0) {
+			return(i);
+		}
+	}
+	return(-1);
+}
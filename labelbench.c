@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Standalone microbenchmark for the label helpers in fslabel.c,
+ * built and run by "make bench", it is not part of dfbeadm itself
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef DFBEADM_FSLABEL_H
+#include "fslabel.h"
+#endif
+
+#define BENCH_ITERS 1000000
+
+static const char *spec = "/dev/serno/WD-WCC4N0123456.s1d@ROOT:default";
+static const char *label = "default.2018.06.01.123045";
+
+/* keeps the compiler from discarding the calls being timed */
+static volatile int64_t sink;
+
+static double elapsed(const struct timespec *start);
+static void report(const char *name, unsigned long iters, double secs);
+
+int
+main(int argc, char **argv) {
+	char dst[NAME_MAX];
+	labelview view;
+	struct timespec start;
+	unsigned long i, iters;
+
+	iters = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_ITERS;
+	if (iters == 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iters; i++) {
+		sink += parselabel(spec, &view);
+	}
+	report("parselabel", iters, elapsed(&start));
+
+	parselabel(spec, &view);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iters; i++) {
+		sink += fmtsnapname(&view, label, dst, sizeof(dst));
+	}
+	report("fmtsnapname", iters, elapsed(&start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iters; i++) {
+		sink += checklabel(label);
+	}
+	report("checklabel", iters, elapsed(&start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iters; i++) {
+		sink += stamplabel("default", (time_t)i, dst, sizeof(dst));
+	}
+	report("stamplabel", iters, elapsed(&start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iters; i++) {
+		sink += labeltime(label);
+	}
+	report("labeltime", iters, elapsed(&start));
+
+	return(0);
+}
+
+/*
+ * Seconds since start on the monotonic clock
+ * returns the elapsed time
+ */
+static double
+elapsed(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Print one result line as nanoseconds per call
+ * returns nothing
+ */
+static void
+report(const char *name, unsigned long iters, double secs) {
+	printf("%-12s %10lu calls %10.1f ns/op\n", name, iters, secs * 1e9 / (double)iters);
+}
@@ -38,7 +38,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifndef DFBEADM_SNAPFS_H
 #include "snapfs.h"
@@ -46,10 +48,32 @@
 #ifndef DFBEADM_FSUP_H
 #include "fsupdate.h"
 #endif
+#ifndef DFBEADM_FSCOMMIT_H
+#include "fscommit.h"
+#endif
+#ifndef DFBEADM_FSGROUP_H
+#include "fsgroup.h"
+#endif
+#ifndef DFBEADM_FSIOCTL_H
+#include "fsioctl.h"
+#endif
+#ifndef DFBEADM_FSUSAGE_H
+#include "fsusage.h"
+#endif
+
+/* shared state of the grouped snapshot workers */
+struct snap_pool {
+	pthread_mutex_t lock;
+	bedata **set;
+	int count;
+	int next;
+	int failed;
+};
+
+static void *snapworker(void *arg);
 
 extern char **environ;
 extern char *__progname;
-extern bool dbg;
 extern bool noop;
 
 /* XXX: This function likely doing too much work */
@@ -66,45 +90,160 @@ snapfs(bedata *fstarget, int fscount, const char *label) {
 	 * though this could be expanded to any filesystem with the same functionality of snapshots. Possibly 
 	 * including both HAMMER and UFS in later versions
 	 */
-	register int i;
 	int retc;
 
 	assert((fstarget != NULL) && (fscount > 0) && (label != NULL));
-	i = retc = 0;
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Entering with fstarget = %p, fscount = %d\n",__progname,__FILE__,__LINE__,__func__,(void *)fstarget,fscount);
+	retc = 0;
+	DBGTRACE("Entering with fstarget = %p, fscount = %d", (void *)fstarget, fscount);
+	/* the fstab goes in first so the snapshot of / carries it, but stays revertible until the snapshots exist */
+	if ((retc = autoactivate(fstarget, fscount, label)) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: Unable to activate %s, no snapshots were created\n",__progname,__FILE__,__LINE__,__func__,label);
+	} else if ((retc = timedsnaps(fstarget, fscount)) != 0) {
+		fprintf(stderr,"ERR: %s [%s:%u] %s: %d snapshots of %s failed, restoring the previous fstab\n",__progname,__FILE__,__LINE__,__func__,retc,label);
+		revertcommit();
+	} else {
+		retirecommit();
 	}
-	/* XXX: Testing fstab installation prior to snapshot creation */
-	autoactivate(fstarget, fscount, label);
-	for (i ^= i; i < fscount; i++) {
+	/* Now go through and ensure we close all the file descriptors since the snapshots have been created */
+	closefs(fstarget, fscount);
+	DBGTRACE("Returning %d to caller", retc);
+	return(retc);
+}
+
+/*
+ * Issue the snapshot ioctl for every marked entry of the given buffer,
+ * split out of snapfs() so scoped creation can snapshot its own subset
+ * returns the number of snapshots that failed
+ */
+int
+mksnaps(bedata *fstarget, int fscount) {
+	register int i;
+	int failed;
+
+	assert(fstarget != NULL);
+	failed = 0;
+	for (i = 0; i < fscount; i++) {
 		/* We use the following ioctl() to actually create a snapshot */
 		if (fstarget[i].snap && !noop) {
-			if (ioctl(fstarget[i].mountfd, HAMMER2IOC_PFS_SNAPSHOT, &fstarget[i].snapshot) != -1) {
+			if (h2ioctl(fstarget[i].mountfd, HAMMER2IOC_PFS_SNAPSHOT, &fstarget[i].snapshot, fstarget[i].fstab.fs_spec) != -1) {
 				fprintf(stdout, "INF: %s [%s:%u] %s: Created new snapshot: %s\n",__progname,__FILE__,__LINE__,__func__,fstarget[i].snapshot.name);
+				progress_step(fstarget[i].snapshot.name, true);
 			} else {
 				fprintf(stderr, "ERR: %s [%s:%u] %s: H2 Snap failed!\n%s\n(target: %s)\n",__progname,__FILE__,__LINE__,__func__,strerror(errno), fstarget[i].snapshot.name);
+				progress_step(fstarget[i].snapshot.name, false);
+				failed++;
 			}
 		} else {
 			if (noop) {
 				fprintf(stdout, "DBG: %s [%s:%u] %s: Skipping creation of %s for %s\n",__progname,__FILE__,__LINE__,__func__,fstarget[i].snapshot.name,fstarget[i].fstab.fs_file);
 				strlcat(fstarget[i].fstab.fs_spec,fstarget[i].snapshot.name,NAME_MAX);
+				progress_step(fstarget[i].snapshot.name, true);
 			} else { 
 				fprintf(stdout, "INF: %s [%s:%u] %s: Skipping %s as it is not HAMMER2\n",__progname,__FILE__,__LINE__,__func__,fstarget[i].fstab.fs_file);
 			}
 		}
 	}
-	/* Now go through and ensure we close all the file descriptors since the snapshots have been created */
-	for (i ^= i; i < fscount; i++) {
+	return(failed);
+}
+
+/*
+ * Close the mountpoint descriptors opened by marktargets()
+ */
+void
+closefs(bedata *fstarget, int fscount) {
+	register int i;
+
+	assert(fstarget != NULL);
+	for (i = 0; i < fscount; i++) {
 		if (fstarget[i].mountfd != 0) {
-			if (dbg) {
-				fprintf(stderr,"DBG: %s [%s:%u] %s: Closing fd %d for %s\n",
-						__progname,__FILE__,__LINE__,__func__,fstarget[i].mountfd,fstarget[i].fstab.fs_file);
-			}
+			DBGTRACE("Closing fd %d for %s", fstarget[i].mountfd, fstarget[i].fstab.fs_file);
 			close(fstarget[i].mountfd);
+			fstarget[i].mountfd = 0;
 		}
 	}
-	if (dbg) {
-		fprintf(stderr,"DBG: %s [%s:%u] %s: Returning %d to caller\n",__progname,__FILE__,__LINE__,__func__,retc);
+}
+
+/*
+ * Snapshot the targets and report how long that took. Each snapshot ioctl
+ * syncs its own PFS under the -W deadline, so there is no separate flush.
+ * returns the number of snapshots that failed
+ */
+int
+timedsnaps(bedata *fstarget, int fscount) {
+	int failed, i, marked;
+	struct timespec start, snapped;
+
+	assert(fstarget != NULL);
+	for (marked = i = 0; i < fscount; i++) {
+		marked += (fstarget[i].snap) ? 1 : 0;
 	}
-	return(retc);
+	progress_add("create", marked);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	failed = groupsnaps(fstarget, fscount);
+	clock_gettime(CLOCK_MONOTONIC, &snapped);
+	/* new snapshots reference what their origins do right now */
+	snapusage(fstarget, fscount);
+	fprintf(stdout,"INF: %s [%s:%u] %s: snapshots took %.3fs\n",__progname,__FILE__,__LINE__,__func__,tsdiff(&start, &snapped));
+	return(failed);
+}
+
+/*
+ * Snapshot a set of entries concurrently, one ioctl per worker,
+ * used to keep the freeze window of a consistency group short
+ * returns the number of snapshots that failed
+ */
+int
+parsnaps(bedata **set, int count) {
+	int i, nworkers;
+	pthread_t workers[SNAP_WORKERS];
+	struct snap_pool pool;
+
+	assert(set != NULL);
+	pool.set = set;
+	pool.count = count;
+	pool.next = pool.failed = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (nworkers = 0; nworkers < SNAP_WORKERS && nworkers < count; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, snapworker, &pool) != 0) {
+			break;
+		}
+	}
+	if (nworkers == 0) {
+		snapworker(&pool);
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	return(pool.failed);
+}
+
+static void *
+snapworker(void *arg) {
+	int idx, failed;
+	struct snap_pool *pool;
+
+	pool = arg;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		idx = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (idx >= pool->count) {
+			break;
+		}
+		if ((failed = mksnaps(pool->set[idx], 1)) != 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->failed += failed;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * Seconds elapsed between two CLOCK_MONOTONIC readings
+ */
+double
+tsdiff(const struct timespec *from, const struct timespec *to) {
+	return((double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9);
 }
@@ -36,4 +36,14 @@
 #include "dfbeadm.h"
 #endif
 
+#include <time.h>
+
+/* Upper bound on the number of snapshots of a consistency group taken at the same time */
+#define SNAP_WORKERS 8
+
 int snapfs(bedata *fstarget, int fscount, const char *label);
+int mksnaps(bedata *fstarget, int fscount);
+int timedsnaps(bedata *fstarget, int fscount);
+int parsnaps(bedata **set, int count);
+double tsdiff(const struct timespec *from, const struct timespec *to);
+void closefs(bedata *fstarget, int fscount);